@@ -0,0 +1,778 @@
+/*
+ * Copyright 2022 Gavin Shan <gshan@redhat.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+#include "sandbox.h"
+
+/*
+ * The host registrations are always one-shot, so that the files which stay
+ * ready don't keep the thread busy. The file is queued to the ready list
+ * of the guest epoll instance when it's reported, and re-armed after the
+ * event is delivered to the guest, unless EPOLLONESHOT is requested by the
+ * guest. The re-armed file is reported again if it's still ready, which
+ * gives the level-triggered semantics. The removed files are released by
+ * the thread, as their events might have been collected by it.
+ */
+#define EP_GUEST_FLAGS	(EPOLLET | EPOLLONESHOT | EPOLLEXCLUSIVE | EPOLLWAKEUP)
+
+static void ep_kick(struct kvm_epoll *ep)
+{
+	uint64_t val = 1;
+
+	if (write(ep->evfd, &val, sizeof(val)) != sizeof(val))
+		fprintf(stderr, "%s: Unable to kick thread (%d)\n",
+			__func__, errno);
+}
+
+/* Arm the host registration. It's called with the lock held */
+static int ep_arm(struct kvm_epoll *ep, struct kvm_epoll_item *item, int op)
+{
+	struct epoll_event ev;
+
+	ev.events = (item->events & ~EP_GUEST_FLAGS) | EPOLLONESHOT;
+	ev.data.ptr = item;
+
+	return epoll_ctl(ep->epfd, op, item->host_fd, &ev) ? -errno : 0;
+}
+
+/* It's called with the lock held */
+static struct kvm_epoll_item *ep_find(struct kvm_epoll_inst *inst, int fd)
+{
+	struct kvm_epoll_item *item;
+
+	list_for_each_entry(item, &inst->items, link) {
+		if (item->fd == fd)
+			return item;
+	}
+
+	return NULL;
+}
+
+/*
+ * Remove the file from the interest list. The host file descriptor of the
+ * poll entry is owned by the wait. It's called with the lock held.
+ */
+static void ep_free_item(struct kvm_epoll *ep, struct kvm_epoll_item *item)
+{
+	epoll_ctl(ep->epfd, EPOLL_CTL_DEL, item->host_fd, NULL);
+	if (item->inst)
+		close(item->host_fd);
+	if (item->ready)
+		list_del(&item->ready_link);
+
+	list_del(&item->link);
+	item->dead = true;
+	list_add_tail(&ep->dead, &item->link);
+}
+
+static void ep_set_deadline(struct kvm_epoll_wait *wait, struct timespec *ts)
+{
+	struct timespec *d = &wait->deadline;
+
+	clock_gettime(CLOCK_MONOTONIC, d);
+	d->tv_sec += ts->tv_sec + (d->tv_nsec + ts->tv_nsec) / 1000000000L;
+	d->tv_nsec = (d->tv_nsec + ts->tv_nsec) % 1000000000L;
+	wait->timed = true;
+}
+
+static bool ep_expired(struct kvm_epoll_wait *wait, struct timespec *now)
+{
+	struct timespec *d = &wait->deadline;
+
+	return wait->timed &&
+	       (now->tv_sec > d->tv_sec ||
+		(now->tv_sec == d->tv_sec && now->tv_nsec >= d->tv_nsec));
+}
+
+/* Timeout of the nearest deadline in ms. It's called with the lock held */
+static int ep_timeout(struct kvm_epoll *ep)
+{
+	struct kvm_epoll_wait *wait;
+	struct timespec now;
+	long ms, timeout = -1;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	list_for_each_entry(wait, &ep->waits, link) {
+		if (!wait->timed)
+			continue;
+
+		ms = (wait->deadline.tv_sec - now.tv_sec) * 1000 +
+		     (wait->deadline.tv_nsec - now.tv_nsec + 999999) / 1000000;
+		ms = max(ms, 0L);
+		if (timeout < 0 || ms < timeout)
+			timeout = ms;
+	}
+
+	return min(timeout, (long)INT_MAX);
+}
+
+/*
+ * Copy the ready events to the guest. It returns the number of copied
+ * events, or negative error code. It's called with the lock held.
+ */
+static int ep_deliver(struct kvm_vm *vm, struct kvm_epoll *ep,
+		      struct kvm_epoll_inst *inst, unsigned long events,
+		      int maxevents)
+{
+	struct kvm_epoll_item *item, *tmp;
+	struct epoll_event ev;
+	int nr = 0;
+
+	list_for_each_entry_safe(item, tmp, &inst->ready, ready_link) {
+		if (nr >= maxevents)
+			break;
+
+		ev.events = item->ready & (item->events | EPOLLERR | EPOLLHUP);
+		ev.data.u64 = item->data;
+		if (kvm_mm_copy_to_guest(vm, events + nr * sizeof(ev),
+					 &ev, sizeof(ev)))
+			return nr ? nr : -EFAULT;
+
+		list_del(&item->ready_link);
+		item->ready = 0;
+		if (!(item->events & EPOLLONESHOT))
+			ep_arm(ep, item, EPOLL_CTL_MOD);
+
+		nr++;
+	}
+
+	return nr;
+}
+
+/*
+ * Check the poll entries without waiting. The files are re-armed if none
+ * of them is ready. It's called with the lock held.
+ */
+static long ep_poll_check(struct kvm_epoll *ep, struct kvm_epoll_wait *wait)
+{
+	struct kvm_epoll_item *item;
+	long ret;
+
+	wait->triggered = false;
+	ret = poll(wait->host, wait->nfds, 0);
+	if (ret < 0)
+		return -errno;
+
+	if (!ret) {
+		list_for_each_entry(item, &wait->items, link)
+			ep_arm(ep, item, EPOLL_CTL_MOD);
+	}
+
+	return ret;
+}
+
+/*
+ * Release the wait. The poll entries are copied to the guest for ppoll(),
+ * where the invalid file descriptors are reported by POLLNVAL. It returns
+ * the result of the system call. The lock is held if the wait is parked.
+ */
+static long ep_finish_wait(struct kvm_vm *vm, struct kvm_epoll *ep,
+			   struct kvm_epoll_wait *wait, long ret)
+{
+	struct kvm_epoll_item *item, *tmp;
+	unsigned long i;
+	int nval = 0;
+
+	list_for_each_entry_safe(item, tmp, &wait->items, link)
+		ep_free_item(ep, item);
+
+	for (i = 0; i < wait->nfds; i++) {
+		if (wait->fds[i].fd >= 0 && wait->host[i].fd < 0) {
+			wait->fds[i].revents = POLLNVAL;
+			nval++;
+		} else {
+			wait->fds[i].revents = wait->host[i].revents;
+		}
+
+		if (wait->host[i].fd >= 0)
+			close(wait->host[i].fd);
+	}
+
+	if (!wait->inst && ret >= 0) {
+		ret += nval;
+		if (kvm_mm_copy_to_guest(vm, wait->events, wait->fds,
+					 wait->nfds * sizeof(*wait->fds)))
+			ret = -EFAULT;
+	}
+
+	free(wait->fds);
+	free(wait);
+
+	return ret;
+}
+
+/* Post the CQ entry of the parked wait. It's called with the lock held */
+static void ep_complete_wait(struct kvm_vm *vm, struct kvm_epoll *ep,
+			     struct kvm_epoll_wait *wait, long ret)
+{
+	struct kvm_syscall_ring *ring = wait->ring;
+	uint64_t user_data = wait->user_data;
+
+	list_del(&wait->link);
+	kvm_syscall_complete(ring, user_data, ep_finish_wait(vm, ep, wait, ret));
+}
+
+/* It's called with the lock held */
+static void ep_complete(struct kvm_vm *vm, struct kvm_epoll *ep)
+{
+	struct kvm_epoll_wait *wait, *tmp;
+	struct timespec now;
+	long ret;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	list_for_each_entry_safe(wait, tmp, &ep->waits, link) {
+		if (wait->inst)
+			ret = ep_deliver(vm, ep, wait->inst, wait->events,
+					 wait->maxevents);
+		else
+			ret = wait->triggered ? ep_poll_check(ep, wait) : 0;
+
+		if (ret || ep_expired(wait, &now))
+			ep_complete_wait(vm, ep, wait, ret);
+	}
+}
+
+static void *ep_thread(void *data)
+{
+	struct kvm_vm *vm = data;
+	struct kvm_epoll *ep = vm->epoll;
+	struct epoll_event evs[KVM_EPOLL_MAX_EVENTS];
+	struct kvm_epoll_item *item, *tmp;
+	uint64_t val;
+	int i, nr, timeout;
+
+	pthread_mutex_lock(&ep->lock);
+
+	while (!ep->stop) {
+		list_for_each_entry_safe(item, tmp, &ep->dead, link) {
+			list_del(&item->link);
+			free(item);
+		}
+
+		timeout = ep_timeout(ep);
+		pthread_mutex_unlock(&ep->lock);
+		nr = epoll_wait(ep->epfd, evs, KVM_EPOLL_MAX_EVENTS, timeout);
+		pthread_mutex_lock(&ep->lock);
+
+		for (i = 0; i < nr; i++) {
+			item = evs[i].data.ptr;
+			if (!item) {
+				if (read(ep->evfd, &val, sizeof(val)) < 0 &&
+				    errno != EAGAIN)
+					fprintf(stderr, "%s: Unable to read event (%d)\n",
+						__func__, errno);
+				continue;
+			}
+
+			if (item->dead)
+				continue;
+
+			if (!item->inst) {
+				item->wait->triggered = true;
+				continue;
+			}
+
+			if (!item->ready)
+				list_add_tail(&item->inst->ready, &item->ready_link);
+			item->ready |= evs[i].events;
+		}
+
+		ep_complete(vm, ep);
+	}
+
+	pthread_mutex_unlock(&ep->lock);
+
+	return NULL;
+}
+
+/*
+ * epoll_create1(flags). The host epoll instance is duplicated to take the
+ * guest file descriptor.
+ */
+static long ep_create(struct kvm_vm *vm,
+		      struct kvm_syscall_ring *ring,
+		      struct syscall_sqe *sqe)
+{
+	struct kvm_epoll *ep = vm->epoll;
+	struct kvm_epoll_inst *inst;
+	int host_fd, fd;
+
+	if (!ep)
+		return -ENOSYS;
+
+	if (sqe->args[0] & ~EPOLL_CLOEXEC)
+		return -EINVAL;
+
+	inst = malloc(sizeof(*inst));
+	if (!inst)
+		return -ENOMEM;
+
+	INIT_LIST_HEAD(&inst->items);
+	INIT_LIST_HEAD(&inst->ready);
+	host_fd = fcntl(ep->epfd, F_DUPFD_CLOEXEC, 0);
+	fd = (host_fd < 0) ? -errno : kvm_fs_install_file(vm, host_fd);
+	if (fd < 0) {
+		if (host_fd >= 0)
+			close(host_fd);
+		free(inst);
+		return fd;
+	}
+
+	pthread_mutex_lock(&ep->lock);
+	inst->fd = fd;
+	ep->insts[fd] = inst;
+	pthread_mutex_unlock(&ep->lock);
+
+	return fd;
+}
+
+/* epoll_ctl(epfd, op, fd, event) */
+static long ep_ctl(struct kvm_vm *vm,
+		   struct kvm_syscall_ring *ring,
+		   struct syscall_sqe *sqe)
+{
+	struct kvm_epoll *ep = vm->epoll;
+	struct kvm_epoll_inst *inst;
+	struct kvm_epoll_item *item;
+	struct epoll_event ev;
+	int epfd = sqe->args[0], op = sqe->args[1], fd = sqe->args[2];
+	int host_fd = -1;
+	long ret;
+
+	if (!ep)
+		return -ENOSYS;
+
+	if (epfd < 0 || epfd >= KVM_FS_MAX_FILES ||
+	    fd < 0 || fd >= KVM_FS_MAX_FILES)
+		return -EBADF;
+
+	if (epfd == fd)
+		return -EINVAL;
+
+	if (op != EPOLL_CTL_DEL &&
+	    kvm_mm_copy_from_guest(vm, &ev, sqe->args[3], sizeof(ev)))
+		return -EFAULT;
+
+	if (op == EPOLL_CTL_ADD) {
+		host_fd = kvm_fs_get_file(vm, fd);
+		if (host_fd < 0)
+			return host_fd;
+	}
+
+	pthread_mutex_lock(&ep->lock);
+
+	inst = ep->insts[epfd];
+	item = inst ? ep_find(inst, fd) : NULL;
+	if (!inst) {
+		ret = -EINVAL;
+	} else if (op == EPOLL_CTL_ADD) {
+		ret = -EEXIST;
+		if (!item) {
+			item = calloc(1, sizeof(*item));
+			ret = -ENOMEM;
+		}
+
+		if (item && ret == -ENOMEM) {
+			item->inst = inst;
+			item->fd = fd;
+			item->host_fd = host_fd;
+			item->events = ev.events;
+			item->data = ev.data.u64;
+			ret = ep_arm(ep, item, EPOLL_CTL_ADD);
+			if (ret) {
+				free(item);
+			} else {
+				list_add_tail(&inst->items, &item->link);
+				host_fd = -1;
+			}
+		}
+	} else if (op == EPOLL_CTL_MOD) {
+		ret = -ENOENT;
+		if (item) {
+			if (item->ready) {
+				list_del(&item->ready_link);
+				item->ready = 0;
+			}
+
+			item->events = ev.events;
+			item->data = ev.data.u64;
+			ret = ep_arm(ep, item, EPOLL_CTL_MOD);
+		}
+	} else if (op == EPOLL_CTL_DEL) {
+		ret = -ENOENT;
+		if (item) {
+			ep_free_item(ep, item);
+			ret = 0;
+		}
+	} else {
+		ret = -EINVAL;
+	}
+
+	pthread_mutex_unlock(&ep->lock);
+
+	if (host_fd >= 0)
+		close(host_fd);
+
+	return ret;
+}
+
+/*
+ * epoll_pwait(epfd, events, maxevents, timeout, sigmask, sigsetsize) and
+ * epoll_pwait2(epfd, events, maxevents, timeout, sigmask, sigsetsize). The
+ * ready events are returned immediately. Otherwise, the wait is parked. The
+ * signal mask is ignored as no signal is delivered to the guest.
+ */
+static long ep_pwait(struct kvm_vm *vm,
+		     struct kvm_syscall_ring *ring,
+		     struct syscall_sqe *sqe)
+{
+	struct kvm_epoll *ep = vm->epoll;
+	struct kvm_epoll_inst *inst;
+	struct kvm_epoll_wait *wait;
+	struct timespec ts = { 0 };
+	int epfd = sqe->args[0], maxevents = sqe->args[2];
+	int timeout = sqe->args[3];
+	bool timed = false;
+	long ret;
+
+	if (!ep)
+		return -ENOSYS;
+
+	if (epfd < 0 || epfd >= KVM_FS_MAX_FILES)
+		return -EBADF;
+
+	if (maxevents <= 0 || maxevents > KVM_EPOLL_MAX_EVENTS * 1024)
+		return -EINVAL;
+
+#ifdef __NR_epoll_pwait2
+	if (sqe->nr == __NR_epoll_pwait2) {
+		timeout = -1;
+		if (sqe->args[3]) {
+			if (kvm_mm_copy_from_guest(vm, &ts, sqe->args[3],
+						   sizeof(ts)))
+				return -EFAULT;
+			if (ts.tv_sec < 0 || ts.tv_nsec < 0 ||
+			    ts.tv_nsec >= 1000000000L)
+				return -EINVAL;
+
+			timed = true;
+		}
+	}
+#endif
+
+	if (timeout >= 0) {
+		ts.tv_sec = timeout / 1000;
+		ts.tv_nsec = (timeout % 1000) * 1000000L;
+		timed = true;
+	}
+
+	pthread_mutex_lock(&ep->lock);
+
+	inst = ep->insts[epfd];
+	if (!inst) {
+		pthread_mutex_unlock(&ep->lock);
+		return -EINVAL;
+	}
+
+	ret = ep_deliver(vm, ep, inst, sqe->args[1], maxevents);
+	if (ret || (timed && !ts.tv_sec && !ts.tv_nsec)) {
+		pthread_mutex_unlock(&ep->lock);
+		return ret;
+	}
+
+	wait = calloc(1, sizeof(*wait));
+	if (!wait) {
+		pthread_mutex_unlock(&ep->lock);
+		return -ENOMEM;
+	}
+
+	wait->ring = ring;
+	wait->user_data = sqe->user_data;
+	wait->inst = inst;
+	wait->events = sqe->args[1];
+	wait->maxevents = maxevents;
+	INIT_LIST_HEAD(&wait->items);
+	if (timed)
+		ep_set_deadline(wait, &ts);
+
+	kvm_syscall_defer(ring);
+	list_add_tail(&ep->waits, &wait->link);
+
+	pthread_mutex_unlock(&ep->lock);
+
+	if (timed)
+		ep_kick(ep);
+
+	return SYSCALL_RET_PENDING;
+}
+
+/*
+ * ppoll(fds, nfds, tmo_p, sigmask, sigsetsize). The files are checked
+ * without waiting first. Otherwise, they're registered to the host epoll
+ * instance and the wait is parked. The signal mask is ignored.
+ */
+static long ep_ppoll(struct kvm_vm *vm,
+		     struct kvm_syscall_ring *ring,
+		     struct syscall_sqe *sqe)
+{
+	struct kvm_epoll *ep = vm->epoll;
+	struct kvm_epoll_wait *wait;
+	struct kvm_epoll_item *item;
+	struct timespec ts;
+	unsigned long i, nfds = sqe->args[1];
+	bool timed = !!sqe->args[2], nval = false;
+	long ret;
+
+	if (!ep)
+		return -ENOSYS;
+
+	if (nfds > KVM_FS_MAX_FILES)
+		return -EINVAL;
+
+	wait = calloc(1, sizeof(*wait));
+	if (wait)
+		wait->fds = calloc(2 * nfds + 1, sizeof(*wait->fds));
+	if (!wait || !wait->fds) {
+		free(wait);
+		return -ENOMEM;
+	}
+
+	wait->ring = ring;
+	wait->user_data = sqe->user_data;
+	wait->events = sqe->args[0];
+	wait->host = wait->fds + nfds;
+	INIT_LIST_HEAD(&wait->items);
+	ret = kvm_mm_copy_from_guest(vm, wait->fds, sqe->args[0],
+				     nfds * sizeof(*wait->fds));
+	if (!ret && timed) {
+		ret = kvm_mm_copy_from_guest(vm, &ts, sqe->args[2], sizeof(ts));
+		if (!ret && (ts.tv_sec < 0 || ts.tv_nsec < 0 ||
+			     ts.tv_nsec >= 1000000000L))
+			ret = -EINVAL;
+	}
+
+	if (ret) {
+		free(wait->fds);
+		free(wait);
+		return ret;
+	}
+
+	/* The duplicated host file descriptors are owned by the wait */
+	wait->nfds = nfds;
+	for (i = 0; i < nfds; i++) {
+		wait->host[i].fd = (wait->fds[i].fd < 0) ? -1 :
+				   kvm_fs_get_file(vm, wait->fds[i].fd);
+		wait->host[i].events = wait->fds[i].events;
+		if (wait->fds[i].fd >= 0 && wait->host[i].fd < 0)
+			nval = true;
+	}
+
+	ret = poll(wait->host, nfds, 0);
+	ret = (ret < 0) ? -errno : ret;
+	if (ret || nval || (timed && !ts.tv_sec && !ts.tv_nsec))
+		return ep_finish_wait(vm, ep, wait, ret);
+
+	pthread_mutex_lock(&ep->lock);
+
+	for (i = 0; i < nfds; i++) {
+		if (wait->host[i].fd < 0)
+			continue;
+
+		item = calloc(1, sizeof(*item));
+		if (!item) {
+			wait->triggered = true;
+			continue;
+		}
+
+		item->wait = wait;
+		item->fd = wait->fds[i].fd;
+		item->host_fd = wait->host[i].fd;
+		item->events = wait->fds[i].events;
+		if (ep_arm(ep, item, EPOLL_CTL_ADD)) {
+			free(item);
+			wait->triggered = true;
+			continue;
+		}
+
+		list_add_tail(&wait->items, &item->link);
+	}
+
+	if (timed)
+		ep_set_deadline(wait, &ts);
+
+	kvm_syscall_defer(ring);
+	list_add_tail(&ep->waits, &wait->link);
+
+	pthread_mutex_unlock(&ep->lock);
+
+	if (timed || wait->triggered)
+		ep_kick(ep);
+
+	return SYSCALL_RET_PENDING;
+}
+
+/**
+ * kvm_epoll_init - Initialize epoll of VM
+ * @vm:		VM where epoll is initialized
+ *
+ * The guest file descriptors are watched, so the file system should have
+ * been initialized. It returns zero on success, or negative error code on
+ * failure.
+ */
+int kvm_epoll_init(struct kvm_vm *vm)
+{
+	struct kvm_epoll *ep;
+	struct epoll_event ev;
+	int ret;
+
+	if (!vm->fs) {
+		fprintf(stderr, "%s: File system isn't initialized\n", __func__);
+		return -EINVAL;
+	}
+
+	ep = malloc(sizeof(*ep));
+	if (!ep) {
+		fprintf(stderr, "%s: Unable to alloc epoll\n", __func__);
+		return -ENOMEM;
+	}
+
+	memset(ep, 0, sizeof(*ep));
+	pthread_mutex_init(&ep->lock, NULL);
+	INIT_LIST_HEAD(&ep->waits);
+	INIT_LIST_HEAD(&ep->dead);
+	ep->epfd = epoll_create1(EPOLL_CLOEXEC);
+	ep->evfd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (ep->epfd < 0 || ep->evfd < 0) {
+		fprintf(stderr, "%s: Unable to create epoll (%d)\n",
+			__func__, errno);
+		ret = -errno;
+		goto error;
+	}
+
+	ev.events = EPOLLIN;
+	ev.data.ptr = NULL;
+	if (epoll_ctl(ep->epfd, EPOLL_CTL_ADD, ep->evfd, &ev)) {
+		fprintf(stderr, "%s: Unable to add event file (%d)\n",
+			__func__, errno);
+		ret = -errno;
+		goto error;
+	}
+
+	vm->epoll = ep;
+	ret = pthread_create(&ep->thread, NULL, ep_thread, vm);
+	if (ret) {
+		fprintf(stderr, "%s: Unable to create thread (%d)\n",
+			__func__, ret);
+		vm->epoll = NULL;
+		ret = -ret;
+		goto error;
+	}
+
+	kvm_syscall_register(__NR_epoll_create1, ep_create, 0);
+	kvm_syscall_register(__NR_epoll_ctl, ep_ctl, 0);
+	kvm_syscall_register(__NR_epoll_pwait, ep_pwait, 0);
+#ifdef __NR_epoll_pwait2
+	kvm_syscall_register(__NR_epoll_pwait2, ep_pwait, 0);
+#endif
+	kvm_syscall_register(__NR_ppoll, ep_ppoll, 0);
+
+	return 0;
+
+error:
+	if (ep->evfd >= 0)
+		close(ep->evfd);
+	if (ep->epfd >= 0)
+		close(ep->epfd);
+	free(ep);
+	return ret;
+}
+
+/**
+ * kvm_epoll_close - Forget the closed guest file
+ * @vm:		VM where the file is closed
+ * @fd:		guest file descriptor
+ *
+ * The file is removed from the interest lists. If it's a guest epoll
+ * instance, the instance is released and its parked waits fail.
+ */
+void kvm_epoll_close(struct kvm_vm *vm, int fd)
+{
+	struct kvm_epoll *ep = vm->epoll;
+	struct kvm_epoll_inst *inst;
+	struct kvm_epoll_item *item, *tmp;
+	struct kvm_epoll_wait *wait, *n;
+	int i;
+
+	if (!ep || fd < 0 || fd >= KVM_FS_MAX_FILES)
+		return;
+
+	pthread_mutex_lock(&ep->lock);
+
+	inst = ep->insts[fd];
+	if (inst) {
+		list_for_each_entry_safe(wait, n, &ep->waits, link) {
+			if (wait->inst == inst)
+				ep_complete_wait(vm, ep, wait, -EBADF);
+		}
+
+		list_for_each_entry_safe(item, tmp, &inst->items, link)
+			ep_free_item(ep, item);
+
+		ep->insts[fd] = NULL;
+		free(inst);
+	}
+
+	for (i = 0; i < KVM_FS_MAX_FILES; i++) {
+		item = ep->insts[i] ? ep_find(ep->insts[i], fd) : NULL;
+		if (item)
+			ep_free_item(ep, item);
+	}
+
+	pthread_mutex_unlock(&ep->lock);
+}
+
+void kvm_epoll_destroy(struct kvm_vm *vm)
+{
+	struct kvm_epoll *ep = vm->epoll;
+	struct kvm_epoll_item *item, *tmp;
+	struct kvm_epoll_wait *wait, *n;
+	int i;
+
+	if (!ep)
+		return;
+
+	pthread_mutex_lock(&ep->lock);
+	ep->stop = true;
+	pthread_mutex_unlock(&ep->lock);
+	ep_kick(ep);
+	pthread_join(ep->thread, NULL);
+
+	list_for_each_entry_safe(wait, n, &ep->waits, link)
+		ep_complete_wait(vm, ep, wait, -EINTR);
+
+	for (i = 0; i < KVM_FS_MAX_FILES; i++) {
+		if (!ep->insts[i])
+			continue;
+
+		list_for_each_entry_safe(item, tmp, &ep->insts[i]->items, link)
+			ep_free_item(ep, item);
+		free(ep->insts[i]);
+	}
+
+	list_for_each_entry_safe(item, tmp, &ep->dead, link) {
+		list_del(&item->link);
+		free(item);
+	}
+
+	close(ep->evfd);
+	close(ep->epfd);
+	vm->epoll = NULL;
+	free(ep);
+}
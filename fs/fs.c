@@ -0,0 +1,824 @@
+/*
+ * Copyright 2022 Gavin Shan <gshan@redhat.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#include <sys/syscall.h>
+#include "sandbox.h"
+
+/*
+ * The file system calls are submitted to io_uring when the system call
+ * ring is drained, and the SQ entries are flushed to the kernel in batch
+ * afterwards. The completions are reaped by the per-VM thread, which posts
+ * the CQ entries to the system call ring. The paths are resolved in the
+ * root directory, which can't be escaped from.
+ */
+static int fs_uring_enter(struct kvm_fs_uring *u,
+			  unsigned int to_submit,
+			  unsigned int min_complete,
+			  unsigned int flags)
+{
+	return syscall(__NR_io_uring_enter, u->fd, to_submit,
+		       min_complete, flags, NULL, 0);
+}
+
+static int fs_uring_register(struct kvm_fs_uring *u,
+			     unsigned int opcode,
+			     void *arg,
+			     unsigned int nr_args)
+{
+	return syscall(__NR_io_uring_register, u->fd, opcode, arg, nr_args);
+}
+
+static void fs_uring_teardown(struct kvm_fs_uring *u)
+{
+	if (u->sqes)
+		munmap(u->sqes, u->sqes_size);
+	if (u->cq_ring && u->cq_ring != u->sq_ring)
+		munmap(u->cq_ring, u->cq_ring_size);
+	if (u->sq_ring)
+		munmap(u->sq_ring, u->sq_ring_size);
+	if (u->fd >= 0)
+		close(u->fd);
+
+	memset(u, 0, sizeof(*u));
+	u->fd = -1;
+}
+
+static void *fs_uring_map(struct kvm_fs_uring *u, unsigned long size,
+			  unsigned long offset)
+{
+	void *addr;
+
+	addr = mmap(NULL, size, PROT_READ | PROT_WRITE,
+		    MAP_SHARED | MAP_POPULATE, u->fd, offset);
+
+	return (addr == MAP_FAILED) ? NULL : addr;
+}
+
+static int fs_uring_setup(struct kvm_fs_uring *u, unsigned int entries)
+{
+	struct io_uring_params p;
+
+	memset(u, 0, sizeof(*u));
+	memset(&p, 0, sizeof(p));
+	u->fd = syscall(__NR_io_uring_setup, entries, &p);
+	if (u->fd < 0) {
+		fprintf(stderr, "%s: Unable to setup io_uring (%d)\n",
+			__func__, errno);
+		return -errno;
+	}
+
+	u->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	u->cq_ring_size = p.cq_off.cqes +
+			  p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		u->sq_ring_size = max(u->sq_ring_size, u->cq_ring_size);
+		u->cq_ring_size = u->sq_ring_size;
+	}
+
+	u->sq_ring = fs_uring_map(u, u->sq_ring_size, IORING_OFF_SQ_RING);
+	if (u->sq_ring && (p.features & IORING_FEAT_SINGLE_MMAP))
+		u->cq_ring = u->sq_ring;
+	else if (u->sq_ring)
+		u->cq_ring = fs_uring_map(u, u->cq_ring_size, IORING_OFF_CQ_RING);
+
+	u->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+	if (u->cq_ring)
+		u->sqes = fs_uring_map(u, u->sqes_size, IORING_OFF_SQES);
+
+	if (!u->sqes) {
+		fprintf(stderr, "%s: Unable to map io_uring\n", __func__);
+		fs_uring_teardown(u);
+		return -ENOMEM;
+	}
+
+	u->sq_head = u->sq_ring + p.sq_off.head;
+	u->sq_tail = u->sq_ring + p.sq_off.tail;
+	u->sq_mask = u->sq_ring + p.sq_off.ring_mask;
+	u->sq_array = u->sq_ring + p.sq_off.array;
+	u->sq_entries = p.sq_entries;
+	u->cq_head = u->cq_ring + p.cq_off.head;
+	u->cq_tail = u->cq_ring + p.cq_off.tail;
+	u->cq_mask = u->cq_ring + p.cq_off.ring_mask;
+	u->cqes = u->cq_ring + p.cq_off.cqes;
+
+	return 0;
+}
+
+/* Submit the pending SQ entries. It's called with the lock held */
+static void fs_submit(struct kvm_fs *fs)
+{
+	struct kvm_fs_uring *u = &fs->uring;
+	int ret;
+
+	while (u->to_submit) {
+		ret = fs_uring_enter(u, u->to_submit, 0, 0);
+		if (ret < 0 && errno == EINTR)
+			continue;
+
+		if (ret <= 0) {
+			if (ret < 0 && errno != EAGAIN && errno != EBUSY)
+				fprintf(stderr, "%s: Unable to submit (%d)\n",
+					__func__, errno);
+			break;
+		}
+
+		u->to_submit -= ret;
+	}
+}
+
+/* Get free SQ entry. It's called with the lock held */
+static struct io_uring_sqe *fs_get_sqe(struct kvm_fs *fs)
+{
+	struct kvm_fs_uring *u = &fs->uring;
+	unsigned int tail = *u->sq_tail, index;
+
+	if (tail - smp_load_acquire(u->sq_head) >= u->sq_entries) {
+		fs_submit(fs);
+		if (tail - smp_load_acquire(u->sq_head) >= u->sq_entries)
+			return NULL;
+	}
+
+	index = tail & *u->sq_mask;
+	u->sq_array[index] = index;
+
+	return &u->sqes[index];
+}
+
+/* Publish the SQ entry. It's called with the lock held */
+static void fs_commit_sqe(struct kvm_fs *fs)
+{
+	struct kvm_fs_uring *u = &fs->uring;
+
+	smp_store_release(u->sq_tail, *u->sq_tail + 1);
+	u->to_submit++;
+}
+
+static void fs_flush(struct kvm_vm *vm)
+{
+	struct kvm_fs *fs = vm->fs;
+
+	if (!fs)
+		return;
+
+	pthread_mutex_lock(&fs->lock);
+	fs_submit(fs);
+	pthread_mutex_unlock(&fs->lock);
+}
+
+static struct kvm_fs_req *fs_alloc_req(struct kvm_vm *vm,
+				       struct kvm_syscall_ring *ring,
+				       struct syscall_sqe *sqe,
+				       int opcode)
+{
+	struct kvm_fs_req *req;
+
+	req = malloc(sizeof(*req));
+	if (!req)
+		return NULL;
+
+	req->vm = vm;
+	req->ring = ring;
+	req->user_data = sqe->user_data;
+	req->opcode = opcode;
+	req->fd = -1;
+	req->dirfd = -1;
+	req->buf = 0;
+
+	return req;
+}
+
+static void fs_free_req(struct kvm_fs_req *req)
+{
+	if (req->dirfd >= 0)
+		close(req->dirfd);
+	if (req->opcode == IORING_OP_STATX && req->fd >= 0)
+		close(req->fd);
+
+	free(req);
+}
+
+/*
+ * Queue the request, which is submitted by the flush handler later. The
+ * request is released if it fails to be queued.
+ */
+static long fs_queue_req(struct kvm_fs *fs,
+			 struct kvm_fs_req *req,
+			 struct io_uring_sqe *s)
+{
+	struct io_uring_sqe *sqe;
+
+	pthread_mutex_lock(&fs->lock);
+
+	sqe = fs_get_sqe(fs);
+	if (!sqe) {
+		pthread_mutex_unlock(&fs->lock);
+		fs_free_req(req);
+		return -EAGAIN;
+	}
+
+	*sqe = *s;
+	sqe->opcode = req->opcode;
+	sqe->user_data = (unsigned long)req;
+	atomic_fetch_inc(&fs->pending);
+	kvm_syscall_defer(req->ring);
+	fs_commit_sqe(fs);
+
+	pthread_mutex_unlock(&fs->lock);
+
+	return SYSCALL_RET_PENDING;
+}
+
+static int fs_copy_path(struct kvm_vm *vm, unsigned long gva, char *path)
+{
+	struct kvm_vm_mm *mm = &vm->mm;
+	unsigned long hva, len;
+	char *end;
+	int copied = 0;
+
+	while (copied < PATH_MAX) {
+		hva = kvm_mm_gva_to_hva(vm, gva, false);
+		if (!hva)
+			return -EFAULT;
+
+		len = min(mm->page_size - (gva & (mm->page_size - 1)),
+			  (unsigned long)(PATH_MAX - copied));
+		end = memchr((void *)hva, 0, len);
+		if (end) {
+			memcpy(path + copied, (void *)hva, end - (char *)hva + 1);
+			return 0;
+		}
+
+		memcpy(path + copied, (void *)hva, len);
+		copied += len;
+		gva += len;
+	}
+
+	return -ENAMETOOLONG;
+}
+
+/*
+ * Translate the guest directory file descriptor to the host one. The
+ * root directory is used for AT_FDCWD, where the absolute paths are
+ * resolved in the root directory too. Otherwise, the host file descriptor
+ * is duplicated to @req->dirfd, so that it can't be closed and reused by
+ * others before the request is completed.
+ */
+static int fs_dirfd(struct kvm_fs *fs, struct kvm_fs_req *req, int dirfd)
+{
+	int fd = -EBADF;
+
+	if (dirfd == AT_FDCWD) {
+		req->how.resolve = RESOLVE_IN_ROOT | RESOLVE_NO_MAGICLINKS;
+		return fs->root_fd;
+	}
+
+	if (dirfd < 0 || dirfd >= KVM_FS_MAX_FILES)
+		return -EBADF;
+
+	pthread_mutex_lock(&fs->lock);
+	if (fs->files[dirfd] >= 0) {
+		fd = fcntl(fs->files[dirfd], F_DUPFD_CLOEXEC, 0);
+		fd = (fd < 0) ? -errno : fd;
+	}
+	pthread_mutex_unlock(&fs->lock);
+
+	req->dirfd = (fd >= 0) ? fd : -1;
+	req->how.resolve = RESOLVE_BENEATH | RESOLVE_NO_MAGICLINKS;
+	return fd;
+}
+
+static bool fs_valid_fd(struct kvm_fs *fs, unsigned long fd)
+{
+	bool valid;
+
+	if (fd >= KVM_FS_MAX_FILES)
+		return false;
+
+	pthread_mutex_lock(&fs->lock);
+	valid = (fs->files[fd] >= 0);
+	pthread_mutex_unlock(&fs->lock);
+
+	return valid;
+}
+
+/* Update the registered file. It's called with the lock held */
+static void fs_update_file(struct kvm_fs *fs, int fd, int host_fd)
+{
+	struct io_uring_files_update up;
+
+	fs->files[fd] = host_fd;
+	if (host_fd == KVM_FS_FILE_RESERVED)
+		return;
+
+	memset(&up, 0, sizeof(up));
+	up.offset = fd;
+	up.fds = (unsigned long)&fs->files[fd];
+	fs_uring_register(&fs->uring, IORING_REGISTER_FILES_UPDATE, &up, 1);
+}
+
+/**
+ * kvm_fs_get_file - Get host file descriptor
+ * @vm:		VM where the file is opened
+ * @fd:		guest file descriptor
+ *
+ * The host file descriptor is duplicated, so that it can't be closed and
+ * reused by others while it's used by the caller. The duplicated one is
+ * returned on success, which is closed by the caller. Otherwise, negative
+ * error code is returned.
+ */
+int kvm_fs_get_file(struct kvm_vm *vm, int fd)
+{
+	struct kvm_fs *fs = vm->fs;
+	int host_fd = -EBADF;
+
+	if (!fs || fd < 0 || fd >= KVM_FS_MAX_FILES)
+		return -EBADF;
+
+	pthread_mutex_lock(&fs->lock);
+	if (fs->files[fd] >= 0) {
+		host_fd = fcntl(fs->files[fd], F_DUPFD_CLOEXEC, 0);
+		host_fd = (host_fd < 0) ? -errno : host_fd;
+	}
+	pthread_mutex_unlock(&fs->lock);
+
+	return host_fd;
+}
+
+/**
+ * kvm_fs_install_file - Install host file descriptor
+ * @vm:		VM where the file is installed
+ * @host_fd:	host file descriptor, owned by the file system on success
+ *
+ * The lowest free guest file descriptor is allocated for @host_fd, and
+ * returned on success. Otherwise, negative error code is returned.
+ */
+int kvm_fs_install_file(struct kvm_vm *vm, int host_fd)
+{
+	struct kvm_fs *fs = vm->fs;
+	int fd;
+
+	if (!fs)
+		return -ENOSYS;
+
+	pthread_mutex_lock(&fs->lock);
+	for (fd = 0; fd < KVM_FS_MAX_FILES; fd++) {
+		if (fs->files[fd] == KVM_FS_FILE_FREE) {
+			fs_update_file(fs, fd, host_fd);
+			break;
+		}
+	}
+	pthread_mutex_unlock(&fs->lock);
+
+	return (fd < KVM_FS_MAX_FILES) ? fd : -EMFILE;
+}
+
+/* openat(dirfd, pathname, flags, mode) */
+static long fs_openat(struct kvm_vm *vm,
+		      struct kvm_syscall_ring *ring,
+		      struct syscall_sqe *sqe)
+{
+	struct kvm_fs *fs = vm->fs;
+	struct kvm_fs_req *req;
+	struct io_uring_sqe s;
+	int dirfd, fd;
+	long ret;
+
+	if (!fs)
+		return -ENOSYS;
+
+	req = fs_alloc_req(vm, ring, sqe, IORING_OP_OPENAT2);
+	if (!req)
+		return -ENOMEM;
+
+	memset(&req->how, 0, sizeof(req->how));
+	dirfd = fs_dirfd(fs, req, sqe->args[0]);
+	ret = (dirfd < 0) ? dirfd : fs_copy_path(vm, sqe->args[1], req->path);
+	if (ret < 0) {
+		fs_free_req(req);
+		return ret;
+	}
+
+	/* Reserve the guest file descriptor */
+	pthread_mutex_lock(&fs->lock);
+	for (fd = 0; fd < KVM_FS_MAX_FILES; fd++) {
+		if (fs->files[fd] == KVM_FS_FILE_FREE) {
+			fs_update_file(fs, fd, KVM_FS_FILE_RESERVED);
+			break;
+		}
+	}
+	pthread_mutex_unlock(&fs->lock);
+
+	if (fd >= KVM_FS_MAX_FILES) {
+		fs_free_req(req);
+		return -EMFILE;
+	}
+
+	req->fd = fd;
+	req->how.flags = (unsigned int)sqe->args[2] | O_CLOEXEC;
+	req->how.mode = (req->how.flags & (O_CREAT | O_TMPFILE)) ?
+			(sqe->args[3] & 07777) : 0;
+
+	memset(&s, 0, sizeof(s));
+	s.fd = dirfd;
+	s.addr = (unsigned long)req->path;
+	s.len = sizeof(req->how);
+	s.off = (unsigned long)&req->how;
+	ret = fs_queue_req(fs, req, &s);
+	if (ret != SYSCALL_RET_PENDING) {
+		pthread_mutex_lock(&fs->lock);
+		fs->files[fd] = KVM_FS_FILE_FREE;
+		pthread_mutex_unlock(&fs->lock);
+	}
+
+	return ret;
+}
+
+/* close(fd) */
+static long fs_close(struct kvm_vm *vm,
+		     struct kvm_syscall_ring *ring,
+		     struct syscall_sqe *sqe)
+{
+	struct kvm_fs *fs = vm->fs;
+	unsigned long fd = sqe->args[0];
+	int host_fd;
+
+	if (!fs)
+		return -ENOSYS;
+
+	if (fd >= KVM_FS_MAX_FILES)
+		return -EBADF;
+
+	/* The file is forgotten by epoll before its slot can be reused */
+	kvm_epoll_close(vm, fd);
+
+	pthread_mutex_lock(&fs->lock);
+	host_fd = fs->files[fd];
+	if (host_fd >= 0)
+		fs_update_file(fs, fd, KVM_FS_FILE_FREE);
+	pthread_mutex_unlock(&fs->lock);
+
+	if (host_fd < 0)
+		return -EBADF;
+
+	close(host_fd);
+
+	return 0;
+}
+
+/*
+ * read(fd, buf, count), write(fd, buf, count), pread64(fd, buf, count,
+ * offset) and pwrite64(fd, buf, count, offset). The data is moved from or
+ * to the guest memory directly through the I/O vector. The count is
+ * limited by the number of I/O vector entries after the contiguous pages
+ * are merged, resulting in a short read or write.
+ */
+static long fs_rw(struct kvm_vm *vm,
+		  struct kvm_syscall_ring *ring,
+		  struct syscall_sqe *sqe,
+		  bool write,
+		  bool positioned)
+{
+	struct kvm_fs *fs = vm->fs;
+	struct kvm_fs_req *req;
+	struct io_uring_sqe s;
+	unsigned long count;
+	int nr;
+
+	if (!fs)
+		return -ENOSYS;
+
+	if (!fs_valid_fd(fs, sqe->args[0]))
+		return -EBADF;
+
+	count = min(sqe->args[2], KVM_FS_MAX_RW_COUNT);
+	if (!count)
+		return 0;
+
+	req = fs_alloc_req(vm, ring, sqe, write ? IORING_OP_WRITEV :
+						  IORING_OP_READV);
+	if (!req)
+		return -ENOMEM;
+
+	nr = kvm_mm_gva_to_iov_partial(vm, sqe->args[1], &count, !write,
+				       req->iov, KVM_FS_MAX_IOV);
+	if (nr < 0) {
+		free(req);
+		return nr;
+	}
+
+	memset(&s, 0, sizeof(s));
+	s.fd = sqe->args[0];
+	s.flags = IOSQE_FIXED_FILE;
+	s.off = positioned ? sqe->args[3] : (uint64_t)-1;
+	s.addr = (unsigned long)req->iov;
+	s.len = nr;
+
+	return fs_queue_req(fs, req, &s);
+}
+
+static long fs_read(struct kvm_vm *vm,
+		    struct kvm_syscall_ring *ring,
+		    struct syscall_sqe *sqe)
+{
+	return fs_rw(vm, ring, sqe, false, false);
+}
+
+static long fs_write(struct kvm_vm *vm,
+		     struct kvm_syscall_ring *ring,
+		     struct syscall_sqe *sqe)
+{
+	return fs_rw(vm, ring, sqe, true, false);
+}
+
+static long fs_pread64(struct kvm_vm *vm,
+		       struct kvm_syscall_ring *ring,
+		       struct syscall_sqe *sqe)
+{
+	return fs_rw(vm, ring, sqe, false, true);
+}
+
+static long fs_pwrite64(struct kvm_vm *vm,
+			struct kvm_syscall_ring *ring,
+			struct syscall_sqe *sqe)
+{
+	return fs_rw(vm, ring, sqe, true, true);
+}
+
+/* fsync(fd) and fdatasync(fd) */
+static long fs_sync(struct kvm_vm *vm,
+		    struct kvm_syscall_ring *ring,
+		    struct syscall_sqe *sqe,
+		    bool datasync)
+{
+	struct kvm_fs *fs = vm->fs;
+	struct kvm_fs_req *req;
+	struct io_uring_sqe s;
+
+	if (!fs)
+		return -ENOSYS;
+
+	if (!fs_valid_fd(fs, sqe->args[0]))
+		return -EBADF;
+
+	req = fs_alloc_req(vm, ring, sqe, IORING_OP_FSYNC);
+	if (!req)
+		return -ENOMEM;
+
+	memset(&s, 0, sizeof(s));
+	s.fd = sqe->args[0];
+	s.flags = IOSQE_FIXED_FILE;
+	s.fsync_flags = datasync ? IORING_FSYNC_DATASYNC : 0;
+
+	return fs_queue_req(fs, req, &s);
+}
+
+static long fs_fsync(struct kvm_vm *vm,
+		     struct kvm_syscall_ring *ring,
+		     struct syscall_sqe *sqe)
+{
+	return fs_sync(vm, ring, sqe, false);
+}
+
+static long fs_fdatasync(struct kvm_vm *vm,
+			 struct kvm_syscall_ring *ring,
+			 struct syscall_sqe *sqe)
+{
+	return fs_sync(vm, ring, sqe, true);
+}
+
+/*
+ * statx(dirfd, pathname, flags, mask, statxbuf). The path is resolved by
+ * openat2() in the root directory, as the resolution can't be restricted
+ * by statx. The result is copied to the guest on completion.
+ */
+static long fs_statx(struct kvm_vm *vm,
+		     struct kvm_syscall_ring *ring,
+		     struct syscall_sqe *sqe)
+{
+	struct kvm_fs *fs = vm->fs;
+	struct kvm_fs_req *req;
+	struct io_uring_sqe s;
+	int dirfd, flags = sqe->args[2];
+	long ret;
+
+	if (!fs)
+		return -ENOSYS;
+
+	req = fs_alloc_req(vm, ring, sqe, IORING_OP_STATX);
+	if (!req)
+		return -ENOMEM;
+
+	memset(&req->how, 0, sizeof(req->how));
+	dirfd = fs_dirfd(fs, req, sqe->args[0]);
+	ret = (dirfd < 0) ? dirfd : fs_copy_path(vm, sqe->args[1], req->path);
+	if (ret < 0) {
+		fs_free_req(req);
+		return ret;
+	}
+
+	if (req->path[0] || !(flags & AT_EMPTY_PATH)) {
+		req->how.flags = O_PATH | O_CLOEXEC;
+		if (flags & AT_SYMLINK_NOFOLLOW)
+			req->how.flags |= O_NOFOLLOW;
+
+		req->fd = syscall(SYS_openat2, dirfd, req->path,
+				  &req->how, sizeof(req->how));
+		if (req->fd < 0) {
+			ret = -errno;
+			fs_free_req(req);
+			return ret;
+		}
+
+		dirfd = req->fd;
+	}
+
+	req->buf = sqe->args[4];
+	req->path[0] = '\0';
+
+	memset(&s, 0, sizeof(s));
+	s.fd = dirfd;
+	s.addr = (unsigned long)req->path;
+	s.len = sqe->args[3];
+	s.off = (unsigned long)&req->stx;
+	s.statx_flags = (flags & AT_STATX_SYNC_TYPE) | AT_EMPTY_PATH;
+
+	return fs_queue_req(fs, req, &s);
+}
+
+static void fs_complete(struct kvm_fs *fs, struct kvm_fs_req *req, int res)
+{
+	long ret = res;
+
+	switch (req->opcode) {
+	case IORING_OP_OPENAT2:
+		pthread_mutex_lock(&fs->lock);
+		fs_update_file(fs, req->fd, (res >= 0) ? res : KVM_FS_FILE_FREE);
+		pthread_mutex_unlock(&fs->lock);
+		if (res >= 0)
+			ret = req->fd;
+		break;
+	case IORING_OP_STATX:
+		if (!res)
+			ret = kvm_mm_copy_to_guest(req->vm, req->buf, &req->stx,
+					       sizeof(req->stx));
+		break;
+	}
+
+	kvm_syscall_complete(req->ring, req->user_data, ret);
+	fs_free_req(req);
+	atomic_fetch_dec(&fs->pending);
+}
+
+static void *fs_thread(void *data)
+{
+	struct kvm_vm *vm = data;
+	struct kvm_fs *fs = vm->fs;
+	struct kvm_fs_uring *u = &fs->uring;
+	struct io_uring_cqe *cqe;
+	struct kvm_fs_req *req;
+	unsigned int head, tail;
+	int ret;
+
+	while (!READ_ONCE(fs->stop) || atomic_read(&fs->pending)) {
+		ret = fs_uring_enter(u, 0, 1, IORING_ENTER_GETEVENTS);
+		if (ret < 0 && errno != EINTR) {
+			fprintf(stderr, "%s: Unable to reap completions (%d)\n",
+				__func__, errno);
+			break;
+		}
+
+		head = *u->cq_head;
+		tail = smp_load_acquire(u->cq_tail);
+		for (; head != tail; head++) {
+			cqe = &u->cqes[head & *u->cq_mask];
+			req = (struct kvm_fs_req *)(unsigned long)cqe->user_data;
+			if (req)
+				fs_complete(fs, req, cqe->res);
+		}
+
+		smp_store_release(u->cq_head, head);
+	}
+
+	return NULL;
+}
+
+static void fs_free(struct kvm_fs *fs)
+{
+	int i;
+
+	for (i = 0; i < KVM_FS_MAX_FILES; i++) {
+		if (fs->files[i] >= 0)
+			close(fs->files[i]);
+	}
+
+	fs_uring_teardown(&fs->uring);
+	if (fs->root_fd >= 0)
+		close(fs->root_fd);
+
+	free(fs);
+}
+
+/**
+ * kvm_fs_init - Initialize file system of VM
+ * @vm:		VM where the file system is initialized
+ * @root:	root directory of the sandbox on host
+ *
+ * The guest's standard input, output and error are inherited from us.
+ * It returns zero on success, or negative error code on failure.
+ */
+int kvm_fs_init(struct kvm_vm *vm, const char *root)
+{
+	struct kvm_fs *fs;
+	int i, ret;
+
+	fs = malloc(sizeof(*fs));
+	if (!fs) {
+		fprintf(stderr, "%s: Unable to alloc file system\n", __func__);
+		return -ENOMEM;
+	}
+
+	memset(fs, 0, sizeof(*fs));
+	fs->uring.fd = -1;
+	pthread_mutex_init(&fs->lock, NULL);
+	for (i = 0; i < KVM_FS_MAX_FILES; i++)
+		fs->files[i] = (i <= STDERR_FILENO) ?
+			       fcntl(i, F_DUPFD_CLOEXEC, 0) : KVM_FS_FILE_FREE;
+
+	fs->root_fd = open(root, O_PATH | O_DIRECTORY | O_CLOEXEC);
+	if (fs->root_fd < 0) {
+		fprintf(stderr, "%s: Unable to open <%s>\n", __func__, root);
+		ret = -errno;
+		goto error;
+	}
+
+	ret = fs_uring_setup(&fs->uring, KVM_FS_URING_ENTRIES);
+	if (ret)
+		goto error;
+
+	if (fs_uring_register(&fs->uring, IORING_REGISTER_FILES,
+			      fs->files, KVM_FS_MAX_FILES)) {
+		fprintf(stderr, "%s: Unable to register files (%d)\n",
+			__func__, errno);
+		ret = -errno;
+		goto error;
+	}
+
+	vm->fs = fs;
+	ret = pthread_create(&fs->thread, NULL, fs_thread, vm);
+	if (ret) {
+		fprintf(stderr, "%s: Unable to create thread (%d)\n",
+			__func__, ret);
+		vm->fs = NULL;
+		ret = -ret;
+		goto error;
+	}
+
+	kvm_syscall_register_flush(vm, fs_flush);
+	kvm_syscall_register(__NR_openat, fs_openat, 0);
+	kvm_syscall_register(__NR_close, fs_close, 0);
+	kvm_syscall_register(__NR_read, fs_read, 0);
+	kvm_syscall_register(__NR_write, fs_write, 0);
+	kvm_syscall_register(__NR_pread64, fs_pread64, 0);
+	kvm_syscall_register(__NR_pwrite64, fs_pwrite64, 0);
+	kvm_syscall_register(__NR_fsync, fs_fsync, 0);
+	kvm_syscall_register(__NR_fdatasync, fs_fdatasync, 0);
+	kvm_syscall_register(__NR_statx, fs_statx, 0);
+
+	return 0;
+
+error:
+	fs_free(fs);
+	return ret;
+}
+
+void kvm_fs_destroy(struct kvm_vm *vm)
+{
+	struct kvm_fs *fs = vm->fs;
+	struct io_uring_sqe *sqe;
+
+	if (!fs)
+		return;
+
+	/* Wake up the thread, which exits after the pending requests */
+	pthread_mutex_lock(&fs->lock);
+	WRITE_ONCE(fs->stop, true);
+	while (!(sqe = fs_get_sqe(fs)))
+		fs_submit(fs);
+
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = IORING_OP_NOP;
+	fs_commit_sqe(fs);
+	fs_submit(fs);
+	pthread_mutex_unlock(&fs->lock);
+
+	pthread_join(fs->thread, NULL);
+
+	vm->fs = NULL;
+	fs_free(fs);
+}
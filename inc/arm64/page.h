@@ -0,0 +1,36 @@
+/*
+ * Copyright 2022 Gavin Shan <gshan@redhat.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#ifndef __SANDBOX_ARM64_PAGE_H
+#define __SANDBOX_ARM64_PAGE_H
+
+#define DCZID_EL0_BS_MASK	0xf
+#define DCZID_EL0_DZP		(1UL << 4)
+
+/*
+ * Zero the pages with DC ZVA, which zeroes one block without reading it
+ * in or polluting the cache. The block size is given by DCZID_EL0, and
+ * memset() is used instead if DC ZVA is prohibited.
+ */
+static inline void arch_clear_pages(void *addr, unsigned long len)
+{
+	unsigned long dczid, size, p, end = (unsigned long)addr + len;
+
+	__asm__ volatile("mrs	%0, dczid_el0" : "=r" (dczid));
+	if (dczid & DCZID_EL0_DZP) {
+		memset(addr, 0, len);
+		return;
+	}
+
+	size = 4UL << (dczid & DCZID_EL0_BS_MASK);
+	for (p = (unsigned long)addr; p < end; p += size)
+		__asm__ volatile("dc	zva, %0" : : "r" (p) : "memory");
+}
+
+#endif /* __SANDBOX_ARM64_PAGE_H */
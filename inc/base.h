@@ -24,6 +24,13 @@
 #define READ_ONCE(x)						\
 	(*(const volatile typeof(x) *)&(x))
 
+/* Memory barriers */
+#define smp_mb()		__atomic_thread_fence(__ATOMIC_SEQ_CST)
+#define smp_rmb()		__atomic_thread_fence(__ATOMIC_ACQUIRE)
+#define smp_wmb()		__atomic_thread_fence(__ATOMIC_RELEASE)
+#define smp_load_acquire(p)	__atomic_load_n(p, __ATOMIC_ACQUIRE)
+#define smp_store_release(p, v)	__atomic_store_n(p, v, __ATOMIC_RELEASE)
+
 /* struct offsets */
 #define offsetof(type, member)					\
 	((size_t)&((type *)0)->member)
@@ -48,6 +48,12 @@ change_bit(unsigned long *p, unsigned int nr)
 	arch_change_bit(p, nr);
 }
 
+static __always_inline bool
+test_bit(unsigned long *p, unsigned int nr)
+{
+	return !!(READ_ONCE(p[BIT_WORD(nr)]) & BIT_MASK(nr));
+}
+
 static __always_inline bool
 test_and_set_bit(unsigned long *p, unsigned int nr)
 {
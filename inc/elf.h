@@ -46,6 +46,9 @@ struct elf64_hdr {
 #define ELF64_PHDR_TYPE_GNU_STACK	0x6474e551
 #define ELF64_PHDR_TYPE_GNU_RELRO	0x6474e552
 #define ELF64_PHDR_TYPE_GNU_PROPERTY	0x6474e553
+#define ELF64_PHDR_FLAG_X		(1 << 0)
+#define ELF64_PHDR_FLAG_W		(1 << 1)
+#define ELF64_PHDR_FLAG_R		(1 << 2)
 
 struct elf64_phdr {
 	uint32_t  p_type;	/* Segment type             */
@@ -98,6 +101,9 @@ struct elf64_shdr {
 #define ELF64_SYM_TYPE_FILE		4
 #define ELF64_SYM_TYPE_COMMON		5
 #define ELF64_SYM_TYPE_TLS		6
+#define ELF64_SYM_SHNDX_UNDEF		0
+#define ELF64_SYM_SHNDX_ABS		0xfff1
+#define ELF64_SYM_INDEX_UNDEF		0
 
 struct elf64_sym {
 	uint32_t  st_name;	/* Symbol name, index in string table  */
@@ -143,10 +149,16 @@ struct elf64_rela {
 #define ELF64_DYN_TAG_DEBUG		21
 #define ELF64_DYN_TAG_TEXTREL		22
 #define ELF64_DYN_TAG_JMPREL		23
+#define ELF64_DYN_TAG_BIND_NOW		24
+#define ELF64_DYN_TAG_FLAGS		30
 #define ELF64_DYN_TAG_ENCODING		32
+#define ELF64_DYN_TAG_RELRSZ		35
+#define ELF64_DYN_TAG_RELR		36
+#define ELF64_DYN_TAG_RELRENT		37
 #define ELF64_DYN_TAG_VALRNG_LO		0x6ffffd00
 #define ELF64_DYN_TAG_VALRNG_HI		0x6ffffdff
 #define ELF64_DYN_TAG_ADDRRNG_LO	0x6ffffe00
+#define ELF64_DYN_TAG_GNU_HASH		0x6ffffef5
 #define ELF64_DYN_TAG_ADDRRNG_HI	0x6ffffeff
 #define ELF64_DYN_TAG_VERSYM		0x6ffffff0
 #define ELF64_DYN_TAG_RELACOUNT		0x6ffffff9
@@ -166,6 +178,8 @@ struct elf64_dyn {
 };
 
 /* ELF64_SHDR_TYPE_NOTE */
+#define ELF64_NOTE_TYPE_GNU_BUILD_ID	3
+
 struct elf64_note {
 	uint32_t  n_namesz;	/* Name size                             */
 	uint32_t  n_descsz;	/* Content size                          */
@@ -320,7 +334,118 @@ struct elf64_rel {
 #define R_AARCH64_TLSDESC    1031 /* TLS Descriptor                 */
 #define R_AARCH64_IRELATIVE  1032 /* STT_GNU_IFUNC relocation       */
 
+/*
+ * The position independent executables (ET_DYN) are loaded at the fixed
+ * base, which is aligned to 64KB so that the alignment requirement of the
+ * program segments is always met.
+ */
+#define ELF_DYN_LOAD_BASE	0x400000UL
+#define ELF_BUILD_ID_MAX	64
+
+/**
+ * struct elf_segment - Loaded program segment
+ *
+ * @vaddr:		Virtual address, where the load bias is applied.
+ * @memsz:		Size of the segment in memory.
+ * @hva:		Host virtual address corresponding to @vaddr.
+ * @flags:		Segment flags (ELF64_PHDR_FLAG_*)
+ * @slot:		Memory slot of the shared read-only segment, or NULL
+ *			if the segment resides in the guest RAM.
+ */
+struct elf_segment {
+	unsigned long		vaddr;
+	unsigned long		memsz;
+	unsigned long		hva;
+	unsigned long		flags;
+	struct kvm_mem_slot	*slot;
+};
+
+/**
+ * struct elf_symbol - Symbol in the index of the loaded ELF image
+ *
+ * @addr:		Address of the symbol, where the load bias is applied
+ *			unless it's an absolute symbol.
+ * @size:		Size of the symbol.
+ * @name:		Name of the symbol.
+ * @hash:		GNU hash value of the name.
+ * @global:		The symbol is global or weak.
+ */
+struct elf_symbol {
+	unsigned long		addr;
+	unsigned long		size;
+	const char		*name;
+	uint32_t		hash;
+	bool			global;
+};
+
+struct elf_symtab;
+
+/**
+ * struct elf_image - Loaded ELF image
+ *
+ * @vm:			The VM, where the image is loaded.
+ * @fd:			File descriptor of the ELF file.
+ * @offset:		Offset of the ELF image in the file, which is non-zero
+ *			when it's embedded in the sandbox package.
+ * @mappable:		The program segments can be mapped from the file
+ *			directly, because the file is immutable.
+ * @hdr:		ELF header.
+ * @phdrs:		Program headers, which are read at once.
+ * @bias:		Load bias, zero for ET_EXEC images.
+ * @entry:		Entry point, where the load bias is applied.
+ * @dynamic:		Virtual address of the dynamic section, zero when
+ *			the image isn't dynamic.
+ * @segs:		Loaded program segments.
+ * @nr_segs:		Number of loaded program segments.
+ * @build_id:		Build ID from the GNU build ID note.
+ * @build_id_len:	Length of the build ID, zero if it's missed.
+ * @symtab:		Symbol index.
+ * @link:		Used to insert the image to the list of the VM.
+ */
+struct elf_image {
+	struct kvm_vm		*vm;
+	int			fd;
+	unsigned long		offset;
+	bool			mappable;
+	struct elf64_hdr	hdr;
+	struct elf64_phdr	*phdrs;
+	unsigned long		bias;
+	unsigned long		entry;
+	unsigned long		dynamic;
+	struct elf_segment	*segs;
+	unsigned int		nr_segs;
+	uint8_t			build_id[ELF_BUILD_ID_MAX];
+	unsigned int		build_id_len;
+	struct elf_symtab	*symtab;
+	struct list_head	link;
+};
+
 /* APIs */
+struct elf_segment *elf_image_add_segment(struct elf_image *image,
+					  unsigned long vaddr,
+					  unsigned long memsz,
+					  unsigned long flags);
+struct elf_segment *elf_image_add_shared_segment(struct elf_image *image,
+				unsigned long vaddr, unsigned long memsz,
+				unsigned long flags,
+				int (*fill)(void *addr, void *data),
+				void *data);
+ssize_t elf_image_read(struct elf_image *image, void *buf,
+		       unsigned long len, unsigned long offset);
+void *elf_image_translate(struct elf_image *image, unsigned long vaddr,
+			  unsigned long len);
+int elf_relocate(struct elf_image *image);
+int elf_cache_restore(struct elf_image *image);
+void elf_cache_store(struct elf_image *image);
+int elf_symtab_build(struct elf_image *image);
+void elf_symtab_destroy(struct elf_image *image);
+int elf_symbol_lookup(struct elf_image *image, const char *name,
+		      unsigned long *addr);
+struct elf_symbol *elf_symbol_find(struct elf_image *image,
+				   unsigned long addr);
+void elf_image_destroy(struct elf_image *image);
+int elf_load(struct kvm_vm *vm, int fd, unsigned long offset,
+	     bool mappable, unsigned long *p_entry);
 int elf_load_file(struct kvm_vm *vm, char *filename, unsigned long *p_entry);
 
 #endif /* __SANDBOX_ELF_H */
@@ -0,0 +1,127 @@
+/*
+ * Copyright 2022 Gavin Shan <gshan@redhat.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#ifndef __SANDBOX_EPOLL_H
+#define __SANDBOX_EPOLL_H
+
+/*
+ * The guest's epoll instances and poll calls are backed by one host epoll
+ * instance per VM. The interest lists of the guest are mirrored to it
+ * with EPOLLONESHOT, and the readiness is collected by the per-VM thread.
+ * The waits which can't be satisfied immediately are parked, and their
+ * CQ entries are posted by the thread when the events arrive or the
+ * timeout expires. No vCPU or worker is blocked by the waits.
+ */
+#define KVM_EPOLL_MAX_EVENTS	64
+
+struct kvm_epoll_wait;
+
+/**
+ * struct kvm_epoll_item - File watched by the guest
+ *
+ * @inst:		Guest epoll instance, or NULL for poll.
+ * @wait:		Poll call which the file is watched for.
+ * @fd:			Guest file descriptor.
+ * @host_fd:		Duplicated host file descriptor.
+ * @events:		Events requested by the guest.
+ * @data:		User data of the guest epoll event.
+ * @ready:		Events which have been reported by the host.
+ * @dead:		The file has been removed from the interest list.
+ * @link:		Used to insert the file to the interest list.
+ * @ready_link:		Used to insert the file to the ready list.
+ */
+struct kvm_epoll_item {
+	struct kvm_epoll_inst	*inst;
+	struct kvm_epoll_wait	*wait;
+	int			fd;
+	int			host_fd;
+	uint32_t		events;
+	uint64_t		data;
+	uint32_t		ready;
+	bool			dead;
+	struct list_head	link;
+	struct list_head	ready_link;
+};
+
+/**
+ * struct kvm_epoll_inst - Guest epoll instance
+ *
+ * @fd:			Guest file descriptor of the instance.
+ * @items:		Interest list.
+ * @ready:		Files with pending events.
+ */
+struct kvm_epoll_inst {
+	int			fd;
+	struct list_head	items;
+	struct list_head	ready;
+};
+
+/**
+ * struct kvm_epoll_wait - Parked epoll_pwait() or ppoll()
+ *
+ * @ring:		Ring where the CQ entry is posted.
+ * @user_data:		User data of the CQ entry.
+ * @inst:		Guest epoll instance, or NULL for ppoll.
+ * @events:		Guest buffer of the epoll events or poll entries.
+ * @maxevents:		Size of the guest buffer of the epoll events.
+ * @fds:		Poll entries of the guest.
+ * @host:		Poll entries of the duplicated host file descriptors.
+ * @nfds:		Number of poll entries.
+ * @items:		Files registered for the poll entries.
+ * @triggered:		Any of the files has been reported by the host.
+ * @timed:		@deadline is valid.
+ * @deadline:		The wait expires at the time (CLOCK_MONOTONIC).
+ * @link:		Used to insert the wait to the parked list.
+ */
+struct kvm_epoll_wait {
+	struct kvm_syscall_ring	*ring;
+	uint64_t		user_data;
+	struct kvm_epoll_inst	*inst;
+	unsigned long		events;
+	int			maxevents;
+	struct pollfd		*fds;
+	struct pollfd		*host;
+	unsigned long		nfds;
+	struct list_head	items;
+	bool			triggered;
+	bool			timed;
+	struct timespec		deadline;
+	struct list_head	link;
+};
+
+/**
+ * struct kvm_epoll - Host epoll instance of VM
+ *
+ * @epfd:		Host epoll instance.
+ * @evfd:		Event file to wake up the thread.
+ * @thread:		Thread where the events are collected.
+ * @lock:		Protect the instances, the waits and the files.
+ * @insts:		Guest epoll instances, indexed by the guest file
+ *			descriptors.
+ * @waits:		Parked waits.
+ * @dead:		Removed files, released by the thread.
+ * @stop:		The thread is stopped.
+ */
+struct kvm_epoll {
+	int			epfd;
+	int			evfd;
+	pthread_t		thread;
+	pthread_mutex_t		lock;
+	struct kvm_epoll_inst	*insts[KVM_FS_MAX_FILES];
+	struct list_head	waits;
+	struct list_head	dead;
+	bool			stop;
+};
+
+/* APIs */
+int kvm_epoll_init(struct kvm_vm *vm);
+void kvm_epoll_close(struct kvm_vm *vm, int fd);
+void kvm_epoll_destroy(struct kvm_vm *vm);
+
+#endif /* __SANDBOX_EPOLL_H */
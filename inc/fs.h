@@ -0,0 +1,107 @@
+/*
+ * Copyright 2022 Gavin Shan <gshan@redhat.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#ifndef __SANDBOX_FS_H
+#define __SANDBOX_FS_H
+
+/*
+ * The guest's file system calls are serviced by io_uring. The guest file
+ * descriptor is the index to the registered file table. The guest RAM
+ * isn't registered as the fixed buffer, which pins it and defeats the
+ * userfaultfd, reclaim and copy-on-write clones. The data is moved through
+ * the I/O vectors instead. The paths are resolved in the root directory of
+ * the sandbox.
+ */
+#define KVM_FS_MAX_FILES	256
+#define KVM_FS_URING_ENTRIES	256
+#define KVM_FS_MAX_IOV		16
+#define KVM_FS_MAX_RW_COUNT	0x7ffff000UL
+
+#define KVM_FS_FILE_FREE	-1
+#define KVM_FS_FILE_RESERVED	-2
+
+struct kvm_fs_uring {
+	int			fd;		/* io_uring fd		*/
+	void			*sq_ring;	/* SQ ring		*/
+	unsigned long		sq_ring_size;	/* Size of SQ ring	*/
+	void			*cq_ring;	/* CQ ring		*/
+	unsigned long		cq_ring_size;	/* Size of CQ ring	*/
+	struct io_uring_sqe	*sqes;		/* SQ entries		*/
+	unsigned long		sqes_size;	/* Size of SQ entries	*/
+	unsigned int		*sq_head;
+	unsigned int		*sq_tail;
+	unsigned int		*sq_mask;
+	unsigned int		*sq_array;
+	unsigned int		sq_entries;	/* Number of SQ entries	*/
+	unsigned int		*cq_head;
+	unsigned int		*cq_tail;
+	unsigned int		*cq_mask;
+	struct io_uring_cqe	*cqes;		/* CQ entries		*/
+	unsigned int		to_submit;	/* Unsubmitted entries	*/
+};
+
+/**
+ * struct kvm_fs_req - File system call submitted to io_uring
+ *
+ * @vm:			VM where the system call is issued.
+ * @ring:		Ring where the CQ entry is posted.
+ * @user_data:		User data of the CQ entry.
+ * @opcode:		io_uring operation.
+ * @fd:			Guest file descriptor reserved by openat, or the
+ *			host file descriptor opened by statx.
+ * @dirfd:		Duplicated host directory file descriptor.
+ * @buf:		Guest buffer of statx.
+ * @iov:		Host I/O vector of read and write.
+ * @how:		Parameters of openat.
+ * @stx:		Bounce buffer of statx.
+ * @path:		Path of openat and statx.
+ */
+struct kvm_fs_req {
+	struct kvm_vm		*vm;
+	struct kvm_syscall_ring	*ring;
+	uint64_t		user_data;
+	int			opcode;
+	int			fd;
+	int			dirfd;
+	unsigned long		buf;
+	struct iovec		iov[KVM_FS_MAX_IOV];
+	struct open_how		how;
+	struct statx		stx;
+	char			path[PATH_MAX];
+};
+
+/**
+ * struct kvm_fs - File system of VM
+ *
+ * @uring:		io_uring where the system calls are submitted.
+ * @root_fd:		Root directory of the sandbox.
+ * @files:		Host file descriptors, indexed by the guest file
+ *			descriptors.
+ * @lock:		Protect @files and the SQ of @uring.
+ * @thread:		Thread where the completions are reaped.
+ * @pending:		Number of submitted system calls.
+ * @stop:		The completion thread is stopped.
+ */
+struct kvm_fs {
+	struct kvm_fs_uring	uring;
+	int			root_fd;
+	int			files[KVM_FS_MAX_FILES];
+	pthread_mutex_t		lock;
+	pthread_t		thread;
+	int			pending;
+	bool			stop;
+};
+
+/* APIs */
+int kvm_fs_init(struct kvm_vm *vm, const char *root);
+int kvm_fs_get_file(struct kvm_vm *vm, int fd);
+int kvm_fs_install_file(struct kvm_vm *vm, int host_fd);
+void kvm_fs_destroy(struct kvm_vm *vm);
+
+#endif /* __SANDBOX_FS_H */
@@ -0,0 +1,93 @@
+/*
+ * Copyright 2022 Gavin Shan <gshan@redhat.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#ifndef __SANDBOX_FUTEX_H
+#define __SANDBOX_FUTEX_H
+
+/*
+ * The futex waiters are queued in the hash buckets keyed by the guest
+ * physical address, so that the aliased mappings share the wait queue.
+ * FUTEX_WAIT is parked and its CQ entry is posted when it's woken up or
+ * timed out, so the vCPU never blocks on it.
+ *
+ * The waiter page is mapped read-only at KVM_FUTEX_VA. It has one counter
+ * per 32-bits word of a page, which is the number of the waiters parked
+ * on the futex words at that page offset. The page offset is same in the
+ * guest virtual and physical address, so the guest finds the counter of
+ * its futex word without translation:
+ *
+ *   waiters[(uaddr & (PAGE_SIZE - 1)) >> 2]
+ *
+ * The guest skips FUTEX_WAKE if the counter is zero. A full barrier is
+ * needed between updating the futex word and reading the counter, which
+ * pairs with the barrier between incrementing the counter and reading
+ * the futex word on FUTEX_WAIT.
+ */
+#define KVM_FUTEX_VA			0x7f0000020000UL
+#define KVM_FUTEX_HASH_BITS		8
+#define KVM_FUTEX_HASH_SIZE		(1 << KVM_FUTEX_HASH_BITS)
+
+/**
+ * struct kvm_futex_waiter - Parked FUTEX_WAIT
+ *
+ * @ring:		Ring where the CQ entry is posted.
+ * @user_data:		User data of the CQ entry.
+ * @gpa:		Guest physical address of the futex word.
+ * @bitset:		Bitset of FUTEX_WAIT_BITSET, or all ones.
+ * @timed:		@deadline is valid.
+ * @deadline:		The wait expires at the time, in nanoseconds of
+ *			CLOCK_MONOTONIC.
+ * @link:		Used to insert the waiter to the hash bucket.
+ */
+struct kvm_futex_waiter {
+	struct kvm_syscall_ring	*ring;
+	uint64_t		user_data;
+	unsigned long		gpa;
+	uint32_t		bitset;
+	bool			timed;
+	uint64_t		deadline;
+	struct list_head	link;
+};
+
+struct kvm_futex_bucket {
+	pthread_mutex_t		lock;		/* Lock			*/
+	struct list_head	waiters;	/* Parked waiters	*/
+};
+
+/**
+ * struct kvm_futex - Futex of VM
+ *
+ * @waiters:		Waiter page, accessed through the host virtual
+ *			address.
+ * @buckets:		Hash buckets of the waiters.
+ * @lock:		Protect the fields below.
+ * @cond:		Wake up the timer thread.
+ * @thread:		Timer thread, which expires the timed waiters. It's
+ *			started on the first timed wait.
+ * @running:		The timer thread is running.
+ * @stop:		The timer thread is stopped.
+ * @next:		The nearest deadline of the timed waiters, or
+ *			UINT64_MAX if there is none.
+ */
+struct kvm_futex {
+	uint32_t		*waiters;
+	struct kvm_futex_bucket	buckets[KVM_FUTEX_HASH_SIZE];
+	pthread_mutex_t		lock;
+	pthread_cond_t		cond;
+	pthread_t		thread;
+	bool			running;
+	bool			stop;
+	uint64_t		next;
+};
+
+/* APIs */
+int kvm_futex_init(struct kvm_vm *vm);
+void kvm_futex_destroy(struct kvm_vm *vm);
+
+#endif /* __SANDBOX_FUTEX_H */
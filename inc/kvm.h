@@ -20,6 +20,91 @@
 		      SYS_REG_CRN(id), SYS_REG_CRM(id),	\
 		      SYS_REG_OP2(id))
 
+/* Stage-1 page table entry */
+#define KVM_MM_PTE_VALID	(1UL << 0)
+#define KVM_MM_PTE_TABLE	(1UL << 1)
+#define KVM_MM_PTE_ATTR_DEVICE	(0UL << 2)
+#define KVM_MM_PTE_ATTR_NORMAL	(4UL << 2)
+#define KVM_MM_PTE_AP_RO	(1UL << 7)
+#define KVM_MM_PTE_AF		(1UL << 10)
+#define KVM_MM_PTE_DEFAULT	(KVM_MM_PTE_AF | KVM_MM_PTE_ATTR_NORMAL | \
+				 KVM_MM_PTE_TABLE | KVM_MM_PTE_VALID)
+
+/* Entries of the per-thread translation cache */
+#define KVM_MM_TLB_ENTRIES	64
+
+/* Memory slots, the guest RAM is always taken by slot 0 */
+#define KVM_MAX_SLOTS		32
+
+struct kvm_shared_seg;
+struct kvm_zygote;
+struct kvm_vm_pool;
+
+struct kvm_mem_slot {
+	unsigned int		id;		/* Slot ID		*/
+	unsigned int		flags;		/* KVM_MEM_*		*/
+	unsigned long		gpa;		/* Guest physical addr	*/
+	unsigned long		size;		/* Size			*/
+	void			*hva;		/* Host virtual address	*/
+	struct kvm_shared_seg	*shared;	/* Shared segment	*/
+	bool			file;		/* Host file mapping	*/
+};
+
+/* Flags of the host file mapped into guest */
+#define KVM_MM_FILE_WRITE	(1U << 0)	/* Writable		*/
+#define KVM_MM_FILE_SHARED	(1U << 1)	/* Shared with host	*/
+#define KVM_MM_FILE_FIXED	(1U << 2)	/* Fixed address	*/
+#define KVM_MM_FILE_REPLACE	(1U << 3)	/* Replace existing	*/
+
+/*
+ * The anonymous memory is carved from one memory slot, which is backed by
+ * the host anonymous memory without reservation. The host pages aren't
+ * allocated until the guest touches them and the stage-2 fault is taken.
+ * The page-table pages of the mappings are allocated from the guest RAM,
+ * so the total size of the mappings is limited, to make their leaf tables
+ * take at most 1/KVM_MM_ANON_PGTABLE_RATIO of the guest RAM.
+ */
+#define KVM_MM_ANON_SIZE	(1UL << 32)
+#define KVM_MM_ANON_PGTABLE_RATIO 4
+
+/* Flags of the anonymous mapping */
+#define KVM_MM_ANON_WRITE	(1U << 0)	/* Writable		*/
+#define KVM_MM_ANON_FIXED	(1U << 1)	/* Fixed address	*/
+#define KVM_MM_ANON_POPULATE	(1U << 2)	/* Populated up front	*/
+#define KVM_MM_ANON_RESERVE	(1U << 3)	/* Address range only	*/
+#define KVM_MM_ANON_REPLACE	(1U << 4)	/* Replace existing	*/
+
+/*
+ * The freed guest memory is returned to the host lazily. The freed ranges
+ * are held until their total size exceeds the threshold, so that the
+ * memory freed and allocated again shortly isn't faulted in repeatedly.
+ * They're sorted and merged before being released, to save madvise()
+ * calls.
+ *
+ * The held ranges are zeroed by the background thread in chunks, and
+ * they're preferred by the allocations. The zeroed pages are handed out
+ * without being zeroed or faulted in again.
+ */
+#define KVM_MM_RECLAIM_BATCH	64
+#define KVM_MM_ZERO_CHUNK	0x10000
+
+struct kvm_mm_range {
+	unsigned long		gpa;		/* Guest physical addr	*/
+	unsigned long		len;		/* Length		*/
+	bool			zeroed;		/* Zeroed		*/
+};
+
+/* Range of the guest RAM bound to host NUMA node */
+#define KVM_MAX_NUMA_NODES	64
+#define KVM_MAX_NUMA_RANGES	8
+
+struct kvm_mm_node {
+	int			node;		/* Host NUMA node	*/
+	int			mode;		/* MPOL_BIND or MPOL_PREFERRED */
+	unsigned long		start;		/* Start page number	*/
+	unsigned long		end;		/* End page number	*/
+};
+
 struct kvm_vm_mm {
 	struct mm	*mm;		/* Memory management struct	*/
 	unsigned long	pa_bits;	/* Physical memory bits		*/
@@ -33,7 +118,193 @@ struct kvm_vm_mm {
 	unsigned long	phys_page_base;	/* Start PFN			*/
 	unsigned long	phys_page_num;	/* Number of physical pages	*/
 	unsigned long	*phys_page_bits; /* Free page bitmap		*/
+	unsigned long	*file_page_bits; /* Pages mapped from file	*/
 	void		*host_virt_addr; /* Host virtual address		*/
+
+	struct kvm_mem_slot slots[KVM_MAX_SLOTS]; /* Extra memory slots	*/
+	unsigned long	slot_base;	/* Base address of extra slots	*/
+	unsigned long	mmio_base;	/* Base address of MMIO regions	*/
+	struct kvm_mem_slot *anon_slot;	/* Anonymous memory slot	*/
+	struct mm	*anon;		/* GPA ranges of anonymous memory */
+	unsigned long	anon_mapped;	/* Size of anonymous mappings	*/
+	unsigned long	brk_start;	/* Start of program break	*/
+	unsigned long	brk;		/* Program break		*/
+
+	struct kvm_mm_range reclaim[KVM_MM_RECLAIM_BATCH]; /* Freed ranges */
+	int		nr_reclaim;	/* Number of freed ranges	*/
+	unsigned long	reclaim_size;	/* Size of freed ranges		*/
+	unsigned long	reclaim_threshold; /* Released above the size	*/
+	int		reclaim_advice;	/* MADV_DONTNEED or MADV_FREE	*/
+	pthread_t	zero_thread;	/* Thread zeroing freed ranges	*/
+	pthread_cond_t	zero_cond;	/* Condition of zeroing		*/
+	bool		zero_running;	/* Zeroing thread is running	*/
+	bool		zero_stop;	/* Zeroing thread is stopped	*/
+	unsigned long	zero_gpa;	/* Range being zeroed		*/
+	unsigned long	zero_len;	/* Length of range being zeroed	*/
+
+	struct kvm_mm_node nodes[KVM_MAX_NUMA_RANGES]; /* NUMA ranges	*/
+	int		nr_nodes;	/* Number of NUMA ranges	*/
+
+	unsigned long	id;		/* Unique ID of translation cache */
+	int		tlb_gen;	/* Generation of page table	*/
+};
+
+/**
+ * struct kvm_shared_seg - Read-only segment shared by VMs
+ *
+ * @key:		Key to identify the segment.
+ * @key_len:		Length of the key.
+ * @fd:			memfd backing the segment.
+ * @hva:		Host virtual address, where the segment is mapped.
+ * @size:		Size of the segment, aligned to page size.
+ * @refcount:		Number of VMs where the segment is attached.
+ * @link:		Used to insert the segment to the global cache.
+ */
+struct kvm_shared_seg {
+	uint8_t			key[96];
+	unsigned int		key_len;
+	int			fd;
+	void			*hva;
+	unsigned long		size;
+	int			refcount;
+	struct list_head	link;
+};
+
+/*
+ * The time page is mapped read-only to the guest at KVM_CLOCK_VA, and
+ * updated by the host periodically. The guest reads it under the seqlock,
+ * which is odd while the page is being updated:
+ *
+ *   ns = base_nsec + (((CNTVCT - cycle_last) * mult) >> shift)
+ *
+ * where CNTVCT is the guest's virtual counter.
+ */
+#define KVM_CLOCK_VA			0x7f0000010000UL
+#define KVM_CLOCK_UPDATE_MS		100
+
+struct kvm_clock_page {
+	uint32_t	seq;		/* Seqlock			*/
+	uint32_t	freq;		/* Counter frequency		*/
+	uint32_t	mult;		/* Counter to ns multiplier	*/
+	uint32_t	shift;		/* Counter to ns shift		*/
+	uint64_t	cycle_last;	/* Guest counter at update	*/
+	uint64_t	counter_offset;	/* Host minus guest counter	*/
+	int64_t		realtime_sec;	/* CLOCK_REALTIME at update	*/
+	int64_t		realtime_nsec;
+	int64_t		monotonic_sec;	/* CLOCK_MONOTONIC at update	*/
+	int64_t		monotonic_nsec;
+};
+
+/**
+ * struct kvm_clock - Host side of the guest's time page
+ *
+ * @vm:			VM where the time page resides.
+ * @data:		Time page, accessed through the host virtual address.
+ * @link:		Used to insert the time page to the global update list.
+ */
+struct kvm_clock {
+	struct kvm_vm		*vm;
+	struct kvm_clock_page	*data;
+	struct list_head	link;
+};
+
+/**
+ * struct kvm_fault - Fault-driven population of the guest memory
+ *
+ * @uffd:		userfaultfd where the missing pages are reported.
+ * @event_fd:		eventfd to stop the handler thread.
+ * @thread:		Handler thread.
+ * @readahead:		Size of the populated window on each fault.
+ * @buf:		Buffer where the window is prepared.
+ * @lock:		Protect @areas and @nr_areas.
+ * @areas:		Virtual memory areas populated on demand.
+ * @nr_areas:		Number of virtual memory areas in @areas.
+ */
+#define KVM_FAULT_MAX_AREAS		16
+#define KVM_FAULT_DEFAULT_READAHEAD	0x10000
+
+struct kvm_fault {
+	int			uffd;
+	int			event_fd;
+	pthread_t		thread;
+	unsigned long		readahead;
+	void			*buf;
+	pthread_mutex_t		lock;
+	struct vm_area		*areas[KVM_FAULT_MAX_AREAS];
+	unsigned int		nr_areas;
+};
+
+/*
+ * The exit handlers are dispatched by the exit reason. The handler returns
+ * zero to resume the vCPU, KVM_EXIT_HANDLER_STOP to stop the vCPU, or
+ * negative error code to stop the VM.
+ */
+#define KVM_EXIT_HANDLER_MAX		64
+#define KVM_EXIT_HANDLER_STOP		1
+
+struct kvm_vcpu;
+struct kvm_syscall;
+struct kvm_syscall_ring;
+struct kvm_fs;
+struct kvm_net;
+struct kvm_epoll;
+struct kvm_futex;
+typedef int (*kvm_exit_handler_t)(struct kvm_vcpu *vcpu);
+
+/* Hypercalls forwarded by the SMCCC filter and emulated MMIO regions */
+#define KVM_MAX_HYPERCALLS		8
+#define KVM_MAX_MMIO			8
+
+typedef long (*kvm_hypercall_handler_t)(struct kvm_vcpu *vcpu);
+typedef int (*kvm_mmio_handler_t)(struct kvm_vcpu *vcpu, unsigned long addr,
+				  void *data, unsigned int len, bool is_write);
+
+struct kvm_hypercall {
+	unsigned int		fn;		/* SMCCC function ID	*/
+	kvm_hypercall_handler_t	handler;	/* Handler		*/
+};
+
+struct kvm_mmio {
+	unsigned long		addr;		/* Guest physical addr	*/
+	unsigned long		len;		/* Length		*/
+	kvm_mmio_handler_t	handler;	/* Handler		*/
+};
+
+/**
+ * struct kvm_vcpu_template - Initial register values shared by vCPUs
+ *
+ * @init:		Target and features for KVM_ARM_VCPU_INIT.
+ * @cpacr_el1:		CPACR_EL1.
+ * @sctlr_el1:		SCTLR_EL1.
+ * @tcr_el1:		TCR_EL1.
+ * @mair_el1:		MAIR_EL1.
+ * @valid:		The template has been figured out.
+ */
+#define KVM_MAX_VCPUS			256
+#define KVM_VCPU_CREATE_THREADS		16
+
+struct kvm_vcpu_template {
+	struct kvm_vcpu_init	init;
+	unsigned long		cpacr_el1;
+	unsigned long		sctlr_el1;
+	unsigned long		tcr_el1;
+	unsigned long		mair_el1;
+	bool			valid;
+};
+
+/**
+ * struct kvm_vcpu_placement - Placement policy of vCPU
+ *
+ * @cpus:		Host CPUs where the vCPU thread runs.
+ * @pinned:		@cpus is valid.
+ * @node:		Host NUMA node of the vCPU's private pages, or -1.
+ * @valid:		The placement policy has been set.
+ */
+struct kvm_vcpu_placement {
+	cpu_set_t		cpus;
+	bool			pinned;
+	int			node;
+	bool			valid;
 };
 
 struct kvm_vcpu {
@@ -46,6 +317,15 @@ struct kvm_vcpu {
 	unsigned long		entry_point;	/* PC for execution	*/
 	unsigned long		stack_base;	/* Stack base address	*/
 	unsigned long		stack_end;	/* Stack end address	*/
+
+	bool			power_off;	/* Started in OFF state	*/
+	bool			power_on;	/* Powered on by PSCI	*/
+	unsigned long		context_id;	/* x0 on power-on	*/
+
+	pthread_t		thread;		/* Running thread	*/
+	bool			running;	/* Thread is running	*/
+	int			exit_code;	/* Error code on exit	*/
+	struct kvm_syscall_ring	*ring;		/* System call ring	*/
 	struct list_head	link;
 };
 
@@ -55,24 +335,155 @@ struct kvm_vm {
 
 	struct kvm_vm_mm	mm;		/* Memory management	*/
 	struct list_head	vcpu_list;	/* List of vCPUs	*/
+	struct kvm_vcpu		*vcpus[KVM_MAX_VCPUS]; /* vCPUs indexed by ID */
+	int			next_vcpu_id;	/* Next vCPU ID		*/
+	struct kvm_vcpu_template vcpu_template; /* Initial registers */
+	bool			psci_user;	/* PSCI CPU_ON handled here */
+	pthread_mutex_t		lock;		/* Lock			*/
+	pthread_cond_t		cond;		/* vCPU power state changed */
+	struct kvm_vcpu_placement *placement;	/* vCPU placement	*/
+	struct list_head	image_list;	/* List of ELF images	*/
+	struct kvm_fault	*fault;		/* Lazy population	*/
+	struct kvm_syscall	*syscall;	/* System call forwarding */
+	struct kvm_clock	*clock;		/* Time page		*/
+	struct kvm_futex	*futex;		/* Futex		*/
+	struct kvm_fs		*fs;		/* File system		*/
+	struct kvm_net		*net;		/* Network		*/
+	struct kvm_epoll	*epoll;		/* Epoll		*/
+
+	kvm_exit_handler_t	exit_handlers[KVM_EXIT_HANDLER_MAX]; /* Exit handlers */
+	struct kvm_hypercall	hypercalls[KVM_MAX_HYPERCALLS]; /* Hypercalls */
+	int			nr_hypercalls;	/* Number of hypercalls	*/
+	struct kvm_mmio		mmio[KVM_MAX_MMIO]; /* MMIO regions	*/
+	int			nr_mmio;	/* Number of MMIO regions */
+	int			stopping;	/* VM is being stopped	*/
 };
 
 /* APIs */
 struct kvm_vm *kvm_vm_create(void);
 int kvm_vcpu_create(struct kvm_vm *vm, unsigned long entry_point);
+int kvm_vm_create_vcpus(struct kvm_vm *vm, unsigned int nr,
+			unsigned long entry_point);
 int kvm_vcpu_get_reg(struct kvm_vcpu *vcpu, unsigned long id,
 		     unsigned long *val);
 int kvm_vcpu_set_reg(struct kvm_vcpu *vcpu, unsigned long id,
 		     unsigned long val);
+struct kvm_vcpu *kvm_vcpu_restore(struct kvm_vm *vm, unsigned int id,
+				  unsigned long entry_point,
+				  unsigned long stack_base, bool power_off);
 void kvm_vcpu_destroy(struct kvm_vcpu *vcpu);
 void kvm_vm_destroy(struct kvm_vm *vm);
 
+/* Snapshot */
+int kvm_vm_snapshot(struct kvm_vm *vm, const char *path);
+struct kvm_vm *kvm_vm_restore(const char *path);
+struct kvm_zygote *kvm_zygote_create(struct kvm_vm *vm);
+struct kvm_vm *kvm_zygote_clone(struct kvm_zygote *zygote);
+void kvm_zygote_destroy(struct kvm_zygote *zygote);
+
+/* Pool of pre-created VMs */
+struct kvm_vm_pool *kvm_vm_pool_create(struct kvm_zygote *zygote,
+				       unsigned int low, unsigned int high);
+struct kvm_vm *kvm_vm_pool_get(struct kvm_vm_pool *pool);
+void kvm_vm_pool_destroy(struct kvm_vm_pool *pool);
+
+/* Run loop */
+void kvm_run_init(struct kvm_vm *vm);
+int kvm_vm_register_exit(struct kvm_vm *vm, unsigned int reason,
+			 kvm_exit_handler_t handler);
+int kvm_vm_register_hypercall(struct kvm_vm *vm, unsigned int fn,
+			      kvm_hypercall_handler_t handler);
+int kvm_vm_register_mmio(struct kvm_vm *vm, unsigned long addr,
+			 unsigned long len, kvm_mmio_handler_t handler);
+int kvm_vm_run(struct kvm_vm *vm);
+void kvm_vm_stop(struct kvm_vm *vm);
+
+/* PSCI */
+void kvm_psci_init(struct kvm_vm *vm);
+int kvm_psci_wait_power_on(struct kvm_vcpu *vcpu);
+
 /* Memory management */
 unsigned long kvm_mm_gpa_to_hva(struct kvm_vm *vm, unsigned long gpa);
+unsigned long kvm_mm_alloc_phys_range(struct kvm_vm *vm,
+				      unsigned long npages,
+				      unsigned long start,
+				      unsigned long end);
 unsigned long kvm_mm_alloc_phys_pages(struct kvm_vm *vm,
 				      unsigned long npages);
-void kvm_mm_map(struct kvm_vm *vm, unsigned long phys,
-		unsigned long virt, unsigned long len);
+int kvm_mm_map_ram_file(struct kvm_vm *vm, unsigned long phys,
+			unsigned long len, int fd, unsigned long offset);
+void kvm_mm_free_phys_pages(struct kvm_vm *vm, unsigned long phys,
+			    unsigned long npages);
+int kvm_mm_set_reclaim(struct kvm_vm *vm, unsigned long threshold,
+		       int advice);
+void kvm_mm_reclaim(struct kvm_vm *vm);
+void kvm_mm_zero_stop(struct kvm_vm *vm);
+int kvm_mm_map(struct kvm_vm *vm, unsigned long phys,
+	       unsigned long virt, unsigned long len);
+int kvm_mm_map_prot(struct kvm_vm *vm, unsigned long phys,
+		    unsigned long virt, unsigned long len,
+		    unsigned long prot);
+void kvm_mm_unmap(struct kvm_vm *vm, unsigned long virt, unsigned long len);
+void kvm_mm_unmap_phys(struct kvm_vm *vm, unsigned long virt);
+int kvm_mm_gva_to_gpa(struct kvm_vm *vm, unsigned long gva, bool write,
+		      unsigned long *gpa);
+unsigned long kvm_mm_gva_to_hva(struct kvm_vm *vm, unsigned long gva,
+				bool write);
+int kvm_mm_gva_to_iov(struct kvm_vm *vm, unsigned long gva,
+		      unsigned long len, bool write,
+		      struct iovec *iov, int max_iov);
+int kvm_mm_gva_to_iov_partial(struct kvm_vm *vm, unsigned long gva,
+			      unsigned long *len, bool write,
+			      struct iovec *iov, int max_iov);
+int kvm_mm_copy_from_guest(struct kvm_vm *vm, void *dst,
+			   unsigned long gva, unsigned long len);
+int kvm_mm_copy_to_guest(struct kvm_vm *vm, unsigned long gva,
+			 const void *src, unsigned long len);
+struct kvm_mem_slot *kvm_mm_add_slot(struct kvm_vm *vm, void *hva,
+				     unsigned long size, unsigned int flags);
+void kvm_mm_remove_slot(struct kvm_vm *vm, struct kvm_mem_slot *slot);
+int kvm_mm_map_file(struct kvm_vm *vm, int fd, unsigned long offset,
+		    unsigned long len, unsigned int flags, unsigned long *addr);
+int kvm_mm_map_anon(struct kvm_vm *vm, unsigned long len,
+		    unsigned int flags, unsigned long *addr);
+int kvm_mm_unmap_range(struct kvm_vm *vm, unsigned long addr,
+		       unsigned long len);
+int kvm_mm_advise(struct kvm_vm *vm, unsigned long addr,
+		  unsigned long len, int advice);
+unsigned long kvm_mm_brk(struct kvm_vm *vm, unsigned long brk);
+
+/* Placement */
+int kvm_mm_bind(struct kvm_vm *vm, unsigned long gpa, unsigned long len,
+		int node, int mode);
+void kvm_mm_rebind(struct kvm_vm *vm, unsigned long start, unsigned long end);
+int kvm_mm_phys_to_node(struct kvm_vm *vm, unsigned long phys);
+unsigned long kvm_mm_alloc_phys_pages_node(struct kvm_vm *vm,
+					   unsigned long npages, int node);
+int kvm_vm_set_vcpu_placement(struct kvm_vm *vm, unsigned int id,
+			      const cpu_set_t *cpus, int node);
+int kvm_vcpu_node(struct kvm_vcpu *vcpu);
+int kvm_vcpu_apply_placement(struct kvm_vcpu *vcpu);
+
+/* Fault-driven population */
+int kvm_fault_init(struct kvm_vm *vm, unsigned long readahead);
+int kvm_fault_register(struct kvm_vm *vm, struct vm_area *vma);
+void kvm_fault_unregister(struct kvm_vm *vm, struct vm_area *vma);
+void kvm_fault_destroy(struct kvm_vm *vm);
+
+/* Time page */
+int kvm_clock_init(struct kvm_vm *vm);
+int kvm_clock_start(struct kvm_vm *vm);
+void kvm_clock_destroy(struct kvm_vm *vm);
+
+/* Shared read-only segments */
+struct kvm_shared_seg *kvm_shared_get(const void *key, unsigned int key_len,
+				      unsigned long size,
+				      int (*fill)(void *addr, void *data),
+				      void *data);
+void kvm_shared_put(struct kvm_shared_seg *seg);
+void kvm_shared_set_limit(unsigned long limit);
+struct kvm_mem_slot *kvm_shared_attach(struct kvm_vm *vm,
+				       struct kvm_shared_seg *seg);
 
 #endif /* __SANDBOX_KVM_H */
 
@@ -13,6 +13,8 @@
 struct mm;
 
 #define MM_VMA_FLAG_FIXED		(1UL << 0)
+#define MM_VMA_FLAG_SLOT		(1UL << 1)
+#define MM_VMA_FLAG_ANON		(1UL << 2)
 
 /**
  * struct vm_area - Virtual memory area
@@ -21,6 +23,13 @@ struct mm;
  * @start:		Start address of the virtual memory area.
  * @end:		End address of the virtual memory area.
  * @prot:		Protol when the memory is mapped through page table.
+ * @fd:			File descriptor of the file backing the area, or -1
+ *			if the area isn't backed by file.
+ * @file_start:		Address where the file image starts.
+ * @file_offset:	Offset of the file image in the file.
+ * @file_size:		Size of the file image. The remaining part of the
+ *			area is zero-filled.
+ * @hva:		Host virtual address of the pages backing the area.
  * @prev:		The previous virtual memory area in the list.
  * @next:		The next virtual memory area in the list.
  * @mm:			The memory management struct, to which this area
@@ -33,6 +42,11 @@ struct vm_area {
 	unsigned long		start;
 	unsigned long		end;
 	unsigned long		prot;
+	int			fd;
+	unsigned long		file_start;
+	unsigned long		file_offset;
+	unsigned long		file_size;
+	unsigned long		hva;
 
 	struct vm_area		*prev;
 	struct vm_area		*next;
@@ -64,6 +78,9 @@ struct vm_area *mm_vma_find(struct mm *mm, unsigned long addr,
 struct vm_area *mm_vma_alloc(struct mm *mm, unsigned long addr,
 			     unsigned long len, unsigned long flags,
 			     unsigned long prot);
+struct vm_area *mm_vma_split(struct mm *mm, struct vm_area *vma,
+			     unsigned long addr);
+void mm_vma_free(struct mm *mm, struct vm_area *vma);
 
 #endif /* __SANDBOX_MM_H */
 
@@ -0,0 +1,81 @@
+/*
+ * Copyright 2022 Gavin Shan <gshan@redhat.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#ifndef __SANDBOX_NET_H
+#define __SANDBOX_NET_H
+
+/*
+ * The guest's sockets are host sockets, which are installed to the file
+ * table of the file system. The messages sent or received by the guest
+ * in one batch are coalesced into sendmmsg() or recvmmsg() per socket.
+ * The blocking waits are done by the workers in slices of KVM_NET_WAIT_MS,
+ * so that they're aborted when the VM is stopped.
+ */
+#define KVM_NET_MAX_BATCH	64
+#define KVM_NET_MAX_IOV		16
+#define KVM_NET_MAX_OPTLEN	256
+#define KVM_NET_WAIT_MS		100
+
+/**
+ * struct kvm_net_msg - Message sent or received by the guest
+ *
+ * @vm:			VM where the system call is issued.
+ * @ring:		Ring where the CQ entry is posted.
+ * @sqe:		Copy of the SQ entry, used when it's offloaded.
+ * @fd:			Guest file descriptor.
+ * @flags:		MSG_* flags.
+ * @send:		The message is sent.
+ * @stream:		The socket has no message boundary.
+ * @name:		Guest buffer of the source address.
+ * @namelen:		Guest address of the source address length.
+ * @msg:		Guest message header of recvmsg.
+ * @hdr:		Host message header.
+ * @addr:		Bounce buffer of the address.
+ * @iov:		Host I/O vector of the guest buffers.
+ * @link:		Used to insert the message to the pending or
+ *			blocked list.
+ */
+struct kvm_net_msg {
+	struct kvm_vm		*vm;
+	struct kvm_syscall_ring	*ring;
+	struct syscall_sqe	sqe;
+	int			fd;
+	int			flags;
+	bool			send;
+	bool			stream;
+	unsigned long		name;
+	unsigned long		namelen;
+	unsigned long		msg;
+	struct msghdr		hdr;
+	struct sockaddr_storage	addr;
+	struct iovec		iov[KVM_NET_MAX_IOV];
+	struct list_head	link;
+};
+
+/**
+ * struct kvm_net - Network of VM
+ *
+ * @lock:		Protect @pending and @blocked.
+ * @pending:		Messages to be sent or received on flush.
+ * @blocked:		Offloaded messages, indexed by the guest file
+ *			descriptors and the direction (send or receive).
+ * @types:		Socket types, indexed by the guest file descriptors.
+ */
+struct kvm_net {
+	pthread_mutex_t		lock;
+	struct list_head	pending;
+	struct list_head	blocked[KVM_FS_MAX_FILES][2];
+	int			types[KVM_FS_MAX_FILES];
+};
+
+/* APIs */
+int kvm_net_init(struct kvm_vm *vm);
+void kvm_net_destroy(struct kvm_vm *vm);
+
+#endif /* __SANDBOX_NET_H */
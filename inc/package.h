@@ -0,0 +1,76 @@
+/*
+ * Copyright 2022 Gavin Shan <gshan@redhat.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#ifndef __SANDBOX_PACKAGE_H
+#define __SANDBOX_PACKAGE_H
+
+/*
+ * The sandbox package bundles the executable, its shared libraries, the
+ * initial filesystem tree and the launch manifest into one file. The
+ * header and the section index are placed at the beginning and read by
+ * one I/O. The sections are aligned to PKG_ALIGN so that they can be
+ * mapped directly.
+ */
+#define PKG_MAGIC		0x50584253	/* "SBXP" */
+#define PKG_VERSION		1
+#define PKG_ALIGN		0x10000
+#define PKG_INDEX_SIZE		0x10000
+#define PKG_SECTION_NAME_LEN	48
+
+#define PKG_SECTION_EXEC	1	/* Executable                    */
+#define PKG_SECTION_LIB		2	/* Shared library                */
+#define PKG_SECTION_FS		3	/* Initial filesystem tree (cpio) */
+#define PKG_SECTION_MANIFEST	4	/* Launch manifest               */
+
+struct pkg_hdr {
+	uint32_t  magic;		/* PKG_MAGIC                       */
+	uint16_t  version;		/* PKG_VERSION                     */
+	uint16_t  nr_sections;		/* Number of sections              */
+	uint32_t  align;		/* Alignment of sections           */
+	uint32_t  index_size;		/* Size of header and index        */
+};
+
+struct pkg_section {
+	uint32_t  type;			/* PKG_SECTION_*                   */
+	uint32_t  flags;		/* Reserved                        */
+	uint64_t  offset;		/* Offset in the package file      */
+	uint64_t  size;			/* Size of the section             */
+	char	  name[PKG_SECTION_NAME_LEN]; /* NULL terminated name      */
+};
+
+/**
+ * struct pkg - Opened sandbox package
+ *
+ * @fd:			File descriptor of the package.
+ * @hdr:		Package header.
+ * @sections:		Section index.
+ * @manifest:		Launch manifest, copied from the package and NULL
+ *			terminated.
+ * @manifest_size:	Size of the launch manifest, without the terminator.
+ */
+struct pkg {
+	int			fd;
+	struct pkg_hdr		*hdr;
+	struct pkg_section	*sections;
+	char			*manifest;
+	unsigned long		manifest_size;
+};
+
+/* APIs */
+bool pkg_probe(int fd);
+struct pkg *pkg_open(int fd);
+void pkg_close(struct pkg *pkg);
+struct pkg_section *pkg_find_section(struct pkg *pkg, unsigned int type,
+				     const char *name);
+void *pkg_map_section(struct pkg *pkg, struct pkg_section *sec);
+int pkg_manifest_get(struct pkg *pkg, const char *key, int index,
+		     char *buf, int len);
+int pkg_load(struct kvm_vm *vm, int fd, unsigned long *pentry);
+
+#endif /* __SANDBOX_PACKAGE_H */
@@ -0,0 +1,17 @@
+/*
+ * Copyright 2022 Gavin Shan <gshan@redhat.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#ifndef __SANDBOX_PAGE_H
+#define __SANDBOX_PAGE_H
+
+#ifdef CONFIG_ARM64
+#include "arm64/page.h"
+#endif
+
+#endif /* __SANDBOX_PAGE_H */
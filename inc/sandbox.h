@@ -17,24 +17,40 @@
 #include <unistd.h>
 #include <string.h>
 #include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <limits.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/mman.h>
 #include <sys/ioctl.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
 #include <fcntl.h>
+#include <pthread.h>
+#include <linux/io_uring.h>
+#include <linux/openat2.h>
 
 #include "config.h"
 #include "base.h"
 #include "sysreg.h"
 #include "atomic.h"
 #include "bitops.h"
+#include "page.h"
 #include "sparsebit.h"
 #include "list.h"
 #include "rbtree.h"
 
 #include "mm.h"
 #include "kvm.h"
+#include "syscall.h"
+#include "futex.h"
+#include "fs.h"
+#include "net.h"
+#include "epoll.h"
 #include "elf.h"
+#include "package.h"
 
 #endif /* __SANDBOX_H */
 
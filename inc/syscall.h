@@ -0,0 +1,178 @@
+/*
+ * Copyright 2022 Gavin Shan <gshan@redhat.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#ifndef __SANDBOX_SYSCALL_H
+#define __SANDBOX_SYSCALL_H
+
+/*
+ * The system calls are forwarded through the submission queue (SQ) and
+ * completion queue (CQ) in the guest memory. Each vCPU has its own ring,
+ * which is mapped at SYSCALL_RING_VA + vCPU ID * SYSCALL_RING_SIZE. The
+ * vCPU ID can be retrieved from TPIDR_EL1.
+ *
+ * The guest fills the SQ entry and publishes it by advancing @sq_tail
+ * with release semantics. The doorbell is rung if SYSCALL_RING_NEED_WAKEUP
+ * is set, either by HVC with SYSCALL_HVC_FN in x0 or by writing to the
+ * page at SYSCALL_DOORBELL_VA. All the pending SQ entries are handled by
+ * one doorbell. There is no doorbell needed when the host is polling the
+ * ring. The results are posted to the CQ, whose entries are matched to
+ * the SQ entries by @user_data.
+ */
+#define SYSCALL_HVC_FN			0xc6000100
+#define SYSCALL_DOORBELL_VA		0x7f0000000000UL
+#define SYSCALL_RING_VA			0x7f0000100000UL
+#define SYSCALL_RING_SIZE		0x4000
+#define SYSCALL_RING_SQ_OFFSET		0x1000
+#define SYSCALL_RING_SQ_ENTRIES		128
+#define SYSCALL_RING_CQ_OFFSET		0x3000
+#define SYSCALL_RING_CQ_ENTRIES		256
+#define SYSCALL_RING_NEED_WAKEUP	(1U << 0)
+#define SYSCALL_MAX			512
+
+/*
+ * The blocking system calls are offloaded to the host worker pool, so
+ * that the vCPU resumes without waiting for them. Their CQ entries are
+ * posted by the workers, maybe out of order.
+ */
+#define SYSCALL_FLAG_BLOCKING		(1U << 0)
+#define SYSCALL_DEFAULT_WORKERS		8
+
+/*
+ * The handler returns SYSCALL_RET_PENDING if the system call is submitted
+ * asynchronously, and its CQ entry is posted on completion. The batched
+ * system calls are submitted by the flush handlers after the ring is
+ * drained.
+ */
+#define SYSCALL_RET_PENDING		LONG_MIN
+#define SYSCALL_MAX_FLUSH		4
+
+/*
+ * The polling thread spins for the number of empty polls, and then backs
+ * off for the period between the polls until the rings become idle.
+ */
+#define SYSCALL_POLL_SPINS		1024
+#define SYSCALL_POLL_WAIT_US		50
+
+struct syscall_ring_hdr {
+	uint32_t	sq_head;	/* Written by host                 */
+	uint32_t	sq_tail;	/* Written by guest                */
+	uint32_t	cq_head;	/* Written by guest                */
+	uint32_t	cq_tail;	/* Written by host                 */
+	uint32_t	flags;		/* SYSCALL_RING_*, written by host */
+	uint32_t	sq_entries;	/* Number of SQ entries            */
+	uint32_t	cq_entries;	/* Number of CQ entries            */
+	uint32_t	pad;
+};
+
+struct syscall_sqe {
+	uint64_t	nr;		/* System call number              */
+	uint64_t	args[6];	/* Arguments                       */
+	uint64_t	user_data;	/* Passed to CQ entry              */
+};
+
+struct syscall_cqe {
+	uint64_t	user_data;	/* From SQ entry                   */
+	int64_t		ret;		/* Return value                    */
+};
+
+/**
+ * struct kvm_syscall_ring - Host side of the vCPU's system call ring
+ *
+ * @hdr:		Ring header.
+ * @sq:			Submission queue.
+ * @cq:			Completion queue.
+ * @busy:		The ring is being drained, by the vCPU's doorbell or
+ *			the polling thread.
+ * @cq_lock:		Serialize the CQ entries posted by the drainer and
+ *			the workers.
+ * @inflight:		Number of system calls offloaded to the workers or
+ *			deferred. The CQ entries are reserved for them.
+ */
+struct kvm_syscall_ring {
+	struct syscall_ring_hdr	*hdr;
+	struct syscall_sqe	*sq;
+	struct syscall_cqe	*cq;
+	int			busy;
+	pthread_mutex_t		cq_lock;
+	int			inflight;
+};
+
+/**
+ * struct kvm_syscall - System call forwarding of VM
+ *
+ * @thread:		Polling thread.
+ * @polling:		The polling thread is running.
+ * @idle_us:		The polling thread sleeps after the rings have been
+ *			idle for the period.
+ * @lock:		Protect @wakeup, @stop and @inflight.
+ * @cond:		Wake up the polling thread.
+ * @wakeup:		The polling thread is woken up.
+ * @stop:		The polling thread is stopped.
+ * @inflight:		Number of system calls offloaded to the workers.
+ * @idle:		Wait for the offloaded system calls.
+ * @flush:		Handlers to submit the batched system calls.
+ * @nr_flush:		Number of flush handlers.
+ */
+struct kvm_syscall {
+	pthread_t		thread;
+	bool			polling;
+	unsigned long		idle_us;
+	pthread_mutex_t		lock;
+	pthread_cond_t		cond;
+	bool			wakeup;
+	bool			stop;
+	int			inflight;
+	pthread_cond_t		idle;
+	void			(*flush[SYSCALL_MAX_FLUSH])(struct kvm_vm *vm);
+	int			nr_flush;
+};
+
+typedef long (*kvm_syscall_handler_t)(struct kvm_vm *vm,
+				      struct kvm_syscall_ring *ring,
+				      struct syscall_sqe *sqe);
+
+/**
+ * struct kvm_syscall_work - System call offloaded to the worker pool
+ *
+ * @vm:			VM where the system call is issued.
+ * @ring:		Ring where the CQ entry is posted.
+ * @sqe:		Copy of the SQ entry.
+ * @handler:		Handler of the system call.
+ * @link:		Used to insert the work to the pending list.
+ */
+struct kvm_syscall_work {
+	struct kvm_vm		*vm;
+	struct kvm_syscall_ring	*ring;
+	struct syscall_sqe	sqe;
+	kvm_syscall_handler_t	handler;
+	struct list_head	link;
+};
+
+/* APIs */
+int kvm_syscall_register(unsigned int nr, kvm_syscall_handler_t handler,
+			 unsigned int flags);
+void kvm_syscall_post(struct kvm_syscall_ring *ring,
+		      uint64_t user_data, long ret);
+void kvm_syscall_defer(struct kvm_syscall_ring *ring);
+void kvm_syscall_complete(struct kvm_syscall_ring *ring,
+			  uint64_t user_data, long ret);
+int kvm_syscall_register_flush(struct kvm_vm *vm,
+			       void (*flush)(struct kvm_vm *vm));
+int kvm_syscall_set_workers(unsigned int nr);
+int kvm_syscall_queue_work(struct kvm_syscall_work *work);
+void kvm_syscall_cancel_work(struct kvm_vm *vm);
+int kvm_syscall_init(struct kvm_vm *vm);
+int kvm_syscall_vcpu_init(struct kvm_vcpu *vcpu);
+int kvm_syscall_vcpu_restore(struct kvm_vcpu *vcpu);
+void kvm_syscall_vcpu_destroy(struct kvm_vcpu *vcpu);
+int kvm_syscall_start_polling(struct kvm_vm *vm, unsigned long idle_us);
+void kvm_syscall_destroy(struct kvm_vm *vm);
+void kvm_mman_init(void);
+
+#endif /* __SANDBOX_SYSCALL_H */
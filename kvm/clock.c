@@ -0,0 +1,223 @@
+/*
+ * Copyright 2022 Gavin Shan <gshan@redhat.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#include <time.h>
+#include "sandbox.h"
+
+/*
+ * The guest reads the time from the time page and its virtual counter,
+ * without exiting to us. The time pages of all VMs are updated by one
+ * host thread, which is started when the first VM runs and exits when
+ * the last time page is destroyed.
+ */
+static pthread_mutex_t clock_lock = PTHREAD_MUTEX_INITIALIZER;
+static LIST_HEAD(clock_list);
+static bool clock_running;
+
+static inline uint64_t clock_read_counter(void)
+{
+	__asm__ volatile ("isb" : : : "memory");
+	return SYS_REG_READ(cntvct_el0);
+}
+
+static void clock_calc_mult_shift(uint32_t freq, uint32_t *mult,
+				  uint32_t *shift)
+{
+	uint64_t m;
+	uint32_t s;
+
+	/* The largest shift, with which the multiplier fits in 32-bits */
+	for (s = 32; s > 0; s--) {
+		m = ((1000000000UL << s) + freq / 2) / freq;
+		if (m <= UINT32_MAX)
+			break;
+	}
+
+	*mult = m;
+	*shift = s;
+}
+
+static void clock_update(struct kvm_clock *clock)
+{
+	struct kvm_clock_page *data = clock->data;
+	struct timespec mono, real;
+	uint64_t cnt;
+
+	clock_gettime(CLOCK_MONOTONIC, &mono);
+	cnt = clock_read_counter();
+	clock_gettime(CLOCK_REALTIME, &real);
+
+	WRITE_ONCE(data->seq, data->seq + 1);
+	smp_wmb();
+
+	data->cycle_last = cnt - data->counter_offset;
+	data->realtime_sec = real.tv_sec;
+	data->realtime_nsec = real.tv_nsec;
+	data->monotonic_sec = mono.tv_sec;
+	data->monotonic_nsec = mono.tv_nsec;
+
+	smp_wmb();
+	WRITE_ONCE(data->seq, data->seq + 1);
+}
+
+static void *clock_thread(void *arg)
+{
+	struct kvm_clock *clock;
+	struct timespec ts;
+
+	pthread_mutex_lock(&clock_lock);
+
+	while (!list_empty(&clock_list)) {
+		list_for_each_entry(clock, &clock_list, link)
+			clock_update(clock);
+
+		pthread_mutex_unlock(&clock_lock);
+		ts.tv_sec = 0;
+		ts.tv_nsec = KVM_CLOCK_UPDATE_MS * 1000000UL;
+		nanosleep(&ts, NULL);
+		pthread_mutex_lock(&clock_lock);
+	}
+
+	clock_running = false;
+	pthread_mutex_unlock(&clock_lock);
+
+	return NULL;
+}
+
+/**
+ * kvm_clock_init - Initialize the time page of VM
+ * @vm:		VM where the time page is initialized
+ *
+ * The time page is allocated from the guest RAM and mapped read-only at
+ * KVM_CLOCK_VA. It returns zero on success, or negative error code on
+ * failure.
+ */
+int kvm_clock_init(struct kvm_vm *vm)
+{
+	struct kvm_vm_mm *mm = &vm->mm;
+	struct kvm_clock *clock;
+	struct vm_area *vma;
+	unsigned long phys;
+
+	clock = malloc(sizeof(*clock));
+	if (!clock) {
+		fprintf(stderr, "%s: Unable to alloc clock\n", __func__);
+		return -ENOMEM;
+	}
+
+	pthread_mutex_lock(&vm->lock);
+	vma = mm_vma_alloc(mm->mm, KVM_CLOCK_VA, mm->page_size,
+			   MM_VMA_FLAG_FIXED, 0);
+	phys = kvm_mm_alloc_phys_pages(vm, 1);
+	if (!vma || !phys) {
+		fprintf(stderr, "%s: Unable to alloc time page\n", __func__);
+		if (phys)
+			kvm_mm_free_phys_pages(vm, phys, 1);
+		if (vma)
+			mm_vma_free(mm->mm, vma);
+		pthread_mutex_unlock(&vm->lock);
+		free(clock);
+		return -ENOMEM;
+	}
+
+	if (kvm_mm_map_prot(vm, phys, vma->start, mm->page_size,
+			    KVM_MM_PTE_DEFAULT | KVM_MM_PTE_AP_RO)) {
+		fprintf(stderr, "%s: Unable to map time page\n", __func__);
+		kvm_mm_free_phys_pages(vm, phys, 1);
+		mm_vma_free(mm->mm, vma);
+		pthread_mutex_unlock(&vm->lock);
+		free(clock);
+		return -ENOMEM;
+	}
+	pthread_mutex_unlock(&vm->lock);
+
+	clock->vm = vm;
+	clock->data = (struct kvm_clock_page *)kvm_mm_gpa_to_hva(vm, phys);
+	INIT_LIST_HEAD(&clock->link);
+	memset(clock->data, 0, mm->page_size);
+	clock->data->freq = SYS_REG_READ(cntfrq_el0);
+	clock_calc_mult_shift(clock->data->freq, &clock->data->mult,
+			      &clock->data->shift);
+	vm->clock = clock;
+
+	return 0;
+}
+
+/**
+ * kvm_clock_start - Start updating the time page of VM
+ * @vm:		VM whose time page is updated
+ *
+ * The counter offset is figured out from vCPU 0, whose virtual counter
+ * is shared by all vCPUs. It's called before the vCPUs start running. It
+ * returns zero on success, or negative error code on failure.
+ */
+int kvm_clock_start(struct kvm_vm *vm)
+{
+	struct kvm_clock *clock = vm->clock;
+	struct kvm_vcpu *vcpu = vm->vcpus[0];
+	pthread_attr_t attr;
+	pthread_t thread;
+	uint64_t before, after;
+	unsigned long guest;
+	int ret = 0;
+
+	if (!clock || !vcpu || !list_empty(&clock->link))
+		return 0;
+
+	before = clock_read_counter();
+	ret = kvm_vcpu_get_reg(vcpu, KVM_REG_ARM_TIMER_CNT, &guest);
+	after = clock_read_counter();
+	if (ret) {
+		fprintf(stderr, "%s: Unable to read counter (%d)\n",
+			__func__, errno);
+		return -errno;
+	}
+
+	clock->data->counter_offset = before + (after - before) / 2 - guest;
+	clock_update(clock);
+
+	pthread_mutex_lock(&clock_lock);
+
+	list_add_tail(&clock_list, &clock->link);
+	if (!clock_running) {
+		pthread_attr_init(&attr);
+		pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+		ret = pthread_create(&thread, &attr, clock_thread, NULL);
+		pthread_attr_destroy(&attr);
+		if (ret) {
+			fprintf(stderr, "%s: Unable to create thread (%d)\n",
+				__func__, ret);
+			list_del(&clock->link);
+			INIT_LIST_HEAD(&clock->link);
+			ret = -ret;
+		} else {
+			clock_running = true;
+		}
+	}
+
+	pthread_mutex_unlock(&clock_lock);
+
+	return ret;
+}
+
+void kvm_clock_destroy(struct kvm_vm *vm)
+{
+	struct kvm_clock *clock = vm->clock;
+
+	if (!clock)
+		return;
+
+	pthread_mutex_lock(&clock_lock);
+	if (!list_empty(&clock->link))
+		list_del(&clock->link);
+	pthread_mutex_unlock(&clock_lock);
+
+	free(clock);
+	vm->clock = NULL;
+}
@@ -0,0 +1,314 @@
+/*
+ * Copyright 2022 Gavin Shan <gshan@redhat.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#include <poll.h>
+#include <sys/syscall.h>
+#include <sys/eventfd.h>
+#include <linux/userfaultfd.h>
+#include "sandbox.h"
+
+/*
+ * The pages backing the registered virtual memory areas aren't populated
+ * until they're accessed for the first time, either by the guest through
+ * stage-2 page fault or by the host. The missing pages are reported by
+ * userfaultfd and populated by the handler thread, together with the
+ * following pages in the readahead window.
+ */
+static struct vm_area *fault_find_area(struct kvm_fault *fault,
+				       unsigned long hva)
+{
+	struct vm_area *vma;
+	int i;
+
+	pthread_mutex_lock(&fault->lock);
+	for (i = 0; i < fault->nr_areas; i++) {
+		vma = fault->areas[i];
+		if (hva >= vma->hva && hva < vma->hva + (vma->end - vma->start)) {
+			pthread_mutex_unlock(&fault->lock);
+			return vma;
+		}
+	}
+	pthread_mutex_unlock(&fault->lock);
+
+	return NULL;
+}
+
+static void fault_fill(struct vm_area *vma,
+		       unsigned long addr,
+		       unsigned long len,
+		       void *buf)
+{
+	unsigned long start, end;
+	ssize_t ret;
+
+	memset(buf, 0, len);
+
+	/* Copy the intersection with the file image */
+	start = max(addr, vma->file_start);
+	end = min(addr + len, vma->file_start + vma->file_size);
+	if (start >= end)
+		return;
+
+	ret = pread(vma->fd, buf + (start - addr), end - start,
+		    vma->file_offset + (start - vma->file_start));
+	if (ret != end - start)
+		fprintf(stderr, "%s: Unable to read 0x%lx bytes at 0x%lx\n",
+			__func__, end - start, start);
+}
+
+static void fault_handle(struct kvm_vm *vm, unsigned long hva)
+{
+	struct kvm_fault *fault = vm->fault;
+	struct vm_area *vma;
+	struct uffdio_copy copy;
+	struct uffdio_zeropage zero;
+	struct uffdio_range range;
+	unsigned long page_size = vm->mm.page_size;
+	unsigned long addr, len, offset;
+
+	hva = ALIGN_DOWN(hva, page_size);
+	vma = fault_find_area(fault, hva);
+	if (!vma) {
+		fprintf(stderr, "%s: Unexpected fault at 0x%lx\n",
+			__func__, hva);
+		zero.range.start = hva;
+		zero.range.len = page_size;
+		zero.mode = 0;
+		ioctl(fault->uffd, UFFDIO_ZEROPAGE, &zero);
+		return;
+	}
+
+	/* Populate the readahead window in one shot */
+	addr = vma->start + (hva - vma->hva);
+	len = min(fault->readahead, vma->end - addr);
+	fault_fill(vma, addr, len, fault->buf);
+	copy.dst = hva;
+	copy.src = (unsigned long)fault->buf;
+	copy.len = len;
+	copy.mode = 0;
+	copy.copy = 0;
+	if (!ioctl(fault->uffd, UFFDIO_COPY, &copy))
+		return;
+
+	/*
+	 * Some of the pages in the window have been populated. The pages
+	 * are populated one by one and the existing ones are skipped.
+	 */
+	for (offset = 0; offset < len; offset += page_size) {
+		copy.dst = hva + offset;
+		copy.src = (unsigned long)fault->buf + offset;
+		copy.len = page_size;
+		copy.mode = UFFDIO_COPY_MODE_DONTWAKE;
+		copy.copy = 0;
+		ioctl(fault->uffd, UFFDIO_COPY, &copy);
+	}
+
+	range.start = hva;
+	range.len = len;
+	ioctl(fault->uffd, UFFDIO_WAKE, &range);
+}
+
+static void *fault_thread(void *data)
+{
+	struct kvm_vm *vm = data;
+	struct kvm_fault *fault = vm->fault;
+	struct pollfd fds[2];
+	struct uffd_msg msg;
+
+	fds[0].fd = fault->uffd;
+	fds[0].events = POLLIN;
+	fds[1].fd = fault->event_fd;
+	fds[1].events = POLLIN;
+	for (;;) {
+		if (poll(fds, 2, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+
+			break;
+		}
+
+		if (fds[1].revents)
+			break;
+
+		if (!(fds[0].revents & POLLIN) ||
+		    read(fault->uffd, &msg, sizeof(msg)) != sizeof(msg))
+			continue;
+
+		if (msg.event == UFFD_EVENT_PAGEFAULT)
+			fault_handle(vm, msg.arg.pagefault.address);
+	}
+
+	return NULL;
+}
+
+/**
+ * kvm_fault_init - Enable fault-driven population of the guest memory
+ * @vm:		VM where the fault-driven population is enabled
+ * @readahead:	size of the window populated on each fault, or zero to
+ *		use the default size
+ *
+ * It returns zero on success, or negative error code on failure.
+ */
+int kvm_fault_init(struct kvm_vm *vm, unsigned long readahead)
+{
+	struct kvm_fault *fault;
+	struct uffdio_api api;
+	int ret;
+
+	fault = malloc(sizeof(*fault));
+	if (!fault) {
+		fprintf(stderr, "%s: Unable to alloc fault\n", __func__);
+		return -ENOMEM;
+	}
+
+	memset(fault, 0, sizeof(*fault));
+	fault->uffd = -1;
+	fault->event_fd = -1;
+	fault->readahead = ALIGN(readahead ? : KVM_FAULT_DEFAULT_READAHEAD,
+				 vm->mm.page_size);
+	pthread_mutex_init(&fault->lock, NULL);
+	fault->buf = malloc(fault->readahead);
+	if (!fault->buf) {
+		fprintf(stderr, "%s: Unable to alloc buffer (0x%lx)\n",
+			__func__, fault->readahead);
+		ret = -ENOMEM;
+		goto error;
+	}
+
+	fault->uffd = syscall(SYS_userfaultfd, O_CLOEXEC | O_NONBLOCK);
+	if (fault->uffd < 0) {
+		fprintf(stderr, "%s: Unable to create userfaultfd (%d)\n",
+			__func__, errno);
+		ret = -errno;
+		goto error;
+	}
+
+	api.api = UFFD_API;
+	api.features = 0;
+	api.ioctls = 0;
+	ret = ioctl(fault->uffd, UFFDIO_API, &api);
+	if (ret) {
+		fprintf(stderr, "%s: Unable to enable userfaultfd (%d)\n",
+			__func__, errno);
+		ret = -errno;
+		goto error;
+	}
+
+	fault->event_fd = eventfd(0, EFD_CLOEXEC);
+	if (fault->event_fd < 0) {
+		ret = -errno;
+		goto error;
+	}
+
+	vm->fault = fault;
+	ret = pthread_create(&fault->thread, NULL, fault_thread, vm);
+	if (ret) {
+		fprintf(stderr, "%s: Unable to create thread (%d)\n",
+			__func__, ret);
+		vm->fault = NULL;
+		ret = -ret;
+		goto error;
+	}
+
+	return 0;
+error:
+	if (fault->event_fd >= 0)
+		close(fault->event_fd);
+	if (fault->uffd >= 0)
+		close(fault->uffd);
+	if (fault->buf)
+		free(fault->buf);
+	free(fault);
+	return ret;
+}
+
+/**
+ * kvm_fault_register - Register virtual memory area for lazy population
+ * @vm:		VM where the fault-driven population has been enabled
+ * @vma:	virtual memory area, whose backing pages haven't been touched
+ *
+ * The file and host virtual address of @vma should have been populated.
+ * It returns zero on success, or negative error code on failure.
+ */
+int kvm_fault_register(struct kvm_vm *vm, struct vm_area *vma)
+{
+	struct kvm_fault *fault = vm->fault;
+	struct uffdio_register reg;
+	int ret = 0;
+
+	if (!fault)
+		return -EINVAL;
+
+	pthread_mutex_lock(&fault->lock);
+
+	if (fault->nr_areas >= KVM_FAULT_MAX_AREAS) {
+		ret = -ENOSPC;
+		goto out;
+	}
+
+	reg.range.start = vma->hva;
+	reg.range.len = vma->end - vma->start;
+	reg.mode = UFFDIO_REGISTER_MODE_MISSING;
+	reg.ioctls = 0;
+	if (ioctl(fault->uffd, UFFDIO_REGISTER, &reg)) {
+		fprintf(stderr, "%s: Unable to register area at 0x%lx (%d)\n",
+			__func__, vma->start, errno);
+		ret = -errno;
+		goto out;
+	}
+
+	fault->areas[fault->nr_areas++] = vma;
+out:
+	pthread_mutex_unlock(&fault->lock);
+	return ret;
+}
+
+/**
+ * kvm_fault_unregister - Unregister virtual memory area
+ * @vm:		VM where the fault-driven population has been enabled
+ * @vma:	virtual memory area registered by kvm_fault_register()
+ */
+void kvm_fault_unregister(struct kvm_vm *vm, struct vm_area *vma)
+{
+	struct kvm_fault *fault = vm->fault;
+	struct uffdio_range range;
+	unsigned int i;
+
+	pthread_mutex_lock(&fault->lock);
+
+	for (i = 0; i < fault->nr_areas; i++) {
+		if (fault->areas[i] != vma)
+			continue;
+
+		range.start = vma->hva;
+		range.len = vma->end - vma->start;
+		ioctl(fault->uffd, UFFDIO_UNREGISTER, &range);
+		fault->areas[i] = fault->areas[--fault->nr_areas];
+		break;
+	}
+
+	pthread_mutex_unlock(&fault->lock);
+}
+
+void kvm_fault_destroy(struct kvm_vm *vm)
+{
+	struct kvm_fault *fault = vm->fault;
+
+	if (!fault)
+		return;
+
+	eventfd_write(fault->event_fd, 1);
+	pthread_join(fault->thread, NULL);
+
+	close(fault->event_fd);
+	close(fault->uffd);
+	free(fault->buf);
+	free(fault);
+	vm->fault = NULL;
+}
@@ -9,6 +9,9 @@
 
 #include "sandbox.h"
 
+/* ID of the translation cache, which isn't reused */
+static int kvm_vm_next_id;
+
 struct kvm_vm *kvm_vm_create(void)
 {
 	struct kvm_vm *vm = NULL;
@@ -22,6 +25,10 @@ struct kvm_vm *kvm_vm_create(void)
 
 	memset(vm, 0, sizeof(*vm));
 	INIT_LIST_HEAD(&vm->vcpu_list);
+	INIT_LIST_HEAD(&vm->image_list);
+	pthread_mutex_init(&vm->lock, NULL);
+	pthread_cond_init(&vm->cond, NULL);
+	kvm_run_init(vm);
 
 	vm->fd_dev = open("/dev/kvm", O_RDWR);
 	if (vm->fd_dev < 0) {
@@ -35,6 +42,9 @@ struct kvm_vm *kvm_vm_create(void)
 		goto error;
 	}
 
+	/* PSCI CPU_ON is handled by us if possible */
+	kvm_psci_init(vm);
+
 	/* Initialize memory management parameters */
 	mm = &vm->mm;
 	mm->pa_bits = 36;
@@ -44,10 +54,18 @@ struct kvm_vm *kvm_vm_create(void)
 	mm->pgtable_levels = 4;
 	mm->phys_page_base = 0UL;
 	mm->phys_page_num = 0x200;
+	mm->slot_base = ALIGN((mm->phys_page_base + mm->phys_page_num) <<
+			      mm->page_shift, 1UL << 30);
+	mm->mmio_base = (1UL << mm->pa_bits) - 0x10000;
+	mm->id = atomic_fetch_inc(&kvm_vm_next_id) + 1;
 	mm->host_virt_addr = MAP_FAILED;
+	mm->reclaim_advice = MADV_DONTNEED;
+	pthread_cond_init(&mm->zero_cond, NULL);
 	mm->phys_page_bits = bitmap_alloc(mm->phys_page_num);
-	if (mm->phys_page_bits) {
+	mm->file_page_bits = bitmap_alloc(mm->phys_page_num);
+	if (mm->phys_page_bits && mm->file_page_bits) {
 		bitmap_zero(mm->phys_page_bits, mm->phys_page_num);
+		bitmap_zero(mm->file_page_bits, mm->phys_page_num);
 	} else {
 		fprintf(stderr, "%s: Unable to alloc bitmap (0x%lx)\n",
 			__func__, mm->phys_page_num);
@@ -55,7 +73,9 @@ struct kvm_vm *kvm_vm_create(void)
 	}
 
 	/* Alloc PGDs of the page table */
+	pthread_mutex_lock(&vm->lock);
 	mm->pgtable = kvm_mm_alloc_phys_pages(vm, 1);
+	pthread_mutex_unlock(&vm->lock);
 
 	/* Initialize memory management struct */
 	mm->mm = mm_create(0, 1UL << mm->va_bits);
@@ -96,14 +116,37 @@ struct kvm_vm *kvm_vm_create(void)
 		goto error;
 	}
 
+	/* System call forwarding */
+	ret = kvm_syscall_init(vm);
+	if (ret)
+		goto error;
+
+	/* Time page */
+	ret = kvm_clock_init(vm);
+	if (ret)
+		goto error;
+
+	/* Futex waiter page */
+	ret = kvm_futex_init(vm);
+	if (ret)
+		goto error;
+
 	return vm;
 error:
+	if (vm && vm->syscall)
+		kvm_syscall_destroy(vm);
+	if (vm && vm->futex)
+		kvm_futex_destroy(vm);
+	if (vm && vm->clock)
+		kvm_clock_destroy(vm);
 	if (mm && mm->host_virt_addr != MAP_FAILED)
 		munmap(mm->host_virt_addr, mm->phys_page_num * mm->page_size);
 	if (mm && mm->mm)
 		mm_destroy(mm->mm);
 	if (mm && mm->phys_page_bits)
 		bitmap_free(mm->phys_page_bits);
+	if (mm && mm->file_page_bits)
+		bitmap_free(mm->file_page_bits);
 	if (vm && vm->fd)
 		close(vm->fd);
 	if (vm && vm->fd_dev)
@@ -117,14 +160,54 @@ error:
 void kvm_vm_destroy(struct kvm_vm *vm)
 {
 	struct kvm_vcpu *vcpu, *tmp;
+	struct elf_image *image, *n;
 	struct kvm_vm_mm *mm = &vm->mm;
+	struct kvm_mem_slot *slot;
+	struct kvm_shared_seg *seg;
+	unsigned long size;
+	void *hva;
+	int i;
+
+	/* No system calls are in flight when the services are destroyed */
+	kvm_syscall_destroy(vm);
+	kvm_clock_destroy(vm);
+	kvm_futex_destroy(vm);
+	kvm_epoll_destroy(vm);
+	kvm_net_destroy(vm);
+	kvm_fs_destroy(vm);
 
 	list_for_each_entry_safe(vcpu, tmp, &vm->vcpu_list, link)
 		kvm_vcpu_destroy(vcpu);
 
+	list_for_each_entry_safe(image, n, &vm->image_list, link)
+		elf_image_destroy(image);
+
+	kvm_mm_zero_stop(vm);
+	for (i = 1; i < KVM_MAX_SLOTS; i++) {
+		slot = &mm->slots[i];
+		if (!slot->size)
+			continue;
+
+		seg = slot->shared;
+		hva = (slot->file || slot == mm->anon_slot) ? slot->hva : NULL;
+		size = slot->size;
+		kvm_mm_remove_slot(vm, slot);
+		if (seg)
+			kvm_shared_put(seg);
+		if (hva)
+			munmap(hva, size);
+	}
+
+	kvm_fault_destroy(vm);
+
+	if (mm->anon)
+		mm_destroy(mm->anon);
 	mm_destroy(mm->mm);
 	munmap(mm->host_virt_addr, mm->phys_page_num * mm->page_size);
 	bitmap_free(mm->phys_page_bits);
+	bitmap_free(mm->file_page_bits);
+	if (vm->placement)
+		free(vm->placement);
 	close(vm->fd);
 	close(vm->fd_dev);
 	free(vm);
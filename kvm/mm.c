@@ -11,34 +11,577 @@
 
 unsigned long kvm_mm_gpa_to_hva(struct kvm_vm *vm, unsigned long gpa)
 {
-	return ((unsigned long)(vm->mm.host_virt_addr) +
-		(gpa - (vm->mm.phys_page_base << vm->mm.page_shift)));
+	struct kvm_vm_mm *mm = &vm->mm;
+	struct kvm_mem_slot *slot;
+	int i;
+
+	/* The guest RAM is the most frequently accessed */
+	if (gpa < mm->slot_base)
+		return ((unsigned long)(mm->host_virt_addr) +
+			(gpa - (mm->phys_page_base << mm->page_shift)));
+
+	for (i = 0; i < KVM_MAX_SLOTS; i++) {
+		slot = &mm->slots[i];
+		if (slot->size && gpa >= slot->gpa &&
+		    gpa < slot->gpa + slot->size)
+			return (unsigned long)slot->hva + (gpa - slot->gpa);
+	}
+
+	return 0;
+}
+
+/**
+ * kvm_mm_add_slot - Add memory slot
+ * @vm:		VM where the memory slot is added
+ * @hva:	host virtual address of the memory slot
+ * @size:	size of the memory slot, aligned to page size
+ * @flags:	flags of the memory slot (KVM_MEM_*)
+ *
+ * The guest physical address range of the memory slot is allocated above
+ * the guest RAM. It's called with the lock held. The memory slot is
+ * returned on success. Otherwise, NULL is returned.
+ */
+struct kvm_mem_slot *kvm_mm_add_slot(struct kvm_vm *vm,
+				     void *hva,
+				     unsigned long size,
+				     unsigned int flags)
+{
+	struct kvm_vm_mm *mm = &vm->mm;
+	struct kvm_userspace_memory_region region;
+	struct kvm_mem_slot *slot = NULL, *tmp;
+	unsigned long gpa = mm->slot_base;
+	int i, ret;
+
+	/* Find a free slot and the lowest free address range (first-fit) */
+	for (i = 1; i < KVM_MAX_SLOTS; i++) {
+		if (!mm->slots[i].size) {
+			slot = &mm->slots[i];
+			break;
+		}
+	}
+
+	if (!slot) {
+		fprintf(stderr, "%s: No free memory slot\n", __func__);
+		return NULL;
+	}
+
+retry:
+	for (i = 1; i < KVM_MAX_SLOTS; i++) {
+		tmp = &mm->slots[i];
+		if (tmp->size && gpa < tmp->gpa + tmp->size &&
+		    gpa + size > tmp->gpa) {
+			gpa = tmp->gpa + tmp->size;
+			goto retry;
+		}
+	}
+
+	if (gpa + size > mm->mmio_base) {
+		fprintf(stderr, "%s: No free address range (0x%lx)\n",
+			__func__, size);
+		return NULL;
+	}
+
+	region.slot = slot - mm->slots;
+	region.flags = flags;
+	region.guest_phys_addr = gpa;
+	region.memory_size = size;
+	region.userspace_addr = (unsigned long)hva;
+	ret = ioctl(vm->fd, KVM_SET_USER_MEMORY_REGION, &region);
+	if (ret) {
+		fprintf(stderr, "%s: Unable to set user memory region (%d)\n",
+			__func__, ret);
+		return NULL;
+	}
+
+	slot->id = region.slot;
+	slot->flags = flags;
+	slot->gpa = gpa;
+	slot->size = size;
+	slot->hva = hva;
+	slot->shared = NULL;
+
+	return slot;
+}
+
+void kvm_mm_remove_slot(struct kvm_vm *vm, struct kvm_mem_slot *slot)
+{
+	struct kvm_userspace_memory_region region;
+
+	region.slot = slot->id;
+	region.flags = 0;
+	region.guest_phys_addr = slot->gpa;
+	region.memory_size = 0;
+	region.userspace_addr = 0;
+	ioctl(vm->fd, KVM_SET_USER_MEMORY_REGION, &region);
+
+	memset(slot, 0, sizeof(*slot));
+}
+
+static int kvm_mm_range_cmp(const void *a, const void *b)
+{
+	const struct kvm_mm_range *r1 = a, *r2 = b;
+
+	return (r1->gpa > r2->gpa) - (r1->gpa < r2->gpa);
+}
+
+/* The range is being zeroed by the thread, without the lock held */
+static bool kvm_mm_range_busy(struct kvm_vm_mm *mm, struct kvm_mm_range *r)
+{
+	return mm->zero_len && r->gpa == mm->zero_gpa;
+}
+
+/**
+ * kvm_mm_reclaim - Return the freed guest memory to host
+ * @vm:		VM whose freed memory is returned
+ *
+ * The freed ranges are sorted and the adjacent ones are merged, so that
+ * one madvise() call is issued for the contiguous host pages. The range
+ * being zeroed is kept. It's called with the lock held.
+ */
+void kvm_mm_reclaim(struct kvm_vm *vm)
+{
+	struct kvm_vm_mm *mm = &vm->mm;
+	struct kvm_mm_range *r, *next, busy = { 0 };
+	int i;
+
+	if (!mm->nr_reclaim)
+		return;
+
+	for (i = 0; i < mm->nr_reclaim; i++) {
+		if (kvm_mm_range_busy(mm, &mm->reclaim[i])) {
+			busy = mm->reclaim[i];
+			mm->reclaim[i] = mm->reclaim[--mm->nr_reclaim];
+			break;
+		}
+	}
+
+	qsort(mm->reclaim, mm->nr_reclaim, sizeof(*r), kvm_mm_range_cmp);
+	for (i = 0; i < mm->nr_reclaim; i++) {
+		r = &mm->reclaim[i];
+		while (i + 1 < mm->nr_reclaim) {
+			next = &mm->reclaim[i + 1];
+			if (next->gpa != r->gpa + r->len)
+				break;
+
+			r->len += next->len;
+			i++;
+		}
+
+		madvise((void *)kvm_mm_gpa_to_hva(vm, r->gpa), r->len,
+			mm->reclaim_advice);
+	}
+
+	mm->nr_reclaim = 0;
+	mm->reclaim_size = 0;
+	if (busy.len) {
+		mm->reclaim[mm->nr_reclaim++] = busy;
+		mm->reclaim_size = busy.len;
+	}
+}
+
+/*
+ * The freed ranges are zeroed in chunks. The lock is released while the
+ * chunk is zeroed, and the range isn't allocated, merged or returned to
+ * host in the meantime.
+ */
+static void *kvm_mm_zero_thread(void *arg)
+{
+	struct kvm_vm *vm = arg;
+	struct kvm_vm_mm *mm = &vm->mm;
+	struct sched_param param = { 0 };
+	struct kvm_mm_range *r, *next;
+	unsigned long hva;
+	int i;
+
+	/* The pages are zeroed when the CPU is idle */
+	pthread_setschedparam(pthread_self(), SCHED_IDLE, &param);
+
+	pthread_mutex_lock(&vm->lock);
+
+	while (!mm->zero_stop) {
+		for (i = 0, r = NULL; i < mm->nr_reclaim; i++) {
+			if (!mm->reclaim[i].zeroed) {
+				r = &mm->reclaim[i];
+				break;
+			}
+		}
+
+		if (!r) {
+			pthread_cond_wait(&mm->zero_cond, &vm->lock);
+			continue;
+		}
+
+		if (r->len > KVM_MM_ZERO_CHUNK &&
+		    mm->nr_reclaim < KVM_MM_RECLAIM_BATCH) {
+			next = &mm->reclaim[mm->nr_reclaim++];
+			next->gpa = r->gpa + KVM_MM_ZERO_CHUNK;
+			next->len = r->len - KVM_MM_ZERO_CHUNK;
+			next->zeroed = false;
+			r->len = KVM_MM_ZERO_CHUNK;
+		}
+
+		mm->zero_gpa = r->gpa;
+		mm->zero_len = r->len;
+		hva = kvm_mm_gpa_to_hva(vm, r->gpa);
+		pthread_mutex_unlock(&vm->lock);
+
+		arch_clear_pages((void *)hva, mm->zero_len);
+
+		pthread_mutex_lock(&vm->lock);
+		for (i = 0; i < mm->nr_reclaim; i++) {
+			if (kvm_mm_range_busy(mm, &mm->reclaim[i])) {
+				mm->reclaim[i].zeroed = true;
+				break;
+			}
+		}
+
+		mm->zero_len = 0;
+		pthread_cond_broadcast(&mm->zero_cond);
+	}
+
+	pthread_mutex_unlock(&vm->lock);
+
+	return NULL;
+}
+
+/*
+ * Start the zeroing thread on the first freed range which is held, and
+ * wake it up. The freed ranges are returned to host without being zeroed
+ * if the thread can't be started.
+ */
+static void kvm_mm_zero_kick(struct kvm_vm *vm)
+{
+	struct kvm_vm_mm *mm = &vm->mm;
+	int ret;
+
+	if (mm->zero_stop)
+		return;
+
+	if (!mm->zero_running) {
+		ret = pthread_create(&mm->zero_thread, NULL,
+				     kvm_mm_zero_thread, vm);
+		if (ret) {
+			fprintf(stderr, "%s: Unable to create thread (%d)\n",
+				__func__, ret);
+			mm->zero_stop = true;
+			return;
+		}
+
+		mm->zero_running = true;
+	}
+
+	pthread_cond_broadcast(&mm->zero_cond);
+}
+
+/**
+ * kvm_mm_zero_stop - Stop zeroing the freed guest memory
+ * @vm:		VM where the freed memory is zeroed
+ */
+void kvm_mm_zero_stop(struct kvm_vm *vm)
+{
+	struct kvm_vm_mm *mm = &vm->mm;
+	bool running;
+
+	pthread_mutex_lock(&vm->lock);
+	running = mm->zero_running;
+	mm->zero_stop = true;
+	pthread_cond_broadcast(&mm->zero_cond);
+	pthread_mutex_unlock(&vm->lock);
+
+	if (running)
+		pthread_join(mm->zero_thread, NULL);
+}
+
+/*
+ * Queue the freed range, which is merged with the adjacent one if
+ * possible. The freed ranges are returned to host when the threshold is
+ * exceeded or no more ranges can be queued. Otherwise, they're zeroed by
+ * the thread.
+ */
+static void kvm_mm_reclaim_add(struct kvm_vm *vm, unsigned long gpa,
+			       unsigned long len)
+{
+	struct kvm_vm_mm *mm = &vm->mm;
+	struct kvm_mm_range *r;
+	int i;
+
+	for (i = 0; i < mm->nr_reclaim; i++) {
+		r = &mm->reclaim[i];
+		if (r->zeroed || kvm_mm_range_busy(mm, r))
+			continue;
+
+		if (r->gpa + r->len == gpa) {
+			r->len += len;
+			break;
+		} else if (gpa + len == r->gpa) {
+			r->gpa = gpa;
+			r->len += len;
+			break;
+		}
+	}
+
+	if (i >= mm->nr_reclaim) {
+		if (mm->nr_reclaim >= KVM_MM_RECLAIM_BATCH)
+			kvm_mm_reclaim(vm);
+
+		r = &mm->reclaim[mm->nr_reclaim++];
+		r->gpa = gpa;
+		r->len = len;
+		r->zeroed = false;
+	}
+
+	mm->reclaim_size += len;
+	if (mm->reclaim_size > mm->reclaim_threshold)
+		kvm_mm_reclaim(vm);
+	else
+		kvm_mm_zero_kick(vm);
+}
+
+/*
+ * Take the zeroed range, which starts in [start, end), from the freed
+ * ranges. It's called with the lock held.
+ */
+static bool kvm_mm_zero_take(struct kvm_vm *vm, unsigned long start,
+			     unsigned long end, unsigned long len,
+			     unsigned long *gpa)
+{
+	struct kvm_vm_mm *mm = &vm->mm;
+	struct kvm_mm_range *r;
+	int i;
+
+	for (i = 0; i < mm->nr_reclaim; i++) {
+		r = &mm->reclaim[i];
+		if (!r->zeroed || r->len < len ||
+		    r->gpa < start || r->gpa + len > end)
+			continue;
+
+		*gpa = r->gpa;
+		r->gpa += len;
+		r->len -= len;
+		mm->reclaim_size -= len;
+		if (!r->len)
+			*r = mm->reclaim[--mm->nr_reclaim];
+
+		return true;
+	}
+
+	return false;
+}
+
+/*
+ * The range is about to be reused and should be zero-filled. The queued
+ * ranges overlapping with it are dropped immediately, after they have
+ * been zeroed by the thread. The host pages released by MADV_FREE may be
+ * still there, so they're dropped as well. It's called with the lock held.
+ */
+static void kvm_mm_reclaim_cancel(struct kvm_vm *vm, unsigned long gpa,
+				  unsigned long len)
+{
+	struct kvm_vm_mm *mm = &vm->mm;
+	struct kvm_mm_range *r;
+	int i = 0;
+
+	while (i < mm->nr_reclaim) {
+		r = &mm->reclaim[i];
+		if (r->gpa >= gpa + len || gpa >= r->gpa + r->len) {
+			i++;
+			continue;
+		}
+
+		if (kvm_mm_range_busy(mm, r)) {
+			pthread_cond_wait(&mm->zero_cond, &vm->lock);
+			i = 0;
+			continue;
+		}
+
+		madvise((void *)kvm_mm_gpa_to_hva(vm, r->gpa), r->len,
+			MADV_DONTNEED);
+		mm->reclaim_size -= r->len;
+		*r = mm->reclaim[--mm->nr_reclaim];
+	}
+
+	if (mm->reclaim_advice == MADV_FREE)
+		madvise((void *)kvm_mm_gpa_to_hva(vm, gpa), len, MADV_DONTNEED);
+}
+
+/**
+ * kvm_mm_set_reclaim - Configure how the freed guest memory is returned
+ * @vm:		VM to be configured
+ * @threshold:	size of the freed memory held before it's returned
+ * @advice:	MADV_DONTNEED, or MADV_FREE to let the host reclaim the pages
+ *		under memory pressure
+ *
+ * It returns zero on success, or negative error code on failure.
+ */
+int kvm_mm_set_reclaim(struct kvm_vm *vm, unsigned long threshold, int advice)
+{
+	struct kvm_vm_mm *mm = &vm->mm;
+
+	if (advice != MADV_DONTNEED && advice != MADV_FREE)
+		return -EINVAL;
+
+	pthread_mutex_lock(&vm->lock);
+
+	kvm_mm_reclaim(vm);
+	mm->reclaim_threshold = threshold;
+	mm->reclaim_advice = advice;
+
+	pthread_mutex_unlock(&vm->lock);
+
+	return 0;
+}
+
+/**
+ * kvm_mm_alloc_phys_range - Allocate physical pages from the range
+ * @vm:		VM where the physical pages are allocated
+ * @npages:	number of physical pages
+ * @start:	start page number of the range
+ * @end:	end page number of the range
+ *
+ * The zeroed pages are preferred. Otherwise, the first fit pages are
+ * allocated, and they're zero-filled if they have been freed. It's called
+ * with the lock held, which is released while the pages being zeroed by
+ * the thread are waited for. The physical address is returned on success.
+ * Otherwise, zero is returned.
+ */
+unsigned long kvm_mm_alloc_phys_range(struct kvm_vm *vm,
+				      unsigned long npages,
+				      unsigned long start,
+				      unsigned long end)
+{
+	struct kvm_vm_mm *mm = &vm->mm;
+	unsigned long len = npages << mm->page_shift;
+	unsigned long s, e, tend, phys;
+
+	if (kvm_mm_zero_take(vm, start << mm->page_shift,
+			     end << mm->page_shift, len, &phys)) {
+		bitmap_set(mm->phys_page_bits, phys >> mm->page_shift, npages);
+		return phys;
+	}
+
+	bitmap_for_each_zero_range(s, tend,
+		mm->phys_page_bits, mm->phys_page_num) {
+		s = max(s, start);
+		e = min(min(tend, mm->phys_page_num), end);
+		if (s < e && e - s >= npages) {
+			bitmap_set(mm->phys_page_bits, s, npages);
+			kvm_mm_reclaim_cancel(vm, s << mm->page_shift, len);
+			return (s << mm->page_shift);
+		}
+	}
+
+	return 0;
 }
 
 unsigned long kvm_mm_alloc_phys_pages(struct kvm_vm *vm,
 				      unsigned long npages)
+{
+	return kvm_mm_alloc_phys_range(vm, npages, 0, vm->mm.phys_page_num);
+}
+
+/**
+ * kvm_mm_map_ram_file - Map the guest RAM pages from file privately
+ * @vm:		VM where the guest RAM pages are mapped
+ * @phys:	guest physical address of the pages
+ * @len:	length of the pages, aligned to page size
+ * @fd:		file where the pages are mapped from
+ * @offset:	offset in the file, aligned to page size
+ *
+ * The pages are read from the file on the first access, and copied on
+ * write. They're recorded so that they're backed by the anonymous memory
+ * again when they're freed. It's called with the lock held. It returns
+ * zero on success, or negative error code on failure.
+ */
+int kvm_mm_map_ram_file(struct kvm_vm *vm, unsigned long phys,
+			unsigned long len, int fd, unsigned long offset)
 {
 	struct kvm_vm_mm *mm = &vm->mm;
-	unsigned long start, end, tend;
+	void *addr;
 
-	bitmap_for_each_zero_range(start, tend,
-		mm->phys_page_bits, mm->phys_page_num) {
-		end = min(tend, mm->phys_page_num);
-		if (end - start >= npages) {
-			bitmap_set(mm->phys_page_bits, start, npages);
-			return (start << mm->page_shift);
+	addr = mmap((void *)kvm_mm_gpa_to_hva(vm, phys), len,
+		    PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED,
+		    fd, offset);
+	if (addr == MAP_FAILED)
+		return -errno;
+
+	madvise(addr, len, MADV_NOHUGEPAGE);
+	bitmap_set(mm->file_page_bits, phys >> mm->page_shift,
+		   len >> mm->page_shift);
+
+	return 0;
+}
+
+/*
+ * The pages mapped privately from file are reverted to the file content,
+ * instead of zero, when their host pages are dropped by MADV_DONTNEED.
+ * They're backed by the anonymous memory again before they're freed. It's
+ * called with the lock held.
+ */
+static int kvm_mm_reset_file_pages(struct kvm_vm *vm, unsigned long start,
+				   unsigned long end)
+{
+	struct kvm_vm_mm *mm = &vm->mm;
+	unsigned long s, e;
+	void *hva, *addr;
+
+	for (s = start; s < end; s = e) {
+		if (!test_bit(mm->file_page_bits, s)) {
+			e = s + 1;
+			continue;
+		}
+
+		for (e = s + 1; e < end && test_bit(mm->file_page_bits, e); e++)
+			;
+
+		hva = mm->host_virt_addr + s * mm->page_size;
+		addr = mmap(hva, (e - s) * mm->page_size,
+			    PROT_READ | PROT_WRITE,
+			    MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0);
+		if (addr == MAP_FAILED) {
+			fprintf(stderr, "%s: Unable to map memory at 0x%lx (%d)\n",
+				__func__, s << mm->page_shift, errno);
+			return -errno;
 		}
+
+		madvise(addr, (e - s) * mm->page_size, MADV_NOHUGEPAGE);
+		kvm_mm_rebind(vm, s, e);
+		bitmap_clear(mm->file_page_bits, s, e - s);
 	}
 
 	return 0;
 }
 
-static void map_one_page(struct kvm_vm *vm,
-			 unsigned long phys,
-			 unsigned long virt)
+/**
+ * kvm_mm_free_phys_pages - Free physical pages of the guest RAM
+ * @vm:		VM where the physical pages are freed
+ * @phys:	guest physical address of the pages
+ * @npages:	number of pages
+ *
+ * The host pages backing them are returned to host lazily. The pages are
+ * leaked if they're mapped from file and can't be backed by the anonymous
+ * memory, because they can't be zero-filled on reuse. It's called with
+ * the lock held.
+ */
+void kvm_mm_free_phys_pages(struct kvm_vm *vm, unsigned long phys,
+			    unsigned long npages)
 {
 	struct kvm_vm_mm *mm = &vm->mm;
-	unsigned long mask, shift, index;
+	unsigned long start = phys >> mm->page_shift;
+
+	if (kvm_mm_reset_file_pages(vm, start, start + npages))
+		return;
+
+	bitmap_clear(mm->phys_page_bits, start, npages);
+	kvm_mm_reclaim_add(vm, phys, npages << mm->page_shift);
+}
+
+static int map_one_page(struct kvm_vm *vm,
+			unsigned long phys,
+			unsigned long virt,
+			unsigned long prot)
+{
+	struct kvm_vm_mm *mm = &vm->mm;
+	unsigned long mask, shift, index, table;
 	unsigned long level, *pte;
 
 	pte = (unsigned long *)kvm_mm_gpa_to_hva(vm, mm->pgtable);
@@ -53,31 +596,989 @@ static void map_one_page(struct kvm_vm *vm,
 		 * accessed directly.
 		 */
 		if (level > 1) {
-			if (!*pte)
-				*pte = kvm_mm_alloc_phys_pages(vm, 1) | 3;
+			if (!*pte) {
+				table = kvm_mm_alloc_phys_pages_node(vm, 1,
+					kvm_mm_phys_to_node(vm, phys));
+				if (!table)
+					return -ENOMEM;
+
+				*pte = table | 3;
+			}
 
 			mask = GENMASK(mm->pa_bits - 1, mm->page_shift);
 			pte = (unsigned long *)kvm_mm_gpa_to_hva(vm, *pte & mask);
+			if (!pte) {
+				fprintf(stderr, "%s: Invalid table at 0x%lx\n",
+					__func__, virt);
+				return -EFAULT;
+			}
 		} else {
-			*pte = (phys | (1 << 10) | (4 << 2) | 3);
+			*pte = (phys | prot);
 		}
 	}
+
+	return 0;
+}
+
+/*
+ * The translation cache is per-thread, so that it's looked up without
+ * lock. The cache is tagged with the VM's ID and generation, which is
+ * increased whenever the page table is changed. The stale cache is
+ * flushed on the next lookup.
+ */
+struct kvm_mm_tlb_entry {
+	unsigned long	vpn;		/* Virtual page number		*/
+	unsigned long	hva;		/* Host virtual address		*/
+	unsigned long	pte;		/* Leaf page table entry	*/
+};
+
+static __thread struct {
+	unsigned long		id;
+	int			gen;
+	struct kvm_mm_tlb_entry	entries[KVM_MM_TLB_ENTRIES];
+} kvm_mm_tlb;
+
+static void kvm_mm_tlb_flush(struct kvm_vm *vm)
+{
+	atomic_fetch_inc(&vm->mm.tlb_gen);
 }
 
-void kvm_mm_map(struct kvm_vm *vm,
-		unsigned long phys,
-		unsigned long virt,
-		unsigned long len)
+/**
+ * kvm_mm_map_prot - Map guest physical address range
+ * @vm:		VM where the range is mapped
+ * @phys:	start of the guest physical address range
+ * @virt:	start of the guest virtual address range
+ * @len:	length of the range, aligned to page size
+ * @prot:	attributes of the leaf entries (KVM_MM_PTE_*)
+ *
+ * The page-table pages are allocated from the guest RAM on demand. It's
+ * called with the lock held. It returns zero on success, or -ENOMEM if
+ * the page-table pages can't be allocated, where the range is unmapped.
+ */
+int kvm_mm_map_prot(struct kvm_vm *vm,
+		    unsigned long phys,
+		    unsigned long virt,
+		    unsigned long len,
+		    unsigned long prot)
 {
 	struct kvm_vm_mm *mm = &vm->mm;
-	unsigned long end = virt + len;
+	unsigned long start = virt, end = virt + len;
+	int ret = 0;
 
 	while (virt < end) {
-		map_one_page(vm, phys, virt);
+		ret = map_one_page(vm, phys, virt, prot);
+		if (ret)
+			break;
 
 		phys += mm->page_size;
 		virt += mm->page_size;
-		len -= mm->page_size;
 	}
+
+	if (ret && virt > start)
+		kvm_mm_unmap(vm, start, virt - start);
+
+	kvm_mm_tlb_flush(vm);
+
+	return ret;
+}
+
+int kvm_mm_map(struct kvm_vm *vm,
+	       unsigned long phys,
+	       unsigned long virt,
+	       unsigned long len)
+{
+	return kvm_mm_map_prot(vm, phys, virt, len, KVM_MM_PTE_DEFAULT);
+}
+
+/*
+ * Walk the page table, and return the leaf entry. NULL is returned if
+ * any level isn't populated.
+ */
+static unsigned long *walk_one_page(struct kvm_vm *vm, unsigned long virt)
+{
+	struct kvm_vm_mm *mm = &vm->mm;
+	unsigned long mask, shift, index;
+	unsigned long level, *pte;
+
+	if (virt >> mm->va_bits)
+		return NULL;
+
+	mask = GENMASK(mm->pa_bits - 1, mm->page_shift);
+	pte = (unsigned long *)kvm_mm_gpa_to_hva(vm, mm->pgtable);
+	for (level = mm->pgtable_levels; level > 1; level--) {
+		shift = (level - 1) * (mm->page_shift - 3) + mm->page_shift;
+		index = (virt >> shift) & GENMASK(mm->page_shift - 4, 0);
+		pte += index;
+		if (!(*pte & KVM_MM_PTE_VALID))
+			return NULL;
+
+		pte = (unsigned long *)kvm_mm_gpa_to_hva(vm, *pte & mask);
+		if (!pte)
+			return NULL;
+	}
+
+	return pte + ((virt >> mm->page_shift) & GENMASK(mm->page_shift - 4, 0));
+}
+
+/**
+ * kvm_mm_unmap - Unmap guest virtual address range
+ * @vm:		VM where the range is unmapped
+ * @virt:	start of the range, aligned to page size
+ * @len:	length of the range, aligned to page size
+ *
+ * The leaf entries are cleared, but the page-table pages are kept.
+ */
+void kvm_mm_unmap(struct kvm_vm *vm, unsigned long virt, unsigned long len)
+{
+	struct kvm_vm_mm *mm = &vm->mm;
+	unsigned long end = virt + len;
+	unsigned long *pte;
+
+	for (; virt < end; virt += mm->page_size) {
+		pte = walk_one_page(vm, virt);
+		if (pte)
+			*pte = 0;
+	}
+
+	kvm_mm_tlb_flush(vm);
+}
+
+static bool kvm_mm_pte_allowed(unsigned long pte, bool write)
+{
+	if (!(pte & KVM_MM_PTE_VALID))
+		return false;
+
+	return !write || !(pte & KVM_MM_PTE_AP_RO);
+}
+
+/**
+ * kvm_mm_gva_to_gpa - Translate guest virtual address to physical address
+ * @vm:		VM where the guest virtual address is translated
+ * @gva:	guest virtual address
+ * @write:	the page is written
+ * @gpa:	guest physical address, filled on success
+ *
+ * The page table built by kvm_mm_map() is walked. It returns zero on
+ * success, or -EFAULT if the address isn't mapped or the page is read-only
+ * for write access.
+ */
+int kvm_mm_gva_to_gpa(struct kvm_vm *vm,
+		      unsigned long gva,
+		      bool write,
+		      unsigned long *gpa)
+{
+	struct kvm_vm_mm *mm = &vm->mm;
+	unsigned long *pte = walk_one_page(vm, gva);
+
+	if (!pte || !kvm_mm_pte_allowed(*pte, write))
+		return -EFAULT;
+
+	*gpa = (*pte & GENMASK(mm->pa_bits - 1, mm->page_shift)) |
+	       (gva & (mm->page_size - 1));
+
+	return 0;
+}
+
+/**
+ * kvm_mm_unmap_phys - Unmap the area backed by the guest RAM
+ * @vm:		VM where the area is unmapped
+ * @virt:	start of the area
+ *
+ * The area is unmapped and released, together with the contiguous
+ * physical pages backing it. It's used to unwind the allocations (e.g.
+ * vCPU's stack). It's called with the lock held.
+ */
+void kvm_mm_unmap_phys(struct kvm_vm *vm, unsigned long virt)
+{
+	struct kvm_vm_mm *mm = &vm->mm;
+	struct vm_area *vma;
+	unsigned long gpa, len;
+
+	vma = mm_vma_find(mm->mm, virt, NULL);
+	if (!vma || vma->start != virt)
+		return;
+
+	len = vma->end - vma->start;
+	if (!kvm_mm_gva_to_gpa(vm, virt, false, &gpa)) {
+		kvm_mm_unmap(vm, virt, len);
+		kvm_mm_free_phys_pages(vm, gpa, len >> mm->page_shift);
+	}
+
+	mm_vma_free(mm->mm, vma);
+}
+
+/**
+ * kvm_mm_gva_to_hva - Translate guest virtual address to host address
+ * @vm:		VM where the guest virtual address is translated
+ * @gva:	guest virtual address
+ * @write:	the page is written
+ *
+ * The translation cache is looked up first, and the page table is walked
+ * on miss. The pages without host address (e.g. MMIO) aren't cached. It
+ * returns the host virtual address on success, or zero on failure.
+ */
+unsigned long kvm_mm_gva_to_hva(struct kvm_vm *vm, unsigned long gva, bool write)
+{
+	struct kvm_vm_mm *mm = &vm->mm;
+	struct kvm_mm_tlb_entry *e;
+	unsigned long vpn = gva >> mm->page_shift;
+	unsigned long offset = gva & (mm->page_size - 1);
+	unsigned long gpa, hva, *pte;
+	int i, gen = atomic_read(&mm->tlb_gen);
+
+	if (kvm_mm_tlb.id != mm->id || kvm_mm_tlb.gen != gen) {
+		for (i = 0; i < KVM_MM_TLB_ENTRIES; i++)
+			kvm_mm_tlb.entries[i].pte = 0;
+
+		kvm_mm_tlb.id = mm->id;
+		kvm_mm_tlb.gen = gen;
+	}
+
+	e = &kvm_mm_tlb.entries[vpn & (KVM_MM_TLB_ENTRIES - 1)];
+	if (e->pte && e->vpn == vpn)
+		return kvm_mm_pte_allowed(e->pte, write) ? e->hva + offset : 0;
+
+	pte = walk_one_page(vm, gva);
+	if (!pte || !kvm_mm_pte_allowed(*pte, write))
+		return 0;
+
+	gpa = *pte & GENMASK(mm->pa_bits - 1, mm->page_shift);
+	hva = kvm_mm_gpa_to_hva(vm, gpa);
+	if (!hva)
+		return 0;
+
+	/* The walk might race with the page table update */
+	if (atomic_read(&mm->tlb_gen) == gen) {
+		e->vpn = vpn;
+		e->hva = hva;
+		e->pte = *pte;
+	}
+
+	return hva + offset;
+}
+
+static int mm_gva_to_iov(struct kvm_vm *vm,
+			 unsigned long gva,
+			 unsigned long *len,
+			 bool write,
+			 struct iovec *iov,
+			 int max_iov)
+{
+	struct kvm_vm_mm *mm = &vm->mm;
+	unsigned long hva, size, left = *len;
+	int nr = 0;
+
+	while (left) {
+		size = min(left, mm->page_size - (gva & (mm->page_size - 1)));
+		hva = kvm_mm_gva_to_hva(vm, gva, write);
+		if (!hva)
+			return -EFAULT;
+
+		if (nr > 0 &&
+		    (unsigned long)iov[nr - 1].iov_base + iov[nr - 1].iov_len == hva) {
+			iov[nr - 1].iov_len += size;
+		} else {
+			if (nr >= max_iov)
+				break;
+
+			iov[nr].iov_base = (void *)hva;
+			iov[nr].iov_len = size;
+			nr++;
+		}
+
+		gva += size;
+		left -= size;
+	}
+
+	*len -= left;
+
+	return nr;
+}
+
+/**
+ * kvm_mm_gva_to_iov - Build host I/O vector for guest virtual address range
+ * @vm:		VM where the guest virtual address range is translated
+ * @gva:	start of the guest virtual address range
+ * @len:	length of the guest virtual address range
+ * @write:	the guest memory is written (e.g. by preadv())
+ * @iov:	I/O vector to be filled
+ * @max_iov:	maximal number of entries in @iov
+ *
+ * The guest pages are translated one by one, and the adjacent pages are
+ * merged into one entry if they're contiguous in the host virtual address
+ * space. The I/O vector can be passed to preadv(), pwritev() or sendmsg()
+ * so that the data is moved to or from the guest memory directly. It
+ * returns the number of filled entries on success, -EFAULT if any page
+ * isn't mapped or accessible, or -E2BIG if @iov isn't large enough.
+ */
+int kvm_mm_gva_to_iov(struct kvm_vm *vm,
+		      unsigned long gva,
+		      unsigned long len,
+		      bool write,
+		      struct iovec *iov,
+		      int max_iov)
+{
+	unsigned long size = len;
+	int nr;
+
+	nr = mm_gva_to_iov(vm, gva, &size, write, iov, max_iov);
+	if (nr >= 0 && size != len)
+		return -E2BIG;
+
+	return nr;
+}
+
+/**
+ * kvm_mm_gva_to_iov_partial - Build host I/O vector for leading part of
+ *			       guest virtual address range
+ * @vm:		VM where the guest virtual address range is translated
+ * @gva:	start of the guest virtual address range
+ * @len:	length of the range, updated to the length covered by @iov
+ * @write:	the guest memory is written (e.g. by preadv())
+ * @iov:	I/O vector to be filled
+ * @max_iov:	maximal number of entries in @iov
+ *
+ * Same as kvm_mm_gva_to_iov(), except the range is truncated when @iov is
+ * full, so that a large buffer contiguous in the host virtual address space
+ * is covered by few entries. It's used for the short read or write. It
+ * returns the number of filled entries on success, or -EFAULT if any page
+ * isn't mapped or accessible.
+ */
+int kvm_mm_gva_to_iov_partial(struct kvm_vm *vm,
+			      unsigned long gva,
+			      unsigned long *len,
+			      bool write,
+			      struct iovec *iov,
+			      int max_iov)
+{
+	return mm_gva_to_iov(vm, gva, len, write, iov, max_iov);
+}
+
+/**
+ * kvm_mm_copy_from_guest - Copy data from guest virtual address range
+ * @vm:		VM where the data is copied from
+ * @dst:	host buffer
+ * @gva:	start of the guest virtual address range
+ * @len:	length of the data
+ *
+ * It returns zero on success, or -EFAULT if any page isn't accessible.
+ */
+int kvm_mm_copy_from_guest(struct kvm_vm *vm,
+			   void *dst,
+			   unsigned long gva,
+			   unsigned long len)
+{
+	struct kvm_vm_mm *mm = &vm->mm;
+	unsigned long hva, size;
+
+	while (len) {
+		size = min(len, mm->page_size - (gva & (mm->page_size - 1)));
+		hva = kvm_mm_gva_to_hva(vm, gva, false);
+		if (!hva)
+			return -EFAULT;
+
+		memcpy(dst, (void *)hva, size);
+		dst += size;
+		gva += size;
+		len -= size;
+	}
+
+	return 0;
+}
+
+/**
+ * kvm_mm_copy_to_guest - Copy data to guest virtual address range
+ * @vm:		VM where the data is copied to
+ * @gva:	start of the guest virtual address range
+ * @src:	host buffer
+ * @len:	length of the data
+ *
+ * It returns zero on success, or -EFAULT if any page isn't writable.
+ */
+int kvm_mm_copy_to_guest(struct kvm_vm *vm,
+			 unsigned long gva,
+			 const void *src,
+			 unsigned long len)
+{
+	struct kvm_vm_mm *mm = &vm->mm;
+	unsigned long hva, size;
+
+	while (len) {
+		size = min(len, mm->page_size - (gva & (mm->page_size - 1)));
+		hva = kvm_mm_gva_to_hva(vm, gva, true);
+		if (!hva)
+			return -EFAULT;
+
+		memcpy((void *)hva, src, size);
+		src += size;
+		gva += size;
+		len -= size;
+	}
+
+	return 0;
+}
+
+/* Called with the lock held */
+static struct kvm_mem_slot *kvm_mm_find_slot(struct kvm_vm *vm,
+					     unsigned long hva)
+{
+	struct kvm_vm_mm *mm = &vm->mm;
+	int i;
+
+	for (i = 1; i < KVM_MAX_SLOTS; i++) {
+		if (mm->slots[i].size &&
+		    (unsigned long)mm->slots[i].hva == hva)
+			return &mm->slots[i];
+	}
+
+	return NULL;
+}
+
+/*
+ * Create the anonymous memory slot on the first anonymous mapping. The
+ * guest physical address ranges are allocated from the slot by the mm
+ * struct. It's called with the lock held.
+ */
+static int kvm_mm_anon_init(struct kvm_vm *vm)
+{
+	struct kvm_vm_mm *mm = &vm->mm;
+	struct kvm_mem_slot *slot;
+	void *hva;
+
+	if (mm->anon)
+		return 0;
+
+	hva = mmap(NULL, KVM_MM_ANON_SIZE, PROT_READ | PROT_WRITE,
+		   MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (hva == MAP_FAILED) {
+		fprintf(stderr, "%s: Unable to map memory (0x%lx)\n",
+			__func__, KVM_MM_ANON_SIZE);
+		return -ENOMEM;
+	}
+
+	madvise(hva, KVM_MM_ANON_SIZE, MADV_NOHUGEPAGE);
+	slot = kvm_mm_add_slot(vm, hva, KVM_MM_ANON_SIZE, 0);
+	if (slot)
+		mm->anon = mm_create(slot->gpa, slot->gpa + slot->size);
+	if (!mm->anon) {
+		if (slot)
+			kvm_mm_remove_slot(vm, slot);
+		munmap(hva, KVM_MM_ANON_SIZE);
+		return -ENOMEM;
+	}
+
+	mm->anon_slot = slot;
+
+	return 0;
 }
 
+/* Release the guest physical address range. It's called with the lock held */
+static void kvm_mm_anon_free(struct kvm_vm *vm, unsigned long gpa,
+			     unsigned long len)
+{
+	struct kvm_vm_mm *mm = &vm->mm;
+	struct vm_area *vma;
+
+	vma = mm_vma_find(mm->anon, gpa, NULL);
+	if (vma && vma->start < gpa)
+		vma = mm_vma_split(mm->anon, vma, gpa);
+	if (vma && vma->end > gpa + len && !mm_vma_split(mm->anon, vma, gpa + len))
+		vma = NULL;
+	if (!vma) {
+		fprintf(stderr, "%s: Unable to free range at 0x%lx\n",
+			__func__, gpa);
+		return;
+	}
+
+	mm_vma_free(mm->anon, vma);
+}
+
+/*
+ * Check if the address range can be replaced by the new mapping. The
+ * areas other than the anonymous memory and host file mappings (e.g.
+ * program segments) can't be replaced. It's called with the lock held.
+ */
+static int kvm_mm_check_replace(struct kvm_vm *vm, unsigned long start,
+				unsigned long end, bool replace)
+{
+	struct kvm_vm_mm *mm = &vm->mm;
+	struct vm_area *vma;
+
+	for (vma = mm_vma_find(mm->mm, start, NULL);
+	     vma && vma->start < end; vma = vma->next) {
+		if (!replace)
+			return -EEXIST;
+
+		if (vma->flags & MM_VMA_FLAG_ANON)
+			continue;
+
+		if ((vma->flags & MM_VMA_FLAG_SLOT) &&
+		    vma->start >= start && vma->end <= end)
+			continue;
+
+		return -EINVAL;
+	}
+
+	return 0;
+}
+
+/*
+ * Tear down the area. The memory slot of the host file mapping is removed,
+ * and the host pages of the anonymous memory are returned to host lazily.
+ * It's called with the lock held.
+ */
+static void kvm_mm_free_area(struct kvm_vm *vm, struct vm_area *vma)
+{
+	struct kvm_vm_mm *mm = &vm->mm;
+	struct kvm_mem_slot *slot;
+	unsigned long gpa, len = vma->end - vma->start;
+
+	if (vma->hva)
+		kvm_mm_unmap(vm, vma->start, len);
+
+	if (vma->flags & MM_VMA_FLAG_SLOT) {
+		slot = kvm_mm_find_slot(vm, vma->hva);
+		if (slot)
+			kvm_mm_remove_slot(vm, slot);
+		munmap((void *)vma->hva, len);
+	} else if (vma->hva) {
+		gpa = mm->anon_slot->gpa +
+		      (vma->hva - (unsigned long)mm->anon_slot->hva);
+		kvm_mm_anon_free(vm, gpa, len);
+		kvm_mm_reclaim_add(vm, gpa, len);
+		mm->anon_mapped -= len;
+	}
+
+	mm_vma_free(mm->mm, vma);
+}
+
+/*
+ * Unmap the address range. The anonymous areas are split if they're
+ * partially covered, but the host file mappings should be covered as a
+ * whole. The other areas (e.g. program segments) can't be unmapped. It's
+ * called with the lock held.
+ */
+static int kvm_mm_unmap_areas(struct kvm_vm *vm, unsigned long start,
+			      unsigned long end)
+{
+	struct kvm_vm_mm *mm = &vm->mm;
+	struct vm_area *vma, *next;
+	int ret;
+
+	ret = kvm_mm_check_replace(vm, start, end, true);
+	if (ret)
+		return ret;
+
+	vma = mm_vma_find(mm->mm, start, NULL);
+	while (vma && vma->start < end) {
+		if (vma->start < start) {
+			vma = mm_vma_split(mm->mm, vma, start);
+			if (!vma)
+				return -ENOMEM;
+		}
+
+		if (vma->end > end && !mm_vma_split(mm->mm, vma, end))
+			return -ENOMEM;
+
+		next = vma->next;
+		kvm_mm_free_area(vm, vma);
+		vma = next;
+	}
+
+	return 0;
+}
+
+/**
+ * kvm_mm_map_file - Map host file into guest
+ * @vm:		VM where the file is mapped
+ * @fd:		host file descriptor
+ * @offset:	offset in the file, aligned to page size
+ * @len:	length of the mapping
+ * @flags:	flags of the mapping (KVM_MM_FILE_*)
+ * @addr:	guest virtual address hint, or the fixed address with
+ *		KVM_MM_FILE_FIXED. It's updated to the mapped address.
+ *
+ * The file is mapped by us and the mapping is installed as its own memory
+ * slot, so that the guest shares the pages with the host page cache. The
+ * read-only mapping is backed by a read-only memory slot and mapped
+ * read-only into the guest page table. The number of mappings is limited
+ * by the free memory slots. The fixed address range is replaced with
+ * KVM_MM_FILE_REPLACE. Otherwise, -EEXIST is returned if it overlaps the
+ * existing mappings. It returns zero on success, or negative error code
+ * on failure, where the fixed address range may have been unmapped with
+ * KVM_MM_FILE_REPLACE.
+ */
+int kvm_mm_map_file(struct kvm_vm *vm,
+		    int fd,
+		    unsigned long offset,
+		    unsigned long len,
+		    unsigned int flags,
+		    unsigned long *addr)
+{
+	struct kvm_vm_mm *mm = &vm->mm;
+	struct kvm_mem_slot *slot;
+	struct vm_area *vma = NULL;
+	unsigned long vma_flags = MM_VMA_FLAG_SLOT;
+	bool write = !!(flags & KVM_MM_FILE_WRITE);
+	void *hva;
+	int ret = -ENOMEM;
+
+	len = ALIGN(len, mm->page_size);
+	if (!len || (offset & (mm->page_size - 1)) || *addr + len < *addr)
+		return -EINVAL;
+
+	hva = mmap(NULL, len, write ? (PROT_READ | PROT_WRITE) : PROT_READ,
+		   (flags & KVM_MM_FILE_SHARED) ? MAP_SHARED : MAP_PRIVATE,
+		   fd, offset);
+	if (hva == MAP_FAILED)
+		return -errno;
+
+	if (flags & KVM_MM_FILE_FIXED)
+		vma_flags |= MM_VMA_FLAG_FIXED;
+
+	pthread_mutex_lock(&vm->lock);
+
+	if (flags & KVM_MM_FILE_FIXED) {
+		ret = kvm_mm_check_replace(vm, *addr, *addr + len,
+					   !!(flags & KVM_MM_FILE_REPLACE));
+		if (ret)
+			goto error;
+	}
+
+	ret = -ENOMEM;
+	slot = kvm_mm_add_slot(vm, hva, len, write ? 0 : KVM_MEM_READONLY);
+	if (!slot)
+		goto error;
+
+	if (flags & KVM_MM_FILE_REPLACE) {
+		ret = kvm_mm_unmap_areas(vm, *addr, *addr + len);
+		if (ret)
+			goto remove_slot;
+	}
+
+	ret = -ENOMEM;
+	vma = mm_vma_alloc(mm->mm, *addr, len, vma_flags, 0);
+	if (!vma)
+		goto remove_slot;
+
+	ret = kvm_mm_map_prot(vm, slot->gpa, vma->start, len,
+			      write ? KVM_MM_PTE_DEFAULT :
+				      (KVM_MM_PTE_DEFAULT | KVM_MM_PTE_AP_RO));
+	if (ret) {
+		mm_vma_free(mm->mm, vma);
+		goto remove_slot;
+	}
+
+	slot->file = true;
+	vma->hva = (unsigned long)hva;
+	*addr = vma->start;
+
+	pthread_mutex_unlock(&vm->lock);
+
+	return 0;
+
+remove_slot:
+	kvm_mm_remove_slot(vm, slot);
+error:
+	pthread_mutex_unlock(&vm->lock);
+	munmap(hva, len);
+	return ret;
+}
+
+/* Maximal total size of the anonymous mappings */
+static unsigned long kvm_mm_anon_limit(struct kvm_vm *vm)
+{
+	struct kvm_vm_mm *mm = &vm->mm;
+	unsigned long tables = mm->phys_page_num / KVM_MM_ANON_PGTABLE_RATIO;
+
+	return min(tables * (mm->page_size / 8) * mm->page_size,
+		   KVM_MM_ANON_SIZE);
+}
+
+/*
+ * Map anonymous memory to the area. The host pages are returned to host
+ * when it's unmapped or advised with MADV_DONTNEED, and zero-filled on
+ * the next access. The existing mappings in the range are replaced with
+ * KVM_MM_ANON_REPLACE, after the backing memory of the new mapping has
+ * been allocated. The area and the page table are allocated after the
+ * existing mappings are unmapped, so the range is left unmapped if they
+ * can't be allocated. It's called with the lock held.
+ */
+static int kvm_mm_anon_map(struct kvm_vm *vm, unsigned long addr,
+			   unsigned long len, unsigned int flags,
+			   unsigned long *start)
+{
+	struct kvm_vm_mm *mm = &vm->mm;
+	struct kvm_mem_slot *slot;
+	struct vm_area *vma, *range = NULL;
+	unsigned long vma_flags = MM_VMA_FLAG_ANON, gpa;
+	int ret;
+
+	if (flags & KVM_MM_ANON_FIXED) {
+		vma_flags |= MM_VMA_FLAG_FIXED;
+		ret = kvm_mm_check_replace(vm, addr, addr + len,
+					   !!(flags & KVM_MM_ANON_REPLACE));
+		if (ret)
+			return ret;
+	}
+
+	if (!(flags & KVM_MM_ANON_RESERVE)) {
+		if (len > kvm_mm_anon_limit(vm) - mm->anon_mapped)
+			return -ENOMEM;
+
+		ret = kvm_mm_anon_init(vm);
+		if (ret)
+			return ret;
+
+		slot = mm->anon_slot;
+		if (kvm_mm_zero_take(vm, slot->gpa, slot->gpa + slot->size,
+				     len, &gpa)) {
+			range = mm_vma_alloc(mm->anon, gpa, len,
+					     MM_VMA_FLAG_FIXED, 0);
+		} else {
+			range = mm_vma_alloc(mm->anon, 0, len, 0, 0);
+			if (range)
+				kvm_mm_reclaim_cancel(vm, range->start, len);
+		}
+
+		if (!range)
+			return -ENOMEM;
+	}
+
+	if (flags & KVM_MM_ANON_REPLACE) {
+		ret = kvm_mm_unmap_areas(vm, addr, addr + len);
+		if (ret)
+			goto error;
+	}
+
+	vma = mm_vma_alloc(mm->mm, addr, len, vma_flags, 0);
+	if (!vma) {
+		ret = -ENOMEM;
+		goto error;
+	}
+
+	*start = vma->start;
+	if (!range)
+		return 0;
+
+	slot = mm->anon_slot;
+	vma->hva = (unsigned long)slot->hva + (range->start - slot->gpa);
+	ret = kvm_mm_map_prot(vm, range->start, vma->start, len,
+			      (flags & KVM_MM_ANON_WRITE) ? KVM_MM_PTE_DEFAULT :
+			      (KVM_MM_PTE_DEFAULT | KVM_MM_PTE_AP_RO));
+	if (ret) {
+		mm_vma_free(mm->mm, vma);
+		goto error;
+	}
+
+	mm->anon_mapped += len;
+
+	return 0;
+
+error:
+	if (range) {
+		kvm_mm_reclaim_add(vm, range->start, len);
+		mm_vma_free(mm->anon, range);
+	}
+
+	return ret;
+}
+
+/**
+ * kvm_mm_map_anon - Map anonymous memory into guest
+ * @vm:		VM where the anonymous memory is mapped
+ * @len:	length of the mapping
+ * @flags:	flags of the mapping (KVM_MM_ANON_*)
+ * @addr:	guest virtual address hint, or the fixed address with
+ *		KVM_MM_ANON_FIXED. It's updated to the mapped address.
+ *
+ * The page table is populated immediately, but the host pages aren't
+ * allocated until they're accessed, unless KVM_MM_ANON_POPULATE is given.
+ * With KVM_MM_ANON_RESERVE, the address range is reserved without being
+ * mapped. The fixed address range is replaced with KVM_MM_ANON_REPLACE.
+ * Otherwise, -EEXIST is returned if it overlaps the existing mappings. It
+ * returns zero on success, or negative error code on failure, where the
+ * fixed address range may have been unmapped with KVM_MM_ANON_REPLACE.
+ */
+int kvm_mm_map_anon(struct kvm_vm *vm,
+		    unsigned long len,
+		    unsigned int flags,
+		    unsigned long *addr)
+{
+	struct kvm_vm_mm *mm = &vm->mm;
+	struct vm_area *vma;
+	int ret;
+
+	len = ALIGN(len, mm->page_size);
+	if (!len || (*addr & (mm->page_size - 1)) || *addr + len < *addr)
+		return -EINVAL;
+
+	pthread_mutex_lock(&vm->lock);
+
+	ret = kvm_mm_anon_map(vm, *addr, len, flags, addr);
+	if (!ret && (flags & KVM_MM_ANON_POPULATE)) {
+		vma = mm_vma_find(mm->mm, *addr, NULL);
+		if (vma->hva)
+			madvise((void *)vma->hva, len, MADV_POPULATE_WRITE);
+	}
+
+	pthread_mutex_unlock(&vm->lock);
+
+	return ret;
+}
+
+/**
+ * kvm_mm_unmap_range - Unmap address range from guest
+ * @vm:		VM where the address range is unmapped
+ * @addr:	start of the address range, aligned to page size
+ * @len:	length of the address range
+ *
+ * The anonymous memory and host file mappings in the range are unmapped.
+ * The dirty pages of the shared file mapping are written back by the host
+ * page cache. It returns zero on success, or negative error code on
+ * failure.
+ */
+int kvm_mm_unmap_range(struct kvm_vm *vm, unsigned long addr,
+		       unsigned long len)
+{
+	struct kvm_vm_mm *mm = &vm->mm;
+	int ret;
+
+	len = ALIGN(len, mm->page_size);
+	if (!len || (addr & (mm->page_size - 1)) || addr + len < addr)
+		return -EINVAL;
+
+	pthread_mutex_lock(&vm->lock);
+	ret = kvm_mm_unmap_areas(vm, addr, addr + len);
+	pthread_mutex_unlock(&vm->lock);
+
+	return ret;
+}
+
+/**
+ * kvm_mm_advise - Give advice about the guest memory
+ * @vm:		VM where the advice is given
+ * @addr:	start of the address range, aligned to page size
+ * @len:	length of the address range
+ * @advice:	MADV_*
+ *
+ * MADV_DONTNEED and MADV_FREE are applied to the host pages backing the
+ * anonymous memory and host file mappings. The other advices are hints,
+ * which are ignored. It returns zero on success, or negative error code
+ * on failure.
+ */
+int kvm_mm_advise(struct kvm_vm *vm, unsigned long addr,
+		  unsigned long len, int advice)
+{
+	struct kvm_vm_mm *mm = &vm->mm;
+	struct vm_area *vma;
+	unsigned long start, end = addr + ALIGN(len, mm->page_size);
+	int ret = 0;
+
+	if ((addr & (mm->page_size - 1)) || end < addr)
+		return -EINVAL;
+
+	switch (advice) {
+	case MADV_DONTNEED:
+	case MADV_FREE:
+		break;
+	case MADV_NORMAL:
+	case MADV_RANDOM:
+	case MADV_SEQUENTIAL:
+	case MADV_WILLNEED:
+	case MADV_HUGEPAGE:
+	case MADV_NOHUGEPAGE:
+	case MADV_DONTDUMP:
+	case MADV_DODUMP:
+		return 0;
+	default:
+		return -EINVAL;
+	}
+
+	pthread_mutex_lock(&vm->lock);
+
+	for (vma = mm_vma_find(mm->mm, addr, NULL), start = addr;
+	     start < end; vma = vma->next) {
+		if (!vma || vma->start > start) {
+			ret = -ENOMEM;
+			break;
+		}
+
+		if (vma->hva &&
+		    (vma->flags & (MM_VMA_FLAG_ANON | MM_VMA_FLAG_SLOT)))
+			madvise((void *)(vma->hva + (start - vma->start)),
+				min(end, vma->end) - start, advice);
+
+		start = vma->end;
+	}
+
+	pthread_mutex_unlock(&vm->lock);
+
+	return ret;
+}
+
+/*
+ * The program break starts from the end of the highest segment of the
+ * executable, which is the first loaded image. It's called with the lock
+ * held.
+ */
+static unsigned long kvm_mm_brk_start(struct kvm_vm *vm)
+{
+	struct elf_image *image;
+	struct elf_segment *seg;
+	unsigned long end = 0;
+	int i;
+
+	if (list_empty(&vm->image_list))
+		return 0;
+
+	image = list_first_entry(&vm->image_list, struct elf_image, link);
+	for (i = 0; i < image->nr_segs; i++) {
+		seg = &image->segs[i];
+		end = max(end, seg->vaddr + seg->memsz);
+	}
+
+	return ALIGN(end, vm->mm.page_size);
+}
+
+/**
+ * kvm_mm_brk - Change the program break
+ * @vm:		VM whose program break is changed
+ * @brk:	requested program break, or zero to query
+ *
+ * The heap is grown or shrunk by mapping or unmapping the anonymous
+ * memory above the current break. It returns the new program break, or
+ * the current one if the request can't be satisfied.
+ */
+unsigned long kvm_mm_brk(struct kvm_vm *vm, unsigned long brk)
+{
+	struct kvm_vm_mm *mm = &vm->mm;
+	unsigned long start, old, new;
+
+	pthread_mutex_lock(&vm->lock);
+
+	if (!mm->brk_start) {
+		mm->brk_start = kvm_mm_brk_start(vm);
+		mm->brk = mm->brk_start;
+	}
+
+	if (!mm->brk_start || brk < mm->brk_start)
+		goto out;
+
+	old = ALIGN(mm->brk, mm->page_size);
+	new = ALIGN(brk, mm->page_size);
+	if (new > old &&
+	    kvm_mm_anon_map(vm, old, new - old,
+			    KVM_MM_ANON_WRITE | KVM_MM_ANON_FIXED, &start))
+		goto out;
+
+	if (new < old && kvm_mm_unmap_areas(vm, new, old))
+		goto out;
+
+	mm->brk = brk;
+out:
+	brk = mm->brk;
+	pthread_mutex_unlock(&vm->lock);
+
+	return brk;
+}
@@ -0,0 +1,237 @@
+/*
+ * Copyright 2022 Gavin Shan <gshan@redhat.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+#include "sandbox.h"
+
+/*
+ * The placement policy pins the vCPU threads to the host CPUs, and binds
+ * the guest memory to the host NUMA nodes. The guest RAM can be split into
+ * ranges, each of which is bound to one node. The vCPU's stack is allocated
+ * from the range of the vCPU's node, and the page-table pages are allocated
+ * from the node where the mapped page resides.
+ */
+
+static int numa_mbind(unsigned long hva, unsigned long len, int node, int mode)
+{
+	unsigned long nodemask[KVM_MAX_NUMA_NODES / BITS_PER_LONG];
+
+	memset(nodemask, 0, sizeof(nodemask));
+	nodemask[BIT_WORD(node)] = BIT_MASK(node);
+	if (syscall(SYS_mbind, hva, len, mode, nodemask,
+		    KVM_MAX_NUMA_NODES + 1, MPOL_MF_MOVE))
+		return -errno;
+
+	return 0;
+}
+
+/**
+ * kvm_mm_bind - Bind guest memory to host NUMA node
+ * @vm:		VM where the guest memory is bound
+ * @gpa:	start of the guest physical address range, aligned to page
+ * @len:	length of the range, aligned to page
+ * @node:	host NUMA node
+ * @mode:	MPOL_BIND or MPOL_PREFERRED
+ *
+ * The range can be in the guest RAM or any other memory slot. The range
+ * in the guest RAM is used for node-local page allocation. It returns
+ * zero on success, or negative error code on failure.
+ */
+int kvm_mm_bind(struct kvm_vm *vm,
+		unsigned long gpa,
+		unsigned long len,
+		int node,
+		int mode)
+{
+	struct kvm_vm_mm *mm = &vm->mm;
+	struct kvm_mm_node *n;
+	unsigned long hva, ram_end;
+	int ret;
+
+	if (node < 0 || node >= KVM_MAX_NUMA_NODES ||
+	    (mode != MPOL_BIND && mode != MPOL_PREFERRED))
+		return -EINVAL;
+
+	hva = kvm_mm_gpa_to_hva(vm, gpa);
+	if (!hva || kvm_mm_gpa_to_hva(vm, gpa + len - 1) != hva + len - 1)
+		return -EINVAL;
+
+	ret = numa_mbind(hva, len, node, mode);
+	if (ret) {
+		fprintf(stderr, "%s: Unable to bind 0x%lx to node %d (%d)\n",
+			__func__, gpa, node, ret);
+		return ret;
+	}
+
+	/* Record the range of the guest RAM for node-local allocation */
+	ram_end = (mm->phys_page_base + mm->phys_page_num) << mm->page_shift;
+	if (gpa >= ram_end || mm->nr_nodes >= KVM_MAX_NUMA_RANGES)
+		return 0;
+
+	n = &mm->nodes[mm->nr_nodes++];
+	n->node = node;
+	n->mode = mode;
+	n->start = (gpa >> mm->page_shift) - mm->phys_page_base;
+	n->end = n->start + (len >> mm->page_shift);
+
+	return 0;
+}
+
+/**
+ * kvm_mm_rebind - Bind the guest RAM pages to host NUMA nodes again
+ * @vm:		VM where the pages are bound
+ * @start:	start page number
+ * @end:	end page number
+ *
+ * The binding is lost when the host mapping of the pages is replaced,
+ * so it's applied again to the pages covered by the recorded ranges.
+ * It's called with the lock held.
+ */
+void kvm_mm_rebind(struct kvm_vm *vm, unsigned long start, unsigned long end)
+{
+	struct kvm_vm_mm *mm = &vm->mm;
+	struct kvm_mm_node *n;
+	unsigned long s, e;
+	int i;
+
+	for (i = 0; i < mm->nr_nodes; i++) {
+		n = &mm->nodes[i];
+		s = max(start, n->start);
+		e = min(end, n->end);
+		if (s < e)
+			numa_mbind((unsigned long)mm->host_virt_addr +
+				   s * mm->page_size,
+				   (e - s) * mm->page_size, n->node, n->mode);
+	}
+}
+
+int kvm_mm_phys_to_node(struct kvm_vm *vm, unsigned long phys)
+{
+	struct kvm_vm_mm *mm = &vm->mm;
+	unsigned long page = (phys >> mm->page_shift) - mm->phys_page_base;
+	int i;
+
+	for (i = 0; i < mm->nr_nodes; i++) {
+		if (page >= mm->nodes[i].start && page < mm->nodes[i].end)
+			return mm->nodes[i].node;
+	}
+
+	return -1;
+}
+
+/**
+ * kvm_mm_alloc_phys_pages_node - Allocate physical pages from NUMA node
+ * @vm:		VM where the physical pages are allocated
+ * @npages:	number of physical pages
+ * @node:	host NUMA node, or -1 for any node
+ *
+ * The pages are allocated from the ranges of the guest RAM bound to @node.
+ * It falls back to any node if the node-local pages are exhausted. It's
+ * called with the lock held. The physical address is returned on success.
+ * Otherwise, zero is returned.
+ */
+unsigned long kvm_mm_alloc_phys_pages_node(struct kvm_vm *vm,
+					   unsigned long npages,
+					   int node)
+{
+	struct kvm_vm_mm *mm = &vm->mm;
+	struct kvm_mm_node *n;
+	unsigned long phys;
+	int i;
+
+	for (i = 0; node >= 0 && i < mm->nr_nodes; i++) {
+		n = &mm->nodes[i];
+		if (n->node != node)
+			continue;
+
+		phys = kvm_mm_alloc_phys_range(vm, npages, n->start, n->end);
+		if (phys)
+			return phys;
+	}
+
+	return kvm_mm_alloc_phys_pages(vm, npages);
+}
+
+/**
+ * kvm_vm_set_vcpu_placement - Set placement policy of vCPU
+ * @vm:		VM where the vCPU resides
+ * @id:		vCPU ID
+ * @cpus:	host CPUs where the vCPU thread runs, or NULL for any CPUs
+ * @node:	host NUMA node of the vCPU's stack, or -1 for any node
+ *
+ * It should be called before the vCPU is created. The vCPU thread is
+ * pinned when it starts running. It returns zero on success, or negative
+ * error code on failure.
+ */
+int kvm_vm_set_vcpu_placement(struct kvm_vm *vm,
+			      unsigned int id,
+			      const cpu_set_t *cpus,
+			      int node)
+{
+	struct kvm_vcpu_placement *p;
+
+	if (id >= KVM_MAX_VCPUS || node >= KVM_MAX_NUMA_NODES)
+		return -EINVAL;
+
+	if (!vm->placement) {
+		vm->placement = calloc(KVM_MAX_VCPUS, sizeof(*vm->placement));
+		if (!vm->placement) {
+			fprintf(stderr, "%s: Unable to alloc placement\n",
+				__func__);
+			return -ENOMEM;
+		}
+	}
+
+	p = &vm->placement[id];
+	p->valid = true;
+	p->node = node;
+	p->pinned = !!cpus;
+	if (cpus)
+		p->cpus = *cpus;
+
+	return 0;
+}
+
+int kvm_vcpu_node(struct kvm_vcpu *vcpu)
+{
+	struct kvm_vm *vm = vcpu->vm;
+
+	if (!vm->placement || !vm->placement[vcpu->id].valid)
+		return -1;
+
+	return vm->placement[vcpu->id].node;
+}
+
+/*
+ * Pin the calling thread, which runs the vCPU. It's called before the
+ * vCPU enters the guest for the first time.
+ */
+int kvm_vcpu_apply_placement(struct kvm_vcpu *vcpu)
+{
+	struct kvm_vm *vm = vcpu->vm;
+	struct kvm_vcpu_placement *p;
+	int ret;
+
+	if (!vm->placement)
+		return 0;
+
+	p = &vm->placement[vcpu->id];
+	if (!p->valid || !p->pinned)
+		return 0;
+
+	ret = pthread_setaffinity_np(pthread_self(), sizeof(p->cpus), &p->cpus);
+	if (ret) {
+		fprintf(stderr, "%s: Unable to pin vCPU %d (%d)\n",
+			__func__, vcpu->id, ret);
+		return -ret;
+	}
+
+	return 0;
+}
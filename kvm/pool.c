@@ -0,0 +1,192 @@
+/*
+ * Copyright 2022 Gavin Shan <gshan@redhat.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#include "sandbox.h"
+
+/*
+ * The VMs are created ahead of time and kept in the pool, so that the
+ * creation isn't on the path where a VM is requested. They're cloned
+ * from the zygote if it's given, or created empty. The pool is refilled
+ * by the background thread to the high watermark when the number of the
+ * VMs drops below the low watermark. It's meant for the launchers which
+ * run many VMs in one process, and isn't used by the one-shot sandbox.
+ */
+struct kvm_vm_pool {
+	struct kvm_zygote	*zygote;	/* VMs are cloned from it  */
+	unsigned int		low;		/* Low watermark	   */
+	unsigned int		high;		/* High watermark	   */
+	struct kvm_vm		**vms;		/* Pre-created VMs	   */
+	unsigned int		nr_vms;		/* Number of VMs	   */
+	pthread_mutex_t		lock;		/* Lock			   */
+	pthread_cond_t		cond;		/* Wake up refill thread   */
+	pthread_t		thread;		/* Refill thread	   */
+	bool			refill;		/* Refill to high watermark */
+	bool			stop;		/* Refill thread is stopped */
+};
+
+/*
+ * The guest RAM is populated so that the host page faults are avoided
+ * when the VM starts running. The pages of the clones are populated for
+ * read, so that they're still shared with the zygote. It's best effort.
+ */
+static struct kvm_vm *pool_create_vm(struct kvm_vm_pool *pool)
+{
+	struct kvm_vm *vm;
+	struct kvm_vm_mm *mm;
+
+	vm = pool->zygote ? kvm_zygote_clone(pool->zygote) : kvm_vm_create();
+	if (!vm)
+		return NULL;
+
+	mm = &vm->mm;
+	madvise(mm->host_virt_addr, mm->phys_page_num * mm->page_size,
+		pool->zygote ? MADV_POPULATE_READ : MADV_POPULATE_WRITE);
+
+	return vm;
+}
+
+static void *pool_refill_thread(void *arg)
+{
+	struct kvm_vm_pool *pool = arg;
+	struct kvm_vm *vm;
+
+	pthread_mutex_lock(&pool->lock);
+
+	while (!pool->stop) {
+		if (!pool->refill || pool->nr_vms >= pool->high) {
+			pool->refill = false;
+			pthread_cond_wait(&pool->cond, &pool->lock);
+			continue;
+		}
+
+		pthread_mutex_unlock(&pool->lock);
+		vm = pool_create_vm(pool);
+		pthread_mutex_lock(&pool->lock);
+
+		/* Retry on next request if the VM can't be created */
+		if (!vm) {
+			pool->refill = false;
+			continue;
+		}
+
+		if (pool->stop || pool->nr_vms >= pool->high) {
+			pthread_mutex_unlock(&pool->lock);
+			kvm_vm_destroy(vm);
+			pthread_mutex_lock(&pool->lock);
+			continue;
+		}
+
+		pool->vms[pool->nr_vms++] = vm;
+	}
+
+	pthread_mutex_unlock(&pool->lock);
+
+	return NULL;
+}
+
+/**
+ * kvm_vm_pool_create - Create pool of the pre-created VMs
+ * @zygote:	zygote where the VMs are cloned from, or NULL for empty VMs
+ * @low:	low watermark, below which the pool is refilled
+ * @high:	high watermark, up to which the pool is refilled
+ *
+ * The pool is filled to the high watermark in the background. The pool
+ * is returned on success. Otherwise, NULL is returned.
+ */
+struct kvm_vm_pool *kvm_vm_pool_create(struct kvm_zygote *zygote,
+				       unsigned int low, unsigned int high)
+{
+	struct kvm_vm_pool *pool;
+	int ret;
+
+	if (!high || low > high) {
+		fprintf(stderr, "%s: Invalid watermarks (%u, %u)\n",
+			__func__, low, high);
+		return NULL;
+	}
+
+	pool = calloc(1, sizeof(*pool));
+	if (!pool) {
+		fprintf(stderr, "%s: Unable to alloc pool\n", __func__);
+		return NULL;
+	}
+
+	pool->vms = calloc(high, sizeof(*pool->vms));
+	if (!pool->vms) {
+		fprintf(stderr, "%s: Unable to alloc VMs (%u)\n",
+			__func__, high);
+		free(pool);
+		return NULL;
+	}
+
+	pool->zygote = zygote;
+	pool->low = low;
+	pool->high = high;
+	pool->refill = true;
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->cond, NULL);
+
+	ret = pthread_create(&pool->thread, NULL, pool_refill_thread, pool);
+	if (ret) {
+		fprintf(stderr, "%s: Unable to create thread (%d)\n",
+			__func__, ret);
+		free(pool->vms);
+		free(pool);
+		return NULL;
+	}
+
+	return pool;
+}
+
+/**
+ * kvm_vm_pool_get - Take VM from the pool
+ * @pool:	pool where the VM is taken
+ *
+ * The VM is created on the spot if the pool is empty. The refill thread
+ * is woken up when the number of the VMs drops below the low watermark.
+ * The VM is returned on success. Otherwise, NULL is returned.
+ */
+struct kvm_vm *kvm_vm_pool_get(struct kvm_vm_pool *pool)
+{
+	struct kvm_vm *vm = NULL;
+
+	pthread_mutex_lock(&pool->lock);
+
+	if (pool->nr_vms)
+		vm = pool->vms[--pool->nr_vms];
+
+	if (pool->nr_vms < pool->low || !pool->nr_vms) {
+		pool->refill = true;
+		pthread_cond_signal(&pool->cond);
+	}
+
+	pthread_mutex_unlock(&pool->lock);
+
+	return vm ? vm : pool_create_vm(pool);
+}
+
+void kvm_vm_pool_destroy(struct kvm_vm_pool *pool)
+{
+	unsigned int i;
+
+	pthread_mutex_lock(&pool->lock);
+	pool->stop = true;
+	pthread_cond_signal(&pool->cond);
+	pthread_mutex_unlock(&pool->lock);
+
+	pthread_join(pool->thread, NULL);
+
+	for (i = 0; i < pool->nr_vms; i++)
+		kvm_vm_destroy(pool->vms[i]);
+
+	pthread_cond_destroy(&pool->cond);
+	pthread_mutex_destroy(&pool->lock);
+	free(pool->vms);
+	free(pool);
+}
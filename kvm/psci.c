@@ -0,0 +1,121 @@
+/*
+ * Copyright 2022 Gavin Shan <gshan@redhat.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#include "sandbox.h"
+
+/*
+ * The secondary vCPUs are powered off initially. PSCI CPU_ON is forwarded
+ * to us through the SMCCC filter. The target vCPU's thread is parked until
+ * it's powered on, and then it sets its own entry point and context ID, so
+ * that the registers prepared at creation time (e.g. MMU) are retained.
+ * The in-kernel PSCI implementation resets the target vCPU on CPU_ON, so
+ * only one vCPU is allowed if the SMCCC filter isn't supported.
+ */
+
+/* The MPIDR is derived from the vCPU ID by KVM */
+static unsigned int kvm_psci_mpidr_to_id(unsigned long mpidr)
+{
+	return ((mpidr & 0xf)			|
+		(((mpidr >> 8) & 0xff) << 4)	|
+		(((mpidr >> 16) & 0xff) << 12));
+}
+
+static long kvm_psci_cpu_on(struct kvm_vm *vm,
+			    unsigned long mpidr,
+			    unsigned long entry_point,
+			    unsigned long context_id)
+{
+	struct kvm_vcpu *vcpu;
+	unsigned int id = kvm_psci_mpidr_to_id(mpidr);
+	long ret = PSCI_RET_SUCCESS;
+
+	if (id >= KVM_MAX_VCPUS)
+		return PSCI_RET_INVALID_PARAMS;
+
+	pthread_mutex_lock(&vm->lock);
+
+	vcpu = vm->vcpus[id];
+	if (!vcpu) {
+		ret = PSCI_RET_INVALID_PARAMS;
+	} else if (!vcpu->power_off || vcpu->power_on) {
+		ret = PSCI_RET_ALREADY_ON;
+	} else {
+		vcpu->entry_point = entry_point;
+		vcpu->context_id = context_id;
+		vcpu->power_on = true;
+		pthread_cond_broadcast(&vm->cond);
+	}
+
+	pthread_mutex_unlock(&vm->lock);
+
+	return ret;
+}
+
+static long kvm_psci_handle_cpu_on(struct kvm_vcpu *vcpu)
+{
+	unsigned long mpidr, entry_point, context_id;
+
+	if (kvm_vcpu_get_reg(vcpu, KVM_ARM64_CORE_REG(regs.regs[1]),
+			     &mpidr)					||
+	    kvm_vcpu_get_reg(vcpu, KVM_ARM64_CORE_REG(regs.regs[2]),
+			     &entry_point)				||
+	    kvm_vcpu_get_reg(vcpu, KVM_ARM64_CORE_REG(regs.regs[3]),
+			     &context_id))
+		return PSCI_RET_INTERNAL_FAILURE;
+
+	return kvm_psci_cpu_on(vcpu->vm, mpidr, entry_point, context_id);
+}
+
+/**
+ * kvm_psci_wait_power_on - Wait until the vCPU is powered on
+ * @vcpu:	vCPU which is powered off
+ *
+ * It's called by the vCPU's running thread. It returns zero when the vCPU
+ * is powered on, KVM_EXIT_HANDLER_STOP when the VM is stopped, or negative
+ * error code on failure.
+ */
+int kvm_psci_wait_power_on(struct kvm_vcpu *vcpu)
+{
+	struct kvm_vm *vm = vcpu->vm;
+	struct kvm_mp_state mp_state;
+
+	/* The in-kernel PSCI implementation wakes up the vCPU */
+	if (!vcpu->power_off || !vm->psci_user)
+		return 0;
+
+	pthread_mutex_lock(&vm->lock);
+	while (!vcpu->power_on && !atomic_read(&vm->stopping))
+		pthread_cond_wait(&vm->cond, &vm->lock);
+	pthread_mutex_unlock(&vm->lock);
+
+	if (!vcpu->power_on)
+		return KVM_EXIT_HANDLER_STOP;
+
+	mp_state.mp_state = KVM_MP_STATE_RUNNABLE;
+	if (kvm_vcpu_set_reg(vcpu, KVM_ARM64_CORE_REG(regs.pc),
+			     vcpu->entry_point)				||
+	    kvm_vcpu_set_reg(vcpu, KVM_ARM64_CORE_REG(regs.regs[0]),
+			     vcpu->context_id)				||
+	    ioctl(vcpu->fd, KVM_SET_MP_STATE, &mp_state)) {
+		fprintf(stderr, "%s: Unable to power on vCPU %d\n",
+			__func__, vcpu->id);
+		return -EIO;
+	}
+
+	return 0;
+}
+
+void kvm_psci_init(struct kvm_vm *vm)
+{
+	if (kvm_vm_register_hypercall(vm, PSCI_0_2_FN64_CPU_ON,
+				      kvm_psci_handle_cpu_on))
+		return;
+
+	vm->psci_user = true;
+}
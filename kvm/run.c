@@ -0,0 +1,366 @@
+/*
+ * Copyright 2022 Gavin Shan <gshan@redhat.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#include <signal.h>
+#include "sandbox.h"
+
+/*
+ * Each vCPU is run by one host thread. The exits are dispatched through
+ * the per-VM table, which is indexed by the exit reason. The handlers are
+ * registered by the subsystems before the vCPUs start running, so the
+ * table is read without lock on the exit path.
+ */
+#define KVM_RUN_KICK_SIGNAL	SIGUSR1
+#define SMCCC_RET_NOT_SUPPORTED	-1
+
+static void kvm_run_kick_handler(int sig)
+{
+	/* Nothing to do, KVM_RUN is interrupted */
+}
+
+static int kvm_exit_system_event(struct kvm_vcpu *vcpu)
+{
+	struct kvm_run *state = vcpu->state;
+
+	switch (state->system_event.type) {
+	case KVM_SYSTEM_EVENT_SHUTDOWN:
+	case KVM_SYSTEM_EVENT_RESET:
+		break;
+	case KVM_SYSTEM_EVENT_CRASH:
+		fprintf(stderr, "%s: vCPU %d crashed\n", __func__, vcpu->id);
+		break;
+	default:
+		fprintf(stderr, "%s: Unknown system event %d on vCPU %d\n",
+			__func__, state->system_event.type, vcpu->id);
+	}
+
+	kvm_vm_stop(vcpu->vm);
+
+	return KVM_EXIT_HANDLER_STOP;
+}
+
+static int kvm_exit_fail_entry(struct kvm_vcpu *vcpu)
+{
+	fprintf(stderr, "%s: vCPU %d fails to enter guest (0x%llx)\n",
+		__func__, vcpu->id,
+		vcpu->state->fail_entry.hardware_entry_failure_reason);
+
+	return -EFAULT;
+}
+
+static int kvm_exit_internal_error(struct kvm_vcpu *vcpu)
+{
+	fprintf(stderr, "%s: Internal error on vCPU %d (%d)\n",
+		__func__, vcpu->id, vcpu->state->internal.suberror);
+
+	return -EFAULT;
+}
+
+static int kvm_exit_unknown(struct kvm_vcpu *vcpu)
+{
+	fprintf(stderr, "%s: Unhandled exit %d on vCPU %d\n",
+		__func__, vcpu->state->exit_reason, vcpu->id);
+
+	return -ENOSYS;
+}
+
+/*
+ * The hypercalls are forwarded to us by the SMCCC filter. The PC has been
+ * advanced by KVM for HVC, but not for SMC. The handler's return value is
+ * passed to the guest through x0.
+ */
+static int kvm_exit_hypercall(struct kvm_vcpu *vcpu)
+{
+	struct kvm_vm *vm = vcpu->vm;
+	struct kvm_run *state = vcpu->state;
+	long ret = SMCCC_RET_NOT_SUPPORTED;
+	unsigned long pc;
+	int i;
+
+	if (state->hypercall.flags & KVM_HYPERCALL_EXIT_SMC) {
+		if (kvm_vcpu_get_reg(vcpu, KVM_ARM64_CORE_REG(regs.pc), &pc) ||
+		    kvm_vcpu_set_reg(vcpu, KVM_ARM64_CORE_REG(regs.pc), pc + 4))
+			return -EIO;
+	}
+
+	for (i = 0; i < vm->nr_hypercalls; i++) {
+		if (vm->hypercalls[i].fn == state->hypercall.nr) {
+			ret = vm->hypercalls[i].handler(vcpu);
+			break;
+		}
+	}
+
+	if (kvm_vcpu_set_reg(vcpu, KVM_ARM64_CORE_REG(regs.regs[0]), ret))
+		return -EIO;
+
+	return 0;
+}
+
+static int kvm_exit_mmio(struct kvm_vcpu *vcpu)
+{
+	struct kvm_vm *vm = vcpu->vm;
+	struct kvm_run *state = vcpu->state;
+	struct kvm_mmio *mmio;
+	unsigned long addr = state->mmio.phys_addr;
+	int i;
+
+	for (i = 0; i < vm->nr_mmio; i++) {
+		mmio = &vm->mmio[i];
+		if (addr >= mmio->addr && addr < mmio->addr + mmio->len)
+			return mmio->handler(vcpu, addr, state->mmio.data,
+					     state->mmio.len,
+					     state->mmio.is_write);
+	}
+
+	fprintf(stderr, "%s: Unhandled MMIO at 0x%lx on vCPU %d\n",
+		__func__, addr, vcpu->id);
+	return -EFAULT;
+}
+
+/**
+ * kvm_vm_register_exit - Register handler for the exit reason
+ * @vm:		VM where the handler is registered
+ * @reason:	exit reason (KVM_EXIT_*)
+ * @handler:	handler, which returns zero to resume the vCPU,
+ *		KVM_EXIT_HANDLER_STOP to stop it, or negative error
+ *		code to stop the VM
+ *
+ * It should be called before the vCPUs start running. It returns zero
+ * on success, or negative error code on failure.
+ */
+int kvm_vm_register_exit(struct kvm_vm *vm,
+			 unsigned int reason,
+			 kvm_exit_handler_t handler)
+{
+	if (reason >= KVM_EXIT_HANDLER_MAX) {
+		fprintf(stderr, "%s: Invalid exit reason %d\n",
+			__func__, reason);
+		return -EINVAL;
+	}
+
+	vm->exit_handlers[reason] = handler;
+
+	return 0;
+}
+
+/**
+ * kvm_vm_register_hypercall - Register handler for the hypercall
+ * @vm:		VM where the handler is registered
+ * @fn:		SMCCC function ID
+ * @handler:	handler, whose return value is passed to the guest
+ *
+ * The hypercall is forwarded to us through the SMCCC filter. It should be
+ * called before the vCPUs start running. It returns zero on success, or
+ * negative error code if the SMCCC filter isn't supported.
+ */
+int kvm_vm_register_hypercall(struct kvm_vm *vm,
+			      unsigned int fn,
+			      kvm_hypercall_handler_t handler)
+{
+	struct kvm_smccc_filter filter;
+	struct kvm_device_attr attr;
+
+	if (vm->nr_hypercalls >= KVM_MAX_HYPERCALLS)
+		return -ENOSPC;
+
+	memset(&filter, 0, sizeof(filter));
+	filter.base = fn;
+	filter.nr_functions = 1;
+	filter.action = KVM_SMCCC_FILTER_FWD_TO_USER;
+
+	attr.flags = 0;
+	attr.group = KVM_ARM_VM_SMCCC_CTRL;
+	attr.attr = KVM_ARM_VM_SMCCC_FILTER;
+	attr.addr = (unsigned long)&filter;
+	if (ioctl(vm->fd, KVM_SET_DEVICE_ATTR, &attr))
+		return -errno;
+
+	vm->hypercalls[vm->nr_hypercalls].fn = fn;
+	vm->hypercalls[vm->nr_hypercalls].handler = handler;
+	vm->nr_hypercalls++;
+
+	return 0;
+}
+
+/**
+ * kvm_vm_register_mmio - Register handler for the MMIO region
+ * @vm:		VM where the handler is registered
+ * @addr:	guest physical address of the region, which isn't covered
+ *		by any memory slot
+ * @len:	length of the region
+ * @handler:	handler, which returns the same values as the exit handler
+ *
+ * It should be called before the vCPUs start running. It returns zero on
+ * success, or negative error code on failure.
+ */
+int kvm_vm_register_mmio(struct kvm_vm *vm,
+			 unsigned long addr,
+			 unsigned long len,
+			 kvm_mmio_handler_t handler)
+{
+	if (vm->nr_mmio >= KVM_MAX_MMIO)
+		return -ENOSPC;
+
+	vm->mmio[vm->nr_mmio].addr = addr;
+	vm->mmio[vm->nr_mmio].len = len;
+	vm->mmio[vm->nr_mmio].handler = handler;
+	vm->nr_mmio++;
+
+	return 0;
+}
+
+void kvm_run_init(struct kvm_vm *vm)
+{
+	int i;
+
+	for (i = 0; i < KVM_EXIT_HANDLER_MAX; i++)
+		vm->exit_handlers[i] = kvm_exit_unknown;
+
+	kvm_vm_register_exit(vm, KVM_EXIT_SYSTEM_EVENT, kvm_exit_system_event);
+	kvm_vm_register_exit(vm, KVM_EXIT_FAIL_ENTRY, kvm_exit_fail_entry);
+	kvm_vm_register_exit(vm, KVM_EXIT_INTERNAL_ERROR,
+			     kvm_exit_internal_error);
+	kvm_vm_register_exit(vm, KVM_EXIT_HYPERCALL, kvm_exit_hypercall);
+	kvm_vm_register_exit(vm, KVM_EXIT_MMIO, kvm_exit_mmio);
+}
+
+static void *kvm_vcpu_thread(void *data)
+{
+	struct kvm_vcpu *vcpu = data;
+	struct kvm_vm *vm = vcpu->vm;
+	unsigned int reason;
+	int ret;
+
+	/*
+	 * The flag is accessed with the lock held. The thread is kicked out
+	 * of KVM_RUN if the VM is stopped after the flag is set. Otherwise,
+	 * the stopping state is seen before KVM_RUN is issued.
+	 */
+	pthread_mutex_lock(&vm->lock);
+	vcpu->running = true;
+	pthread_mutex_unlock(&vm->lock);
+
+	/* The secondary vCPUs are parked until they're powered on */
+	ret = kvm_vcpu_apply_placement(vcpu);
+	if (!ret)
+		ret = kvm_psci_wait_power_on(vcpu);
+
+	while (!ret && !atomic_read(&vm->stopping)) {
+		ret = ioctl(vcpu->fd, KVM_RUN, NULL);
+		if (ret) {
+			if (errno == EINTR || errno == EAGAIN)
+				continue;
+
+			fprintf(stderr, "%s: Unable to run vCPU %d (%d)\n",
+				__func__, vcpu->id, errno);
+			ret = -errno;
+			break;
+		}
+
+		reason = vcpu->state->exit_reason;
+		if (reason < KVM_EXIT_HANDLER_MAX)
+			ret = vm->exit_handlers[reason](vcpu);
+		else
+			ret = kvm_exit_unknown(vcpu);
+
+		if (ret)
+			break;
+	}
+
+	/* The VM is stopped on errors */
+	if (ret < 0) {
+		vcpu->exit_code = ret;
+		kvm_vm_stop(vm);
+	}
+
+	/* The thread isn't kicked once the flag is cleared */
+	pthread_mutex_lock(&vm->lock);
+	vcpu->running = false;
+	pthread_mutex_unlock(&vm->lock);
+
+	return NULL;
+}
+
+/**
+ * kvm_vm_stop - Stop all vCPUs of the VM
+ * @vm:		VM to be stopped
+ *
+ * The vCPUs are kicked out of KVM_RUN. @immediate_exit covers the case
+ * where the signal is delivered before KVM_RUN is issued. The threads
+ * are kicked with the lock held, so that they haven't exited.
+ */
+void kvm_vm_stop(struct kvm_vm *vm)
+{
+	struct kvm_vcpu *vcpu;
+
+	if (atomic_fetch_or(&vm->stopping, 1))
+		return;
+
+	/* Wake up the parked vCPUs */
+	pthread_mutex_lock(&vm->lock);
+	pthread_cond_broadcast(&vm->cond);
+
+	list_for_each_entry(vcpu, &vm->vcpu_list, link) {
+		vcpu->state->immediate_exit = 1;
+		if (vcpu->running)
+			pthread_kill(vcpu->thread, KVM_RUN_KICK_SIGNAL);
+	}
+
+	pthread_mutex_unlock(&vm->lock);
+}
+
+/**
+ * kvm_vm_run - Run the VM
+ * @vm:		VM to be run
+ *
+ * One host thread is created for each vCPU. It returns when all vCPUs
+ * are stopped, with zero on success, or the first vCPU's error code.
+ */
+int kvm_vm_run(struct kvm_vm *vm)
+{
+	struct kvm_vcpu *vcpu;
+	struct sigaction act;
+	unsigned int nr_threads = 0;
+	int ret = 0;
+
+	memset(&act, 0, sizeof(act));
+	act.sa_handler = kvm_run_kick_handler;
+	sigemptyset(&act.sa_mask);
+	sigaction(KVM_RUN_KICK_SIGNAL, &act, NULL);
+
+	ret = kvm_clock_start(vm);
+	if (ret)
+		return ret;
+
+	list_for_each_entry(vcpu, &vm->vcpu_list, link) {
+		ret = pthread_create(&vcpu->thread, NULL,
+				     kvm_vcpu_thread, vcpu);
+		if (ret) {
+			fprintf(stderr, "%s: Unable to create thread for vCPU %d (%d)\n",
+				__func__, vcpu->id, ret);
+			ret = -ret;
+			kvm_vm_stop(vm);
+			break;
+		}
+
+		nr_threads++;
+	}
+
+	/* The threads are created in order */
+	list_for_each_entry(vcpu, &vm->vcpu_list, link) {
+		if (!nr_threads--)
+			break;
+
+		pthread_join(vcpu->thread, NULL);
+		if (!ret && vcpu->exit_code)
+			ret = vcpu->exit_code;
+	}
+
+	return ret;
+}
@@ -0,0 +1,255 @@
+/*
+ * Copyright 2022 Gavin Shan <gshan@redhat.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#include "sandbox.h"
+
+/*
+ * The read-only segments (e.g. text of the shared libraries) are cached
+ * in the host process and shared by all VMs. Each segment is backed by a
+ * sealed memfd and mapped read-only once. It's attached to the VM as a
+ * read-only memory slot. The segments without users are kept in the cache,
+ * in LRU order, and evicted when the total size exceeds the limit.
+ */
+#define KVM_SHARED_DEFAULT_LIMIT	(512UL << 20)
+
+static pthread_mutex_t shared_lock = PTHREAD_MUTEX_INITIALIZER;
+static LIST_HEAD(shared_list);
+static unsigned long shared_size;
+static unsigned long shared_limit = KVM_SHARED_DEFAULT_LIMIT;
+
+static struct kvm_shared_seg *shared_find(const void *key,
+					  unsigned int key_len)
+{
+	struct kvm_shared_seg *seg;
+
+	list_for_each_entry(seg, &shared_list, link) {
+		if (seg->key_len == key_len && !memcmp(seg->key, key, key_len))
+			return seg;
+	}
+
+	return NULL;
+}
+
+/*
+ * Reference the segment on cache hit. It's moved to the tail as the most
+ * recently used one, so that the least recently used segments are always
+ * at the head.
+ */
+static void shared_touch(struct kvm_shared_seg *seg)
+{
+	seg->refcount++;
+	list_del(&seg->link);
+	list_add_tail(&shared_list, &seg->link);
+}
+
+static void shared_free(struct kvm_shared_seg *seg)
+{
+	if (seg->hva && seg->hva != MAP_FAILED)
+		munmap(seg->hva, seg->size);
+	if (seg->fd >= 0)
+		close(seg->fd);
+
+	free(seg);
+}
+
+static struct kvm_shared_seg *shared_create(const void *key,
+					    unsigned int key_len,
+					    unsigned long size,
+					    int (*fill)(void *addr, void *data),
+					    void *data)
+{
+	struct kvm_shared_seg *seg;
+	void *addr;
+	int ret;
+
+	seg = malloc(sizeof(*seg));
+	if (!seg) {
+		fprintf(stderr, "%s: Unable to alloc segment\n", __func__);
+		return NULL;
+	}
+
+	memset(seg, 0, sizeof(*seg));
+	memcpy(seg->key, key, key_len);
+	seg->key_len = key_len;
+	seg->size = size;
+	seg->refcount = 1;
+	INIT_LIST_HEAD(&seg->link);
+	seg->fd = memfd_create("sandbox-shared", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	if (seg->fd < 0 || ftruncate(seg->fd, size)) {
+		fprintf(stderr, "%s: Unable to create memfd (0x%lx)\n",
+			__func__, size);
+		goto error;
+	}
+
+	/* Fill the segment through the temporary writable mapping */
+	addr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, seg->fd, 0);
+	if (addr == MAP_FAILED) {
+		fprintf(stderr, "%s: Unable to map memfd (0x%lx)\n",
+			__func__, size);
+		goto error;
+	}
+
+	ret = fill(addr, data);
+	munmap(addr, size);
+	if (ret)
+		goto error;
+
+	/* The segment is immutable from now on */
+	ret = fcntl(seg->fd, F_ADD_SEALS,
+		    F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL);
+	if (ret) {
+		fprintf(stderr, "%s: Unable to seal memfd (%d)\n",
+			__func__, errno);
+		goto error;
+	}
+
+	seg->hva = mmap(NULL, size, PROT_READ, MAP_SHARED, seg->fd, 0);
+	if (seg->hva == MAP_FAILED) {
+		fprintf(stderr, "%s: Unable to map segment (0x%lx)\n",
+			__func__, size);
+		goto error;
+	}
+
+	return seg;
+error:
+	shared_free(seg);
+	return NULL;
+}
+
+/**
+ * kvm_shared_get - Get the shared read-only segment
+ * @key:	key to identify the segment
+ * @key_len:	length of the key
+ * @size:	size of the segment, aligned to page size
+ * @fill:	callback to fill the segment on cache miss
+ * @data:	private data passed to @fill
+ *
+ * The segment is looked up from the cache. It's created and filled by
+ * @fill if it doesn't exist. @fill is called without the lock held, so
+ * that the segments can be filled concurrently. The referenced segment
+ * is returned on success. Otherwise, NULL is returned.
+ */
+struct kvm_shared_seg *kvm_shared_get(const void *key,
+				      unsigned int key_len,
+				      unsigned long size,
+				      int (*fill)(void *addr, void *data),
+				      void *data)
+{
+	struct kvm_shared_seg *seg, *new;
+
+	if (key_len > sizeof(seg->key))
+		return NULL;
+
+	pthread_mutex_lock(&shared_lock);
+	seg = shared_find(key, key_len);
+	if (seg) {
+		shared_touch(seg);
+		pthread_mutex_unlock(&shared_lock);
+		return seg;
+	}
+	pthread_mutex_unlock(&shared_lock);
+
+	new = shared_create(key, key_len, size, fill, data);
+	if (!new)
+		return NULL;
+
+	/* The segment may have been created by others in parallel */
+	pthread_mutex_lock(&shared_lock);
+	seg = shared_find(key, key_len);
+	if (seg) {
+		shared_touch(seg);
+	} else {
+		seg = new;
+		new = NULL;
+		list_add_tail(&shared_list, &seg->link);
+		shared_size += seg->size;
+	}
+	pthread_mutex_unlock(&shared_lock);
+
+	if (new)
+		shared_free(new);
+
+	return seg;
+}
+
+static void shared_shrink(unsigned long target)
+{
+	struct kvm_shared_seg *seg, *tmp;
+
+	/* The least recently used segments are at the head */
+	list_for_each_entry_safe(seg, tmp, &shared_list, link) {
+		if (shared_size <= target)
+			break;
+
+		if (seg->refcount)
+			continue;
+
+		list_del(&seg->link);
+		shared_size -= seg->size;
+		shared_free(seg);
+	}
+}
+
+void kvm_shared_put(struct kvm_shared_seg *seg)
+{
+	pthread_mutex_lock(&shared_lock);
+
+	if (--seg->refcount) {
+		pthread_mutex_unlock(&shared_lock);
+		return;
+	}
+
+	/* Move to the tail as the most recently used one */
+	list_del(&seg->link);
+	list_add_tail(&shared_list, &seg->link);
+	shared_shrink(shared_limit);
+
+	pthread_mutex_unlock(&shared_lock);
+}
+
+/**
+ * kvm_shared_set_limit - Set the limit of the shared segment cache
+ * @limit:	maximal total size of the cached segments
+ *
+ * The unused segments are evicted until the total size drops to @limit.
+ * The segments in use aren't evicted, so the limit can be exceeded. Zero
+ * disables caching the unused segments.
+ */
+void kvm_shared_set_limit(unsigned long limit)
+{
+	pthread_mutex_lock(&shared_lock);
+	shared_limit = limit;
+	shared_shrink(shared_limit);
+	pthread_mutex_unlock(&shared_lock);
+}
+
+/**
+ * kvm_shared_attach - Attach the shared segment to VM
+ * @vm:		VM where the segment is attached
+ * @seg:	referenced shared segment
+ *
+ * The segment is attached as a read-only memory slot. The reference is
+ * transferred to the memory slot and dropped when the memory slot is
+ * removed. It's called with the VM's lock held. The memory slot is
+ * returned on success. Otherwise, NULL is returned and the reference is
+ * kept by the caller.
+ */
+struct kvm_mem_slot *kvm_shared_attach(struct kvm_vm *vm,
+				       struct kvm_shared_seg *seg)
+{
+	struct kvm_mem_slot *slot;
+
+	slot = kvm_mm_add_slot(vm, seg->hva, seg->size, KVM_MEM_READONLY);
+	if (!slot)
+		return NULL;
+
+	slot->shared = seg;
+
+	return slot;
+}
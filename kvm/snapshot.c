@@ -0,0 +1,896 @@
+/*
+ * Copyright 2022 Gavin Shan <gshan@redhat.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#include "sandbox.h"
+
+/*
+ * The snapshot captures the VM which is ready to run: the guest RAM, the
+ * virtual memory areas, the physical page bitmap, the shared segments
+ * and the vCPU registers. The file is laid out as below. The sections of
+ * the guest RAM and the shared segments are aligned to page size, so
+ * that the guest RAM is mapped privately on restore. The free and zero
+ * pages of the guest RAM are holes in the file.
+ *
+ *   header | bitmap | areas | shared segments | vCPUs | RAM | segments
+ *
+ * The VM is restored on top of a newly created one, whose page table,
+ * time page and futex waiter page are allocated at the same addresses
+ * as the snapshot's.
+ */
+#define KVM_SNAPSHOT_MAGIC	0x50414e53	/* "SNAP" */
+#define KVM_SNAPSHOT_VERSION	1
+
+struct kvm_snapshot_hdr {
+	uint32_t	magic;		/* KVM_SNAPSHOT_MAGIC		*/
+	uint32_t	version;	/* KVM_SNAPSHOT_VERSION		*/
+	uint64_t	page_size;	/* Page size			*/
+	uint64_t	phys_page_num;	/* Number of physical pages	*/
+	uint64_t	pgtable;	/* Page table			*/
+	uint64_t	brk_start;	/* Start of program break	*/
+	uint64_t	brk;		/* Program break		*/
+	uint32_t	nr_areas;	/* Number of areas		*/
+	uint32_t	nr_shared;	/* Number of shared segments	*/
+	uint32_t	nr_vcpus;	/* Number of vCPUs		*/
+	uint32_t	reserved;
+	uint64_t	meta_size;	/* Size of the sections before RAM */
+	uint64_t	ram_offset;	/* Offset of the guest RAM	*/
+};
+
+struct kvm_snapshot_area {
+	uint64_t	start;		/* Start address		*/
+	uint64_t	end;		/* End address			*/
+	uint64_t	flags;		/* MM_VMA_FLAG_*		*/
+	uint64_t	prot;		/* Protection			*/
+};
+
+struct kvm_snapshot_shared {
+	uint8_t		key[96];	/* Key of the shared segment	*/
+	uint32_t	key_len;	/* Length of the key		*/
+	uint32_t	reserved;
+	uint64_t	gpa;		/* Guest physical address	*/
+	uint64_t	size;		/* Size				*/
+	uint64_t	offset;		/* Offset of the content	*/
+};
+
+/*
+ * The vCPU is followed by its registers. Each of them is the register ID
+ * and the value, which is padded to 8 bytes.
+ */
+struct kvm_snapshot_vcpu {
+	uint32_t	id;		/* vCPU ID			*/
+	uint32_t	power_off;	/* Started in OFF state		*/
+	uint64_t	entry_point;	/* PC for execution		*/
+	uint64_t	stack_base;	/* Stack base address		*/
+	uint64_t	nr_regs;	/* Number of registers		*/
+	uint64_t	regs_size;	/* Size of the registers	*/
+};
+
+struct kvm_snapshot_buf {
+	void		*data;
+	unsigned long	len;
+	unsigned long	size;
+};
+
+static void *snapshot_buf_add(struct kvm_snapshot_buf *buf, unsigned long len)
+{
+	unsigned long size;
+	void *data;
+
+	if (buf->len + len > buf->size) {
+		size = max(buf->size * 2, ALIGN(buf->len + len, 0x1000UL));
+		data = realloc(buf->data, size);
+		if (!data)
+			return NULL;
+
+		buf->data = data;
+		buf->size = size;
+	}
+
+	data = buf->data + buf->len;
+	memset(data, 0, len);
+	buf->len += len;
+
+	return data;
+}
+
+static int snapshot_write(int fd, const void *buf, unsigned long len,
+			  unsigned long offset)
+{
+	ssize_t ret;
+
+	while (len) {
+		ret = pwrite(fd, buf, len, offset);
+		if (ret <= 0)
+			return ret ? -errno : -EIO;
+
+		buf += ret;
+		len -= ret;
+		offset += ret;
+	}
+
+	return 0;
+}
+
+static int snapshot_read(int fd, void *buf, unsigned long len,
+			 unsigned long offset)
+{
+	ssize_t ret;
+
+	while (len) {
+		ret = pread(fd, buf, len, offset);
+		if (ret <= 0)
+			return ret ? -errno : -EIO;
+
+		buf += ret;
+		len -= ret;
+		offset += ret;
+	}
+
+	return 0;
+}
+
+static bool snapshot_page_zero(const void *addr, unsigned long size)
+{
+	const uint64_t *p = addr;
+	unsigned long i;
+
+	for (i = 0; i < size / sizeof(*p); i++) {
+		if (p[i])
+			return false;
+	}
+
+	return true;
+}
+
+/*
+ * The VM can be captured before it runs. The guest memory should be in
+ * the guest RAM or the shared segments, which can be recreated from the
+ * snapshot. It's called with the lock held.
+ */
+static int snapshot_check(struct kvm_vm *vm)
+{
+	struct kvm_vm_mm *mm = &vm->mm;
+	struct kvm_vcpu *vcpu;
+	struct vm_area *vma;
+	int i;
+
+	list_for_each_entry(vcpu, &vm->vcpu_list, link) {
+		if (vcpu->running) {
+			fprintf(stderr, "%s: vCPU %d is running\n",
+				__func__, vcpu->id);
+			return -EBUSY;
+		}
+	}
+
+	if (vm->fault) {
+		fprintf(stderr, "%s: Lazy population isn't supported\n",
+			__func__);
+		return -EOPNOTSUPP;
+	}
+
+	for (i = 1; i < KVM_MAX_SLOTS; i++) {
+		if (mm->slots[i].size && !mm->slots[i].shared) {
+			fprintf(stderr, "%s: Memory slot %d isn't supported\n",
+				__func__, mm->slots[i].id);
+			return -EOPNOTSUPP;
+		}
+	}
+
+	for (vma = mm->mm->vma; vma; vma = vma->next) {
+		if (vma->hva || vma->fd >= 0 ||
+		    (vma->flags & (MM_VMA_FLAG_SLOT | MM_VMA_FLAG_ANON))) {
+			fprintf(stderr, "%s: Area at 0x%lx isn't supported\n",
+				__func__, vma->start);
+			return -EOPNOTSUPP;
+		}
+	}
+
+	return 0;
+}
+
+static int snapshot_shared_cmp(const void *a, const void *b)
+{
+	const struct kvm_snapshot_shared *s1 = a, *s2 = b;
+
+	return (s1->gpa > s2->gpa) - (s1->gpa < s2->gpa);
+}
+
+/* Save the memory management state. It's called with the lock held */
+static int snapshot_save_mm(struct kvm_vm *vm, struct kvm_snapshot_hdr *hdr,
+			    struct kvm_snapshot_buf *buf)
+{
+	struct kvm_vm_mm *mm = &vm->mm;
+	struct kvm_snapshot_area *area;
+	struct kvm_snapshot_shared *shared;
+	struct kvm_mem_slot *slot;
+	struct vm_area *vma;
+	unsigned long len;
+	void *bits;
+	int i;
+
+	len = BITS_TO_LONGS(mm->phys_page_num) * sizeof(unsigned long);
+	bits = snapshot_buf_add(buf, len);
+	if (!bits)
+		return -ENOMEM;
+
+	memcpy(bits, mm->phys_page_bits, len);
+
+	for (vma = mm->mm->vma; vma; vma = vma->next) {
+		area = snapshot_buf_add(buf, sizeof(*area));
+		if (!area)
+			return -ENOMEM;
+
+		area->start = vma->start;
+		area->end = vma->end;
+		area->flags = vma->flags;
+		area->prot = vma->prot;
+		hdr->nr_areas++;
+	}
+
+	/* The shared segments are attached in ascending order on restore */
+	for (i = 1; i < KVM_MAX_SLOTS; i++) {
+		slot = &mm->slots[i];
+		if (!slot->size)
+			continue;
+
+		shared = snapshot_buf_add(buf, sizeof(*shared));
+		if (!shared)
+			return -ENOMEM;
+
+		memcpy(shared->key, slot->shared->key, slot->shared->key_len);
+		shared->key_len = slot->shared->key_len;
+		shared->gpa = slot->gpa;
+		shared->size = slot->size;
+		hdr->nr_shared++;
+	}
+
+	qsort(buf->data + buf->len - hdr->nr_shared * sizeof(*shared),
+	      hdr->nr_shared, sizeof(*shared), snapshot_shared_cmp);
+
+	hdr->page_size = mm->page_size;
+	hdr->phys_page_num = mm->phys_page_num;
+	hdr->pgtable = mm->pgtable;
+	hdr->brk_start = mm->brk_start;
+	hdr->brk = mm->brk;
+
+	return 0;
+}
+
+/* Save all registers, which are figured out by KVM_GET_REG_LIST */
+static int snapshot_save_vcpu(struct kvm_vcpu *vcpu,
+			      struct kvm_snapshot_buf *buf)
+{
+	struct kvm_reg_list head = { .n = 0 }, *list;
+	struct kvm_snapshot_vcpu *sv;
+	struct kvm_one_reg reg;
+	unsigned long offset = buf->len, i;
+	uint64_t *p;
+	int ret;
+
+	/* The number of registers is returned with E2BIG */
+	ret = ioctl(vcpu->fd, KVM_GET_REG_LIST, &head);
+	if (ret && errno != E2BIG) {
+		fprintf(stderr, "%s: Unable to get register list (%d)\n",
+			__func__, errno);
+		return -errno;
+	}
+
+	list = malloc(sizeof(*list) + head.n * sizeof(list->reg[0]));
+	if (!list) {
+		fprintf(stderr, "%s: Unable to alloc register list\n",
+			__func__);
+		return -ENOMEM;
+	}
+
+	list->n = head.n;
+	ret = ioctl(vcpu->fd, KVM_GET_REG_LIST, list);
+	if (ret) {
+		fprintf(stderr, "%s: Unable to get register list (%d)\n",
+			__func__, errno);
+		ret = -errno;
+		goto out;
+	}
+
+	sv = snapshot_buf_add(buf, sizeof(*sv));
+	if (!sv) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	sv->id = vcpu->id;
+	sv->power_off = vcpu->power_off;
+	sv->entry_point = vcpu->entry_point;
+	sv->stack_base = vcpu->stack_base;
+	sv->nr_regs = list->n;
+
+	for (i = 0; i < list->n; i++) {
+		p = snapshot_buf_add(buf, sizeof(*p) +
+				     ALIGN(KVM_REG_SIZE(list->reg[i]), 8));
+		if (!p) {
+			ret = -ENOMEM;
+			goto out;
+		}
+
+		p[0] = list->reg[i];
+		reg.id = list->reg[i];
+		reg.addr = (unsigned long)&p[1];
+		ret = ioctl(vcpu->fd, KVM_GET_ONE_REG, &reg);
+		if (ret) {
+			fprintf(stderr, "%s: Unable to get register 0x%llx (%d)\n",
+				__func__, reg.id, errno);
+			ret = -errno;
+			goto out;
+		}
+	}
+
+	sv = buf->data + offset;
+	sv->regs_size = buf->len - offset - sizeof(*sv);
+out:
+	free(list);
+	return ret;
+}
+
+/* Write the allocated pages of the guest RAM, except the zero pages */
+static int snapshot_save_ram(struct kvm_vm *vm, int fd, unsigned long offset)
+{
+	struct kvm_vm_mm *mm = &vm->mm;
+	unsigned long start, end, i, j;
+	void *hva;
+	int ret;
+
+	for (start = bitmap_first_set_bit(mm->phys_page_bits,
+					  mm->phys_page_num);
+	     start < mm->phys_page_num;
+	     start = bitmap_next_set_bit(mm->phys_page_bits, end + 1,
+					 mm->phys_page_num)) {
+		end = bitmap_next_zero_bit(mm->phys_page_bits, start + 1,
+					   mm->phys_page_num);
+		end = min(end, mm->phys_page_num);
+
+		for (i = start; i < end; i = j) {
+			hva = mm->host_virt_addr + i * mm->page_size;
+			if (snapshot_page_zero(hva, mm->page_size)) {
+				j = i + 1;
+				continue;
+			}
+
+			for (j = i + 1; j < end; j++) {
+				if (snapshot_page_zero(mm->host_virt_addr +
+						j * mm->page_size,
+						mm->page_size))
+					break;
+			}
+
+			ret = snapshot_write(fd, hva, (j - i) * mm->page_size,
+					     offset + i * mm->page_size);
+			if (ret)
+				return ret;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Write the snapshot to the file, which is empty. The guest RAM and the
+ * shared segments are written from the page aligned offsets.
+ */
+static int snapshot_save(struct kvm_vm *vm, int fd)
+{
+	struct kvm_vm_mm *mm = &vm->mm;
+	struct kvm_snapshot_hdr hdr = { 0 };
+	struct kvm_snapshot_buf buf = { 0 };
+	struct kvm_snapshot_shared *shared;
+	struct kvm_mem_slot *slot;
+	struct kvm_vcpu *vcpu;
+	unsigned long offset, ram_size = mm->phys_page_num * mm->page_size;
+	int i, j, ret;
+
+	/* The program break is figured out from the loaded images */
+	kvm_mm_brk(vm, 0);
+
+	pthread_mutex_lock(&vm->lock);
+	ret = snapshot_check(vm);
+	if (!ret)
+		ret = snapshot_save_mm(vm, &hdr, &buf);
+	pthread_mutex_unlock(&vm->lock);
+	if (ret)
+		goto out;
+
+	list_for_each_entry(vcpu, &vm->vcpu_list, link) {
+		ret = snapshot_save_vcpu(vcpu, &buf);
+		if (ret)
+			goto out;
+
+		hdr.nr_vcpus++;
+	}
+
+	hdr.magic = KVM_SNAPSHOT_MAGIC;
+	hdr.version = KVM_SNAPSHOT_VERSION;
+	hdr.meta_size = buf.len;
+	hdr.ram_offset = ALIGN(sizeof(hdr) + buf.len, mm->page_size);
+
+	/* The shared segments are placed after the guest RAM */
+	shared = buf.data + BITS_TO_LONGS(mm->phys_page_num) *
+		 sizeof(unsigned long) +
+		 hdr.nr_areas * sizeof(struct kvm_snapshot_area);
+	offset = hdr.ram_offset + ram_size;
+	for (i = 0; i < hdr.nr_shared; i++) {
+		shared[i].offset = offset;
+		offset += ALIGN(shared[i].size, mm->page_size);
+	}
+
+	ret = snapshot_write(fd, &hdr, sizeof(hdr), 0);
+	if (!ret)
+		ret = snapshot_write(fd, buf.data, buf.len, sizeof(hdr));
+	if (!ret)
+		ret = snapshot_save_ram(vm, fd, hdr.ram_offset);
+	for (i = 1; !ret && i < KVM_MAX_SLOTS; i++) {
+		slot = &mm->slots[i];
+		for (j = 0; slot->size && j < hdr.nr_shared; j++) {
+			if (shared[j].gpa == slot->gpa)
+				ret = snapshot_write(fd, slot->hva, slot->size,
+						     shared[j].offset);
+		}
+	}
+	if (!ret && ftruncate(fd, offset))
+		ret = -errno;
+out:
+	free(buf.data);
+	return ret;
+}
+
+/**
+ * kvm_vm_snapshot - Capture the VM to file
+ * @vm:		VM to be captured, which hasn't run yet
+ * @path:	path of the snapshot file
+ *
+ * It returns zero on success, or negative error code on failure.
+ */
+int kvm_vm_snapshot(struct kvm_vm *vm, const char *path)
+{
+	int fd, ret;
+
+	fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+	if (fd < 0) {
+		fprintf(stderr, "%s: Unable to open <%s>\n", __func__, path);
+		return -errno;
+	}
+
+	ret = snapshot_save(vm, fd);
+	if (ret) {
+		fprintf(stderr, "%s: Unable to write <%s> (%d)\n",
+			__func__, path, ret);
+		unlink(path);
+	}
+
+	close(fd);
+	return ret;
+}
+
+/*
+ * The allocated guest RAM pages are mapped privately from the snapshot,
+ * and they are read in on the first access. The areas are recreated.
+ * It's called with the lock held.
+ */
+static int snapshot_restore_mm(struct kvm_vm *vm, int fd,
+			       struct kvm_snapshot_hdr *hdr,
+			       unsigned long *bits,
+			       struct kvm_snapshot_area *areas)
+{
+	struct kvm_vm_mm *mm = &vm->mm;
+	unsigned long start, end;
+	struct mm *new;
+	struct vm_area *vma;
+	int i, ret;
+
+	/* The pages allocated on creation should be in the snapshot */
+	for (i = 0; i < BITS_TO_LONGS(mm->phys_page_num); i++) {
+		if (mm->phys_page_bits[i] & ~bits[i]) {
+			fprintf(stderr, "%s: Incompatible page bitmap\n",
+				__func__);
+			return -EINVAL;
+		}
+	}
+
+	new = mm_create(0, 1UL << mm->va_bits);
+	if (!new) {
+		fprintf(stderr, "%s: Unable to create memory management struct\n",
+			__func__);
+		return -ENOMEM;
+	}
+
+	for (i = 0; i < hdr->nr_areas; i++) {
+		vma = mm_vma_alloc(new, areas[i].start,
+				   areas[i].end - areas[i].start,
+				   areas[i].flags | MM_VMA_FLAG_FIXED,
+				   areas[i].prot);
+		if (!vma) {
+			fprintf(stderr, "%s: Unable to alloc area at 0x%lx\n",
+				__func__, (unsigned long)areas[i].start);
+			mm_destroy(new);
+			return -ENOMEM;
+		}
+
+		vma->flags = areas[i].flags;
+	}
+
+	/*
+	 * Only the allocated pages are mapped from the snapshot. They're
+	 * backed by the anonymous memory again when they're freed, so that
+	 * MADV_DONTNEED on them doesn't bring back the snapshot content.
+	 * The free pages stay in the anonymous memory.
+	 */
+	for (start = bitmap_first_set_bit(bits, mm->phys_page_num);
+	     start < mm->phys_page_num;
+	     start = bitmap_next_set_bit(bits, end + 1, mm->phys_page_num)) {
+		end = bitmap_next_zero_bit(bits, start + 1, mm->phys_page_num);
+		end = min(end, mm->phys_page_num);
+		ret = kvm_mm_map_ram_file(vm,
+			(mm->phys_page_base + start) << mm->page_shift,
+			(end - start) << mm->page_shift,
+			fd, hdr->ram_offset + (start << mm->page_shift));
+		if (ret) {
+			fprintf(stderr, "%s: Unable to map page 0x%lx\n",
+				__func__, start);
+			mm_destroy(new);
+			return ret;
+		}
+	}
+
+	bitmap_copy(mm->phys_page_bits, bits, mm->phys_page_num);
+	mm_destroy(mm->mm);
+	mm->mm = new;
+	mm->brk_start = hdr->brk_start;
+	mm->brk = hdr->brk;
+
+	/* The page table has been replaced */
+	atomic_fetch_inc(&mm->tlb_gen);
+
+	return 0;
+}
+
+struct kvm_snapshot_fill {
+	int		fd;
+	unsigned long	offset;
+	unsigned long	size;
+};
+
+static int snapshot_fill_shared(void *addr, void *data)
+{
+	struct kvm_snapshot_fill *fill = data;
+
+	return snapshot_read(fill->fd, addr, fill->size, fill->offset);
+}
+
+/*
+ * The shared segments are taken from the cache, or filled from the
+ * snapshot on cache miss. They should be attached at the same guest
+ * physical addresses. It's called with the lock held.
+ */
+static int snapshot_restore_shared(struct kvm_vm *vm, int fd,
+				   struct kvm_snapshot_shared *shared,
+				   unsigned int nr)
+{
+	struct kvm_snapshot_fill fill;
+	struct kvm_shared_seg *seg;
+	struct kvm_mem_slot *slot;
+	int i;
+
+	for (i = 0; i < nr; i++) {
+		fill.fd = fd;
+		fill.offset = shared[i].offset;
+		fill.size = shared[i].size;
+		seg = kvm_shared_get(shared[i].key, shared[i].key_len,
+				     shared[i].size, snapshot_fill_shared, &fill);
+		if (!seg) {
+			fprintf(stderr, "%s: Unable to get shared segment\n",
+				__func__);
+			return -ENOMEM;
+		}
+
+		slot = kvm_shared_attach(vm, seg);
+		if (!slot) {
+			kvm_shared_put(seg);
+			return -ENOMEM;
+		}
+
+		if (slot->gpa != shared[i].gpa) {
+			fprintf(stderr, "%s: Shared segment at 0x%lx moved to 0x%lx\n",
+				__func__, (unsigned long)shared[i].gpa,
+				slot->gpa);
+			return -EINVAL;
+		}
+	}
+
+	return 0;
+}
+
+static int snapshot_restore_vcpu(struct kvm_vm *vm,
+				 struct kvm_snapshot_vcpu *sv)
+{
+	struct kvm_vcpu *vcpu;
+	struct kvm_one_reg reg;
+	uint64_t *p = (uint64_t *)(sv + 1);
+	uint64_t *end = (void *)p + sv->regs_size;
+	unsigned long i;
+
+	vcpu = kvm_vcpu_restore(vm, sv->id, sv->entry_point,
+				sv->stack_base, sv->power_off);
+	if (!vcpu)
+		return -ENOMEM;
+
+	for (i = 0; i < sv->nr_regs; i++) {
+		if (p >= end ||
+		    p + 1 + ALIGN(KVM_REG_SIZE(p[0]), 8) / 8 > end) {
+			fprintf(stderr, "%s: Truncated registers of vCPU %d\n",
+				__func__, vcpu->id);
+			return -EINVAL;
+		}
+
+		/*
+		 * Some of the registers (e.g. the invariant ID registers)
+		 * can't be written. The core registers must be restored.
+		 */
+		reg.id = p[0];
+		reg.addr = (unsigned long)&p[1];
+		if (ioctl(vcpu->fd, KVM_SET_ONE_REG, &reg) &&
+		    (reg.id & KVM_REG_ARM_COPROC_MASK) == KVM_REG_ARM_CORE) {
+			fprintf(stderr, "%s: Unable to set register 0x%llx (%d)\n",
+				__func__, reg.id, errno);
+			return -errno;
+		}
+
+		p += 1 + ALIGN(KVM_REG_SIZE(reg.id), 8) / 8;
+	}
+
+	return 0;
+}
+
+/*
+ * Create the VM and restore it from the snapshot, whose header and the
+ * sections before the guest RAM have been read to @meta.
+ */
+static struct kvm_vm *snapshot_restore(int fd, struct kvm_snapshot_hdr *hdr,
+				       void *meta)
+{
+	struct kvm_vm *vm;
+	struct kvm_vm_mm *mm;
+	struct kvm_snapshot_area *areas;
+	struct kvm_snapshot_shared *shared;
+	struct kvm_snapshot_vcpu *sv;
+	unsigned long *bits, len;
+	void *p, *end;
+	int i, ret;
+
+	vm = kvm_vm_create();
+	if (!vm)
+		return NULL;
+
+	mm = &vm->mm;
+	if (hdr->page_size != mm->page_size ||
+	    hdr->phys_page_num != mm->phys_page_num ||
+	    hdr->pgtable != mm->pgtable) {
+		fprintf(stderr, "%s: Incompatible snapshot\n", __func__);
+		goto error;
+	}
+
+	len = BITS_TO_LONGS(mm->phys_page_num) * sizeof(unsigned long) +
+	      hdr->nr_areas * sizeof(*areas) + hdr->nr_shared * sizeof(*shared);
+	if (len > hdr->meta_size) {
+		fprintf(stderr, "%s: Truncated snapshot\n", __func__);
+		goto error;
+	}
+
+	bits = meta;
+	areas = meta + BITS_TO_LONGS(mm->phys_page_num) * sizeof(unsigned long);
+	shared = (void *)(areas + hdr->nr_areas);
+
+	pthread_mutex_lock(&vm->lock);
+	ret = snapshot_restore_mm(vm, fd, hdr, bits, areas);
+	if (!ret)
+		ret = snapshot_restore_shared(vm, fd, shared, hdr->nr_shared);
+	pthread_mutex_unlock(&vm->lock);
+	if (ret)
+		goto error;
+
+	for (i = 0, p = shared + hdr->nr_shared, end = meta + hdr->meta_size;
+	     i < hdr->nr_vcpus; i++, p += sizeof(*sv) + sv->regs_size) {
+		sv = p;
+		if (p + sizeof(*sv) > end ||
+		    p + sizeof(*sv) + sv->regs_size > end) {
+			fprintf(stderr, "%s: Truncated snapshot\n", __func__);
+			goto error;
+		}
+
+		ret = snapshot_restore_vcpu(vm, sv);
+		if (ret)
+			goto error;
+	}
+
+	return vm;
+
+error:
+	kvm_vm_destroy(vm);
+	return NULL;
+}
+
+/**
+ * kvm_vm_restore - Restore the VM from snapshot
+ * @path:	path of the snapshot file
+ *
+ * The VM is created and its guest RAM is mapped privately from the
+ * snapshot, so the pages aren't read until they're accessed. The VM
+ * is returned on success. Otherwise, NULL is returned.
+ */
+struct kvm_vm *kvm_vm_restore(const char *path)
+{
+	struct kvm_vm *vm = NULL;
+	struct kvm_snapshot_hdr hdr;
+	void *meta = NULL;
+	int fd, ret;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		fprintf(stderr, "%s: Unable to open <%s>\n", __func__, path);
+		return NULL;
+	}
+
+	ret = snapshot_read(fd, &hdr, sizeof(hdr), 0);
+	if (ret || hdr.magic != KVM_SNAPSHOT_MAGIC ||
+	    hdr.version != KVM_SNAPSHOT_VERSION) {
+		fprintf(stderr, "%s: Invalid snapshot <%s>\n", __func__, path);
+		goto out;
+	}
+
+	meta = malloc(hdr.meta_size);
+	if (!meta || snapshot_read(fd, meta, hdr.meta_size, sizeof(hdr))) {
+		fprintf(stderr, "%s: Unable to read snapshot <%s>\n",
+			__func__, path);
+		goto out;
+	}
+
+	vm = snapshot_restore(fd, &hdr, meta);
+out:
+	free(meta);
+	close(fd);
+	return vm;
+}
+
+/*
+ * The zygote is the snapshot of the template VM, which is kept in a
+ * sealed memfd. The clones map the guest RAM privately from the memfd,
+ * so that the pages are shared by all of them until they're written.
+ * The shared segments are referenced by the zygote, so that they stay
+ * in the cache and are attached to the clones without being filled.
+ */
+struct kvm_zygote {
+	int			fd;
+	struct kvm_snapshot_hdr	hdr;
+	void			*meta;
+	struct kvm_shared_seg	**segs;
+};
+
+/**
+ * kvm_zygote_create - Create zygote from the template VM
+ * @vm:		template VM, which has been loaded but hasn't run yet
+ *
+ * The template VM isn't needed by the zygote and can be destroyed once
+ * the zygote is created. The zygote is returned on success. Otherwise,
+ * NULL is returned.
+ */
+struct kvm_zygote *kvm_zygote_create(struct kvm_vm *vm)
+{
+	struct kvm_vm_mm *mm = &vm->mm;
+	struct kvm_zygote *zygote;
+	struct kvm_snapshot_hdr *hdr;
+	struct kvm_snapshot_shared *shared;
+	struct kvm_snapshot_fill fill;
+	int i, ret;
+
+	zygote = calloc(1, sizeof(*zygote));
+	if (!zygote) {
+		fprintf(stderr, "%s: Unable to alloc zygote\n", __func__);
+		return NULL;
+	}
+
+	hdr = &zygote->hdr;
+	zygote->fd = memfd_create("sandbox-zygote",
+				  MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	if (zygote->fd < 0) {
+		fprintf(stderr, "%s: Unable to create memfd\n", __func__);
+		goto error;
+	}
+
+	ret = snapshot_save(vm, zygote->fd);
+	if (ret) {
+		fprintf(stderr, "%s: Unable to capture VM (%d)\n",
+			__func__, ret);
+		goto error;
+	}
+
+	ret = fcntl(zygote->fd, F_ADD_SEALS,
+		    F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL);
+	if (ret) {
+		fprintf(stderr, "%s: Unable to seal memfd (%d)\n",
+			__func__, errno);
+		goto error;
+	}
+
+	ret = snapshot_read(zygote->fd, hdr, sizeof(*hdr), 0);
+	if (!ret) {
+		zygote->meta = malloc(hdr->meta_size);
+		ret = zygote->meta ? snapshot_read(zygote->fd, zygote->meta,
+					hdr->meta_size, sizeof(*hdr)) : -ENOMEM;
+	}
+	if (ret) {
+		fprintf(stderr, "%s: Unable to read snapshot (%d)\n",
+			__func__, ret);
+		goto error;
+	}
+
+	zygote->segs = calloc(hdr->nr_shared + 1, sizeof(*zygote->segs));
+	if (!zygote->segs) {
+		fprintf(stderr, "%s: Unable to alloc shared segments\n",
+			__func__);
+		goto error;
+	}
+
+	shared = zygote->meta +
+		 BITS_TO_LONGS(mm->phys_page_num) * sizeof(unsigned long) +
+		 hdr->nr_areas * sizeof(struct kvm_snapshot_area);
+	for (i = 0; i < hdr->nr_shared; i++) {
+		fill.fd = zygote->fd;
+		fill.offset = shared[i].offset;
+		fill.size = shared[i].size;
+		zygote->segs[i] = kvm_shared_get(shared[i].key,
+						 shared[i].key_len,
+						 shared[i].size,
+						 snapshot_fill_shared, &fill);
+		if (!zygote->segs[i]) {
+			fprintf(stderr, "%s: Unable to get shared segment\n",
+				__func__);
+			goto error;
+		}
+	}
+
+	return zygote;
+
+error:
+	kvm_zygote_destroy(zygote);
+	return NULL;
+}
+
+/**
+ * kvm_zygote_clone - Clone VM from the zygote
+ * @zygote:	zygote where the VM is cloned from
+ *
+ * The zygote isn't changed by the cloning, so the VMs can be cloned from
+ * it concurrently. The VM, which is ready to run, is returned on success.
+ * Otherwise, NULL is returned.
+ */
+struct kvm_vm *kvm_zygote_clone(struct kvm_zygote *zygote)
+{
+	return snapshot_restore(zygote->fd, &zygote->hdr, zygote->meta);
+}
+
+void kvm_zygote_destroy(struct kvm_zygote *zygote)
+{
+	int i;
+
+	for (i = 0; zygote->segs && zygote->segs[i]; i++)
+		kvm_shared_put(zygote->segs[i]);
+
+	if (zygote->fd >= 0)
+		close(zygote->fd);
+
+	free(zygote->segs);
+	free(zygote->meta);
+	free(zygote);
+}
@@ -9,90 +9,60 @@
 
 #include "sandbox.h"
 
-int kvm_vcpu_create(struct kvm_vm *vm, unsigned long entry_point)
+/*
+ * The initial register values are same for all vCPUs, except the stack
+ * and the ID. They're figured out once when the first vCPU is created.
+ */
+static int kvm_vcpu_init(struct kvm_vcpu *vcpu)
 {
+	struct kvm_vm *vm = vcpu->vm;
 	struct kvm_vm_mm *mm = &vm->mm;
-	struct kvm_vcpu *vcpu = NULL, *tmp;
-	struct kvm_vcpu_init init, preferred;
-	struct vm_area *vma;
-	unsigned long phys, sctlr_el1 = 0, tcr_el1 = 0;
-	unsigned int id = 0;
+	struct kvm_vcpu_template *tmpl = &vm->vcpu_template;
+	struct kvm_vcpu_init init;
+	unsigned long sctlr_el1 = 0, tcr_el1 = 0;
 	int ret = 0;
 
-	/*
-	 * Automatically assign vCPU ID, which the existing and maximal
-	 * one, plus 1. 0 will be taken if there are no existing vCPUs
-	 */
-	list_for_each_entry(tmp, &vm->vcpu_list, link) {
-		if (tmp->id >= id)
-			id = tmp->id + 1;
-	}
+	pthread_mutex_lock(&vm->lock);
 
-	/* Alloc vCPU */
-	vcpu = malloc(sizeof(*vcpu));
-	if (!vcpu) {
-		fprintf(stderr, "%s: Unable to alloc vcpu\n", __func__);
-		return -ENOMEM;
-	}
+	if (tmpl->valid) {
+		pthread_mutex_unlock(&vm->lock);
 
-	memset(vcpu, 0, sizeof(*vcpu));
-	vcpu->id = id;
-	vcpu->entry_point = entry_point;
-	INIT_LIST_HEAD(&vcpu->link);
+		init = tmpl->init;
+		if (vcpu->power_off)
+			init.features[0] |= (1 << KVM_ARM_VCPU_POWER_OFF);
 
-	/* Alloc stack, whose size is one page */
-	vma = mm_vma_alloc(mm->mm, 0, mm->page_size, 0, 0);
-	phys = kvm_mm_alloc_phys_pages(vm, 1);
-	kvm_mm_map(vm, phys, vma->start, mm->page_size);
-	vcpu->stack_base = vma->start;
-	vcpu->stack_end  = vma->start + mm->page_size;
+		ret = ioctl(vcpu->fd, KVM_ARM_VCPU_INIT, &init);
+		if (ret) {
+			fprintf(stderr, "%s: Unable to initialize vCPU %d (%d)\n",
+				__func__, vcpu->id, ret);
+		}
 
-	/* Create vCPU */
-	vcpu->fd = ioctl(vm->fd, KVM_CREATE_VCPU, id);
-	if (vcpu->fd < 0) {
-		fprintf(stderr, "%s: Unable to create vcpu (%d)\n",
-			__func__, id);
-		ret = -ENOMEM;
-		goto error;
-	}
-
-	/* Map vCPU running state */
-	vcpu->state_size = ioctl(vm->fd_dev, KVM_GET_VCPU_MMAP_SIZE, NULL);
-	if (vcpu->state_size < sizeof(*vcpu->state)) {
-		fprintf(stderr, "%s: Invalid state size (0x%lx)\n",
-			__func__, vcpu->state_size);
-		ret = -ENOSPC;
-		goto error;
+		return ret;
 	}
 
-	vcpu->state = mmap(NULL, vcpu->state_size, PROT_READ | PROT_WRITE,
-			   MAP_SHARED, vcpu->fd, 0);
-	if (vcpu->state == MAP_FAILED) {
-		fprintf(stderr, "%s: Unable to map running state\n", __func__);
-		ret = -ENOMEM;
-		goto error;
-	}
-
-	/* Reset vCPU */
-	ret = ioctl(vm->fd, KVM_ARM_PREFERRED_TARGET, &preferred);
+	ret = ioctl(vm->fd, KVM_ARM_PREFERRED_TARGET, &tmpl->init);
 	if (ret) {
 		fprintf(stderr, "%s: Unable to get the preferred target (%d)\n",
 			__func__, ret);
-		goto error;
+		goto out;
 	}
 
-	memset(&init, 0, sizeof(init));
-	init.target = preferred.target;
+	memset(tmpl->init.features, 0, sizeof(tmpl->init.features));
+	tmpl->init.features[0] = (1 << KVM_ARM_VCPU_PSCI_0_2);
+	init = tmpl->init;
+	if (vcpu->power_off)
+		init.features[0] |= (1 << KVM_ARM_VCPU_POWER_OFF);
+
 	ret = ioctl(vcpu->fd, KVM_ARM_VCPU_INIT, &init);
 	if (ret) {
-		fprintf(stderr, "%s: Unable to initialize vCPU (%d)\n",
-			__func__, ret);
-		goto error;
+		fprintf(stderr, "%s: Unable to initialize vCPU %d (%d)\n",
+			__func__, vcpu->id, ret);
+		goto out;
 	}
 
 	/*
-	 * Set vCPU registers. Some of the registers might be write-only.
-	 * We're just try our best here. Its return value won't be checked.
+	 * Some of the registers might be write-only. We're just try our
+	 * best here.
 	 */
 	ret = kvm_vcpu_get_reg(vcpu, KVM_ARM64_SYS_REG(SYS_REG_SCTLR_EL1),
 			       &sctlr_el1);
@@ -101,7 +71,7 @@ int kvm_vcpu_create(struct kvm_vm *vm, unsigned long entry_point)
 	if (ret) {
 		fprintf(stderr, "%s: Unable to get registers (%d)\n",
 			__func__, ret);
-		goto error;
+		goto out;
 	}
 
 	sctlr_el1 |= (1 << 0) | (1 << 2) | (1 << 12);	/* M | C | I    */
@@ -110,38 +80,176 @@ int kvm_vcpu_create(struct kvm_vm *vm, unsigned long entry_point)
 	tcr_el1   |= (1 << 8) | (1 << 10) | (3 << 12);
 	tcr_el1   |= (64 - mm->va_bits);		/* T0SZ         */
 
+	tmpl->cpacr_el1 = (3 << 20);
+	tmpl->sctlr_el1 = sctlr_el1;
+	tmpl->tcr_el1   = tcr_el1;
+	tmpl->mair_el1  = (0x00UL)       | (0x04UL << 8)  |
+			  (0x0cUL << 16) | (0x44UL << 24) |
+			  (0xffUL << 32) | (0xbbUL << 40);
+	tmpl->valid = true;
+out:
+	pthread_mutex_unlock(&vm->lock);
+	return ret;
+}
+
+static int kvm_vcpu_init_regs(struct kvm_vcpu *vcpu)
+{
+	struct kvm_vm *vm = vcpu->vm;
+	struct kvm_vcpu_template *tmpl = &vm->vcpu_template;
+	int ret;
+
 	ret = kvm_vcpu_set_reg(vcpu, KVM_ARM64_SYS_REG(SYS_REG_CPACR_EL1),
-			       (3 << 20));
+			       tmpl->cpacr_el1);
 	ret |= kvm_vcpu_set_reg(vcpu, KVM_ARM64_SYS_REG(SYS_REG_SCTLR_EL1),
-				sctlr_el1);
+				tmpl->sctlr_el1);
 	ret |= kvm_vcpu_set_reg(vcpu, KVM_ARM64_SYS_REG(SYS_REG_TCR_EL1),
-				tcr_el1);
+				tmpl->tcr_el1);
 	ret |= kvm_vcpu_set_reg(vcpu, KVM_ARM64_SYS_REG(SYS_REG_MAIR_EL1),
-				(0x00UL)       | (0x04UL << 8)  |
-				(0x0cUL << 16) | (0x44UL << 24) |
-				(0xffUL << 32) | (0xbbUL << 40));
+				tmpl->mair_el1);
 	ret |= kvm_vcpu_set_reg(vcpu, KVM_ARM64_SYS_REG(SYS_REG_TTBR0_EL1),
-				mm->pgtable);
+				vm->mm.pgtable);
 	ret |= kvm_vcpu_set_reg(vcpu, KVM_ARM64_SYS_REG(SYS_REG_TPIDR_EL1),
 				vcpu->id);
 	ret |= kvm_vcpu_set_reg(vcpu, KVM_ARM64_CORE_REG(sp_el1),
 				vcpu->stack_end);
 	ret |= kvm_vcpu_set_reg(vcpu, KVM_ARM64_CORE_REG(regs.pc),
 				vcpu->entry_point);
-
 	if (ret) {
 		fprintf(stderr, "%s: Unable to set registers (%d)\n",
 			__func__, ret);
+	}
+
+	return ret;
+}
+
+/*
+ * Create the vCPU, map its running state and reset it. The resources are
+ * released by the caller on failure.
+ */
+static int kvm_vcpu_open(struct kvm_vcpu *vcpu)
+{
+	struct kvm_vm *vm = vcpu->vm;
+
+	vcpu->fd = ioctl(vm->fd, KVM_CREATE_VCPU, vcpu->id);
+	if (vcpu->fd < 0) {
+		fprintf(stderr, "%s: Unable to create vcpu (%d)\n",
+			__func__, vcpu->id);
+		return -ENOMEM;
+	}
+
+	/* Map vCPU running state */
+	vcpu->state_size = ioctl(vm->fd_dev, KVM_GET_VCPU_MMAP_SIZE, NULL);
+	if (vcpu->state_size < sizeof(*vcpu->state)) {
+		fprintf(stderr, "%s: Invalid state size (0x%lx)\n",
+			__func__, vcpu->state_size);
+		return -ENOSPC;
+	}
+
+	vcpu->state = mmap(NULL, vcpu->state_size, PROT_READ | PROT_WRITE,
+			   MAP_SHARED, vcpu->fd, 0);
+	if (vcpu->state == MAP_FAILED) {
+		fprintf(stderr, "%s: Unable to map running state\n", __func__);
+		vcpu->state = NULL;
+		return -ENOMEM;
+	}
+
+	return kvm_vcpu_init(vcpu);
+}
+
+/**
+ * kvm_vcpu_create - Create vCPU
+ * @vm:		VM where the vCPU is created
+ * @entry_point: PC where the vCPU starts execution
+ *
+ * The vCPU ID is allocated atomically, so that the vCPUs can be created
+ * in parallel. The vCPUs other than the first one are powered off, and
+ * brought up by PSCI CPU_ON. It returns zero on success, or negative
+ * error code on failure.
+ */
+int kvm_vcpu_create(struct kvm_vm *vm, unsigned long entry_point)
+{
+	struct kvm_vm_mm *mm = &vm->mm;
+	struct kvm_vcpu *vcpu = NULL;
+	struct vm_area *vma;
+	unsigned long phys;
+	unsigned int id;
+	int ret = 0;
+
+	id = atomic_fetch_inc(&vm->next_vcpu_id);
+	if (id >= KVM_MAX_VCPUS) {
+		fprintf(stderr, "%s: Too many vCPUs (%d)\n", __func__, id);
+		return -ENOSPC;
+	}
+
+	/* Alloc vCPU */
+	vcpu = malloc(sizeof(*vcpu));
+	if (!vcpu) {
+		fprintf(stderr, "%s: Unable to alloc vcpu\n", __func__);
+		return -ENOMEM;
+	}
+
+	memset(vcpu, 0, sizeof(*vcpu));
+	vcpu->vm = vm;
+	vcpu->id = id;
+	vcpu->entry_point = entry_point;
+	vcpu->power_off = (id != 0);
+	INIT_LIST_HEAD(&vcpu->link);
+
+	/* Alloc stack, whose size is one page, from the vCPU's node */
+	pthread_mutex_lock(&vm->lock);
+	vma = mm_vma_alloc(mm->mm, 0, mm->page_size, 0, 0);
+	phys = kvm_mm_alloc_phys_pages_node(vm, 1, kvm_vcpu_node(vcpu));
+	if (!vma || !phys || kvm_mm_map(vm, phys, vma->start, mm->page_size)) {
+		if (phys)
+			kvm_mm_free_phys_pages(vm, phys, 1);
+		if (vma)
+			mm_vma_free(mm->mm, vma);
+		pthread_mutex_unlock(&vm->lock);
+		fprintf(stderr, "%s: Unable to alloc stack for vCPU %d\n",
+			__func__, id);
+		ret = -ENOMEM;
 		goto error;
 	}
+	pthread_mutex_unlock(&vm->lock);
+
+	vcpu->stack_base = vma->start;
+	vcpu->stack_end  = vma->start + mm->page_size;
+
+	/* Alloc system call ring */
+	pthread_mutex_lock(&vm->lock);
+	ret = kvm_syscall_vcpu_init(vcpu);
+	pthread_mutex_unlock(&vm->lock);
+	if (ret)
+		goto error;
+
+	/* Create and reset vCPU, and set registers */
+	ret = kvm_vcpu_open(vcpu);
+	if (ret)
+		goto error;
+
+	ret = kvm_vcpu_init_regs(vcpu);
+	if (ret)
+		goto error;
 
 	/* Add to the list */
-	vcpu->vm = vm;
+	pthread_mutex_lock(&vm->lock);
 	list_add_tail(&vm->vcpu_list, &vcpu->link);
+	vm->vcpus[id] = vcpu;
+	pthread_mutex_unlock(&vm->lock);
 
 	return 0;
 
 error:
+	/* Release the stack and ring in the guest RAM */
+	pthread_mutex_lock(&vm->lock);
+	if (vcpu && vcpu->ring)
+		kvm_mm_unmap_phys(vm, SYSCALL_RING_VA +
+				      id * SYSCALL_RING_SIZE);
+	if (vcpu && vcpu->stack_base)
+		kvm_mm_unmap_phys(vm, vcpu->stack_base);
+	pthread_mutex_unlock(&vm->lock);
+	if (vcpu)
+		kvm_syscall_vcpu_destroy(vcpu);
 	if (vcpu && vcpu->state)
 		munmap(vcpu->state, vcpu->state_size);
 	if (vcpu && vcpu->fd > 0)
@@ -152,6 +260,157 @@ error:
 	return ret;
 }
 
+/**
+ * kvm_vcpu_restore - Restore vCPU from snapshot
+ * @vm:		VM where the vCPU is restored
+ * @id:		vCPU ID
+ * @entry_point: PC where the vCPU starts execution
+ * @stack_base:	base address of the vCPU's stack
+ * @power_off:	the vCPU is started in OFF state
+ *
+ * The stack and the system call ring have been restored with the guest
+ * memory, so they aren't allocated again. The vCPU is reset, and its
+ * registers should be restored by the caller. The vCPU is returned on
+ * success. Otherwise, NULL is returned.
+ */
+struct kvm_vcpu *kvm_vcpu_restore(struct kvm_vm *vm,
+				  unsigned int id,
+				  unsigned long entry_point,
+				  unsigned long stack_base,
+				  bool power_off)
+{
+	struct kvm_vcpu *vcpu;
+	int ret;
+
+	if (id >= KVM_MAX_VCPUS || vm->vcpus[id]) {
+		fprintf(stderr, "%s: Invalid vCPU %d\n", __func__, id);
+		return NULL;
+	}
+
+	vcpu = malloc(sizeof(*vcpu));
+	if (!vcpu) {
+		fprintf(stderr, "%s: Unable to alloc vcpu\n", __func__);
+		return NULL;
+	}
+
+	memset(vcpu, 0, sizeof(*vcpu));
+	vcpu->vm = vm;
+	vcpu->id = id;
+	vcpu->entry_point = entry_point;
+	vcpu->stack_base = stack_base;
+	vcpu->stack_end = stack_base + vm->mm.page_size;
+	vcpu->power_off = power_off;
+	INIT_LIST_HEAD(&vcpu->link);
+
+	pthread_mutex_lock(&vm->lock);
+	ret = kvm_syscall_vcpu_restore(vcpu);
+	pthread_mutex_unlock(&vm->lock);
+	if (ret)
+		goto error;
+
+	ret = kvm_vcpu_open(vcpu);
+	if (ret)
+		goto error;
+
+	pthread_mutex_lock(&vm->lock);
+	list_add_tail(&vm->vcpu_list, &vcpu->link);
+	vm->vcpus[id] = vcpu;
+	if (vm->next_vcpu_id <= id)
+		vm->next_vcpu_id = id + 1;
+	pthread_mutex_unlock(&vm->lock);
+
+	return vcpu;
+
+error:
+	kvm_syscall_vcpu_destroy(vcpu);
+	if (vcpu->state)
+		munmap(vcpu->state, vcpu->state_size);
+	if (vcpu->fd > 0)
+		close(vcpu->fd);
+	free(vcpu);
+
+	return NULL;
+}
+
+struct kvm_vcpu_create_data {
+	struct kvm_vm	*vm;
+	unsigned long	entry_point;
+	int		remaining;
+	int		ret;
+};
+
+static void *kvm_vcpu_create_thread(void *arg)
+{
+	struct kvm_vcpu_create_data *data = arg;
+	int ret;
+
+	while (atomic_fetch_dec(&data->remaining) > 0) {
+		ret = kvm_vcpu_create(data->vm, data->entry_point);
+		if (ret) {
+			data->ret = ret;
+			break;
+		}
+	}
+
+	return NULL;
+}
+
+/**
+ * kvm_vm_create_vcpus - Create vCPUs in parallel
+ * @vm:		VM where the vCPUs are created
+ * @nr:		number of vCPUs
+ * @entry_point: PC where the first vCPU starts execution
+ *
+ * The first vCPU is created by the caller, to figure out the template
+ * of the initial registers. The remaining vCPUs are created by multiple
+ * threads. Multiple vCPUs are refused if PSCI CPU_ON isn't handled by
+ * us. It returns zero on success, or negative error code on failure.
+ */
+int kvm_vm_create_vcpus(struct kvm_vm *vm,
+			unsigned int nr,
+			unsigned long entry_point)
+{
+	struct kvm_vcpu_create_data data;
+	pthread_t threads[KVM_VCPU_CREATE_THREADS];
+	int i, nr_threads, ret;
+
+	/*
+	 * The in-kernel PSCI CPU_ON resets the target vCPU, which loses the
+	 * system registers (e.g. MMU) prepared at creation time.
+	 */
+	if (nr > 1 && !vm->psci_user) {
+		fprintf(stderr, "%s: Multiple vCPUs unsupported without SMCCC filter\n",
+			__func__);
+		return -EOPNOTSUPP;
+	}
+
+	ret = kvm_vcpu_create(vm, entry_point);
+	if (ret || nr <= 1)
+		return ret;
+
+	data.vm = vm;
+	data.entry_point = entry_point;
+	data.remaining = nr - 1;
+	data.ret = 0;
+	nr_threads = min((int)nr - 1, KVM_VCPU_CREATE_THREADS);
+	nr_threads = min(nr_threads, (int)sysconf(_SC_NPROCESSORS_ONLN));
+	for (i = 0; i < nr_threads; i++) {
+		if (pthread_create(&threads[i], NULL,
+				   kvm_vcpu_create_thread, &data))
+			break;
+	}
+
+	/* Create the remaining vCPUs if we fail to create all threads */
+	nr_threads = i;
+	if (!nr_threads)
+		kvm_vcpu_create_thread(&data);
+
+	for (i = 0; i < nr_threads; i++)
+		pthread_join(threads[i], NULL);
+
+	return data.ret;
+}
+
 int kvm_vcpu_get_reg(struct kvm_vcpu *vcpu,
 		     unsigned long id,
 		     unsigned long *val)
@@ -179,7 +438,9 @@ int kvm_vcpu_set_reg(struct kvm_vcpu *vcpu,
 
 void kvm_vcpu_destroy(struct kvm_vcpu *vcpu)
 {
+	vcpu->vm->vcpus[vcpu->id] = NULL;
 	list_del(&vcpu->link);
+	kvm_syscall_vcpu_destroy(vcpu);
 	munmap(vcpu->state, vcpu->state_size);
 	close(vcpu->fd);
 	free(vcpu);
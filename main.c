@@ -8,23 +8,134 @@
  */
 #include "sandbox.h"
 
-int main(int argc, char **argv)
+#define SANDBOX_DEFAULT_FILENAME	"/tmp/debug"
+
+/*
+ * Load the program and create the vCPUs. The program segments are
+ * populated on the first access if the readahead window size is
+ * specified.
+ */
+static int sandbox_load(struct kvm_vm *vm, char *filename)
 {
-	struct kvm_vm *vm;
+	char *readahead, *vcpus;
+	unsigned int nr_vcpus = 1;
 	unsigned long entry_point;
 	int ret;
 
-	vm = kvm_vm_create();
+	readahead = getenv("SANDBOX_READAHEAD");
+	if (readahead) {
+		ret = kvm_fault_init(vm, strtoul(readahead, NULL, 0));
+		if (ret)
+			return ret;
+	}
+
+	ret = elf_load_file(vm, filename, &entry_point);
+	if (ret)
+		return ret;
+
+	/* The secondary vCPUs are brought up by PSCI CPU_ON */
+	vcpus = getenv("SANDBOX_VCPUS");
+	if (vcpus)
+		nr_vcpus = strtoul(vcpus, NULL, 0);
+
+	return kvm_vm_create_vcpus(vm, nr_vcpus, entry_point);
+}
+
+int main(int argc, char **argv)
+{
+	struct kvm_vm *vm;
+	char *filename = SANDBOX_DEFAULT_FILENAME;
+	char *poll, *workers, *root, *net, *reclaim, *restore, *snapshot;
+	char *shared;
+	int advice, ret;
+
+	/* The ELF file or sandbox package can be specified */
+	if (argc > 1)
+		filename = argv[1];
+
+	/*
+	 * The read-only segments are shared through the cache, whose unused
+	 * segments are evicted when its size exceeds the limit.
+	 */
+	shared = getenv("SANDBOX_SHARED_LIMIT");
+	if (shared)
+		kvm_shared_set_limit(strtoul(shared, NULL, 0));
+
+	/*
+	 * The VM is restored from the snapshot if it's specified, instead of
+	 * being created and loaded from scratch.
+	 */
+	restore = getenv("SANDBOX_RESTORE");
+	vm = restore ? kvm_vm_restore(restore) : kvm_vm_create();
 	if (!vm)
 		return -ENOMEM;
 
-	ret = elf_load_file(vm, "/tmp/debug", &entry_point);
-	if (ret)
-		goto error;
+	/*
+	 * The freed guest memory is held until its size exceeds the
+	 * threshold, and then returned to host. The host pages are dropped
+	 * immediately, or reclaimed under memory pressure if MADV_FREE is
+	 * preferred.
+	 */
+	reclaim = getenv("SANDBOX_RECLAIM");
+	if (reclaim) {
+		advice = getenv("SANDBOX_RECLAIM_LAZY") ? MADV_FREE :
+							  MADV_DONTNEED;
+		ret = kvm_mm_set_reclaim(vm, strtoul(reclaim, NULL, 0), advice);
+		if (ret)
+			goto error;
+	}
 
-	ret = kvm_vcpu_create(vm, entry_point);
-	if (ret)
-		goto error;
+	if (!restore) {
+		ret = sandbox_load(vm, filename);
+		if (ret)
+			goto error;
+	}
+
+	/* The VM, which is ready to run, is captured to the snapshot */
+	snapshot = getenv("SANDBOX_SNAPSHOT");
+	if (snapshot) {
+		ret = kvm_vm_snapshot(vm, snapshot);
+		if (ret)
+			goto error;
+	}
+
+	/* The file system is available if the root directory is specified */
+	root = getenv("SANDBOX_ROOT");
+	if (root) {
+		ret = kvm_fs_init(vm, root);
+		if (ret)
+			goto error;
+
+		ret = kvm_epoll_init(vm);
+		if (ret)
+			goto error;
+	}
+
+	/* The sockets are installed to the file table of the file system */
+	net = getenv("SANDBOX_NET");
+	if (net) {
+		ret = kvm_net_init(vm);
+		if (ret)
+			goto error;
+	}
+
+	/* The blocking system calls are offloaded to the workers */
+	workers = getenv("SANDBOX_SYSCALL_WORKERS");
+	if (workers) {
+		ret = kvm_syscall_set_workers(strtoul(workers, NULL, 0));
+		if (ret)
+			goto error;
+	}
+
+	/* The system call rings are polled if the idle period is specified */
+	poll = getenv("SANDBOX_SYSCALL_POLL");
+	if (poll) {
+		ret = kvm_syscall_start_polling(vm, strtoul(poll, NULL, 0));
+		if (ret)
+			goto error;
+	}
+
+	ret = kvm_vm_run(vm);
 
 error:
 	kvm_vm_destroy(vm);
@@ -39,6 +39,8 @@ void mm_destroy(struct mm *mm)
 			mm->vma->prev = NULL;
 
 		rb_erase(&mm->root, &vma->node);
+		if (vma->fd >= 0)
+			close(vma->fd);
 		free(vma);
 	}
 
@@ -116,7 +116,7 @@ struct vm_area *mm_vma_alloc(struct mm *mm, unsigned long addr,
 	 */
 	if (flags & MM_VMA_FLAG_FIXED) {
 		vma = mm_vma_find(mm, addr, &prev);
-		if (!vma || (addr + len) < vma->start)
+		if (!vma || (addr + len) <= vma->start)
 			goto found;
 
 		return NULL;
@@ -171,6 +171,7 @@ found:
 	vma->prot  = prot;
 	vma->start = addr;
 	vma->end   = addr + len;
+	vma->fd    = -1;
 
 	/* Insert to the list */
 	vma->prev = prev;
@@ -192,3 +193,67 @@ found:
 
 	return vma;
 }
+
+/**
+ * mm_vma_split - Split virtual memory area (vma)
+ * @mm:		mm struct
+ * @vma:	vma to be split
+ * @addr:	address where @vma is split
+ *
+ * @vma is shrunk to end at @addr, and the remaining part is covered by
+ * the new vma, which inherits the flags, protocol, file image and host
+ * virtual address. It returns the new vma on success. Otherwise, it
+ * returns NULL on errors.
+ */
+struct vm_area *mm_vma_split(struct mm *mm, struct vm_area *vma,
+			     unsigned long addr)
+{
+	struct vm_area *new;
+	unsigned long end = vma->end;
+
+	if (addr <= vma->start || addr >= vma->end)
+		return NULL;
+
+	vma->end = addr;
+	new = mm_vma_alloc(mm, addr, end - addr,
+			   vma->flags | MM_VMA_FLAG_FIXED, vma->prot);
+	if (!new) {
+		vma->end = end;
+		return NULL;
+	}
+
+	new->flags = vma->flags;
+	new->file_start = vma->file_start;
+	new->file_offset = vma->file_offset;
+	new->file_size = vma->file_size;
+	if (vma->hva)
+		new->hva = vma->hva + (addr - vma->start);
+	if (vma->fd >= 0)
+		new->fd = dup(vma->fd);
+
+	return new;
+}
+
+/**
+ * mm_vma_free - Free virtual memory area (vma)
+ * @mm:		mm struct
+ * @vma:	vma to be freed
+ *
+ * The vma is removed from the list and RBTree, and released. The file
+ * backing the vma is closed.
+ */
+void mm_vma_free(struct mm *mm, struct vm_area *vma)
+{
+	if (vma->prev)
+		vma->prev->next = vma->next;
+	else
+		mm->vma = vma->next;
+
+	if (vma->next)
+		vma->next->prev = vma->prev;
+
+	rb_erase(&mm->root, &vma->node);
+	if (vma->fd >= 0)
+		close(vma->fd);
+	free(vma);
+}
@@ -0,0 +1,830 @@
+/*
+ * Copyright 2022 Gavin Shan <gshan@redhat.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#include <signal.h>
+#include <sys/syscall.h>
+#include "sandbox.h"
+
+/*
+ * sendto(), recvfrom(), sendmsg() and recvmsg() are queued when the ring
+ * is drained, and issued by the flush handler afterwards. The queued
+ * messages of the same datagram socket are coalesced into one sendmmsg()
+ * or recvmmsg(). The flush handler never blocks. The messages which would
+ * block are offloaded to the workers, unless the socket or the call is
+ * non-blocking. The following messages of the socket in the same direction
+ * are queued behind the offloaded ones, so that the stream data isn't
+ * reordered. Like the blocking call interrupted by signal, a short count
+ * may be returned for the stream socket.
+ */
+static int net_type(struct kvm_net *net, int fd)
+{
+	if (fd < 0 || fd >= KVM_FS_MAX_FILES)
+		return 0;
+
+	return READ_ONCE(net->types[fd]);
+}
+
+static bool net_nonblock(int host_fd, int flags)
+{
+	return (flags & MSG_DONTWAIT) || (fcntl(host_fd, F_GETFL) & O_NONBLOCK);
+}
+
+/*
+ * Wait for the blocking socket to be ready. It's done in slices, so that
+ * it's aborted when the VM is stopped. It returns zero immediately for
+ * the non-blocking socket or call.
+ */
+static int net_wait(struct kvm_vm *vm, int host_fd, short events, int flags)
+{
+	struct pollfd pfd = { .fd = host_fd, .events = events };
+	int ret;
+
+	if (net_nonblock(host_fd, flags))
+		return 0;
+
+	while (!READ_ONCE(vm->stopping)) {
+		ret = poll(&pfd, 1, KVM_NET_WAIT_MS);
+		if (ret > 0)
+			return 0;
+
+		if (ret < 0 && errno != EINTR)
+			return -errno;
+	}
+
+	return -EINTR;
+}
+
+static int net_get_socket(struct kvm_vm *vm, int fd)
+{
+	if (!vm->net)
+		return -ENOSYS;
+
+	return kvm_fs_get_file(vm, fd);
+}
+
+static int net_install(struct kvm_vm *vm, int host_fd, int type)
+{
+	int fd;
+
+	fd = kvm_fs_install_file(vm, host_fd);
+	if (fd < 0) {
+		close(host_fd);
+		return fd;
+	}
+
+	WRITE_ONCE(vm->net->types[fd], type & ~(SOCK_NONBLOCK | SOCK_CLOEXEC));
+
+	return fd;
+}
+
+static int net_get_addr(struct kvm_vm *vm, unsigned long gva,
+			unsigned long len, struct sockaddr_storage *addr)
+{
+	if (len > sizeof(*addr))
+		return -EINVAL;
+
+	return kvm_mm_copy_from_guest(vm, addr, gva, len);
+}
+
+/*
+ * Copy the address to the guest buffer at @gva, which is truncated if the
+ * buffer isn't large enough. The buffer size is read from @lenp, and the
+ * actual length of the address is written back.
+ */
+static int net_put_addr(struct kvm_vm *vm, struct sockaddr_storage *addr,
+			socklen_t len, unsigned long gva, unsigned long lenp)
+{
+	socklen_t size;
+	int ret;
+
+	if (!gva)
+		return 0;
+
+	ret = kvm_mm_copy_from_guest(vm, &size, lenp, sizeof(size));
+	if (!ret)
+		ret = kvm_mm_copy_to_guest(vm, gva, addr, min(size, len));
+	if (!ret)
+		ret = kvm_mm_copy_to_guest(vm, lenp, &len, sizeof(len));
+
+	return ret;
+}
+
+/*
+ * Add the guest buffer to the I/O vector of the message. The buffer is
+ * truncated for the stream socket if the I/O vector is full. Otherwise,
+ * -EMSGSIZE is returned. It returns the number of added bytes.
+ */
+static long net_msg_add_buf(struct kvm_vm *vm, struct kvm_net_msg *msg,
+			    unsigned long gva, unsigned long len)
+{
+	struct kvm_vm_mm *mm = &vm->mm;
+	int nr, left = KVM_NET_MAX_IOV - msg->hdr.msg_iovlen;
+	unsigned long max_len;
+
+	max_len = left * mm->page_size - (gva & (mm->page_size - 1));
+	if (!left || len > max_len) {
+		if (!msg->stream)
+			return -EMSGSIZE;
+
+		len = left ? max_len : 0;
+	}
+
+	if (!len)
+		return 0;
+
+	nr = kvm_mm_gva_to_iov(vm, gva, len, !msg->send,
+			       &msg->iov[msg->hdr.msg_iovlen], left);
+	if (nr < 0)
+		return nr;
+
+	msg->hdr.msg_iovlen += nr;
+
+	return len;
+}
+
+/*
+ * sendto(fd, buf, len, flags, dest_addr, addrlen),
+ * recvfrom(fd, buf, len, flags, src_addr, addrlen),
+ * sendmsg(fd, msg, flags) and recvmsg(fd, msg, flags). The ancillary data
+ * isn't supported.
+ */
+static long net_msg_init(struct kvm_vm *vm,
+			 struct kvm_syscall_ring *ring,
+			 struct syscall_sqe *sqe,
+			 struct kvm_net_msg *msg)
+{
+	struct msghdr hdr;
+	struct iovec iov;
+	unsigned long i;
+	int type;
+	long ret;
+
+	memset(msg, 0, sizeof(*msg));
+	msg->vm = vm;
+	msg->ring = ring;
+	msg->sqe = *sqe;
+	msg->fd = sqe->args[0];
+	msg->send = (sqe->nr == __NR_sendto || sqe->nr == __NR_sendmsg);
+	type = net_type(vm->net, msg->fd);
+	msg->stream = (!type || type == SOCK_STREAM);
+	msg->hdr.msg_iov = msg->iov;
+	INIT_LIST_HEAD(&msg->link);
+
+	if (sqe->nr == __NR_sendto || sqe->nr == __NR_recvfrom) {
+		msg->flags = sqe->args[3];
+		ret = net_msg_add_buf(vm, msg, sqe->args[1], sqe->args[2]);
+		if (ret < 0)
+			return ret;
+
+		if (msg->send && sqe->args[4]) {
+			ret = net_get_addr(vm, sqe->args[4], sqe->args[5],
+					   &msg->addr);
+			if (ret)
+				return ret;
+
+			msg->hdr.msg_name = &msg->addr;
+			msg->hdr.msg_namelen = sqe->args[5];
+		} else if (!msg->send) {
+			msg->name = sqe->args[4];
+			msg->namelen = sqe->args[5];
+		}
+	} else {
+		msg->flags = sqe->args[2];
+		ret = kvm_mm_copy_from_guest(vm, &hdr, sqe->args[1], sizeof(hdr));
+		if (ret)
+			return ret;
+
+		if (msg->send && hdr.msg_controllen)
+			return -EOPNOTSUPP;
+		if (hdr.msg_iovlen > UIO_MAXIOV)
+			return -EMSGSIZE;
+
+		if (msg->send && hdr.msg_name) {
+			ret = net_get_addr(vm, (unsigned long)hdr.msg_name,
+					   hdr.msg_namelen, &msg->addr);
+			if (ret)
+				return ret;
+
+			msg->hdr.msg_name = &msg->addr;
+			msg->hdr.msg_namelen = hdr.msg_namelen;
+		} else if (!msg->send) {
+			msg->msg = sqe->args[1];
+			msg->name = (unsigned long)hdr.msg_name;
+			msg->namelen = sqe->args[1] +
+				       offsetof(struct msghdr, msg_namelen);
+		}
+
+		for (i = 0; i < hdr.msg_iovlen; i++) {
+			ret = kvm_mm_copy_from_guest(vm, &iov,
+					(unsigned long)hdr.msg_iov + i * sizeof(iov),
+					sizeof(iov));
+			if (!ret)
+				ret = net_msg_add_buf(vm, msg,
+						      (unsigned long)iov.iov_base,
+						      iov.iov_len);
+			if (ret < 0)
+				return ret;
+			if (ret < iov.iov_len)
+				break;
+		}
+	}
+
+	if (msg->name) {
+		msg->hdr.msg_name = &msg->addr;
+		msg->hdr.msg_namelen = sizeof(msg->addr);
+	}
+
+	return 0;
+}
+
+/* Copy the source address and flags of the received message to the guest */
+static long net_msg_finish(struct kvm_net_msg *msg, long ret)
+{
+	struct kvm_vm *vm = msg->vm;
+	size_t controllen = 0;
+	int flags = msg->hdr.msg_flags;
+
+	if (ret < 0 || msg->send)
+		return ret;
+
+	if (msg->name &&
+	    net_put_addr(vm, &msg->addr, msg->hdr.msg_namelen,
+			 msg->name, msg->namelen))
+		return -EFAULT;
+
+	if (msg->msg &&
+	    (kvm_mm_copy_to_guest(vm,
+			msg->msg + offsetof(struct msghdr, msg_controllen),
+			&controllen, sizeof(controllen)) ||
+	     kvm_mm_copy_to_guest(vm,
+			msg->msg + offsetof(struct msghdr, msg_flags),
+			&flags, sizeof(flags))))
+		return -EFAULT;
+
+	return ret;
+}
+
+static void net_msg_complete(struct kvm_net_msg *msg, long ret)
+{
+	kvm_syscall_complete(msg->ring, msg->sqe.user_data,
+			     net_msg_finish(msg, ret));
+	free(msg);
+}
+
+/*
+ * The offloaded messages of the socket in one direction, or NULL if the
+ * guest file descriptor is invalid. It's called with the lock held.
+ */
+static struct list_head *net_blocked(struct kvm_net *net, int fd, bool send)
+{
+	if (fd < 0 || fd >= KVM_FS_MAX_FILES)
+		return NULL;
+
+	return &net->blocked[fd][send];
+}
+
+/* Send or receive the message, waiting for the blocking socket */
+static long net_msg_xmit_sync(struct kvm_net_msg *msg)
+{
+	struct kvm_vm *vm = msg->vm;
+	int host_fd;
+	long ret;
+
+	host_fd = kvm_fs_get_file(vm, msg->fd);
+	if (host_fd < 0)
+		return host_fd;
+
+	ret = net_wait(vm, host_fd, msg->send ? POLLOUT : POLLIN, msg->flags);
+	if (!ret) {
+		ret = msg->send ? sendmsg(host_fd, &msg->hdr, msg->flags) :
+				  recvmsg(host_fd, &msg->hdr, msg->flags);
+		ret = (ret < 0) ? -errno : ret;
+	}
+
+	close(host_fd);
+
+	return ret;
+}
+
+/*
+ * The offloaded messages of the socket in one direction are sent or
+ * received by the worker one by one, in the order they're issued. The
+ * message is kept in the list until it's done, so that the following
+ * messages are queued behind it instead of being issued by the flush
+ * handler. The work holds an extra CQ entry reservation of the first
+ * message's ring, which is released by the worker.
+ */
+static long net_blocked_drain(struct kvm_vm *vm,
+			      struct kvm_syscall_ring *ring,
+			      struct syscall_sqe *sqe)
+{
+	struct kvm_net *net = vm->net;
+	struct kvm_net_msg *msg;
+	struct list_head *blocked;
+	long ret;
+
+	pthread_mutex_lock(&net->lock);
+
+	blocked = net_blocked(net, sqe->args[0],
+			      sqe->nr == __NR_sendto || sqe->nr == __NR_sendmsg);
+	while (!list_empty(blocked)) {
+		msg = list_first_entry(blocked, struct kvm_net_msg, link);
+		pthread_mutex_unlock(&net->lock);
+
+		ret = net_msg_xmit_sync(msg);
+
+		pthread_mutex_lock(&net->lock);
+		list_del(&msg->link);
+		pthread_mutex_unlock(&net->lock);
+
+		net_msg_complete(msg, ret);
+
+		pthread_mutex_lock(&net->lock);
+	}
+
+	pthread_mutex_unlock(&net->lock);
+
+	return SYSCALL_RET_PENDING;
+}
+
+/*
+ * Queue the messages behind the offloaded ones of the same socket and
+ * direction. The worker is started if there are no offloaded messages.
+ * It's called with the lock held, and the messages are completed with
+ * error if the worker can't be started.
+ */
+static void net_msg_offload(struct kvm_vm *vm,
+			    struct list_head *blocked,
+			    struct kvm_net_msg **batch,
+			    int nr)
+{
+	struct kvm_syscall_work *work;
+	bool idle = list_empty(blocked);
+	int i, ret = 0;
+
+	for (i = 0; i < nr; i++)
+		list_add_tail(blocked, &batch[i]->link);
+
+	if (!idle)
+		return;
+
+	work = malloc(sizeof(*work));
+	if (!work) {
+		ret = -ENOMEM;
+	} else {
+		work->vm = vm;
+		work->ring = batch[0]->ring;
+		work->sqe = batch[0]->sqe;
+		work->handler = net_blocked_drain;
+		INIT_LIST_HEAD(&work->link);
+		kvm_syscall_defer(work->ring);
+		ret = kvm_syscall_queue_work(work);
+		if (ret) {
+			atomic_fetch_dec(&work->ring->inflight);
+			free(work);
+		}
+	}
+
+	if (!ret)
+		return;
+
+	for (i = 0; i < nr; i++) {
+		list_del(&batch[i]->link);
+		net_msg_complete(batch[i], ret);
+	}
+}
+
+/*
+ * Send or receive the messages of the same socket, direction and flags in
+ * one batch. The remaining messages are offloaded if the socket becomes
+ * busy.
+ */
+static void net_xmit(struct kvm_vm *vm, struct kvm_net_msg **batch, int nr)
+{
+	struct kvm_net *net = vm->net;
+	struct mmsghdr hdrs[KVM_NET_MAX_BATCH];
+	struct kvm_net_msg *msg = batch[0];
+	struct list_head *blocked;
+	int i, host_fd, done = 0;
+	long ret;
+
+	/* Keep the order behind the offloaded messages */
+	pthread_mutex_lock(&net->lock);
+	blocked = net_blocked(net, msg->fd, msg->send);
+	if (blocked && !list_empty(blocked)) {
+		net_msg_offload(vm, blocked, batch, nr);
+		pthread_mutex_unlock(&net->lock);
+		return;
+	}
+	pthread_mutex_unlock(&net->lock);
+
+	for (i = 0; i < nr; i++) {
+		hdrs[i].msg_hdr = batch[i]->hdr;
+		hdrs[i].msg_len = 0;
+	}
+
+	host_fd = kvm_fs_get_file(vm, msg->fd);
+	while (host_fd >= 0 && done < nr) {
+		ret = msg->send ?
+		      sendmmsg(host_fd, &hdrs[done], nr - done,
+			       msg->flags | MSG_DONTWAIT) :
+		      recvmmsg(host_fd, &hdrs[done], nr - done,
+			       msg->flags | MSG_DONTWAIT, NULL);
+		if (ret > 0) {
+			for (i = done; i < done + ret; i++) {
+				batch[i]->hdr = hdrs[i].msg_hdr;
+				net_msg_complete(batch[i], hdrs[i].msg_len);
+			}
+
+			done += ret;
+			continue;
+		}
+
+		/* Nothing is sent or received without error */
+		ret = (ret < 0) ? -errno : -EAGAIN;
+		if (ret == -EAGAIN && !net_nonblock(host_fd, msg->flags)) {
+			pthread_mutex_lock(&net->lock);
+			net_msg_offload(vm, blocked, &batch[done], nr - done);
+			pthread_mutex_unlock(&net->lock);
+			done = nr;
+			break;
+		}
+
+		net_msg_complete(batch[done++], ret);
+	}
+
+	for (; done < nr; done++)
+		net_msg_complete(batch[done], host_fd);
+
+	if (host_fd >= 0)
+		close(host_fd);
+}
+
+static void net_flush(struct kvm_vm *vm)
+{
+	struct kvm_net *net = vm->net;
+	struct kvm_net_msg *batch[KVM_NET_MAX_BATCH];
+	struct kvm_net_msg *msg, *tmp, *first;
+	LIST_HEAD(list);
+	int nr;
+
+	if (!net)
+		return;
+
+	pthread_mutex_lock(&net->lock);
+	list_for_each_entry_safe(msg, tmp, &net->pending, link) {
+		list_del(&msg->link);
+		list_add_tail(&list, &msg->link);
+	}
+	pthread_mutex_unlock(&net->lock);
+
+	while (!list_empty(&list)) {
+		first = list_first_entry(&list, struct kvm_net_msg, link);
+		nr = 0;
+		list_for_each_entry_safe(msg, tmp, &list, link) {
+			if (msg->fd != first->fd || msg->send != first->send ||
+			    msg->flags != first->flags)
+				continue;
+
+			list_del(&msg->link);
+			batch[nr++] = msg;
+			if (nr >= KVM_NET_MAX_BATCH ||
+			    net_type(net, first->fd) != SOCK_DGRAM)
+				break;
+		}
+
+		net_xmit(vm, batch, nr);
+	}
+}
+
+static long net_queue_msg(struct kvm_vm *vm,
+			  struct kvm_syscall_ring *ring,
+			  struct syscall_sqe *sqe)
+{
+	struct kvm_net *net = vm->net;
+	struct kvm_net_msg *msg;
+	long ret;
+
+	if (!net)
+		return -ENOSYS;
+
+	msg = malloc(sizeof(*msg));
+	if (!msg)
+		return -ENOMEM;
+
+	ret = net_msg_init(vm, ring, sqe, msg);
+	if (ret) {
+		free(msg);
+		return ret;
+	}
+
+	kvm_syscall_defer(ring);
+	pthread_mutex_lock(&net->lock);
+	list_add_tail(&net->pending, &msg->link);
+	pthread_mutex_unlock(&net->lock);
+
+	return SYSCALL_RET_PENDING;
+}
+
+/* socket(domain, type, protocol). Only IPv4 and IPv6 are allowed. */
+static long net_socket(struct kvm_vm *vm,
+		       struct kvm_syscall_ring *ring,
+		       struct syscall_sqe *sqe)
+{
+	int domain = sqe->args[0], type = sqe->args[1];
+	int host_fd;
+
+	if (!vm->net)
+		return -ENOSYS;
+
+	if (domain != AF_INET && domain != AF_INET6)
+		return -EAFNOSUPPORT;
+
+	host_fd = socket(domain, type | SOCK_CLOEXEC, sqe->args[2]);
+	if (host_fd < 0)
+		return -errno;
+
+	return net_install(vm, host_fd, type);
+}
+
+/* bind(fd, addr, addrlen) and connect(fd, addr, addrlen) */
+static long net_addr_call(struct kvm_vm *vm,
+			  struct syscall_sqe *sqe,
+			  int (*fn)(int, const struct sockaddr *, socklen_t))
+{
+	struct sockaddr_storage addr;
+	int host_fd;
+	long ret;
+
+	host_fd = net_get_socket(vm, sqe->args[0]);
+	if (host_fd < 0)
+		return host_fd;
+
+	ret = net_get_addr(vm, sqe->args[1], sqe->args[2], &addr);
+	if (!ret) {
+		ret = fn(host_fd, (struct sockaddr *)&addr, sqe->args[2]);
+		ret = ret ? -errno : 0;
+	}
+
+	close(host_fd);
+
+	return ret;
+}
+
+static long net_bind(struct kvm_vm *vm,
+		     struct kvm_syscall_ring *ring,
+		     struct syscall_sqe *sqe)
+{
+	return net_addr_call(vm, sqe, bind);
+}
+
+static long net_connect(struct kvm_vm *vm,
+			struct kvm_syscall_ring *ring,
+			struct syscall_sqe *sqe)
+{
+	return net_addr_call(vm, sqe, connect);
+}
+
+/* listen(fd, backlog) and shutdown(fd, how) */
+static long net_listen_shutdown(struct kvm_vm *vm,
+				struct kvm_syscall_ring *ring,
+				struct syscall_sqe *sqe)
+{
+	int host_fd;
+	long ret;
+
+	host_fd = net_get_socket(vm, sqe->args[0]);
+	if (host_fd < 0)
+		return host_fd;
+
+	ret = (sqe->nr == __NR_listen) ? listen(host_fd, sqe->args[1]) :
+					 shutdown(host_fd, sqe->args[1]);
+	ret = ret ? -errno : 0;
+	close(host_fd);
+
+	return ret;
+}
+
+/* accept(fd, addr, addrlen) and accept4(fd, addr, addrlen, flags) */
+static long net_accept(struct kvm_vm *vm,
+		       struct kvm_syscall_ring *ring,
+		       struct syscall_sqe *sqe)
+{
+	struct sockaddr_storage addr;
+	socklen_t len = sizeof(addr);
+	int flags = (sqe->nr == __NR_accept4) ? sqe->args[3] : 0;
+	int host_fd, new_fd = -1;
+	long ret;
+
+	host_fd = net_get_socket(vm, sqe->args[0]);
+	if (host_fd < 0)
+		return host_fd;
+
+	ret = net_wait(vm, host_fd, POLLIN, 0);
+	if (!ret) {
+		new_fd = accept4(host_fd, (struct sockaddr *)&addr, &len,
+				 (flags & SOCK_NONBLOCK) | SOCK_CLOEXEC);
+		ret = (new_fd < 0) ? -errno : 0;
+	}
+
+	if (!ret && net_put_addr(vm, &addr, len, sqe->args[1], sqe->args[2])) {
+		close(new_fd);
+		ret = -EFAULT;
+	}
+
+	if (!ret)
+		ret = net_install(vm, new_fd, net_type(vm->net, sqe->args[0]));
+
+	close(host_fd);
+
+	return ret;
+}
+
+/* getsockname(fd, addr, addrlen) and getpeername(fd, addr, addrlen) */
+static long net_getname(struct kvm_vm *vm,
+			struct kvm_syscall_ring *ring,
+			struct syscall_sqe *sqe)
+{
+	struct sockaddr_storage addr;
+	socklen_t len = sizeof(addr);
+	int host_fd;
+	long ret;
+
+	host_fd = net_get_socket(vm, sqe->args[0]);
+	if (host_fd < 0)
+		return host_fd;
+
+	ret = (sqe->nr == __NR_getsockname) ?
+	      getsockname(host_fd, (struct sockaddr *)&addr, &len) :
+	      getpeername(host_fd, (struct sockaddr *)&addr, &len);
+	ret = ret ? -errno :
+	      net_put_addr(vm, &addr, len, sqe->args[1], sqe->args[2]);
+	close(host_fd);
+
+	return ret;
+}
+
+/* setsockopt(fd, level, optname, optval, optlen) */
+static long net_setsockopt(struct kvm_vm *vm,
+			   struct kvm_syscall_ring *ring,
+			   struct syscall_sqe *sqe)
+{
+	char opt[KVM_NET_MAX_OPTLEN];
+	socklen_t len = sqe->args[4];
+	int host_fd;
+	long ret;
+
+	if (sqe->args[4] > sizeof(opt))
+		return -EINVAL;
+
+	host_fd = net_get_socket(vm, sqe->args[0]);
+	if (host_fd < 0)
+		return host_fd;
+
+	ret = kvm_mm_copy_from_guest(vm, opt, sqe->args[3], len);
+	if (!ret) {
+		ret = setsockopt(host_fd, sqe->args[1], sqe->args[2], opt, len);
+		ret = ret ? -errno : 0;
+	}
+
+	close(host_fd);
+
+	return ret;
+}
+
+/* getsockopt(fd, level, optname, optval, optlen) */
+static long net_getsockopt(struct kvm_vm *vm,
+			   struct kvm_syscall_ring *ring,
+			   struct syscall_sqe *sqe)
+{
+	char opt[KVM_NET_MAX_OPTLEN];
+	socklen_t len;
+	int host_fd;
+	long ret;
+
+	host_fd = net_get_socket(vm, sqe->args[0]);
+	if (host_fd < 0)
+		return host_fd;
+
+	ret = kvm_mm_copy_from_guest(vm, &len, sqe->args[4], sizeof(len));
+	if (!ret) {
+		len = min(len, (socklen_t)sizeof(opt));
+		ret = getsockopt(host_fd, sqe->args[1], sqe->args[2], opt, &len);
+		ret = ret ? -errno : 0;
+	}
+
+	if (!ret &&
+	    (kvm_mm_copy_to_guest(vm, sqe->args[3], opt, len) ||
+	     kvm_mm_copy_to_guest(vm, sqe->args[4], &len, sizeof(len))))
+		ret = -EFAULT;
+
+	close(host_fd);
+
+	return ret;
+}
+
+/**
+ * kvm_net_init - Initialize network of VM
+ * @vm:		VM where the network is initialized
+ *
+ * The sockets are installed to the file table, so the file system should
+ * have been initialized. It returns zero on success, or negative error
+ * code on failure.
+ */
+int kvm_net_init(struct kvm_vm *vm)
+{
+	struct kvm_net *net;
+	int i, ret;
+
+	if (!vm->fs) {
+		fprintf(stderr, "%s: File system isn't initialized\n", __func__);
+		return -EINVAL;
+	}
+
+	net = malloc(sizeof(*net));
+	if (!net) {
+		fprintf(stderr, "%s: Unable to alloc network\n", __func__);
+		return -ENOMEM;
+	}
+
+	memset(net, 0, sizeof(*net));
+	pthread_mutex_init(&net->lock, NULL);
+	INIT_LIST_HEAD(&net->pending);
+	for (i = 0; i < KVM_FS_MAX_FILES; i++) {
+		INIT_LIST_HEAD(&net->blocked[i][0]);
+		INIT_LIST_HEAD(&net->blocked[i][1]);
+	}
+
+	ret = kvm_syscall_register_flush(vm, net_flush);
+	if (ret) {
+		fprintf(stderr, "%s: Unable to register flush handler (%d)\n",
+			__func__, ret);
+		free(net);
+		return ret;
+	}
+
+	/* The writes to the broken sockets fail with -EPIPE instead */
+	signal(SIGPIPE, SIG_IGN);
+	vm->net = net;
+
+	kvm_syscall_register(__NR_socket, net_socket, 0);
+	kvm_syscall_register(__NR_bind, net_bind, 0);
+	kvm_syscall_register(__NR_listen, net_listen_shutdown, 0);
+	kvm_syscall_register(__NR_shutdown, net_listen_shutdown, 0);
+	kvm_syscall_register(__NR_getsockname, net_getname, 0);
+	kvm_syscall_register(__NR_getpeername, net_getname, 0);
+	kvm_syscall_register(__NR_setsockopt, net_setsockopt, 0);
+	kvm_syscall_register(__NR_getsockopt, net_getsockopt, 0);
+	kvm_syscall_register(__NR_sendto, net_queue_msg, 0);
+	kvm_syscall_register(__NR_recvfrom, net_queue_msg, 0);
+	kvm_syscall_register(__NR_sendmsg, net_queue_msg, 0);
+	kvm_syscall_register(__NR_recvmsg, net_queue_msg, 0);
+	kvm_syscall_register(__NR_connect, net_connect, SYSCALL_FLAG_BLOCKING);
+	kvm_syscall_register(__NR_accept, net_accept, SYSCALL_FLAG_BLOCKING);
+	kvm_syscall_register(__NR_accept4, net_accept, SYSCALL_FLAG_BLOCKING);
+
+	return 0;
+}
+
+void kvm_net_destroy(struct kvm_vm *vm)
+{
+	struct kvm_net *net = vm->net;
+	struct kvm_net_msg *msg, *tmp;
+	struct list_head *blocked;
+	int i;
+
+	if (!net)
+		return;
+
+	/* The offloaded system calls might be using the sockets */
+	if (vm->syscall)
+		kvm_syscall_cancel_work(vm);
+
+	pthread_mutex_lock(&net->lock);
+	list_for_each_entry_safe(msg, tmp, &net->pending, link) {
+		list_del(&msg->link);
+		kvm_syscall_complete(msg->ring, msg->sqe.user_data, -ECANCELED);
+		free(msg);
+	}
+
+	/* The offloaded messages are left if the work is cancelled */
+	for (i = 0; i < KVM_FS_MAX_FILES * 2; i++) {
+		blocked = &net->blocked[i / 2][i % 2];
+		list_for_each_entry_safe(msg, tmp, blocked, link) {
+			list_del(&msg->link);
+			kvm_syscall_complete(msg->ring, msg->sqe.user_data,
+					     -ECANCELED);
+			free(msg);
+		}
+	}
+	pthread_mutex_unlock(&net->lock);
+
+	vm->net = NULL;
+	free(net);
+}
@@ -0,0 +1,348 @@
+/*
+ * Copyright 2022 Gavin Shan <gshan@redhat.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#include "sandbox.h"
+
+/*
+ * The loaded and relocated ELF images are cached on disk, keyed by their
+ * build ID and load bias. The cache file consists of the header, the
+ * segment descriptors and the segment contents. Each segment's content
+ * covers the pages where the segment resides and starts at page boundary
+ * in the cache file, so that it can be mapped directly to the guest RAM.
+ */
+#define ELF_CACHE_DIR		"/var/tmp/sandbox"	/* Suffixed by UID */
+#define ELF_CACHE_MAGIC		0x43584253	/* "SBXC" */
+#define ELF_CACHE_VERSION	1
+
+struct elf_cache_hdr {
+	uint32_t	magic;
+	uint32_t	version;
+	uint64_t	page_size;
+	uint64_t	bias;
+	uint64_t	entry;
+	uint64_t	dynamic;
+	uint32_t	nr_segs;
+	uint32_t	build_id_len;
+	uint8_t		build_id[ELF_BUILD_ID_MAX];
+};
+
+struct elf_cache_seg {
+	uint64_t	vaddr;
+	uint64_t	memsz;
+	uint64_t	flags;
+	uint64_t	offset;		/* Page aligned offset in cache file */
+	uint64_t	size;		/* Page aligned size of the content  */
+};
+
+struct elf_cache_fill {
+	int			fd;
+	struct elf_cache_seg	*cs;
+};
+
+static int elf_cache_fill(void *addr, void *data)
+{
+	struct elf_cache_fill *fill = data;
+
+	if (pread(fill->fd, addr, fill->cs->size, fill->cs->offset) !=
+	    fill->cs->size)
+		return -EIO;
+
+	return 0;
+}
+
+/*
+ * The cache directory is private to the user, so that the code images
+ * can't be planted by others. It's created if needed, and isn't trusted
+ * unless it's owned by the user and inaccessible to others.
+ */
+static int elf_cache_dir(char *dir, int len)
+{
+	const char *env;
+	struct stat st;
+
+	env = getenv("SANDBOX_ELF_CACHE");
+	if (env) {
+		snprintf(dir, len, "%s", env);
+	} else {
+		env = getenv("XDG_CACHE_HOME");
+		if (env && *env)
+			snprintf(dir, len, "%s/sandbox", env);
+		else
+			snprintf(dir, len, "%s-%u", ELF_CACHE_DIR, getuid());
+	}
+
+	if (mkdir(dir, 0700) && errno != EEXIST)
+		return -ENOENT;
+
+	if (lstat(dir, &st) || !S_ISDIR(st.st_mode) ||
+	    st.st_uid != getuid() || (st.st_mode & 0077)) {
+		fprintf(stderr, "%s: Untrusted cache directory <%s>\n",
+			__func__, dir);
+		return -ENOENT;
+	}
+
+	return 0;
+}
+
+static int elf_cache_path(struct elf_image *image, char *path, int len)
+{
+	char id[ELF_BUILD_ID_MAX * 2 + 1];
+	char dir[PATH_MAX];
+	int i;
+
+	/* The cache is disabled if the image has no build ID */
+	if (!image->build_id_len)
+		return -ENOENT;
+
+	if (elf_cache_dir(dir, sizeof(dir)))
+		return -ENOENT;
+
+	for (i = 0; i < image->build_id_len; i++)
+		sprintf(&id[i * 2], "%02x", image->build_id[i]);
+
+	snprintf(path, len, "%s/%s-%lx.img", dir, id, image->bias);
+
+	return 0;
+}
+
+/*
+ * The cached segment should match the image's loadable segment, and its
+ * content should be in the cache file.
+ */
+static bool elf_cache_check_segment(struct elf_image *image,
+				    struct elf64_phdr *phdr,
+				    struct elf_cache_seg *cs,
+				    unsigned long data_start,
+				    unsigned long file_size)
+{
+	unsigned long page_size = image->vm->mm.page_size;
+
+	return phdr->p_vaddr + image->bias == cs->vaddr		&&
+	       phdr->p_memsz == cs->memsz			&&
+	       phdr->p_flags == cs->flags			&&
+	       !(cs->offset & (page_size - 1))			&&
+	       cs->offset >= data_start				&&
+	       cs->size == ALIGN(cs->vaddr + cs->memsz, page_size) -
+			   ALIGN_DOWN(cs->vaddr, page_size)	&&
+	       cs->offset + cs->size > cs->offset		&&
+	       cs->offset + cs->size <= file_size;
+}
+
+/**
+ * elf_cache_restore - Restore the ELF image from the cache
+ * @image:	ELF image whose headers and build ID have been parsed
+ *
+ * The segment contents are mapped from the cache file to the guest RAM
+ * privately, instead of being read and relocated. It returns zero on
+ * cache hit, -ENOENT on cache miss, or other negative error code when
+ * the image has been partially restored.
+ */
+int elf_cache_restore(struct elf_image *image)
+{
+	struct kvm_vm *vm = image->vm;
+	struct elf_cache_hdr hdr;
+	struct elf_cache_seg *cs = NULL;
+	struct elf64_phdr *phdr;
+	struct elf_segment *seg;
+	struct elf_cache_fill fill;
+	struct stat st;
+	char path[PATH_MAX];
+	unsigned long size, phys;
+	int fd, i, n, ret;
+
+	ret = elf_cache_path(image, path, sizeof(path));
+	if (ret)
+		return ret;
+
+	fd = open(path, O_RDONLY | O_NOFOLLOW);
+	if (fd < 0)
+		return -ENOENT;
+
+	/* The mismatched or truncated cache file is treated as cache miss */
+	ret = -ENOENT;
+	if (fstat(fd, &st) || !S_ISREG(st.st_mode)			||
+	    st.st_uid != getuid()					||
+	    pread(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr)		||
+	    hdr.magic != ELF_CACHE_MAGIC				||
+	    hdr.version != ELF_CACHE_VERSION				||
+	    hdr.page_size != vm->mm.page_size				||
+	    hdr.bias != image->bias					||
+	    hdr.build_id_len != image->build_id_len			||
+	    memcmp(hdr.build_id, image->build_id, hdr.build_id_len)	||
+	    hdr.entry != image->entry					||
+	    hdr.dynamic != image->dynamic				||
+	    !hdr.nr_segs || hdr.nr_segs > image->hdr.e_phnum)
+		goto out;
+
+	size = hdr.nr_segs * sizeof(*cs);
+	cs = malloc(size);
+	if (!cs) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	if (pread(fd, cs, size, sizeof(hdr)) != size)
+		goto out;
+
+	/*
+	 * All segments are validated before any of them is added. There is
+	 * one record for each loadable segment, in the same order.
+	 */
+	for (i = 0, n = 0; i < image->hdr.e_phnum; i++) {
+		phdr = (void *)image->phdrs + i * image->hdr.e_phentsize;
+		if (phdr->p_type != ELF64_PHDR_TYPE_LOAD)
+			continue;
+
+		if (n >= hdr.nr_segs ||
+		    !elf_cache_check_segment(image, phdr, &cs[n],
+					     sizeof(hdr) + size, st.st_size)) {
+			fprintf(stderr, "%s: Invalid segment %d in <%s>\n",
+				__func__, n, path);
+			goto out;
+		}
+
+		n++;
+	}
+
+	if (n != hdr.nr_segs) {
+		fprintf(stderr, "%s: Invalid segments in <%s>\n",
+			__func__, path);
+		goto out;
+	}
+
+	for (i = 0; i < hdr.nr_segs; i++) {
+		/*
+		 * The read-only segments are shared by VMs, or through the
+		 * host page cache of the cache file for the mappable image.
+		 */
+		if (!(cs[i].flags & ELF64_PHDR_FLAG_W) && !image->mappable) {
+			fill.fd = fd;
+			fill.cs = &cs[i];
+			seg = elf_image_add_shared_segment(image, cs[i].vaddr,
+					cs[i].memsz, cs[i].flags,
+					elf_cache_fill, &fill);
+			if (!seg) {
+				ret = -ENOMEM;
+				goto out;
+			}
+
+			continue;
+		}
+
+		seg = elf_image_add_segment(image, cs[i].vaddr,
+					    cs[i].memsz, cs[i].flags);
+		if (!seg) {
+			ret = -ENOMEM;
+			goto out;
+		}
+
+		/*
+		 * The pages are mapped privately, so that the cache file
+		 * isn't affected when the guest writes to them.
+		 */
+		phys = ALIGN_DOWN(seg->hva, vm->mm.page_size) -
+		       (unsigned long)vm->mm.host_virt_addr +
+		       (vm->mm.phys_page_base << vm->mm.page_shift);
+		pthread_mutex_lock(&vm->lock);
+		ret = kvm_mm_map_ram_file(vm, phys, cs[i].size,
+					  fd, cs[i].offset);
+		pthread_mutex_unlock(&vm->lock);
+		if (ret) {
+			fprintf(stderr, "%s: Unable to map segment %d from <%s>\n",
+				__func__, i, path);
+			goto out;
+		}
+	}
+
+	image->entry = hdr.entry;
+	image->dynamic = hdr.dynamic;
+	ret = 0;
+out:
+	if (cs)
+		free(cs);
+	close(fd);
+
+	return ret;
+}
+
+/**
+ * elf_cache_store - Store the loaded and relocated ELF image to the cache
+ * @image:	loaded and relocated ELF image
+ *
+ * The cache file is written to a temporary file, which is renamed to the
+ * target one at last. The concurrent sandboxes won't see partially written
+ * cache file. The failure is ignored because the cache is optional.
+ */
+void elf_cache_store(struct elf_image *image)
+{
+	struct kvm_vm *vm = image->vm;
+	struct elf_cache_hdr hdr;
+	struct elf_cache_seg *cs;
+	struct elf_segment *seg;
+	char path[PATH_MAX], tmp[PATH_MAX + 8];
+	unsigned long offset, start;
+	int fd = -1, i;
+
+	if (elf_cache_path(image, path, sizeof(path)))
+		return;
+
+	cs = calloc(image->nr_segs, sizeof(*cs));
+	if (!cs)
+		return;
+
+	snprintf(tmp, sizeof(tmp), "%s.XXXXXX", path);
+	fd = mkstemp(tmp);
+	if (fd < 0)
+		goto out;
+
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.magic = ELF_CACHE_MAGIC;
+	hdr.version = ELF_CACHE_VERSION;
+	hdr.page_size = vm->mm.page_size;
+	hdr.bias = image->bias;
+	hdr.entry = image->entry;
+	hdr.dynamic = image->dynamic;
+	hdr.nr_segs = image->nr_segs;
+	hdr.build_id_len = image->build_id_len;
+	memcpy(hdr.build_id, image->build_id, image->build_id_len);
+
+	offset = ALIGN(sizeof(hdr) + image->nr_segs * sizeof(*cs),
+		       vm->mm.page_size);
+	for (i = 0; i < image->nr_segs; i++) {
+		seg = &image->segs[i];
+		start = ALIGN_DOWN(seg->vaddr, vm->mm.page_size);
+		cs[i].vaddr = seg->vaddr;
+		cs[i].memsz = seg->memsz;
+		cs[i].flags = seg->flags;
+		cs[i].offset = offset;
+		cs[i].size = ALIGN(seg->vaddr + seg->memsz, vm->mm.page_size) -
+			     start;
+
+		if (pwrite(fd, (void *)(seg->hva - (seg->vaddr - start)),
+			   cs[i].size, cs[i].offset) != cs[i].size)
+			goto error;
+
+		offset += cs[i].size;
+	}
+
+	if (pwrite(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr) ||
+	    pwrite(fd, cs, image->nr_segs * sizeof(*cs), sizeof(hdr)) !=
+	    image->nr_segs * sizeof(*cs))
+		goto error;
+
+	if (!rename(tmp, path))
+		goto out;
+error:
+	fprintf(stderr, "%s: Unable to write <%s>\n", __func__, path);
+	unlink(tmp);
+out:
+	if (fd >= 0)
+		close(fd);
+	free(cs);
+}
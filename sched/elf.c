@@ -9,148 +9,699 @@
 
 #include "sandbox.h"
 
-static int elf_handle_header(int fd, struct elf64_hdr *hdr)
+/**
+ * elf_image_read - Read from the ELF image
+ * @image:	ELF image
+ * @buf:	buffer where the data is stored
+ * @len:	length of the data to be read
+ * @offset:	offset in the ELF image
+ *
+ * It returns the number of bytes read, or -1 on failure.
+ */
+ssize_t elf_image_read(struct elf_image *image,
+		       void *buf,
+		       unsigned long len,
+		       unsigned long offset)
 {
-	off_t offset;
-	int ret;
+	return pread(image->fd, buf, len, image->offset + offset);
+}
 
-	offset = lseek(fd, 0, SEEK_SET);
-	if (offset < 0) {
-		fprintf(stderr, "%s: Unable to seek header\n",
-			__func__);
-		return -EIO;
+/**
+ * elf_image_translate - Translate virtual address to host virtual address
+ * @image:	loaded ELF image
+ * @vaddr:	virtual address, where the load bias has been applied
+ * @len:	length of the range to be accessed
+ *
+ * The range specified by @vaddr and @len should be covered by one loaded
+ * program segment. The host virtual address is returned on success.
+ * Otherwise, NULL is returned.
+ */
+void *elf_image_translate(struct elf_image *image,
+			  unsigned long vaddr,
+			  unsigned long len)
+{
+	struct elf_segment *seg;
+	int i;
+
+	for (i = 0; i < image->nr_segs; i++) {
+		seg = &image->segs[i];
+		if (vaddr < seg->vaddr ||
+		    vaddr + len > seg->vaddr + seg->memsz)
+			continue;
+
+		return (void *)(seg->hva + (vaddr - seg->vaddr));
 	}
 
-	ret = read(fd, hdr, sizeof(*hdr));
+	return NULL;
+}
+
+static int elf_handle_header(struct elf_image *image)
+{
+	struct elf64_hdr *hdr = &image->hdr;
+	ssize_t ret;
+
+	ret = elf_image_read(image, hdr, sizeof(*hdr), 0);
 	if (ret != sizeof(*hdr)) {
 		fprintf(stderr, "%s: Unable to read header\n",
 			__func__);
 		return -EIO;
 	}
 
-	if (hdr->e_type != ELF64_HDR_TYPE_EXEC) {
+	if (hdr->e_type != ELF64_HDR_TYPE_EXEC &&
+	    hdr->e_type != ELF64_HDR_TYPE_DYN) {
 		fprintf(stderr, "%s: Not a executable file (0x%04x)\n",
 			__func__, hdr->e_type);
 		return -EINVAL;
 	}
 
+	if (!hdr->e_phnum || hdr->e_phentsize < sizeof(struct elf64_phdr)) {
+		fprintf(stderr, "%s: Invalid program headers (%d, 0x%x)\n",
+			__func__, hdr->e_phnum, hdr->e_phentsize);
+		return -EINVAL;
+	}
+
 	return 0;
 }
 
-static int elf_load_segments(struct kvm_vm *vm,
-			     int fd,
-			     struct elf64_hdr *hdr,
-			     struct elf64_phdr *phdr)
+static int elf_handle_program_headers(struct elf_image *image)
 {
-	struct vm_area *vma;
-	unsigned long phys, addr;
-	off_t offset;
-	int i, ret;
+	struct elf64_hdr *hdr = &image->hdr;
+	struct elf64_phdr *phdr;
+	unsigned long size, min_vaddr = ~0UL;
+	ssize_t ret;
+	int i;
+
+	/* Read all program headers at once */
+	size = hdr->e_phnum * hdr->e_phentsize;
+	image->phdrs = malloc(size);
+	if (!image->phdrs) {
+		fprintf(stderr, "%s: Unable to alloc program headers\n",
+			__func__);
+		return -ENOMEM;
+	}
+
+	ret = elf_image_read(image, image->phdrs, size, hdr->e_phoff);
+	if (ret != size) {
+		fprintf(stderr, "%s: Unable to read program headers\n",
+			__func__);
+		return -EIO;
+	}
+
+	image->segs = calloc(hdr->e_phnum, sizeof(*image->segs));
+	if (!image->segs) {
+		fprintf(stderr, "%s: Unable to alloc segments\n", __func__);
+		return -ENOMEM;
+	}
+
+	for (i = 0; i < hdr->e_phnum; i++) {
+		phdr = (void *)image->phdrs + i * hdr->e_phentsize;
+		if (phdr->p_type == ELF64_PHDR_TYPE_LOAD) {
+			if (phdr->p_filesz > phdr->p_memsz ||
+			    phdr->p_vaddr + phdr->p_memsz < phdr->p_vaddr) {
+				fprintf(stderr, "%s: Invalid program segment %d\n",
+					__func__, i);
+				return -ENOEXEC;
+			}
+
+			min_vaddr = min(min_vaddr, phdr->p_vaddr);
+		} else if (phdr->p_type == ELF64_PHDR_TYPE_DYNAMIC) {
+			image->dynamic = phdr->p_vaddr;
+		}
+	}
+
+	if (min_vaddr == ~0UL) {
+		fprintf(stderr, "%s: No loadable segments\n", __func__);
+		return -ENOEXEC;
+	}
 
 	/*
-	 * There is no program headers, which shouldn't happen.
-	 * However, it'd better to double check.
+	 * The position independent executable is linked at zero. It's
+	 * moved to ELF_DYN_LOAD_BASE, whose difference is the load bias.
 	 */
-	if (!hdr->e_phnum)
-		return 0;
+	if (hdr->e_type == ELF64_HDR_TYPE_DYN)
+		image->bias = ELF_DYN_LOAD_BASE -
+			      ALIGN_DOWN(min_vaddr, image->vm->mm.page_size);
 
-	for (i = 0; i < hdr->e_phnum; i++) {
-		offset = lseek(fd, hdr->e_phoff + i * hdr->e_phentsize, SEEK_SET);
-		if (offset < 0) {
-			fprintf(stderr, "%s: Unable seek program header %d\n",
-				__func__, i);
+	image->entry = hdr->e_entry + image->bias;
+	if (image->dynamic)
+		image->dynamic += image->bias;
+
+	return 0;
+}
+
+/**
+ * elf_image_add_segment - Populate memory for one program segment
+ * @image:	ELF image
+ * @vaddr:	virtual address of the segment, where load bias is applied
+ * @memsz:	size of the segment in memory
+ * @flags:	segment flags (ELF64_PHDR_FLAG_*)
+ *
+ * The segment isn't necessarily aligned to page boundary. The pages
+ * covering the segment are allocated and mapped. The segment struct is
+ * returned on success. Otherwise, NULL is returned.
+ */
+struct elf_segment *elf_image_add_segment(struct elf_image *image,
+					  unsigned long vaddr,
+					  unsigned long memsz,
+					  unsigned long flags)
+{
+	struct kvm_vm *vm = image->vm;
+	struct elf_segment *seg;
+	struct vm_area *vma;
+	unsigned long start, end, phys;
+
+	start = ALIGN_DOWN(vaddr, vm->mm.page_size);
+	end = ALIGN(vaddr + memsz, vm->mm.page_size);
+	pthread_mutex_lock(&vm->lock);
+	phys = kvm_mm_alloc_phys_pages(vm, (end - start) >> vm->mm.page_shift);
+	vma = mm_vma_alloc(vm->mm.mm, start, end - start,
+			   MM_VMA_FLAG_FIXED, 0);
+	if (!phys || !vma || kvm_mm_map(vm, phys, vma->start, end - start)) {
+		fprintf(stderr, "%s: Unable to alloc segment at 0x%lx\n",
+			__func__, vaddr);
+		if (phys)
+			kvm_mm_free_phys_pages(vm, phys,
+					       (end - start) >> vm->mm.page_shift);
+		if (vma)
+			mm_vma_free(vm->mm.mm, vma);
+		pthread_mutex_unlock(&vm->lock);
+		return NULL;
+	}
+	pthread_mutex_unlock(&vm->lock);
+
+	seg = &image->segs[image->nr_segs++];
+	seg->vaddr = vaddr;
+	seg->memsz = memsz;
+	seg->hva = kvm_mm_gpa_to_hva(vm, phys) + (vaddr - start);
+	seg->flags = flags;
+
+	return seg;
+}
+
+/*
+ * The shared segment is identified by the build ID, or the file identity
+ * if the build ID is missed, plus the segment's position in the image.
+ * The load bias isn't included because the read-only segments aren't
+ * relocated.
+ */
+static int elf_shared_key(struct elf_image *image,
+			  unsigned long vaddr,
+			  unsigned long memsz,
+			  uint8_t *key)
+{
+	struct stat st;
+	uint64_t *p;
+	int len;
+
+	if (image->build_id_len) {
+		memcpy(key, image->build_id, image->build_id_len);
+		len = image->build_id_len;
+	} else {
+		if (fstat(image->fd, &st))
 			return -EIO;
+
+		p = (uint64_t *)key;
+		p[0] = st.st_dev;
+		p[1] = st.st_ino;
+		p[2] = st.st_mtim.tv_sec;
+		p[3] = st.st_mtim.tv_nsec;
+		p[4] = image->offset;
+		len = 5 * sizeof(uint64_t);
+	}
+
+	p = (uint64_t *)(key + ALIGN(len, sizeof(uint64_t)));
+	p[0] = vaddr - image->bias;
+	p[1] = memsz;
+
+	return ALIGN(len, sizeof(uint64_t)) + 2 * sizeof(uint64_t);
+}
+
+/**
+ * elf_image_add_shared_segment - Add read-only segment shared by VMs
+ * @image:	ELF image
+ * @vaddr:	virtual address of the segment, where load bias is applied
+ * @memsz:	size of the segment in memory
+ * @flags:	segment flags (ELF64_PHDR_FLAG_*)
+ * @fill:	callback to fill the pages covering the segment on cache miss
+ * @data:	private data passed to @fill
+ *
+ * The pages covering the segment are taken from the host-wide cache of
+ * the shared segments, instead of the guest RAM. They are attached as
+ * a read-only memory slot and mapped read-only. The segment struct is
+ * returned on success. Otherwise, NULL is returned.
+ */
+struct elf_segment *elf_image_add_shared_segment(struct elf_image *image,
+				unsigned long vaddr,
+				unsigned long memsz,
+				unsigned long flags,
+				int (*fill)(void *addr, void *data),
+				void *data)
+{
+	struct kvm_vm *vm = image->vm;
+	struct kvm_shared_seg *shared;
+	struct kvm_mem_slot *slot;
+	struct elf_segment *seg;
+	struct vm_area *vma;
+	unsigned long start, end;
+	uint8_t key[sizeof(shared->key)];
+	int len;
+
+	start = ALIGN_DOWN(vaddr, vm->mm.page_size);
+	end = ALIGN(vaddr + memsz, vm->mm.page_size);
+	len = elf_shared_key(image, vaddr, memsz, key);
+	if (len < 0)
+		return NULL;
+
+	shared = kvm_shared_get(key, len, end - start, fill, data);
+	if (!shared) {
+		fprintf(stderr, "%s: Unable to get shared segment at 0x%lx\n",
+			__func__, vaddr);
+		return NULL;
+	}
+
+	pthread_mutex_lock(&vm->lock);
+	slot = kvm_shared_attach(vm, shared);
+	if (!slot) {
+		pthread_mutex_unlock(&vm->lock);
+		kvm_shared_put(shared);
+		return NULL;
+	}
+
+	vma = mm_vma_alloc(vm->mm.mm, start, end - start,
+			   MM_VMA_FLAG_FIXED, 0);
+	if (!vma ||
+	    kvm_mm_map_prot(vm, slot->gpa, vma->start, end - start,
+			    KVM_MM_PTE_DEFAULT | KVM_MM_PTE_AP_RO)) {
+		fprintf(stderr, "%s: Unable to alloc segment at 0x%lx\n",
+			__func__, vaddr);
+		if (vma)
+			mm_vma_free(vm->mm.mm, vma);
+		kvm_mm_remove_slot(vm, slot);
+		pthread_mutex_unlock(&vm->lock);
+		kvm_shared_put(shared);
+		return NULL;
+	}
+	pthread_mutex_unlock(&vm->lock);
+
+	seg = &image->segs[image->nr_segs++];
+	seg->vaddr = vaddr;
+	seg->memsz = memsz;
+	seg->hva = (unsigned long)slot->hva + (vaddr - start);
+	seg->flags = flags;
+	seg->slot = slot;
+
+	return seg;
+}
+
+/*
+ * Release the segments which have been added, when the image fails to be
+ * loaded. The guest RAM mapped from the image or the cache file is backed
+ * by the anonymous memory again when it's freed.
+ */
+static void elf_image_remove_segments(struct elf_image *image)
+{
+	struct kvm_vm *vm = image->vm;
+	struct kvm_vm_mm *mm = &vm->mm;
+	struct kvm_shared_seg *shared;
+	struct elf_segment *seg;
+	struct vm_area *vma;
+	unsigned long start, end, hva, phys;
+	int i;
+
+	pthread_mutex_lock(&vm->lock);
+
+	for (i = image->nr_segs - 1; i >= 0; i--) {
+		seg = &image->segs[i];
+		start = ALIGN_DOWN(seg->vaddr, mm->page_size);
+		end = ALIGN(seg->vaddr + seg->memsz, mm->page_size);
+		vma = mm_vma_find(mm->mm, start, NULL);
+		if (vma && vma->start == start) {
+			if (vma->fd >= 0 && vm->fault)
+				kvm_fault_unregister(vm, vma);
+
+			kvm_mm_unmap(vm, start, end - start);
+			mm_vma_free(mm->mm, vma);
 		}
 
-		ret = read(fd, phdr, sizeof(*phdr));
-		if (ret != sizeof(*phdr)) {
-			fprintf(stderr, "%s: Unable to read program header %d\n",
-				__func__, i);
+		if (seg->slot) {
+			shared = seg->slot->shared;
+			kvm_mm_remove_slot(vm, seg->slot);
+			kvm_shared_put(shared);
+			continue;
+		}
+
+		hva = ALIGN_DOWN(seg->hva, mm->page_size);
+		phys = (hva - (unsigned long)mm->host_virt_addr) +
+		       (mm->phys_page_base << mm->page_shift);
+		kvm_mm_free_phys_pages(vm, phys,
+				       (end - start) >> mm->page_shift);
+	}
+
+	image->nr_segs = 0;
+
+	pthread_mutex_unlock(&vm->lock);
+}
+
+static int elf_handle_notes(struct elf_image *image)
+{
+	struct elf64_hdr *hdr = &image->hdr;
+	struct elf64_phdr *phdr;
+	struct elf64_note *note;
+	unsigned long offset, name_off, desc_off;
+	char buf[1024];
+	ssize_t ret;
+	int i;
+
+	for (i = 0; i < hdr->e_phnum; i++) {
+		phdr = (void *)image->phdrs + i * hdr->e_phentsize;
+		if (phdr->p_type != ELF64_PHDR_TYPE_NOTE)
+			continue;
+
+		ret = elf_image_read(image, buf,
+				     min(phdr->p_filesz, sizeof(buf)),
+				     phdr->p_offset);
+		if (ret < 0)
 			return -EIO;
+
+		/* The name and descriptor are aligned to 4 bytes */
+		for (offset = 0; offset + sizeof(*note) <= ret;
+		     offset = desc_off + ALIGN(note->n_descsz, 4)) {
+			note = (struct elf64_note *)&buf[offset];
+			name_off = offset + sizeof(*note);
+			desc_off = name_off + ALIGN(note->n_namesz, 4);
+			if (desc_off + note->n_descsz > ret)
+				break;
+
+			if (note->n_type != ELF64_NOTE_TYPE_GNU_BUILD_ID ||
+			    note->n_namesz != 4 ||
+			    memcmp(&buf[name_off], "GNU", 4) ||
+			    note->n_descsz > ELF_BUILD_ID_MAX)
+				continue;
+
+			memcpy(image->build_id, &buf[desc_off], note->n_descsz);
+			image->build_id_len = note->n_descsz;
+			return 0;
 		}
+	}
 
+	return 0;
+}
+
+/*
+ * The pages covering the file image of the segment are mapped from the
+ * file privately, so that the page cache is shared. The file offset and
+ * virtual address of the segment are congruent modulo the page size.
+ */
+static int elf_map_segment(struct elf_image *image,
+			   struct elf_segment *seg,
+			   struct elf64_phdr *phdr)
+{
+	struct kvm_vm *vm = image->vm;
+	unsigned long hva, offset, size, phys;
+	struct stat st;
+	int ret;
+
+	if (!phdr->p_filesz)
+		return 0;
+
+	hva = ALIGN_DOWN(seg->hva, vm->mm.page_size);
+	offset = image->offset + phdr->p_offset - (seg->hva - hva);
+	size = ALIGN(seg->hva + phdr->p_filesz, vm->mm.page_size) - hva;
+	if (offset & (vm->mm.page_size - 1)) {
+		fprintf(stderr, "%s: Unaligned segment at 0x%lx\n",
+			__func__, seg->vaddr);
+		return -ENOEXEC;
+	}
+
+	/* The pages beyond the end of file can't be accessed */
+	if (fstat(image->fd, &st) ||
+	    offset + size > ALIGN(st.st_size, vm->mm.page_size)) {
+		fprintf(stderr, "%s: Truncated segment at 0x%lx\n",
+			__func__, seg->vaddr);
+		return -ENOEXEC;
+	}
+
+	phys = hva - (unsigned long)vm->mm.host_virt_addr +
+	       (vm->mm.phys_page_base << vm->mm.page_shift);
+	pthread_mutex_lock(&vm->lock);
+	ret = kvm_mm_map_ram_file(vm, phys, size, image->fd, offset);
+	pthread_mutex_unlock(&vm->lock);
+	if (ret) {
+		fprintf(stderr, "%s: Unable to map segment at 0x%lx\n",
+			__func__, seg->vaddr);
+		return ret;
+	}
+
+	return 0;
+}
+
+struct elf_shared_fill {
+	struct elf_image	*image;
+	struct elf64_phdr	*phdr;
+};
+
+static int elf_fill_shared_segment(void *addr, void *data)
+{
+	struct elf_shared_fill *fill = data;
+	struct elf_image *image = fill->image;
+	struct elf64_phdr *phdr = fill->phdr;
+	unsigned long vaddr = phdr->p_vaddr + image->bias;
+	ssize_t ret;
+
+	/* The memfd is zero-filled, including the area beyond file image */
+	addr += vaddr - ALIGN_DOWN(vaddr, image->vm->mm.page_size);
+	ret = elf_image_read(image, addr, phdr->p_filesz, phdr->p_offset);
+	if (ret != phdr->p_filesz) {
+		fprintf(stderr, "%s: Unable to read segment at 0x%lx\n",
+			__func__, vaddr);
+		return -EIO;
+	}
+
+	return 0;
+}
+
+/*
+ * The pages covering the segment aren't populated until they're accessed.
+ * The file image is read on the first access by the fault handler. The
+ * pages, which can have been zeroed in advance, are dropped so that the
+ * accesses to them are reported as missing pages.
+ */
+static int elf_lazy_segment(struct elf_image *image,
+			    struct elf_segment *seg,
+			    struct elf64_phdr *phdr)
+{
+	struct kvm_vm *vm = image->vm;
+	struct vm_area *vma;
+	int ret;
+
+	vma = mm_vma_find(vm->mm.mm, seg->vaddr, NULL);
+	if (!vma)
+		return -EINVAL;
+
+	vma->fd = dup(image->fd);
+	if (vma->fd < 0)
+		return -errno;
+
+	vma->file_start = seg->vaddr;
+	vma->file_offset = image->offset + phdr->p_offset;
+	vma->file_size = phdr->p_filesz;
+	vma->hva = ALIGN_DOWN(seg->hva, vm->mm.page_size);
+	if (madvise((void *)vma->hva, vma->end - vma->start, MADV_DONTNEED)) {
+		ret = -errno;
+		fprintf(stderr, "%s: Unable to drop pages at 0x%lx\n",
+			__func__, vma->start);
+		return ret;
+	}
+
+	return kvm_fault_register(vm, vma);
+}
+
+static int elf_load_segments(struct elf_image *image)
+{
+	struct elf64_hdr *hdr = &image->hdr;
+	struct elf64_phdr *phdr;
+	struct elf_segment *seg;
+	struct elf_shared_fill fill;
+	ssize_t ret;
+	int i;
+
+	for (i = 0; i < hdr->e_phnum; i++) {
+		phdr = (void *)image->phdrs + i * hdr->e_phentsize;
 		if (phdr->p_type != ELF64_PHDR_TYPE_LOAD)
 			continue;
 
-		phys = kvm_mm_alloc_phys_pages(vm,
-				DIV_ROUND_UP(phdr->p_memsz, vm->mm.page_size));
-		vma = mm_vma_alloc(vm->mm.mm,
-				   ALIGN_DOWN(phdr->p_vaddr, vm->mm.page_size),
-				   ALIGN(phdr->p_memsz, vm->mm.page_size),
-				   MM_VMA_FLAG_FIXED, 0);
-		kvm_mm_map(vm, phys, vma->start,
-			   ALIGN(phdr->p_memsz, vm->mm.page_size));
-		addr = kvm_mm_gpa_to_hva(vm, phys) +
-				(phdr->p_vaddr & (vm->mm.page_size - 1));
-		offset = lseek(fd, phdr->p_offset, SEEK_SET);
-		if (offset < 0) {
-			fprintf(stderr, "%s: Unable to seek program segment %d\n",
-				__func__, i);
-			return -EIO;
+		/*
+		 * The read-only segments are shared by VMs. The segments of
+		 * the mappable image are shared through the host page cache
+		 * instead. The shared segments are filled once, so they can't
+		 * be populated lazily on the first access of each VM.
+		 */
+		if (!(phdr->p_flags & ELF64_PHDR_FLAG_W) &&
+		    !image->mappable && !image->vm->fault) {
+			fill.image = image;
+			fill.phdr = phdr;
+			seg = elf_image_add_shared_segment(image,
+					phdr->p_vaddr + image->bias,
+					phdr->p_memsz, phdr->p_flags,
+					elf_fill_shared_segment, &fill);
+			if (!seg)
+				return -ENOMEM;
+
+			continue;
+		}
+
+		seg = elf_image_add_segment(image, phdr->p_vaddr + image->bias,
+					    phdr->p_memsz, phdr->p_flags);
+		if (!seg)
+			return -ENOMEM;
+
+		if (image->mappable) {
+			ret = elf_map_segment(image, seg, phdr);
+			if (ret)
+				return ret;
+
+			goto zero;
 		}
 
-		ret = read(fd, (void *)addr, phdr->p_memsz);
-		if (ret != phdr->p_memsz) {
+		if (image->vm->fault) {
+			ret = elf_lazy_segment(image, seg, phdr);
+			if (ret)
+				return ret;
+
+			continue;
+		}
+
+		ret = elf_image_read(image, (void *)seg->hva,
+				     phdr->p_filesz, phdr->p_offset);
+		if (ret != phdr->p_filesz) {
 			fprintf(stderr, "%s: Unable to read program segment %d\n",
 				__func__, i);
 			return -EIO;
 		}
+zero:
+		/* The area beyond the file image (e.g. BSS) is zeroed */
+		memset((void *)(seg->hva + phdr->p_filesz), 0,
+		       phdr->p_memsz - phdr->p_filesz);
 	}
 
 	return 0;
 }
 
-int elf_load_file(struct kvm_vm *vm,
-		  char *filename,
-		  unsigned long *pentry)
+/**
+ * elf_load - Load ELF image
+ * @vm:		VM where the image is loaded
+ * @fd:		file descriptor, owned by this function
+ * @offset:	offset of the ELF image in the file
+ * @mappable:	the file is immutable and the segments can be mapped
+ * @pentry:	entry point of the loaded image
+ *
+ * It returns zero on success, or negative error code on failure.
+ */
+int elf_load(struct kvm_vm *vm,
+	     int fd,
+	     unsigned long offset,
+	     bool mappable,
+	     unsigned long *pentry)
 {
-	struct elf64_hdr *hdr = NULL;
-	struct elf64_phdr *phdr = NULL;
-	struct elf64_shdr *shdr = NULL;
-	int fd = 0, ret;
+	struct elf_image *image;
+	bool cached = false;
+	int ret;
 
-	/* Open the file */
-	fd = open(filename, O_RDWR);
-	if (fd < 0) {
-		fprintf(stderr, "%s: Unable to open <%s>\n",
-			__func__, filename);
-		ret = fd;
-		goto out;
+	image = malloc(sizeof(*image));
+	if (!image) {
+		fprintf(stderr, "%s: Unable to alloc image\n", __func__);
+		close(fd);
+		return -ENOMEM;
 	}
 
-	/* Alloc various headers */
-	hdr = malloc(sizeof(*hdr));
-	phdr = malloc(sizeof(*phdr));
-	shdr = malloc(sizeof(*shdr));
-	if (!hdr || !phdr || !shdr) {
-		fprintf(stderr, "%s: Unable to alloc headers\n",
-			__func__);
-		ret = -ENOMEM;
-		goto out;
-	}
+	memset(image, 0, sizeof(*image));
+	image->vm = vm;
+	image->fd = fd;
+	image->offset = offset;
+	image->mappable = mappable;
+	INIT_LIST_HEAD(&image->link);
 
 	/* Read header and ensure it's a executable program */
-	ret = elf_handle_header(fd, hdr);
+	ret = elf_handle_header(image);
 	if (ret)
 		goto out;
 
-	/* Load program segments */
-	ret = elf_load_segments(vm, fd, hdr, phdr);
+	/* Read program headers and figure out the load bias */
+	ret = elf_handle_program_headers(image);
 	if (ret)
 		goto out;
 
-	/* FIXME: Relocation and resolution */  
+	/* Restore the loaded and relocated image from cache if possible */
+	ret = elf_handle_notes(image);
+	if (ret)
+		goto out;
 
-	*pentry = hdr->e_entry;
-out:
-	if (shdr)
-		free(shdr);
-	if (phdr)
-		free(phdr);
-	if (hdr)
-		free(hdr);
-	if (fd > 0)
-		close(fd);
+	ret = elf_cache_restore(image);
+	if (!ret)
+		cached = true;
+	else if (ret == -ENOENT)
+		ret = elf_load_segments(image);
+	if (ret)
+		goto out;
 
+	/* Build symbol index before the file is closed and relocation */
+	ret = elf_symtab_build(image);
+	if (ret)
+		goto out;
+
+	if (!cached) {
+		ret = elf_relocate(image);
+		if (ret)
+			goto out;
+
+		/* Storing the image populates all pages, which isn't wanted */
+		if (!vm->fault)
+			elf_cache_store(image);
+	}
+
+	close(image->fd);
+	image->fd = -1;
+	list_add_tail(&vm->image_list, &image->link);
+	*pentry = image->entry;
+	return 0;
+out:
+	elf_image_remove_segments(image);
+	elf_image_destroy(image);
 	return ret;
 }
+
+int elf_load_file(struct kvm_vm *vm,
+		  char *filename,
+		  unsigned long *pentry)
+{
+	int fd;
+
+	/* Open the file */
+	fd = open(filename, O_RDONLY);
+	if (fd < 0) {
+		fprintf(stderr, "%s: Unable to open <%s>\n",
+			__func__, filename);
+		return -ENOENT;
+	}
+
+	/* The sandbox package is loaded in a different way */
+	if (pkg_probe(fd))
+		return pkg_load(vm, fd, pentry);
+
+	return elf_load(vm, fd, 0, false, pentry);
+}
+
+void elf_image_destroy(struct elf_image *image)
+{
+	if (!list_empty(&image->link))
+		list_del(&image->link);
+
+	elf_symtab_destroy(image);
+	if (image->segs)
+		free(image->segs);
+	if (image->phdrs)
+		free(image->phdrs);
+	if (image->fd >= 0)
+		close(image->fd);
+	free(image);
+}
@@ -0,0 +1,281 @@
+/*
+ * Copyright 2022 Gavin Shan <gshan@redhat.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#include "sandbox.h"
+
+bool pkg_probe(int fd)
+{
+	uint32_t magic;
+
+	if (pread(fd, &magic, sizeof(magic), 0) != sizeof(magic))
+		return false;
+
+	return magic == PKG_MAGIC;
+}
+
+/**
+ * pkg_open - Open sandbox package
+ * @fd:		file descriptor of the package
+ *
+ * The header and the section index are read by one I/O in most cases.
+ * The package struct is returned on success. Otherwise, NULL is returned.
+ * The file descriptor is owned by this function, and closed on failure.
+ */
+struct pkg *pkg_open(int fd)
+{
+	struct pkg *pkg;
+	struct pkg_hdr *hdr;
+	struct pkg_section *sec;
+	struct stat st;
+	ssize_t ret;
+	int i;
+
+	pkg = malloc(sizeof(*pkg));
+	if (!pkg) {
+		fprintf(stderr, "%s: Unable to alloc package\n", __func__);
+		close(fd);
+		return NULL;
+	}
+
+	memset(pkg, 0, sizeof(*pkg));
+	pkg->fd = fd;
+	pkg->hdr = hdr = malloc(PKG_INDEX_SIZE);
+	if (!hdr) {
+		fprintf(stderr, "%s: Unable to alloc index\n", __func__);
+		goto error;
+	}
+
+	ret = pread(fd, hdr, PKG_INDEX_SIZE, 0);
+	if (ret < (ssize_t)sizeof(*hdr) || fstat(fd, &st) ||
+	    hdr->magic != PKG_MAGIC || hdr->version != PKG_VERSION) {
+		fprintf(stderr, "%s: Invalid package header\n", __func__);
+		goto error;
+	}
+
+	if (hdr->index_size < sizeof(*hdr) +
+			      hdr->nr_sections * sizeof(*sec) ||
+	    hdr->index_size > st.st_size ||
+	    hdr->align < getpagesize() || (hdr->align & (hdr->align - 1))) {
+		fprintf(stderr, "%s: Invalid package index\n", __func__);
+		goto error;
+	}
+
+	/* The index is too large to be covered by the first read */
+	if (hdr->index_size > ret) {
+		pkg->hdr = realloc(hdr, hdr->index_size);
+		if (!pkg->hdr) {
+			pkg->hdr = hdr;
+			goto error;
+		}
+
+		hdr = pkg->hdr;
+		if (pread(fd, (void *)hdr + ret, hdr->index_size - ret, ret) !=
+		    hdr->index_size - ret) {
+			fprintf(stderr, "%s: Unable to read index\n", __func__);
+			goto error;
+		}
+	}
+
+	pkg->sections = (struct pkg_section *)(hdr + 1);
+	for (i = 0; i < hdr->nr_sections; i++) {
+		sec = &pkg->sections[i];
+		sec->name[PKG_SECTION_NAME_LEN - 1] = '\0';
+		if (sec->offset & (hdr->align - 1)) {
+			fprintf(stderr, "%s: Unaligned section <%s>\n",
+				__func__, sec->name);
+			goto error;
+		}
+
+		/* The truncated section can't be mapped */
+		if (sec->offset < hdr->index_size ||
+		    sec->offset + sec->size < sec->offset ||
+		    sec->offset + sec->size > st.st_size) {
+			fprintf(stderr, "%s: Truncated section <%s>\n",
+				__func__, sec->name);
+			goto error;
+		}
+	}
+
+	/* The launch manifest is optional, and copied out to be terminated */
+	sec = pkg_find_section(pkg, PKG_SECTION_MANIFEST, NULL);
+	if (sec) {
+		pkg->manifest = malloc(sec->size + 1);
+		if (!pkg->manifest ||
+		    pread(fd, pkg->manifest, sec->size, sec->offset) !=
+		    sec->size) {
+			fprintf(stderr, "%s: Unable to read manifest\n",
+				__func__);
+			goto error;
+		}
+
+		pkg->manifest[sec->size] = '\0';
+		pkg->manifest_size = sec->size;
+	}
+
+	return pkg;
+
+error:
+	pkg_close(pkg);
+	return NULL;
+}
+
+void pkg_close(struct pkg *pkg)
+{
+	if (pkg->manifest)
+		free(pkg->manifest);
+	if (pkg->hdr)
+		free(pkg->hdr);
+	if (pkg->fd >= 0)
+		close(pkg->fd);
+
+	free(pkg);
+}
+
+/**
+ * pkg_find_section - Find section in the package
+ * @pkg:	opened package
+ * @type:	section type (PKG_SECTION_*)
+ * @name:	section name, or NULL to match any name
+ *
+ * The first matched section is returned, or NULL if it doesn't exist.
+ */
+struct pkg_section *pkg_find_section(struct pkg *pkg,
+				     unsigned int type,
+				     const char *name)
+{
+	struct pkg_section *sec;
+	int i;
+
+	for (i = 0; i < pkg->hdr->nr_sections; i++) {
+		sec = &pkg->sections[i];
+		if (sec->type != type)
+			continue;
+
+		if (!name || !strcmp(sec->name, name))
+			return sec;
+	}
+
+	return NULL;
+}
+
+/**
+ * pkg_map_section - Map section of the package
+ * @pkg:	opened package
+ * @sec:	section to be mapped
+ *
+ * The section is mapped read-only and shared, so that the page cache is
+ * shared by all sandboxes running the same package. NULL is returned on
+ * failure.
+ */
+void *pkg_map_section(struct pkg *pkg, struct pkg_section *sec)
+{
+	void *addr;
+
+	addr = mmap(NULL, sec->size, PROT_READ, MAP_SHARED,
+		    pkg->fd, sec->offset);
+	if (addr == MAP_FAILED) {
+		fprintf(stderr, "%s: Unable to map section <%s>\n",
+			__func__, sec->name);
+		return NULL;
+	}
+
+	return addr;
+}
+
+/**
+ * pkg_manifest_get - Retrieve value from the launch manifest
+ * @pkg:	opened package
+ * @key:	key to be searched
+ * @index:	index of the value for the repeated keys (e.g. "arg")
+ * @buf:	buffer where the value is stored
+ * @len:	length of the buffer
+ *
+ * The launch manifest consists of lines in format of "key=value". The
+ * lines starting with '#' are comments. It returns the length of the
+ * value on success, or negative error code on failure.
+ */
+int pkg_manifest_get(struct pkg *pkg,
+		     const char *key,
+		     int index,
+		     char *buf,
+		     int len)
+{
+	char *p, *end, *line, *eol;
+	int key_len = strlen(key), val_len;
+
+	if (!pkg->manifest)
+		return -ENOENT;
+
+	p = pkg->manifest;
+	end = p + pkg->manifest_size;
+	for (line = p; line < end; line = eol + 1) {
+		eol = memchr(line, '\n', end - line);
+		if (!eol)
+			eol = end;
+
+		if (*line == '#' || eol - line <= key_len ||
+		    line[key_len] != '=' || strncmp(line, key, key_len))
+			continue;
+
+		if (index-- > 0)
+			continue;
+
+		val_len = eol - line - key_len - 1;
+		if (val_len >= len)
+			return -ENOSPC;
+
+		memcpy(buf, line + key_len + 1, val_len);
+		buf[val_len] = '\0';
+		return val_len;
+	}
+
+	return -ENOENT;
+}
+
+/**
+ * pkg_load - Load the executable from the sandbox package
+ * @vm:		VM where the executable is loaded
+ * @fd:		file descriptor of the package, owned by this function
+ * @pentry:	entry point of the executable
+ *
+ * The executable is specified by "exec" in the launch manifest. The first
+ * executable section is used if it's missed. The program segments are
+ * mapped from the package file directly. It returns zero on success, or
+ * negative error code on failure.
+ */
+int pkg_load(struct kvm_vm *vm, int fd, unsigned long *pentry)
+{
+	struct pkg *pkg;
+	struct pkg_section *sec;
+	char name[PKG_SECTION_NAME_LEN];
+	int exec_fd, ret;
+
+	pkg = pkg_open(fd);
+	if (!pkg)
+		return -EINVAL;
+
+	ret = pkg_manifest_get(pkg, "exec", 0, name, sizeof(name));
+	sec = pkg_find_section(pkg, PKG_SECTION_EXEC, ret > 0 ? name : NULL);
+	if (!sec) {
+		fprintf(stderr, "%s: No executable found\n", __func__);
+		ret = -ENOEXEC;
+		goto out;
+	}
+
+	exec_fd = dup(pkg->fd);
+	if (exec_fd < 0) {
+		ret = -errno;
+		goto out;
+	}
+
+	ret = elf_load(vm, exec_fd, sec->offset, true, pentry);
+out:
+	pkg_close(pkg);
+	return ret;
+}
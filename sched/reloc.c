@@ -0,0 +1,411 @@
+/*
+ * Copyright 2022 Gavin Shan <gshan@redhat.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#include "sandbox.h"
+
+#define ELF_RELOC_BATCH		64
+
+/**
+ * struct elf_reloc - Relocation context
+ *
+ * @image:		ELF image to be relocated.
+ * @rela:		Relocation entries (DT_RELA).
+ * @nr_rela:		Number of relocation entries in @rela.
+ * @nr_relative:	Number of leading R_AARCH64_RELATIVE entries in
+ *			@rela, which is specified by DT_RELACOUNT.
+ * @jmprel:		PLT relocation entries (DT_JMPREL).
+ * @nr_jmprel:		Number of relocation entries in @jmprel.
+ * @relr:		Packed relative relocation entries (DT_RELR).
+ * @nr_relr:		Number of entries in @relr.
+ * @symtab:		Dynamic symbol table (DT_SYMTAB).
+ * @strtab:		Dynamic string table (DT_STRTAB).
+ * @strsz:		Size of the dynamic string table.
+ * @seg:		Segment where the last relocation is applied. It's
+ *			cached because the relocation entries are usually
+ *			sorted by address.
+ */
+struct elf_reloc {
+	struct elf_image	*image;
+	struct elf64_rela	*rela;
+	unsigned long		nr_rela;
+	unsigned long		nr_relative;
+	struct elf64_rela	*jmprel;
+	unsigned long		nr_jmprel;
+	uint64_t		*relr;
+	unsigned long		nr_relr;
+	struct elf64_sym	*symtab;
+	char			*strtab;
+	unsigned long		strsz;
+	struct elf_segment	*seg;
+};
+
+static uint64_t *reloc_target(struct elf_reloc *reloc, unsigned long vaddr)
+{
+	struct elf_image *image = reloc->image;
+	struct elf_segment *seg = reloc->seg;
+	int i;
+
+	if (seg && vaddr >= seg->vaddr &&
+	    vaddr + sizeof(uint64_t) <= seg->vaddr + seg->memsz)
+		return (uint64_t *)(seg->hva + (vaddr - seg->vaddr));
+
+	for (i = 0; i < image->nr_segs; i++) {
+		seg = &image->segs[i];
+		if (vaddr < seg->vaddr ||
+		    vaddr + sizeof(uint64_t) > seg->vaddr + seg->memsz)
+			continue;
+
+		/* The shared segments can't be modified (text relocation) */
+		if (seg->slot) {
+			fprintf(stderr, "%s: Relocation to read-only segment 0x%lx\n",
+				__func__, vaddr);
+			return NULL;
+		}
+
+		reloc->seg = seg;
+		return (uint64_t *)(seg->hva + (vaddr - seg->vaddr));
+	}
+
+	fprintf(stderr, "%s: Invalid relocation address 0x%lx\n",
+		__func__, vaddr);
+	return NULL;
+}
+
+static void *reloc_table(struct elf_image *image,
+			 unsigned long ptr,
+			 unsigned long size)
+{
+	if (!ptr || !size)
+		return NULL;
+
+	return elf_image_translate(image, ptr + image->bias, size);
+}
+
+static int reloc_parse_dynamic(struct elf_reloc *reloc)
+{
+	struct elf_image *image = reloc->image;
+	struct elf64_dyn *dyn;
+	unsigned long rela = 0, relasz = 0, relaent = sizeof(struct elf64_rela);
+	unsigned long jmprel = 0, pltrelsz = 0, pltrel = ELF64_DYN_TAG_RELA;
+	unsigned long relr = 0, relrsz = 0, relrent = sizeof(uint64_t);
+	unsigned long symtab = 0, strtab = 0, vaddr, i;
+
+	for (vaddr = image->dynamic;
+	     (dyn = elf_image_translate(image, vaddr, sizeof(*dyn))) &&
+	     dyn->d_tag != ELF64_DYN_TAG_NULL;
+	     vaddr += sizeof(*dyn)) {
+		switch (dyn->d_tag) {
+		case ELF64_DYN_TAG_RELA:
+			rela = dyn->d_ptr;
+			break;
+		case ELF64_DYN_TAG_RELASZ:
+			relasz = dyn->d_val;
+			break;
+		case ELF64_DYN_TAG_RELAENT:
+			relaent = dyn->d_val;
+			break;
+		case ELF64_DYN_TAG_RELACOUNT:
+			reloc->nr_relative = dyn->d_val;
+			break;
+		case ELF64_DYN_TAG_JMPREL:
+			jmprel = dyn->d_ptr;
+			break;
+		case ELF64_DYN_TAG_PLTRELSZ:
+			pltrelsz = dyn->d_val;
+			break;
+		case ELF64_DYN_TAG_PLTREL:
+			pltrel = dyn->d_val;
+			break;
+		case ELF64_DYN_TAG_RELR:
+			relr = dyn->d_ptr;
+			break;
+		case ELF64_DYN_TAG_RELRSZ:
+			relrsz = dyn->d_val;
+			break;
+		case ELF64_DYN_TAG_RELRENT:
+			relrent = dyn->d_val;
+			break;
+		case ELF64_DYN_TAG_SYMTAB:
+			symtab = dyn->d_ptr;
+			break;
+		case ELF64_DYN_TAG_STRTAB:
+			strtab = dyn->d_ptr;
+			break;
+		case ELF64_DYN_TAG_STRSZ:
+			reloc->strsz = dyn->d_val;
+			break;
+		case ELF64_DYN_TAG_REL:
+			fprintf(stderr, "%s: DT_REL isn't supported\n",
+				__func__);
+			return -ENOEXEC;
+		}
+	}
+
+	if (relaent != sizeof(struct elf64_rela) ||
+	    relrent != sizeof(uint64_t) ||
+	    (pltrelsz && pltrel != ELF64_DYN_TAG_RELA)) {
+		fprintf(stderr, "%s: Unsupported relocation format\n",
+			__func__);
+		return -ENOEXEC;
+	}
+
+	reloc->rela = reloc_table(image, rela, relasz);
+	reloc->nr_rela = reloc->rela ? (relasz / relaent) : 0;
+	reloc->nr_relative = min(reloc->nr_relative, reloc->nr_rela);
+	reloc->jmprel = reloc_table(image, jmprel, pltrelsz);
+	reloc->nr_jmprel = reloc->jmprel ? (pltrelsz / relaent) : 0;
+	reloc->relr = reloc_table(image, relr, relrsz);
+	reloc->nr_relr = reloc->relr ? (relrsz / relrent) : 0;
+	reloc->strtab = reloc_table(image, strtab, reloc->strsz);
+
+	/*
+	 * The size of the dynamic symbol table isn't provided by the dynamic
+	 * section. The symbol is translated when it's accessed.
+	 */
+	if (symtab)
+		reloc->symtab = (struct elf64_sym *)(symtab + image->bias);
+
+	if ((relasz && !reloc->rela) || (pltrelsz && !reloc->jmprel) ||
+	    (relrsz && !reloc->relr)) {
+		fprintf(stderr, "%s: Relocation table out of range\n",
+			__func__);
+		return -ENOEXEC;
+	}
+
+	/*
+	 * DT_RELACOUNT is a hint. The entries beyond the leading relative
+	 * ones are applied as the generic relocations.
+	 */
+	for (i = 0; i < reloc->nr_relative; i++) {
+		if (ELF64_RELA_TYPE(reloc->rela[i].r_info) != R_AARCH64_RELATIVE)
+			break;
+	}
+
+	reloc->nr_relative = i;
+
+	return 0;
+}
+
+/*
+ * The packed relative relocations (DT_RELR). An even entry is the address
+ * of the relocation, following by one or more odd entries. Each odd entry
+ * is a bitmap, indicating the relocations of the next 63 words.
+ */
+static int reloc_apply_relr(struct elf_reloc *reloc)
+{
+	unsigned long bias = reloc->image->bias;
+	unsigned long i, entry, vaddr = 0, bits;
+	uint64_t *where;
+
+	for (i = 0; i < reloc->nr_relr; i++) {
+		entry = reloc->relr[i];
+		if (!(entry & 1)) {
+			vaddr = entry + bias;
+			where = reloc_target(reloc, vaddr);
+			if (!where)
+				return -ENOEXEC;
+
+			*where += bias;
+			vaddr += sizeof(uint64_t);
+			continue;
+		}
+
+		for (bits = entry >> 1; bits; bits &= (bits - 1)) {
+			where = reloc_target(reloc,
+				vaddr + __ffs(bits) * sizeof(uint64_t));
+			if (!where)
+				return -ENOEXEC;
+
+			*where += bias;
+		}
+
+		vaddr += 63 * sizeof(uint64_t);
+	}
+
+	return 0;
+}
+
+/*
+ * The leading R_AARCH64_RELATIVE entries are applied in batches. The
+ * targets are resolved at first, and then the values are computed and
+ * stored in separate loops, which can be vectorized by compiler.
+ */
+static int reloc_apply_relative(struct elf_reloc *reloc)
+{
+	struct elf64_rela *rela = reloc->rela;
+	unsigned long bias = reloc->image->bias;
+	unsigned long i, j, count;
+	uint64_t *where[ELF_RELOC_BATCH];
+	uint64_t val[ELF_RELOC_BATCH];
+
+	for (i = 0; i < reloc->nr_relative; i += count) {
+		count = min(reloc->nr_relative - i, ELF_RELOC_BATCH);
+		for (j = 0; j < count; j++) {
+			where[j] = reloc_target(reloc,
+						rela[i + j].r_offset + bias);
+			if (!where[j])
+				return -ENOEXEC;
+		}
+
+		for (j = 0; j < count; j++)
+			val[j] = rela[i + j].r_addend + bias;
+
+		for (j = 0; j < count; j++)
+			*where[j] = val[j];
+	}
+
+	return 0;
+}
+
+/*
+ * The defined symbol is resolved by the image itself. The undefined one
+ * is looked up by name from the symbol index of the images, which have
+ * been loaded into the VM. The relocation without symbol (STN_UNDEF)
+ * takes zero as the symbol value.
+ */
+static int reloc_resolve_symbol(struct elf_reloc *reloc,
+				unsigned long index,
+				unsigned long *val)
+{
+	struct elf_image *image = reloc->image;
+	struct elf_image *other;
+	struct elf64_sym *sym;
+	const char *name;
+
+	if (index == ELF64_SYM_INDEX_UNDEF) {
+		*val = 0;
+		return 0;
+	}
+
+	sym = reloc->symtab ?
+	      elf_image_translate(image, (unsigned long)&reloc->symtab[index],
+				  sizeof(*sym)) : NULL;
+	if (!sym) {
+		fprintf(stderr, "%s: Invalid symbol %ld\n", __func__, index);
+		return -ENOEXEC;
+	}
+
+	/* The absolute symbols aren't relocated */
+	if (sym->st_shndx == ELF64_SYM_SHNDX_ABS) {
+		*val = sym->st_value;
+		return 0;
+	} else if (sym->st_shndx != ELF64_SYM_SHNDX_UNDEF) {
+		*val = sym->st_value + image->bias;
+		return 0;
+	}
+
+	name = (reloc->strtab && sym->st_name < reloc->strsz) ?
+	       &reloc->strtab[sym->st_name] : NULL;
+	list_for_each_entry(other, &image->vm->image_list, link) {
+		if (name && !elf_symbol_lookup(other, name, val))
+			return 0;
+	}
+
+	/* The undefined weak symbols are resolved to zero */
+	if (ELF64_SYM_BIND(sym->st_info) == ELF64_SYM_BIND_WEAK) {
+		*val = 0;
+		return 0;
+	}
+
+	fprintf(stderr, "%s: Unresolved symbol <%s>\n",
+		__func__, name ? name : "?");
+	return -ENOEXEC;
+}
+
+static int reloc_apply_rela(struct elf_reloc *reloc,
+			    struct elf64_rela *rela,
+			    unsigned long nr)
+{
+	unsigned long bias = reloc->image->bias;
+	unsigned long i, sym_index = ~0UL, sym_val = 0;
+	uint64_t *where;
+	int ret;
+
+	for (i = 0; i < nr; i++, rela++) {
+		if (ELF64_RELA_TYPE(rela->r_info) == R_AARCH64_NONE)
+			continue;
+
+		where = reloc_target(reloc, rela->r_offset + bias);
+		if (!where)
+			return -ENOEXEC;
+
+		switch (ELF64_RELA_TYPE(rela->r_info)) {
+		case R_AARCH64_RELATIVE:
+			*where = rela->r_addend + bias;
+			break;
+		case R_AARCH64_ABS64:
+		case R_AARCH64_GLOB_DAT:
+		case R_AARCH64_JUMP_SLOT:
+			/*
+			 * The consecutive relocations usually refer to the
+			 * same symbol, whose value is cached.
+			 */
+			if (ELF64_RELA_SYM(rela->r_info) != sym_index) {
+				sym_index = ELF64_RELA_SYM(rela->r_info);
+				ret = reloc_resolve_symbol(reloc, sym_index,
+							   &sym_val);
+				if (ret)
+					return ret;
+			}
+
+			*where = sym_val + rela->r_addend;
+			break;
+		default:
+			fprintf(stderr, "%s: Unsupported relocation type %ld\n",
+				__func__,
+				(unsigned long)ELF64_RELA_TYPE(rela->r_info));
+			return -ENOEXEC;
+		}
+	}
+
+	return 0;
+}
+
+/**
+ * elf_relocate - Apply relocations to the loaded ELF image
+ * @image:	loaded ELF image
+ *
+ * The relocation entries specified by DT_RELA, DT_JMPREL and DT_RELR are
+ * applied. The images without dynamic section, or the ET_EXEC images
+ * don't need relocation. There is no dynamic linker, so the shared
+ * libraries aren't loaded. The undefined symbols, except the weak ones,
+ * fail the relocation unless they're exported by the images loaded
+ * before, meaning the self-contained images like static-pie are
+ * supported. The symbol index should have been built. It returns zero
+ * on success, or negative error code on failure.
+ */
+int elf_relocate(struct elf_image *image)
+{
+	struct elf_reloc reloc;
+	int ret;
+
+	if (!image->dynamic || image->hdr.e_type != ELF64_HDR_TYPE_DYN)
+		return 0;
+
+	memset(&reloc, 0, sizeof(reloc));
+	reloc.image = image;
+	ret = reloc_parse_dynamic(&reloc);
+	if (ret)
+		return ret;
+
+	ret = reloc_apply_relr(&reloc);
+	if (ret)
+		return ret;
+
+	ret = reloc_apply_relative(&reloc);
+	if (ret)
+		return ret;
+
+	ret = reloc_apply_rela(&reloc, reloc.rela + reloc.nr_relative,
+			       reloc.nr_rela - reloc.nr_relative);
+	if (ret)
+		return ret;
+
+	return reloc_apply_rela(&reloc, reloc.jmprel, reloc.nr_jmprel);
+}
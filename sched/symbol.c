@@ -0,0 +1,496 @@
+/*
+ * Copyright 2022 Gavin Shan <gshan@redhat.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#include "sandbox.h"
+
+/*
+ * The symbol index has two parts. The exported symbols are looked up
+ * through the GNU hash table (DT_GNU_HASH), with its bloom filter
+ * rejecting most of the missed lookups. The GNU hash table and the
+ * dynamic symbols are copied from the loaded image, which is writable
+ * by the guest, when the index is built.
+ * All symbols from ".symtab", or the dynamic symbols when ".symtab" has
+ * been stripped, are sorted by address for address to symbol queries.
+ * The global and weak ones are hashed by name for the lookups missed in
+ * the GNU hash table. The local symbols can't be looked up by name, as
+ * the name isn't unique.
+ */
+struct elf_symtab {
+	/* DT_GNU_HASH */
+	uint32_t		nr_buckets;
+	uint32_t		sym_offset;
+	uint32_t		bloom_size;
+	uint32_t		bloom_shift;
+	uint64_t		*bloom;
+	uint32_t		*buckets;
+	uint32_t		*chain;
+	struct elf64_sym	*dynsym;
+	unsigned long		nr_dynsyms;
+	char			*dynstr;
+	unsigned long		dynstr_size;
+
+	/* Sorted by address */
+	struct elf_symbol	*syms;
+	unsigned long		nr_syms;
+	char			*strtab;
+
+	/* Hashed by name, index to @syms plus one */
+	uint32_t		*hash;
+	unsigned long		hash_mask;
+};
+
+/* The absolute symbols aren't relocated */
+static unsigned long symbol_addr(struct elf_image *image,
+				 struct elf64_sym *sym)
+{
+	if (sym->st_shndx == ELF64_SYM_SHNDX_ABS)
+		return sym->st_value;
+
+	return sym->st_value + image->bias;
+}
+
+static uint32_t symbol_hash(const char *name)
+{
+	uint32_t h = 5381;
+
+	while (*name)
+		h = (h << 5) + h + (unsigned char)*name++;
+
+	return h;
+}
+
+/* Copy the table from the loaded image, followed by @extra zero bytes */
+static void *symbol_copy(struct elf_image *image, unsigned long vaddr,
+			 unsigned long size, unsigned long extra)
+{
+	void *src, *dst;
+
+	src = elf_image_translate(image, vaddr, size);
+	if (!src)
+		return NULL;
+
+	dst = malloc(size + extra);
+	if (!dst)
+		return NULL;
+
+	memcpy(dst, src, size);
+	memset(dst + size, 0, extra);
+
+	return dst;
+}
+
+static void symbol_free_gnu_hash(struct elf_symtab *st)
+{
+	free(st->bloom);
+	free(st->buckets);
+	free(st->chain);
+	free(st->dynsym);
+	free(st->dynstr);
+	st->bloom = NULL;
+	st->buckets = NULL;
+	st->chain = NULL;
+	st->dynsym = NULL;
+	st->dynstr = NULL;
+	st->nr_buckets = 0;
+	st->nr_dynsyms = 0;
+}
+
+/*
+ * The malformed GNU hash table is ignored, and the symbols are looked up
+ * from the index built from ".symtab" instead.
+ */
+static void symbol_build_gnu_hash(struct elf_image *image,
+				  struct elf_symtab *st)
+{
+	struct elf64_dyn *dyn;
+	uint32_t *hdr;
+	unsigned long vaddr, gnu_hash = 0, symtab = 0, strtab = 0;
+	unsigned long i, last = 0;
+
+	for (vaddr = image->dynamic;
+	     (dyn = elf_image_translate(image, vaddr, sizeof(*dyn))) &&
+	     dyn->d_tag != ELF64_DYN_TAG_NULL;
+	     vaddr += sizeof(*dyn)) {
+		switch (dyn->d_tag) {
+		case ELF64_DYN_TAG_GNU_HASH:
+			gnu_hash = dyn->d_ptr + image->bias;
+			break;
+		case ELF64_DYN_TAG_SYMTAB:
+			symtab = dyn->d_ptr + image->bias;
+			break;
+		case ELF64_DYN_TAG_STRTAB:
+			strtab = dyn->d_ptr + image->bias;
+			break;
+		case ELF64_DYN_TAG_STRSZ:
+			st->dynstr_size = dyn->d_val;
+			break;
+		}
+	}
+
+	if (!gnu_hash || !symtab || !strtab)
+		return;
+
+	hdr = elf_image_translate(image, gnu_hash, 4 * sizeof(uint32_t));
+	if (!hdr)
+		goto error;
+
+	st->nr_buckets = hdr[0];
+	st->sym_offset = hdr[1];
+	st->bloom_size = hdr[2];
+	st->bloom_shift = hdr[3];
+	if (!st->nr_buckets || !st->bloom_size ||
+	    (st->bloom_size & (st->bloom_size - 1)))
+		goto error;
+
+	vaddr = gnu_hash + 4 * sizeof(uint32_t);
+	st->bloom = symbol_copy(image, vaddr,
+				st->bloom_size * sizeof(uint64_t), 0);
+	vaddr += st->bloom_size * sizeof(uint64_t);
+	st->buckets = symbol_copy(image, vaddr,
+				  st->nr_buckets * sizeof(uint32_t), 0);
+	vaddr += st->nr_buckets * sizeof(uint32_t);
+	if (!st->bloom || !st->buckets)
+		goto error;
+
+	/*
+	 * The number of dynamic symbols is figured out from the chain of
+	 * the last non-empty bucket, whose last entry has bit 0 set.
+	 */
+	for (i = 0; i < st->nr_buckets; i++)
+		last = max(last, st->buckets[i]);
+
+	for (; last >= st->sym_offset; last++) {
+		hdr = elf_image_translate(image,
+			vaddr + (last - st->sym_offset) * sizeof(uint32_t),
+			sizeof(uint32_t));
+		if (!hdr)
+			goto error;
+
+		if (*hdr & 1)
+			break;
+	}
+
+	/* The dynamic string table is terminated by us */
+	st->nr_dynsyms = max(last + 1, st->sym_offset);
+	if (st->nr_dynsyms > st->sym_offset)
+		st->chain = symbol_copy(image, vaddr,
+			(st->nr_dynsyms - st->sym_offset) * sizeof(uint32_t), 0);
+	st->dynsym = symbol_copy(image, symtab,
+			st->nr_dynsyms * sizeof(struct elf64_sym), 0);
+	st->dynstr = symbol_copy(image, strtab, st->dynstr_size, 1);
+	if ((st->nr_dynsyms > st->sym_offset && !st->chain) ||
+	    !st->dynsym || !st->dynstr)
+		goto error;
+
+	return;
+
+error:
+	fprintf(stderr, "%s: Invalid GNU hash table\n", __func__);
+	symbol_free_gnu_hash(st);
+}
+
+static int symbol_read_symtab(struct elf_image *image,
+			      struct elf64_sym **psyms,
+			      unsigned long *pnr,
+			      unsigned long *pstrsz)
+{
+	struct elf64_hdr *hdr = &image->hdr;
+	struct elf64_shdr *shdrs = NULL, *shdr, *str_shdr;
+	struct elf_symtab *st = image->symtab;
+	unsigned long size;
+	int i, ret = 0;
+
+	if (!hdr->e_shoff || !hdr->e_shnum ||
+	    hdr->e_shentsize < sizeof(*shdr))
+		return 0;
+
+	size = hdr->e_shnum * hdr->e_shentsize;
+	shdrs = malloc(size);
+	if (!shdrs)
+		return -ENOMEM;
+
+	if (elf_image_read(image, shdrs, size, hdr->e_shoff) != size) {
+		ret = -EIO;
+		goto out;
+	}
+
+	for (i = 0; i < hdr->e_shnum; i++) {
+		shdr = (void *)shdrs + i * hdr->e_shentsize;
+		if (shdr->sh_type == ELF64_SHDR_TYPE_SYMTAB &&
+		    shdr->sh_entsize == sizeof(struct elf64_sym) &&
+		    shdr->sh_link < hdr->e_shnum)
+			break;
+	}
+
+	if (i >= hdr->e_shnum)
+		goto out;
+
+	str_shdr = (void *)shdrs + shdr->sh_link * hdr->e_shentsize;
+	*psyms = malloc(shdr->sh_size);
+	st->strtab = malloc(str_shdr->sh_size + 1);
+	if (!*psyms || !st->strtab) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	if (elf_image_read(image, *psyms, shdr->sh_size, shdr->sh_offset) !=
+	    shdr->sh_size ||
+	    elf_image_read(image, st->strtab, str_shdr->sh_size,
+			   str_shdr->sh_offset) != str_shdr->sh_size) {
+		ret = -EIO;
+		goto out;
+	}
+
+	st->strtab[str_shdr->sh_size] = '\0';
+	*pnr = shdr->sh_size / sizeof(struct elf64_sym);
+	*pstrsz = str_shdr->sh_size;
+out:
+	free(shdrs);
+	return ret;
+}
+
+static int symbol_compare(const void *a, const void *b)
+{
+	const struct elf_symbol *sa = a, *sb = b;
+
+	if (sa->addr != sb->addr)
+		return sa->addr < sb->addr ? -1 : 1;
+
+	return 0;
+}
+
+static int symbol_build_index(struct elf_image *image,
+			      struct elf64_sym *syms,
+			      unsigned long nr,
+			      char *strtab,
+			      unsigned long strsz)
+{
+	struct elf_symtab *st = image->symtab;
+	struct elf64_sym *sym;
+	struct elf_symbol *s;
+	unsigned long i, slot, size;
+
+	st->syms = calloc(nr, sizeof(*st->syms));
+	if (!st->syms)
+		return -ENOMEM;
+
+	for (i = 0; i < nr; i++) {
+		sym = &syms[i];
+		if (sym->st_shndx == ELF64_SYM_SHNDX_UNDEF ||
+		    !sym->st_name || sym->st_name >= strsz ||
+		    (ELF64_SYM_TYPE(sym->st_info) != ELF64_SYM_TYPE_FUNC &&
+		     ELF64_SYM_TYPE(sym->st_info) != ELF64_SYM_TYPE_OBJECT &&
+		     ELF64_SYM_TYPE(sym->st_info) != ELF64_SYM_TYPE_NOTYPE))
+			continue;
+
+		s = &st->syms[st->nr_syms++];
+		s->addr = symbol_addr(image, sym);
+		s->size = sym->st_size;
+		s->name = &strtab[sym->st_name];
+		s->global = ELF64_SYM_BIND(sym->st_info) !=
+			    ELF64_SYM_BIND_LOCAL;
+	}
+
+	qsort(st->syms, st->nr_syms, sizeof(*st->syms), symbol_compare);
+
+	/* The hash table is kept half empty at least */
+	for (size = 16; size < st->nr_syms * 2; size <<= 1);
+	st->hash = calloc(size, sizeof(*st->hash));
+	if (!st->hash)
+		return -ENOMEM;
+
+	st->hash_mask = size - 1;
+	for (i = 0; i < st->nr_syms; i++) {
+		s = &st->syms[i];
+		if (!s->global)
+			continue;
+
+		s->hash = symbol_hash(s->name);
+		slot = s->hash & st->hash_mask;
+		while (st->hash[slot])
+			slot = (slot + 1) & st->hash_mask;
+
+		st->hash[slot] = i + 1;
+	}
+
+	return 0;
+}
+
+/**
+ * elf_symtab_build - Build the symbol index for the loaded ELF image
+ * @image:	loaded ELF image, whose file is still opened
+ *
+ * It returns zero on success, or negative error code on failure.
+ */
+int elf_symtab_build(struct elf_image *image)
+{
+	struct elf_symtab *st;
+	struct elf64_sym *syms = NULL;
+	unsigned long nr = 0, strsz = 0;
+	int ret;
+
+	st = malloc(sizeof(*st));
+	if (!st)
+		return -ENOMEM;
+
+	memset(st, 0, sizeof(*st));
+	image->symtab = st;
+
+	if (image->dynamic)
+		symbol_build_gnu_hash(image, st);
+
+	ret = symbol_read_symtab(image, &syms, &nr, &strsz);
+	if (ret)
+		goto out;
+
+	if (nr)
+		ret = symbol_build_index(image, syms, nr, st->strtab, strsz);
+	else if (st->nr_dynsyms)
+		ret = symbol_build_index(image, st->dynsym, st->nr_dynsyms,
+					 st->dynstr, st->dynstr_size);
+out:
+	if (syms)
+		free(syms);
+
+	return ret;
+}
+
+void elf_symtab_destroy(struct elf_image *image)
+{
+	struct elf_symtab *st = image->symtab;
+
+	if (!st)
+		return;
+
+	symbol_free_gnu_hash(st);
+	free(st->hash);
+	free(st->syms);
+	free(st->strtab);
+	free(st);
+	image->symtab = NULL;
+}
+
+static struct elf64_sym *symbol_gnu_lookup(struct elf_symtab *st,
+					   const char *name,
+					   uint32_t h)
+{
+	struct elf64_sym *sym;
+	uint64_t word, mask;
+	uint32_t index, h2;
+
+	if (!st->nr_buckets)
+		return NULL;
+
+	/* Two bits of the bloom filter are checked */
+	word = st->bloom[(h / 64) & (st->bloom_size - 1)];
+	mask = (1UL << (h % 64)) | (1UL << ((h >> st->bloom_shift) % 64));
+	if ((word & mask) != mask)
+		return NULL;
+
+	index = st->buckets[h % st->nr_buckets];
+	if (index < st->sym_offset || index >= st->nr_dynsyms)
+		return NULL;
+
+	for (; index < st->nr_dynsyms; index++) {
+		h2 = st->chain[index - st->sym_offset];
+		sym = &st->dynsym[index];
+		if ((h | 1) == (h2 | 1) &&
+		    sym->st_name < st->dynstr_size &&
+		    sym->st_shndx != ELF64_SYM_SHNDX_UNDEF &&
+		    !strcmp(name, &st->dynstr[sym->st_name]))
+			return sym;
+
+		if (h2 & 1)
+			break;
+	}
+
+	return NULL;
+}
+
+/**
+ * elf_symbol_lookup - Find the address of the global symbol by name
+ * @image:	loaded ELF image
+ * @name:	symbol name
+ * @addr:	address of the symbol, where the load bias is applied unless
+ *		it's an absolute symbol
+ *
+ * It returns zero on success, or -ENOENT if the symbol isn't found.
+ */
+int elf_symbol_lookup(struct elf_image *image,
+		      const char *name,
+		      unsigned long *addr)
+{
+	struct elf_symtab *st = image->symtab;
+	struct elf64_sym *sym;
+	struct elf_symbol *s;
+	unsigned long slot;
+	uint32_t h, index;
+
+	if (!st)
+		return -ENOENT;
+
+	h = symbol_hash(name);
+	sym = symbol_gnu_lookup(st, name, h);
+	if (sym) {
+		*addr = symbol_addr(image, sym);
+		return 0;
+	}
+
+	if (!st->hash)
+		return -ENOENT;
+
+	for (slot = h & st->hash_mask;
+	     (index = st->hash[slot]);
+	     slot = (slot + 1) & st->hash_mask) {
+		s = &st->syms[index - 1];
+		if (s->hash == h && !strcmp(s->name, name)) {
+			*addr = s->addr;
+			return 0;
+		}
+	}
+
+	return -ENOENT;
+}
+
+/**
+ * elf_symbol_find - Find the symbol covering the address
+ * @image:	loaded ELF image
+ * @addr:	address, where the load bias is applied
+ *
+ * The symbol with the highest address, which is equal to or lower than
+ * @addr, is returned if @addr falls in its range. The symbol without size
+ * is considered as covering the range up to the next symbol. NULL is
+ * returned if no symbol is found.
+ */
+struct elf_symbol *elf_symbol_find(struct elf_image *image,
+				   unsigned long addr)
+{
+	struct elf_symtab *st = image->symtab;
+	struct elf_symbol *s;
+	unsigned long low, high, mid;
+
+	if (!st || !st->nr_syms || addr < st->syms[0].addr)
+		return NULL;
+
+	low = 0;
+	high = st->nr_syms;
+	while (high - low > 1) {
+		mid = low + (high - low) / 2;
+		if (st->syms[mid].addr <= addr)
+			low = mid;
+		else
+			high = mid;
+	}
+
+	s = &st->syms[low];
+	if (s->size && addr >= s->addr + s->size)
+		return NULL;
+
+	return s;
+}
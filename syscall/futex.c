@@ -0,0 +1,512 @@
+/*
+ * Copyright 2022 Gavin Shan <gshan@redhat.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include "sandbox.h"
+
+/*
+ * The waiters are queued, woken up and requeued with the bucket lock held,
+ * and their counters in the waiter page are updated at the same time. The
+ * timed waiters are expired by the timer thread, which sleeps until the
+ * nearest deadline. The bucket lock is taken before the futex lock.
+ */
+static uint64_t futex_now(clockid_t clock)
+{
+	struct timespec ts;
+
+	clock_gettime(clock, &ts);
+
+	return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+static struct kvm_futex_bucket *futex_bucket(struct kvm_futex *futex,
+					     unsigned long gpa)
+{
+	uint64_t hash = (gpa >> 2) * 0x9e3779b97f4a7c15UL;
+
+	return &futex->buckets[hash >> (64 - KVM_FUTEX_HASH_BITS)];
+}
+
+static int *futex_counter(struct kvm_vm *vm, unsigned long gpa)
+{
+	unsigned long offset = gpa & (vm->mm.page_size - 1);
+
+	return (int *)&vm->futex->waiters[offset >> 2];
+}
+
+/*
+ * Translate the futex word, which should be 32-bits aligned. The host
+ * address is returned if @word isn't NULL.
+ */
+static int futex_translate(struct kvm_vm *vm, unsigned long uaddr,
+			   unsigned long *gpa, uint32_t **word)
+{
+	if (uaddr & 3)
+		return -EINVAL;
+
+	if (kvm_mm_gva_to_gpa(vm, uaddr, false, gpa))
+		return -EFAULT;
+
+	if (word) {
+		*word = (uint32_t *)kvm_mm_gva_to_hva(vm, uaddr, false);
+		if (!*word)
+			return -EFAULT;
+	}
+
+	return 0;
+}
+
+/*
+ * The timeout is relative for FUTEX_WAIT, or absolute for FUTEX_WAIT_BITSET.
+ * The absolute timeout of CLOCK_REALTIME is converted to CLOCK_MONOTONIC,
+ * so the later changes to the wall clock aren't followed.
+ */
+static int futex_deadline(struct kvm_vm *vm, struct syscall_sqe *sqe,
+			  uint64_t *deadline)
+{
+	struct timespec ts;
+	uint64_t now, timeout;
+	clockid_t clock;
+
+	if (kvm_mm_copy_from_guest(vm, &ts, sqe->args[3], sizeof(ts)))
+		return -EFAULT;
+
+	if (ts.tv_sec < 0 || ts.tv_nsec < 0 || ts.tv_nsec >= 1000000000L)
+		return -EINVAL;
+
+	/* Beyond the lifetime of the sandbox */
+	timeout = min((uint64_t)ts.tv_sec, 1UL << 32) * 1000000000UL +
+		  ts.tv_nsec;
+	now = futex_now(CLOCK_MONOTONIC);
+	if ((sqe->args[1] & FUTEX_CMD_MASK) == FUTEX_WAIT_BITSET) {
+		clock = (sqe->args[1] & FUTEX_CLOCK_REALTIME) ?
+			CLOCK_REALTIME : CLOCK_MONOTONIC;
+		timeout -= min(timeout, futex_now(clock));
+	}
+
+	*deadline = now + timeout;
+
+	return 0;
+}
+
+/* Post the CQ entry of the waiter. It's called with the bucket lock held */
+static void futex_complete(struct kvm_vm *vm, struct kvm_futex_waiter *waiter,
+			   long ret)
+{
+	list_del(&waiter->link);
+	atomic_dec(futex_counter(vm, waiter->gpa));
+	kvm_syscall_complete(waiter->ring, waiter->user_data, ret);
+	free(waiter);
+}
+
+/*
+ * Expire the timed waiters. It returns the nearest deadline of the
+ * remaining timed waiters, or UINT64_MAX if there is none.
+ */
+static uint64_t futex_expire(struct kvm_vm *vm, uint64_t now)
+{
+	struct kvm_futex *futex = vm->futex;
+	struct kvm_futex_bucket *bucket;
+	struct kvm_futex_waiter *waiter, *tmp;
+	uint64_t next = UINT64_MAX;
+	int i;
+
+	for (i = 0; i < KVM_FUTEX_HASH_SIZE; i++) {
+		bucket = &futex->buckets[i];
+		pthread_mutex_lock(&bucket->lock);
+
+		list_for_each_entry_safe(waiter, tmp, &bucket->waiters, link) {
+			if (!waiter->timed)
+				continue;
+
+			if (waiter->deadline <= now)
+				futex_complete(vm, waiter, -ETIMEDOUT);
+			else
+				next = min(next, waiter->deadline);
+		}
+
+		pthread_mutex_unlock(&bucket->lock);
+	}
+
+	return next;
+}
+
+static void *futex_thread(void *data)
+{
+	struct kvm_vm *vm = data;
+	struct kvm_futex *futex = vm->futex;
+	struct timespec ts;
+	uint64_t now, next;
+
+	pthread_mutex_lock(&futex->lock);
+
+	while (!futex->stop) {
+		if (futex->next == UINT64_MAX) {
+			pthread_cond_wait(&futex->cond, &futex->lock);
+			continue;
+		}
+
+		now = futex_now(CLOCK_MONOTONIC);
+		if (now < futex->next) {
+			ts.tv_sec = futex->next / 1000000000UL;
+			ts.tv_nsec = futex->next % 1000000000UL;
+			pthread_cond_timedwait(&futex->cond, &futex->lock, &ts);
+			continue;
+		}
+
+		futex->next = UINT64_MAX;
+		pthread_mutex_unlock(&futex->lock);
+		next = futex_expire(vm, now);
+		pthread_mutex_lock(&futex->lock);
+		futex->next = min(futex->next, next);
+	}
+
+	pthread_mutex_unlock(&futex->lock);
+
+	return NULL;
+}
+
+/* Start the timer thread on the first timed wait */
+static int futex_start_timer(struct kvm_vm *vm)
+{
+	struct kvm_futex *futex = vm->futex;
+	int ret = 0;
+
+	pthread_mutex_lock(&futex->lock);
+
+	if (!futex->running) {
+		ret = pthread_create(&futex->thread, NULL, futex_thread, vm);
+		if (ret)
+			fprintf(stderr, "%s: Unable to create thread (%d)\n",
+				__func__, ret);
+		else
+			futex->running = true;
+	}
+
+	pthread_mutex_unlock(&futex->lock);
+
+	return -ret;
+}
+
+static void futex_arm_timer(struct kvm_vm *vm, uint64_t deadline)
+{
+	struct kvm_futex *futex = vm->futex;
+
+	pthread_mutex_lock(&futex->lock);
+
+	if (deadline < futex->next) {
+		futex->next = deadline;
+		pthread_cond_signal(&futex->cond);
+	}
+
+	pthread_mutex_unlock(&futex->lock);
+}
+
+/*
+ * FUTEX_WAIT and FUTEX_WAIT_BITSET. The counter is incremented before the
+ * futex word is read, so that the guest's FUTEX_WAKE isn't skipped once
+ * the waiter is committed.
+ */
+static long futex_wait(struct kvm_vm *vm,
+		       struct kvm_syscall_ring *ring,
+		       struct syscall_sqe *sqe,
+		       uint32_t bitset)
+{
+	struct kvm_futex_bucket *bucket;
+	struct kvm_futex_waiter *waiter;
+	unsigned long gpa;
+	uint64_t deadline = 0;
+	uint32_t *word;
+	bool timed = !!sqe->args[3];
+	int *counter;
+	long ret;
+
+	if (!bitset)
+		return -EINVAL;
+
+	if (timed) {
+		ret = futex_deadline(vm, sqe, &deadline);
+		if (!ret)
+			ret = futex_start_timer(vm);
+		if (ret)
+			return ret;
+	}
+
+	ret = futex_translate(vm, sqe->args[0], &gpa, &word);
+	if (ret)
+		return ret;
+
+	waiter = malloc(sizeof(*waiter));
+	if (!waiter)
+		return -ENOMEM;
+
+	bucket = futex_bucket(vm->futex, gpa);
+	counter = futex_counter(vm, gpa);
+	pthread_mutex_lock(&bucket->lock);
+
+	atomic_inc(counter);
+	smp_mb();
+	if (READ_ONCE(*word) != (uint32_t)sqe->args[2])
+		ret = -EAGAIN;
+	else if (timed && deadline <= futex_now(CLOCK_MONOTONIC))
+		ret = -ETIMEDOUT;
+
+	if (ret) {
+		atomic_dec(counter);
+		pthread_mutex_unlock(&bucket->lock);
+		free(waiter);
+		return ret;
+	}
+
+	waiter->ring = ring;
+	waiter->user_data = sqe->user_data;
+	waiter->gpa = gpa;
+	waiter->bitset = bitset;
+	waiter->timed = timed;
+	waiter->deadline = deadline;
+	kvm_syscall_defer(ring);
+	list_add_tail(&bucket->waiters, &waiter->link);
+
+	pthread_mutex_unlock(&bucket->lock);
+
+	if (timed)
+		futex_arm_timer(vm, deadline);
+
+	return SYSCALL_RET_PENDING;
+}
+
+/* FUTEX_WAKE and FUTEX_WAKE_BITSET */
+static long futex_wake(struct kvm_vm *vm,
+		       struct syscall_sqe *sqe,
+		       uint32_t bitset)
+{
+	struct kvm_futex_bucket *bucket;
+	struct kvm_futex_waiter *waiter, *tmp;
+	unsigned long gpa;
+	int nr = sqe->args[2];
+	long ret;
+
+	if (!bitset)
+		return -EINVAL;
+
+	ret = futex_translate(vm, sqe->args[0], &gpa, NULL);
+	if (ret)
+		return ret;
+
+	bucket = futex_bucket(vm->futex, gpa);
+	pthread_mutex_lock(&bucket->lock);
+
+	list_for_each_entry_safe(waiter, tmp, &bucket->waiters, link) {
+		if (waiter->gpa != gpa || !(waiter->bitset & bitset))
+			continue;
+
+		futex_complete(vm, waiter, 0);
+		if (++ret >= nr)
+			break;
+	}
+
+	pthread_mutex_unlock(&bucket->lock);
+
+	return ret;
+}
+
+/*
+ * FUTEX_REQUEUE and FUTEX_CMP_REQUEUE. The waiters which aren't woken up
+ * are moved to the second futex word. The bucket locks are taken in the
+ * order of their addresses.
+ */
+static long futex_requeue(struct kvm_vm *vm,
+			  struct syscall_sqe *sqe,
+			  bool cmp)
+{
+	struct kvm_futex_bucket *b1, *b2;
+	struct kvm_futex_waiter *waiter, *tmp;
+	unsigned long gpa1, gpa2;
+	uint32_t *word;
+	int nr_wake = sqe->args[2], nr_requeue = sqe->args[3];
+	int woken = 0, requeued = 0;
+	long ret;
+
+	if (nr_wake < 0 || nr_requeue < 0)
+		return -EINVAL;
+
+	ret = futex_translate(vm, sqe->args[0], &gpa1, &word);
+	if (!ret)
+		ret = futex_translate(vm, sqe->args[4], &gpa2, NULL);
+	if (ret)
+		return ret;
+
+	if (gpa1 == gpa2)
+		return -EINVAL;
+
+	b1 = futex_bucket(vm->futex, gpa1);
+	b2 = futex_bucket(vm->futex, gpa2);
+	pthread_mutex_lock(&min(b1, b2)->lock);
+	if (b1 != b2)
+		pthread_mutex_lock(&max(b1, b2)->lock);
+
+	if (cmp && READ_ONCE(*word) != (uint32_t)sqe->args[5]) {
+		ret = -EAGAIN;
+		goto out;
+	}
+
+	list_for_each_entry_safe(waiter, tmp, &b1->waiters, link) {
+		if (waiter->gpa != gpa1)
+			continue;
+
+		if (woken < nr_wake) {
+			futex_complete(vm, waiter, 0);
+			woken++;
+		} else if (requeued < nr_requeue) {
+			list_del(&waiter->link);
+			atomic_dec(futex_counter(vm, gpa1));
+			waiter->gpa = gpa2;
+			atomic_inc(futex_counter(vm, gpa2));
+			list_add_tail(&b2->waiters, &waiter->link);
+			requeued++;
+		} else {
+			break;
+		}
+	}
+
+	ret = woken + requeued;
+out:
+	if (b1 != b2)
+		pthread_mutex_unlock(&max(b1, b2)->lock);
+	pthread_mutex_unlock(&min(b1, b2)->lock);
+
+	return ret;
+}
+
+/*
+ * futex(uaddr, futex_op, val, timeout or val2, uaddr2, val3). The private
+ * and shared futexes are same, as all the guest threads share the address
+ * space. The priority-inheritance operations aren't supported.
+ */
+static long futex_handler(struct kvm_vm *vm,
+			  struct kvm_syscall_ring *ring,
+			  struct syscall_sqe *sqe)
+{
+	if (!vm->futex)
+		return -ENOSYS;
+
+	switch (sqe->args[1] & FUTEX_CMD_MASK) {
+	case FUTEX_WAIT:
+		return futex_wait(vm, ring, sqe, FUTEX_BITSET_MATCH_ANY);
+	case FUTEX_WAIT_BITSET:
+		return futex_wait(vm, ring, sqe, sqe->args[5]);
+	case FUTEX_WAKE:
+		return futex_wake(vm, sqe, FUTEX_BITSET_MATCH_ANY);
+	case FUTEX_WAKE_BITSET:
+		return futex_wake(vm, sqe, sqe->args[5]);
+	case FUTEX_REQUEUE:
+		return futex_requeue(vm, sqe, false);
+	case FUTEX_CMP_REQUEUE:
+		return futex_requeue(vm, sqe, true);
+	}
+
+	return -ENOSYS;
+}
+
+/**
+ * kvm_futex_init - Initialize futex of VM
+ * @vm:		VM where futex is initialized
+ *
+ * The waiter page is allocated from the guest RAM and mapped read-only at
+ * KVM_FUTEX_VA. It returns zero on success, or negative error code on
+ * failure.
+ */
+int kvm_futex_init(struct kvm_vm *vm)
+{
+	struct kvm_vm_mm *mm = &vm->mm;
+	struct kvm_futex *futex;
+	pthread_condattr_t attr;
+	struct vm_area *vma;
+	unsigned long phys;
+	int i;
+
+	futex = malloc(sizeof(*futex));
+	if (!futex) {
+		fprintf(stderr, "%s: Unable to alloc futex\n", __func__);
+		return -ENOMEM;
+	}
+
+	pthread_mutex_lock(&vm->lock);
+	vma = mm_vma_alloc(mm->mm, KVM_FUTEX_VA, mm->page_size,
+			   MM_VMA_FLAG_FIXED, 0);
+	phys = kvm_mm_alloc_phys_pages(vm, 1);
+	if (!vma || !phys) {
+		fprintf(stderr, "%s: Unable to alloc waiter page\n", __func__);
+		if (phys)
+			kvm_mm_free_phys_pages(vm, phys, 1);
+		if (vma)
+			mm_vma_free(mm->mm, vma);
+		pthread_mutex_unlock(&vm->lock);
+		free(futex);
+		return -ENOMEM;
+	}
+
+	if (kvm_mm_map_prot(vm, phys, vma->start, mm->page_size,
+			    KVM_MM_PTE_DEFAULT | KVM_MM_PTE_AP_RO)) {
+		fprintf(stderr, "%s: Unable to map waiter page\n", __func__);
+		kvm_mm_free_phys_pages(vm, phys, 1);
+		mm_vma_free(mm->mm, vma);
+		pthread_mutex_unlock(&vm->lock);
+		free(futex);
+		return -ENOMEM;
+	}
+	pthread_mutex_unlock(&vm->lock);
+
+	memset(futex, 0, sizeof(*futex));
+	futex->waiters = (uint32_t *)kvm_mm_gpa_to_hva(vm, phys);
+	memset(futex->waiters, 0, mm->page_size);
+	for (i = 0; i < KVM_FUTEX_HASH_SIZE; i++) {
+		pthread_mutex_init(&futex->buckets[i].lock, NULL);
+		INIT_LIST_HEAD(&futex->buckets[i].waiters);
+	}
+
+	pthread_mutex_init(&futex->lock, NULL);
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&futex->cond, &attr);
+	pthread_condattr_destroy(&attr);
+	futex->next = UINT64_MAX;
+	vm->futex = futex;
+
+	kvm_syscall_register(__NR_futex, futex_handler, 0);
+
+	return 0;
+}
+
+void kvm_futex_destroy(struct kvm_vm *vm)
+{
+	struct kvm_futex *futex = vm->futex;
+	struct kvm_futex_waiter *waiter, *tmp;
+	int i;
+
+	if (!futex)
+		return;
+
+	pthread_mutex_lock(&futex->lock);
+	futex->stop = true;
+	pthread_cond_signal(&futex->cond);
+	pthread_mutex_unlock(&futex->lock);
+	if (futex->running)
+		pthread_join(futex->thread, NULL);
+
+	for (i = 0; i < KVM_FUTEX_HASH_SIZE; i++) {
+		list_for_each_entry_safe(waiter, tmp,
+					 &futex->buckets[i].waiters, link)
+			futex_complete(vm, waiter, -EINTR);
+	}
+
+	vm->futex = NULL;
+	free(futex);
+}
@@ -0,0 +1,122 @@
+/*
+ * Copyright 2022 Gavin Shan <gshan@redhat.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#include <sys/syscall.h>
+#include "sandbox.h"
+
+/* brk(addr) */
+static long mman_brk(struct kvm_vm *vm,
+		     struct kvm_syscall_ring *ring,
+		     struct syscall_sqe *sqe)
+{
+	return kvm_mm_brk(vm, sqe->args[0]);
+}
+
+/*
+ * mmap(addr, length, prot, flags, fd, offset). The anonymous memory isn't
+ * populated until it's accessed, unless MAP_POPULATE is given. PROT_NONE
+ * reserves the address range only. The file is mapped into the guest
+ * through its own memory slot, so that the pages are shared with the host
+ * page cache. The existing mappings are replaced by MAP_FIXED, and -EEXIST
+ * is returned by MAP_FIXED_NOREPLACE if they're overlapped. As on Linux,
+ * the address range may have been unmapped when MAP_FIXED fails.
+ */
+static long mman_mmap(struct kvm_vm *vm,
+		      struct kvm_syscall_ring *ring,
+		      struct syscall_sqe *sqe)
+{
+	unsigned long addr = sqe->args[0], len = sqe->args[1];
+	int prot = sqe->args[2], flags = sqe->args[3], fd = sqe->args[4];
+	unsigned int map_flags = 0;
+	bool shared = false;
+	int host_fd, ret;
+
+	switch (flags & MAP_TYPE) {
+	case MAP_SHARED:
+	case MAP_SHARED_VALIDATE:
+		shared = true;
+		break;
+	case MAP_PRIVATE:
+		break;
+	default:
+		return -EINVAL;
+	}
+
+	if (!len)
+		return -EINVAL;
+
+	if (!(flags & (MAP_FIXED | MAP_FIXED_NOREPLACE)))
+		addr = 0;
+
+	if (!(flags & MAP_ANONYMOUS) && !vm->fs)
+		return -EBADF;
+
+	/* The shared anonymous memory is private as there is no fork() */
+	if (flags & MAP_ANONYMOUS) {
+		if (prot & PROT_WRITE)
+			map_flags |= KVM_MM_ANON_WRITE;
+		if (prot == PROT_NONE)
+			map_flags |= KVM_MM_ANON_RESERVE;
+		if (addr)
+			map_flags |= KVM_MM_ANON_FIXED;
+		if (addr && (flags & MAP_FIXED))
+			map_flags |= KVM_MM_ANON_REPLACE;
+		if (flags & MAP_POPULATE)
+			map_flags |= KVM_MM_ANON_POPULATE;
+
+		ret = kvm_mm_map_anon(vm, len, map_flags, &addr);
+
+		return ret ? ret : (long)addr;
+	}
+
+	if (shared)
+		map_flags |= KVM_MM_FILE_SHARED;
+	if (prot & PROT_WRITE)
+		map_flags |= KVM_MM_FILE_WRITE;
+	if (addr)
+		map_flags |= KVM_MM_FILE_FIXED;
+	if (addr && (flags & MAP_FIXED))
+		map_flags |= KVM_MM_FILE_REPLACE;
+
+	host_fd = kvm_fs_get_file(vm, fd);
+	if (host_fd < 0)
+		return host_fd;
+
+	ret = kvm_mm_map_file(vm, host_fd, sqe->args[5], len, map_flags, &addr);
+	close(host_fd);
+
+	return ret ? ret : (long)addr;
+}
+
+/*
+ * munmap(addr, length). The host file mappings can't be partially
+ * unmapped.
+ */
+static long mman_munmap(struct kvm_vm *vm,
+			struct kvm_syscall_ring *ring,
+			struct syscall_sqe *sqe)
+{
+	return kvm_mm_unmap_range(vm, sqe->args[0], sqe->args[1]);
+}
+
+/* madvise(addr, length, advice) */
+static long mman_madvise(struct kvm_vm *vm,
+			 struct kvm_syscall_ring *ring,
+			 struct syscall_sqe *sqe)
+{
+	return kvm_mm_advise(vm, sqe->args[0], sqe->args[1], sqe->args[2]);
+}
+
+void kvm_mman_init(void)
+{
+	kvm_syscall_register(__NR_brk, mman_brk, 0);
+	kvm_syscall_register(__NR_mmap, mman_mmap, 0);
+	kvm_syscall_register(__NR_munmap, mman_munmap, 0);
+	kvm_syscall_register(__NR_madvise, mman_madvise, 0);
+}
@@ -0,0 +1,603 @@
+/*
+ * Copyright 2022 Gavin Shan <gshan@redhat.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#include <time.h>
+#include <sys/syscall.h>
+#include "sandbox.h"
+
+/*
+ * The handlers are registered by the subsystems at initialization time,
+ * and looked up without lock when the rings are drained.
+ */
+static struct {
+	kvm_syscall_handler_t	handler;
+	unsigned int		flags;
+} syscall_handlers[SYSCALL_MAX];
+
+/**
+ * kvm_syscall_register - Register handler for the system call
+ * @nr:		system call number
+ * @handler:	handler, whose return value is posted to the CQ entry, or
+ *		SYSCALL_RET_PENDING if it's posted by kvm_syscall_complete()
+ * @flags:	SYSCALL_FLAG_BLOCKING if the handler might block
+ *
+ * It returns zero on success, or negative error code on failure.
+ */
+int kvm_syscall_register(unsigned int nr, kvm_syscall_handler_t handler,
+			 unsigned int flags)
+{
+	if (nr >= SYSCALL_MAX)
+		return -EINVAL;
+
+	syscall_handlers[nr].handler = handler;
+	syscall_handlers[nr].flags = flags;
+
+	return 0;
+}
+
+/*
+ * Post the CQ entry. The space has been reserved when the SQ entry is
+ * consumed, so the CQ can't be overflown.
+ */
+void kvm_syscall_post(struct kvm_syscall_ring *ring,
+		      uint64_t user_data, long ret)
+{
+	struct syscall_ring_hdr *hdr = ring->hdr;
+	struct syscall_cqe *cqe;
+	uint32_t cq_tail;
+
+	pthread_mutex_lock(&ring->cq_lock);
+
+	cq_tail = hdr->cq_tail;
+	cqe = &ring->cq[cq_tail & (SYSCALL_RING_CQ_ENTRIES - 1)];
+	cqe->user_data = user_data;
+	cqe->ret = ret;
+	smp_store_release(&hdr->cq_tail, cq_tail + 1);
+
+	pthread_mutex_unlock(&ring->cq_lock);
+}
+
+/**
+ * kvm_syscall_defer - Defer the CQ entry of the system call
+ * @ring:	ring where the system call is issued
+ *
+ * It's called by the handler, which returns SYSCALL_RET_PENDING then. The
+ * CQ entry is reserved until kvm_syscall_complete() is called.
+ */
+void kvm_syscall_defer(struct kvm_syscall_ring *ring)
+{
+	atomic_fetch_inc(&ring->inflight);
+}
+
+void kvm_syscall_complete(struct kvm_syscall_ring *ring,
+			  uint64_t user_data, long ret)
+{
+	kvm_syscall_post(ring, user_data, ret);
+	atomic_fetch_dec(&ring->inflight);
+}
+
+/**
+ * kvm_syscall_register_flush - Register flush handler
+ * @vm:		VM where the handler is registered
+ * @flush:	handler, called after the SQ entries are consumed
+ *
+ * The handler submits the system calls batched by the handlers (e.g. to
+ * io_uring). It returns zero on success, or negative error code on failure.
+ */
+int kvm_syscall_register_flush(struct kvm_vm *vm,
+			       void (*flush)(struct kvm_vm *vm))
+{
+	struct kvm_syscall *sc = vm->syscall;
+
+	if (sc->nr_flush >= SYSCALL_MAX_FLUSH)
+		return -ENOSPC;
+
+	sc->flush[sc->nr_flush++] = flush;
+
+	return 0;
+}
+
+static void syscall_post(struct kvm_syscall_ring *ring,
+			 uint64_t user_data, long ret)
+{
+	if (ret != SYSCALL_RET_PENDING)
+		kvm_syscall_post(ring, user_data, ret);
+}
+
+static long syscall_offload(struct kvm_vm *vm,
+			    struct kvm_syscall_ring *ring,
+			    struct syscall_sqe *sqe)
+{
+	struct kvm_syscall_work *work;
+	int ret;
+
+	work = malloc(sizeof(*work));
+	if (!work)
+		return -ENOMEM;
+
+	work->vm = vm;
+	work->ring = ring;
+	work->sqe = *sqe;
+	work->handler = syscall_handlers[sqe->nr].handler;
+	INIT_LIST_HEAD(&work->link);
+
+	atomic_fetch_inc(&ring->inflight);
+	ret = kvm_syscall_queue_work(work);
+	if (ret) {
+		atomic_fetch_dec(&ring->inflight);
+		free(work);
+	}
+
+	return ret;
+}
+
+/*
+ * Drain the ring. The ring is drained by either the vCPU's doorbell or
+ * the polling thread at once. The other one backs off if the ring is
+ * being drained. The blocking system calls are offloaded to the workers,
+ * whose CQ entries are posted later. It returns the number of consumed
+ * SQ entries.
+ */
+static int syscall_ring_drain(struct kvm_vm *vm, struct kvm_syscall_ring *ring)
+{
+	struct syscall_ring_hdr *hdr = ring->hdr;
+	struct syscall_sqe sqe;
+	kvm_syscall_handler_t handler;
+	uint32_t sq_head, sq_tail, used;
+	long ret;
+	int i, count = 0;
+
+	if (atomic_fetch_or(&ring->busy, 1))
+		return 0;
+
+	sq_head = hdr->sq_head;
+	sq_tail = smp_load_acquire(&hdr->sq_tail);
+	while (sq_head != sq_tail) {
+		/* Stop if the CQ is full, including the reserved entries */
+		used = READ_ONCE(hdr->cq_tail) -
+		       smp_load_acquire(&hdr->cq_head) +
+		       atomic_read(&ring->inflight);
+		if (used >= SYSCALL_RING_CQ_ENTRIES)
+			break;
+
+		/* The entry is copied as the guest might change it */
+		sqe = ring->sq[sq_head & (SYSCALL_RING_SQ_ENTRIES - 1)];
+		handler = (sqe.nr < SYSCALL_MAX) ?
+			  syscall_handlers[sqe.nr].handler : NULL;
+		if (!handler) {
+			kvm_syscall_post(ring, sqe.user_data, -ENOSYS);
+		} else if (syscall_handlers[sqe.nr].flags &
+			   SYSCALL_FLAG_BLOCKING) {
+			ret = syscall_offload(vm, ring, &sqe);
+			if (ret)
+				kvm_syscall_post(ring, sqe.user_data, ret);
+		} else {
+			syscall_post(ring, sqe.user_data,
+				     handler(vm, ring, &sqe));
+		}
+
+		sq_head++;
+		count++;
+	}
+
+	smp_store_release(&hdr->sq_head, sq_head);
+	smp_store_release(&ring->busy, 0);
+
+	/* Submit the batched system calls */
+	for (i = 0; count && i < vm->syscall->nr_flush; i++)
+		vm->syscall->flush[i](vm);
+
+	return count;
+}
+
+static void syscall_wakeup_poller(struct kvm_vm *vm)
+{
+	struct kvm_syscall *sc = vm->syscall;
+
+	if (!sc || !sc->polling)
+		return;
+
+	pthread_mutex_lock(&sc->lock);
+	sc->wakeup = true;
+	pthread_cond_signal(&sc->cond);
+	pthread_mutex_unlock(&sc->lock);
+}
+
+static long syscall_doorbell(struct kvm_vcpu *vcpu)
+{
+	long count = 0;
+
+	if (vcpu->ring)
+		count = syscall_ring_drain(vcpu->vm, vcpu->ring);
+
+	syscall_wakeup_poller(vcpu->vm);
+
+	return count;
+}
+
+static int syscall_doorbell_mmio(struct kvm_vcpu *vcpu,
+				 unsigned long addr,
+				 void *data,
+				 unsigned int len,
+				 bool is_write)
+{
+	if (is_write)
+		syscall_doorbell(vcpu);
+	else
+		memset(data, 0, len);
+
+	return 0;
+}
+
+static long syscall_exit_group(struct kvm_vm *vm,
+			       struct kvm_syscall_ring *ring,
+			       struct syscall_sqe *sqe)
+{
+	kvm_vm_stop(vm);
+
+	return 0;
+}
+
+/**
+ * kvm_syscall_init - Initialize system call forwarding of VM
+ * @vm:		VM where the system call forwarding is initialized
+ *
+ * The doorbell page is mapped to the MMIO region. The doorbell hypercall
+ * is preferred if the SMCCC filter is supported. It returns zero on
+ * success, or negative error code on failure.
+ */
+int kvm_syscall_init(struct kvm_vm *vm)
+{
+	struct kvm_vm_mm *mm = &vm->mm;
+	struct kvm_syscall *sc;
+	struct vm_area *vma;
+	pthread_condattr_t attr;
+	int ret;
+
+	sc = malloc(sizeof(*sc));
+	if (!sc) {
+		fprintf(stderr, "%s: Unable to alloc syscall\n", __func__);
+		return -ENOMEM;
+	}
+
+	memset(sc, 0, sizeof(*sc));
+	pthread_mutex_init(&sc->lock, NULL);
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&sc->cond, &attr);
+	pthread_condattr_destroy(&attr);
+	pthread_cond_init(&sc->idle, NULL);
+
+	pthread_mutex_lock(&vm->lock);
+	vma = mm_vma_alloc(mm->mm, SYSCALL_DOORBELL_VA, mm->page_size,
+			   MM_VMA_FLAG_FIXED, 0);
+	if (!vma) {
+		fprintf(stderr, "%s: Unable to alloc doorbell\n", __func__);
+		ret = -ENOMEM;
+		goto unlock;
+	}
+
+	ret = kvm_mm_map_prot(vm, mm->mmio_base, vma->start, mm->page_size,
+			      KVM_MM_PTE_AF | KVM_MM_PTE_ATTR_DEVICE |
+			      KVM_MM_PTE_TABLE | KVM_MM_PTE_VALID);
+	if (ret)
+		goto free_doorbell;
+	pthread_mutex_unlock(&vm->lock);
+
+	ret = kvm_vm_register_mmio(vm, mm->mmio_base, mm->page_size,
+				   syscall_doorbell_mmio);
+	if (ret)
+		goto unmap_doorbell;
+
+	vm->syscall = sc;
+
+	kvm_vm_register_hypercall(vm, SYSCALL_HVC_FN, syscall_doorbell);
+	kvm_syscall_register(__NR_exit, syscall_exit_group, 0);
+	kvm_syscall_register(__NR_exit_group, syscall_exit_group, 0);
+	kvm_mman_init();
+
+	return 0;
+
+unmap_doorbell:
+	pthread_mutex_lock(&vm->lock);
+	kvm_mm_unmap(vm, vma->start, mm->page_size);
+free_doorbell:
+	mm_vma_free(mm->mm, vma);
+unlock:
+	pthread_mutex_unlock(&vm->lock);
+	free(sc);
+	return ret;
+}
+
+static void syscall_ring_setup(struct kvm_vcpu *vcpu,
+			       struct kvm_syscall_ring *ring)
+{
+	struct kvm_vm *vm = vcpu->vm;
+	unsigned long hva = (unsigned long)ring->hdr;
+
+	ring->sq = (struct syscall_sqe *)(hva + SYSCALL_RING_SQ_OFFSET);
+	ring->cq = (struct syscall_cqe *)(hva + SYSCALL_RING_CQ_OFFSET);
+	ring->busy = 0;
+	ring->inflight = 0;
+	pthread_mutex_init(&ring->cq_lock, NULL);
+	ring->hdr->flags = vm->syscall && vm->syscall->polling ?
+			   0 : SYSCALL_RING_NEED_WAKEUP;
+	vcpu->ring = ring;
+}
+
+/**
+ * kvm_syscall_vcpu_init - Initialize the vCPU's system call ring
+ * @vcpu:	vCPU whose ring is initialized
+ *
+ * The ring is allocated from the vCPU's node and mapped at the well-known
+ * address. It's called with the VM's lock held. It returns zero on
+ * success, or negative error code on failure.
+ */
+int kvm_syscall_vcpu_init(struct kvm_vcpu *vcpu)
+{
+	struct kvm_vm *vm = vcpu->vm;
+	struct kvm_vm_mm *mm = &vm->mm;
+	struct kvm_syscall_ring *ring;
+	struct vm_area *vma;
+	unsigned long phys, hva;
+
+	ring = malloc(sizeof(*ring));
+	if (!ring) {
+		fprintf(stderr, "%s: Unable to alloc ring\n", __func__);
+		return -ENOMEM;
+	}
+
+	vma = mm_vma_alloc(mm->mm, SYSCALL_RING_VA + vcpu->id * SYSCALL_RING_SIZE,
+			   SYSCALL_RING_SIZE, MM_VMA_FLAG_FIXED, 0);
+	phys = kvm_mm_alloc_phys_pages_node(vm,
+			SYSCALL_RING_SIZE >> mm->page_shift,
+			kvm_vcpu_node(vcpu));
+	if (!vma || !phys ||
+	    kvm_mm_map(vm, phys, vma->start, SYSCALL_RING_SIZE)) {
+		fprintf(stderr, "%s: Unable to alloc ring for vCPU %d\n",
+			__func__, vcpu->id);
+		if (phys)
+			kvm_mm_free_phys_pages(vm, phys,
+				SYSCALL_RING_SIZE >> mm->page_shift);
+		if (vma)
+			mm_vma_free(mm->mm, vma);
+		free(ring);
+		return -ENOMEM;
+	}
+
+	hva = kvm_mm_gpa_to_hva(vm, phys);
+	memset((void *)hva, 0, SYSCALL_RING_SIZE);
+	ring->hdr = (struct syscall_ring_hdr *)hva;
+	ring->hdr->sq_entries = SYSCALL_RING_SQ_ENTRIES;
+	ring->hdr->cq_entries = SYSCALL_RING_CQ_ENTRIES;
+	syscall_ring_setup(vcpu, ring);
+
+	return 0;
+}
+
+/**
+ * kvm_syscall_vcpu_restore - Attach the vCPU's restored system call ring
+ * @vcpu:	vCPU whose ring is attached
+ *
+ * The ring has been restored with the guest memory and mapped at the
+ * well-known address. It's called with the VM's lock held. It returns
+ * zero on success, or negative error code on failure.
+ */
+int kvm_syscall_vcpu_restore(struct kvm_vcpu *vcpu)
+{
+	struct kvm_vm *vm = vcpu->vm;
+	struct kvm_syscall_ring *ring;
+	unsigned long hva;
+
+	hva = kvm_mm_gva_to_hva(vm, SYSCALL_RING_VA +
+				vcpu->id * SYSCALL_RING_SIZE, true);
+	if (!hva) {
+		fprintf(stderr, "%s: No ring for vCPU %d\n",
+			__func__, vcpu->id);
+		return -EINVAL;
+	}
+
+	ring = malloc(sizeof(*ring));
+	if (!ring) {
+		fprintf(stderr, "%s: Unable to alloc ring\n", __func__);
+		return -ENOMEM;
+	}
+
+	ring->hdr = (struct syscall_ring_hdr *)hva;
+	syscall_ring_setup(vcpu, ring);
+
+	return 0;
+}
+
+void kvm_syscall_vcpu_destroy(struct kvm_vcpu *vcpu)
+{
+	if (vcpu->ring)
+		free(vcpu->ring);
+
+	vcpu->ring = NULL;
+}
+
+static void syscall_set_flags(struct kvm_vm *vm, uint32_t flags)
+{
+	struct kvm_vcpu *vcpu;
+	int i, nr = min(atomic_read(&vm->next_vcpu_id), KVM_MAX_VCPUS);
+
+	for (i = 0; i < nr; i++) {
+		vcpu = READ_ONCE(vm->vcpus[i]);
+		if (vcpu && vcpu->ring)
+			WRITE_ONCE(vcpu->ring->hdr->flags, flags);
+	}
+}
+
+static int syscall_poll_once(struct kvm_vm *vm, bool pending_only)
+{
+	struct kvm_vcpu *vcpu;
+	struct syscall_ring_hdr *hdr;
+	int i, count = 0, nr = min(atomic_read(&vm->next_vcpu_id),
+				   KVM_MAX_VCPUS);
+
+	for (i = 0; i < nr; i++) {
+		vcpu = READ_ONCE(vm->vcpus[i]);
+		if (!vcpu || !vcpu->ring)
+			continue;
+
+		hdr = vcpu->ring->hdr;
+		if (pending_only) {
+			count += (READ_ONCE(hdr->sq_head) !=
+				  READ_ONCE(hdr->sq_tail));
+			continue;
+		}
+
+		count += syscall_ring_drain(vm, vcpu->ring);
+	}
+
+	return count;
+}
+
+static unsigned long syscall_now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000UL + ts.tv_nsec / 1000;
+}
+
+/*
+ * Back off for a short period when the rings are idle. The guest doesn't
+ * ring the doorbell at this point, so it's a timed wait, which is cut
+ * short when the polling thread is stopped.
+ */
+static void syscall_poll_wait(struct kvm_syscall *sc)
+{
+	struct timespec ts;
+	unsigned long expire;
+
+	expire = syscall_now_us() + SYSCALL_POLL_WAIT_US;
+	ts.tv_sec = expire / 1000000UL;
+	ts.tv_nsec = (expire % 1000000UL) * 1000UL;
+
+	pthread_mutex_lock(&sc->lock);
+	if (!sc->stop)
+		pthread_cond_timedwait(&sc->cond, &sc->lock, &ts);
+	pthread_mutex_unlock(&sc->lock);
+}
+
+/*
+ * The polling thread drains the rings without the doorbell. It spins for
+ * a bounded number of empty polls, and then backs off between the polls.
+ * It goes to sleep if the rings have been idle for the specified period,
+ * and the guest is asked to ring the doorbell through
+ * SYSCALL_RING_NEED_WAKEUP.
+ */
+static void *syscall_poll_thread(void *data)
+{
+	struct kvm_vm *vm = data;
+	struct kvm_syscall *sc = vm->syscall;
+	unsigned long idle_start = syscall_now_us();
+	unsigned int spins = 0;
+
+	while (!READ_ONCE(sc->stop)) {
+		if (syscall_poll_once(vm, false)) {
+			idle_start = syscall_now_us();
+			spins = 0;
+			continue;
+		}
+
+		if (++spins < SYSCALL_POLL_SPINS)
+			continue;
+
+		if (syscall_now_us() - idle_start < sc->idle_us) {
+			syscall_poll_wait(sc);
+			continue;
+		}
+
+		/* Recheck the rings after the guest is asked for doorbell */
+		syscall_set_flags(vm, SYSCALL_RING_NEED_WAKEUP);
+		smp_mb();
+		if (!syscall_poll_once(vm, true)) {
+			pthread_mutex_lock(&sc->lock);
+			while (!sc->wakeup && !sc->stop)
+				pthread_cond_wait(&sc->cond, &sc->lock);
+			sc->wakeup = false;
+			pthread_mutex_unlock(&sc->lock);
+		}
+
+		syscall_set_flags(vm, 0);
+		idle_start = syscall_now_us();
+		spins = 0;
+	}
+
+	syscall_set_flags(vm, SYSCALL_RING_NEED_WAKEUP);
+
+	return NULL;
+}
+
+/**
+ * kvm_syscall_start_polling - Start polling the system call rings
+ * @vm:		VM whose rings are polled
+ * @idle_us:	period of idle time before the polling thread sleeps
+ *
+ * It returns zero on success, or negative error code on failure.
+ */
+int kvm_syscall_start_polling(struct kvm_vm *vm, unsigned long idle_us)
+{
+	struct kvm_syscall *sc = vm->syscall;
+	int ret;
+
+	if (!sc || sc->polling)
+		return -EINVAL;
+
+	sc->idle_us = idle_us;
+	sc->stop = false;
+	sc->wakeup = false;
+	sc->polling = true;
+	syscall_set_flags(vm, 0);
+	ret = pthread_create(&sc->thread, NULL, syscall_poll_thread, vm);
+	if (ret) {
+		fprintf(stderr, "%s: Unable to create thread (%d)\n",
+			__func__, ret);
+		sc->polling = false;
+		syscall_set_flags(vm, SYSCALL_RING_NEED_WAKEUP);
+		return -ret;
+	}
+
+	return 0;
+}
+
+/**
+ * kvm_syscall_destroy - Destroy system call forwarding of VM
+ * @vm:		VM whose system call forwarding is destroyed
+ *
+ * The polling thread is stopped, and the offloaded system calls are
+ * cancelled or waited for. It's called before the services used by the
+ * system calls (e.g. file system and network) are destroyed.
+ */
+void kvm_syscall_destroy(struct kvm_vm *vm)
+{
+	struct kvm_syscall *sc = vm->syscall;
+
+	if (!sc)
+		return;
+
+	/* Stop the polling thread first, so that no more work is queued */
+	if (sc->polling) {
+		pthread_mutex_lock(&sc->lock);
+		sc->stop = true;
+		pthread_cond_signal(&sc->cond);
+		pthread_mutex_unlock(&sc->lock);
+		pthread_join(sc->thread, NULL);
+		sc->polling = false;
+	}
+
+	/* The rings are accessed by the workers until they're done */
+	kvm_syscall_cancel_work(vm);
+
+	free(sc);
+	vm->syscall = NULL;
+}
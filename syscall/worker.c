@@ -0,0 +1,161 @@
+/*
+ * Copyright 2022 Gavin Shan <gshan@redhat.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#include "sandbox.h"
+
+/*
+ * The worker pool is shared by all VMs. The workers are created on demand
+ * when the work is queued, until the number of workers reaches the limit.
+ * They're never destroyed. The work is handled in FIFO order.
+ */
+static pthread_mutex_t worker_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t worker_cond = PTHREAD_COND_INITIALIZER;
+static LIST_HEAD(worker_list);
+static unsigned int worker_limit = SYSCALL_DEFAULT_WORKERS;
+static unsigned int worker_nr;
+static unsigned int worker_idle;
+
+static void worker_done(struct kvm_syscall_work *work)
+{
+	struct kvm_syscall *sc = work->vm->syscall;
+
+	pthread_mutex_lock(&sc->lock);
+	if (--sc->inflight == 0)
+		pthread_cond_broadcast(&sc->idle);
+	pthread_mutex_unlock(&sc->lock);
+
+	free(work);
+}
+
+static void *worker_thread(void *data)
+{
+	struct kvm_syscall_work *work;
+	long ret;
+
+	pthread_mutex_lock(&worker_lock);
+
+	while (true) {
+		while (list_empty(&worker_list)) {
+			worker_idle++;
+			pthread_cond_wait(&worker_cond, &worker_lock);
+			worker_idle--;
+		}
+
+		work = list_first_entry(&worker_list,
+					struct kvm_syscall_work, link);
+		list_del(&work->link);
+		pthread_mutex_unlock(&worker_lock);
+
+		ret = work->handler(work->vm, work->ring, &work->sqe);
+		if (ret != SYSCALL_RET_PENDING)
+			kvm_syscall_post(work->ring, work->sqe.user_data, ret);
+		atomic_fetch_dec(&work->ring->inflight);
+		worker_done(work);
+
+		pthread_mutex_lock(&worker_lock);
+	}
+
+	return NULL;
+}
+
+/* Called with the lock held */
+static void worker_create(void)
+{
+	pthread_attr_t attr;
+	pthread_t thread;
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	if (!pthread_create(&thread, &attr, worker_thread, NULL))
+		worker_nr++;
+	pthread_attr_destroy(&attr);
+}
+
+/**
+ * kvm_syscall_set_workers - Set the maximal number of workers
+ * @nr:		maximal number of workers
+ *
+ * The existing workers are kept if there are more of them than the new
+ * limit. It returns zero on success, or negative error code on failure.
+ */
+int kvm_syscall_set_workers(unsigned int nr)
+{
+	if (!nr)
+		return -EINVAL;
+
+	pthread_mutex_lock(&worker_lock);
+	worker_limit = nr;
+	pthread_mutex_unlock(&worker_lock);
+
+	return 0;
+}
+
+/**
+ * kvm_syscall_queue_work - Offload the system call to the workers
+ * @work:	system call to be offloaded
+ *
+ * The CQ entry is posted by the worker after the system call is handled,
+ * and @work is released then. It returns zero on success, or negative
+ * error code on failure.
+ */
+int kvm_syscall_queue_work(struct kvm_syscall_work *work)
+{
+	struct kvm_syscall *sc = work->vm->syscall;
+
+	pthread_mutex_lock(&worker_lock);
+
+	if (!worker_idle && worker_nr < worker_limit)
+		worker_create();
+
+	if (!worker_nr) {
+		pthread_mutex_unlock(&worker_lock);
+		fprintf(stderr, "%s: No available worker\n", __func__);
+		return -EAGAIN;
+	}
+
+	pthread_mutex_lock(&sc->lock);
+	sc->inflight++;
+	pthread_mutex_unlock(&sc->lock);
+
+	list_add_tail(&worker_list, &work->link);
+	pthread_cond_signal(&worker_cond);
+
+	pthread_mutex_unlock(&worker_lock);
+
+	return 0;
+}
+
+/**
+ * kvm_syscall_cancel_work - Cancel the offloaded system calls of VM
+ * @vm:		VM whose offloaded system calls are cancelled
+ *
+ * The pending work is dropped, and the work being handled is waited for.
+ * It's called before the rings are released.
+ */
+void kvm_syscall_cancel_work(struct kvm_vm *vm)
+{
+	struct kvm_syscall *sc = vm->syscall;
+	struct kvm_syscall_work *work, *tmp;
+
+	pthread_mutex_lock(&worker_lock);
+	list_for_each_entry_safe(work, tmp, &worker_list, link) {
+		if (work->vm != vm)
+			continue;
+
+		list_del(&work->link);
+		atomic_fetch_dec(&work->ring->inflight);
+		worker_done(work);
+	}
+	pthread_mutex_unlock(&worker_lock);
+
+	pthread_mutex_lock(&sc->lock);
+	while (sc->inflight)
+		pthread_cond_wait(&sc->idle, &sc->lock);
+	pthread_mutex_unlock(&sc->lock);
+}
@@ -0,0 +1,145 @@
+/*
+ * Copyright 2022 Gavin Shan <gshan@redhat.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#include "sandbox.h"
+
+/*
+ * Create sandbox package. Each section is specified in the format of
+ * "<type>:<name>:<file>", where <type> is one of "exec", "lib", "fs"
+ * and "manifest".
+ *
+ *     pkg app.sbx exec:app:/tmp/debug manifest:manifest:/tmp/manifest
+ */
+static const char *section_types[] = {
+	[PKG_SECTION_EXEC]	= "exec",
+	[PKG_SECTION_LIB]	= "lib",
+	[PKG_SECTION_FS]	= "fs",
+	[PKG_SECTION_MANIFEST]	= "manifest",
+};
+
+static int parse_section(char *arg, struct pkg_section *sec, char **path)
+{
+	char *type, *name;
+	int i;
+
+	type = strtok(arg, ":");
+	name = strtok(NULL, ":");
+	*path = strtok(NULL, "");
+	if (!type || !name || !*path ||
+	    strlen(name) >= PKG_SECTION_NAME_LEN)
+		return -EINVAL;
+
+	for (i = PKG_SECTION_EXEC; i <= PKG_SECTION_MANIFEST; i++) {
+		if (!strcmp(type, section_types[i]))
+			break;
+	}
+
+	if (i > PKG_SECTION_MANIFEST)
+		return -EINVAL;
+
+	sec->type = i;
+	strcpy(sec->name, name);
+
+	return 0;
+}
+
+static int copy_section(int fd, struct pkg_section *sec, const char *path)
+{
+	struct stat st;
+	void *addr;
+	int in, ret = 0;
+
+	in = open(path, O_RDONLY);
+	if (in < 0) {
+		fprintf(stderr, "%s: Unable to open <%s>\n", __func__, path);
+		return -ENOENT;
+	}
+
+	if (fstat(in, &st)) {
+		ret = -EIO;
+		goto out;
+	}
+
+	sec->size = st.st_size;
+	if (!sec->size)
+		goto out;
+
+	addr = mmap(NULL, sec->size, PROT_READ, MAP_PRIVATE, in, 0);
+	if (addr == MAP_FAILED) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	if (pwrite(fd, addr, sec->size, sec->offset) != sec->size)
+		ret = -EIO;
+
+	munmap(addr, sec->size);
+out:
+	close(in);
+	return ret;
+}
+
+int main(int argc, char **argv)
+{
+	struct pkg_hdr *hdr;
+	struct pkg_section *sec;
+	unsigned long offset;
+	char *path;
+	int fd, i, nr, ret;
+
+	if (argc < 3) {
+		fprintf(stderr, "Usage: %s <package> <type:name:file> ...\n",
+			argv[0]);
+		return -EINVAL;
+	}
+
+	nr = argc - 2;
+	hdr = calloc(1, PKG_INDEX_SIZE);
+	if (!hdr || sizeof(*hdr) + nr * sizeof(*sec) > PKG_INDEX_SIZE) {
+		fprintf(stderr, "%s: Too many sections (%d)\n", __func__, nr);
+		return -ENOMEM;
+	}
+
+	fd = open(argv[1], O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		fprintf(stderr, "%s: Unable to create <%s>\n",
+			__func__, argv[1]);
+		return -EIO;
+	}
+
+	hdr->magic = PKG_MAGIC;
+	hdr->version = PKG_VERSION;
+	hdr->nr_sections = nr;
+	hdr->align = PKG_ALIGN;
+	hdr->index_size = ALIGN(sizeof(*hdr) + nr * sizeof(*sec), 8);
+	sec = (struct pkg_section *)(hdr + 1);
+	offset = ALIGN(hdr->index_size, PKG_ALIGN);
+	for (i = 0; i < nr; i++, sec++) {
+		ret = parse_section(argv[i + 2], sec, &path);
+		if (ret) {
+			fprintf(stderr, "%s: Invalid section <%s>\n",
+				__func__, argv[i + 2]);
+			goto out;
+		}
+
+		sec->offset = offset;
+		ret = copy_section(fd, sec, path);
+		if (ret)
+			goto out;
+
+		offset = ALIGN(sec->offset + sec->size, PKG_ALIGN);
+	}
+
+	if (pwrite(fd, hdr, hdr->index_size, 0) != hdr->index_size)
+		ret = -EIO;
+out:
+	close(fd);
+	free(hdr);
+	return ret;
+}
@@ -0,0 +1,101 @@
+/*
+ * Copyright 2022 Gavin Shan <gshan@redhat.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#include "sandbox.h"
+
+/*
+ * Create the pool, where the VMs are cloned from the zygote of the
+ * program. The VMs are taken from the pool and run one by one, and
+ * then the pool is destroyed with the VMs it still holds.
+ *
+ *     pool /tmp/debug 4
+ */
+#define POOL_DEFAULT_FILENAME	"/tmp/debug"
+#define POOL_DEFAULT_VMS	2
+#define POOL_LOW_WATERMARK	1
+#define POOL_HIGH_WATERMARK	2
+
+static struct kvm_zygote *create_zygote(char *filename)
+{
+	struct kvm_vm *vm;
+	struct kvm_zygote *zygote = NULL;
+	unsigned long entry_point;
+	int ret;
+
+	vm = kvm_vm_create();
+	if (!vm)
+		return NULL;
+
+	ret = elf_load_file(vm, filename, &entry_point);
+	if (ret)
+		goto out;
+
+	ret = kvm_vm_create_vcpus(vm, 1, entry_point);
+	if (ret)
+		goto out;
+
+	zygote = kvm_zygote_create(vm);
+out:
+	kvm_vm_destroy(vm);
+	return zygote;
+}
+
+int main(int argc, char **argv)
+{
+	char *filename = POOL_DEFAULT_FILENAME;
+	unsigned int i, nr_vms = POOL_DEFAULT_VMS;
+	struct kvm_zygote *zygote;
+	struct kvm_vm_pool *pool;
+	struct kvm_vm *vm;
+	int ret = 0;
+
+	if (argc > 1)
+		filename = argv[1];
+	if (argc > 2)
+		nr_vms = strtoul(argv[2], NULL, 0);
+
+	zygote = create_zygote(filename);
+	if (!zygote) {
+		fprintf(stderr, "%s: Unable to create zygote from <%s>\n",
+			__func__, filename);
+		return -ENOMEM;
+	}
+
+	pool = kvm_vm_pool_create(zygote, POOL_LOW_WATERMARK,
+				  POOL_HIGH_WATERMARK);
+	if (!pool) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	for (i = 0; i < nr_vms; i++) {
+		vm = kvm_vm_pool_get(pool);
+		if (!vm) {
+			fprintf(stderr, "%s: Unable to get VM %u\n",
+				__func__, i);
+			ret = -ENOMEM;
+			break;
+		}
+
+		ret = kvm_vm_run(vm);
+		kvm_vm_destroy(vm);
+		if (ret) {
+			fprintf(stderr, "%s: VM %u failed (%d)\n",
+				__func__, i, ret);
+			break;
+		}
+	}
+
+	kvm_vm_pool_destroy(pool);
+	if (!ret)
+		fprintf(stdout, "Ran %u VMs from pool\n", nr_vms);
+out:
+	kvm_zygote_destroy(zygote);
+	return ret;
+}
@@ -0,0 +1,176 @@
+/*
+ * Copyright 2022 Gavin Shan <gshan@redhat.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#include "sandbox.h"
+
+/*
+ * The symbol index is built from the test program itself, which is
+ * linked with "-no-pie -rdynamic" so that its global symbols are in the
+ * GNU hash table. The image is pretended to be loaded with the bias. The
+ * symbols are looked up through the GNU hash table, and then through the
+ * index built from ".symtab" after the dynamic section is hidden.
+ */
+#define TEST_SYMBOL_BIAS	0x10000000UL
+
+asm(".globl test_symbol_abs\n"
+    ".set test_symbol_abs, 0x1234\n");
+
+int test_symbol_object = 1;
+
+void test_symbol_func(void)
+{
+}
+
+static void __attribute__((noinline, used)) test_symbol_local(void)
+{
+}
+
+static void *test_map;
+static int test_failures;
+
+void *elf_image_translate(struct elf_image *image,
+			  unsigned long vaddr,
+			  unsigned long len)
+{
+	struct elf_segment *seg;
+	int i;
+
+	for (i = 0; i < image->nr_segs; i++) {
+		seg = &image->segs[i];
+		if (vaddr < seg->vaddr ||
+		    vaddr + len > seg->vaddr + seg->memsz)
+			continue;
+
+		return (void *)(seg->hva + (vaddr - seg->vaddr));
+	}
+
+	return NULL;
+}
+
+ssize_t elf_image_read(struct elf_image *image, void *buf,
+		       unsigned long len, unsigned long offset)
+{
+	return pread(image->fd, buf, len, image->offset + offset);
+}
+
+static void test_lookup(struct elf_image *image, const char *name,
+			unsigned long expected)
+{
+	unsigned long addr = 0;
+	int ret;
+
+	ret = elf_symbol_lookup(image, name, &addr);
+	if (expected && (ret || addr != expected)) {
+		fprintf(stderr, "%s: <%s> at 0x%lx (%d), expected 0x%lx\n",
+			__func__, name, addr, ret, expected);
+		test_failures++;
+	} else if (!expected && ret != -ENOENT) {
+		fprintf(stderr, "%s: <%s> found at 0x%lx\n",
+			__func__, name, addr);
+		test_failures++;
+	}
+}
+
+static void test_find(struct elf_image *image, unsigned long addr,
+		      const char *name)
+{
+	struct elf_symbol *s;
+
+	s = elf_symbol_find(image, addr);
+	if (!s || strcmp(s->name, name)) {
+		fprintf(stderr, "%s: 0x%lx resolved to <%s>, expected <%s>\n",
+			__func__, addr, s ? s->name : "?", name);
+		test_failures++;
+	}
+}
+
+static void test_image(struct elf_image *image, const char *how)
+{
+	unsigned long func = (unsigned long)test_symbol_func;
+	unsigned long local = (unsigned long)test_symbol_local;
+	int ret;
+
+	ret = elf_symtab_build(image);
+	if (ret) {
+		fprintf(stderr, "%s: Unable to build index (%d)\n",
+			__func__, ret);
+		test_failures++;
+		return;
+	}
+
+	test_lookup(image, "test_symbol_func", func + image->bias);
+	test_lookup(image, "test_symbol_object",
+		    (unsigned long)&test_symbol_object + image->bias);
+	test_lookup(image, "test_symbol_abs", 0x1234);
+	test_lookup(image, "test_symbol_local", 0);
+	test_lookup(image, "test_symbol_missed", 0);
+	test_find(image, func + image->bias, "test_symbol_func");
+	test_find(image, local + image->bias, "test_symbol_local");
+
+	elf_symtab_destroy(image);
+	fprintf(stdout, "%s: %s\n", how, test_failures ? "FAIL" : "PASS");
+}
+
+int main(int argc, char **argv)
+{
+	struct elf_image image;
+	struct elf64_phdr *phdr;
+	struct elf_segment *seg;
+	struct stat st;
+	int fd, i;
+
+	fd = open("/proc/self/exe", O_RDONLY);
+	if (fd < 0 || fstat(fd, &st)) {
+		fprintf(stderr, "%s: Unable to open test program\n", __func__);
+		return -ENOENT;
+	}
+
+	test_map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (test_map == MAP_FAILED) {
+		fprintf(stderr, "%s: Unable to map test program\n", __func__);
+		return -ENOMEM;
+	}
+
+	memset(&image, 0, sizeof(image));
+	image.fd = fd;
+	image.bias = TEST_SYMBOL_BIAS;
+	memcpy(&image.hdr, test_map, sizeof(image.hdr));
+	image.segs = calloc(image.hdr.e_phnum, sizeof(*image.segs));
+	if (!image.segs)
+		return -ENOMEM;
+
+	/* The file image of the segments is enough for the index */
+	for (i = 0; i < image.hdr.e_phnum; i++) {
+		phdr = test_map + image.hdr.e_phoff + i * image.hdr.e_phentsize;
+		if (phdr->p_type == ELF64_PHDR_TYPE_DYNAMIC) {
+			image.dynamic = phdr->p_vaddr + image.bias;
+		} else if (phdr->p_type == ELF64_PHDR_TYPE_LOAD) {
+			seg = &image.segs[image.nr_segs++];
+			seg->vaddr = phdr->p_vaddr + image.bias;
+			seg->memsz = phdr->p_filesz;
+			seg->hva = (unsigned long)test_map + phdr->p_offset;
+		}
+	}
+
+	if (!image.dynamic) {
+		fprintf(stderr, "%s: No dynamic section\n", __func__);
+		return -ENOEXEC;
+	}
+
+	test_image(&image, "GNU hash");
+
+	image.dynamic = 0;
+	test_image(&image, "Fallback");
+
+	free(image.segs);
+	munmap(test_map, st.st_size);
+	close(fd);
+
+	return test_failures ? -EINVAL : 0;
+}
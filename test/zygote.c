@@ -0,0 +1,102 @@
+/*
+ * Copyright 2022 Gavin Shan <gshan@redhat.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#include "sandbox.h"
+
+/*
+ * Create the zygote from the template VM, where the program is loaded.
+ * The VMs are cloned from the zygote and run one by one. The average
+ * latency to clone the VM is reported.
+ *
+ *     zygote /tmp/debug 16
+ */
+#define ZYGOTE_DEFAULT_FILENAME	"/tmp/debug"
+#define ZYGOTE_DEFAULT_CLONES	8
+
+static struct kvm_zygote *create_zygote(char *filename)
+{
+	struct kvm_vm *vm;
+	struct kvm_zygote *zygote = NULL;
+	unsigned long entry_point;
+	int ret;
+
+	vm = kvm_vm_create();
+	if (!vm)
+		return NULL;
+
+	ret = elf_load_file(vm, filename, &entry_point);
+	if (ret)
+		goto out;
+
+	ret = kvm_vm_create_vcpus(vm, 1, entry_point);
+	if (ret)
+		goto out;
+
+	zygote = kvm_zygote_create(vm);
+out:
+	kvm_vm_destroy(vm);
+	return zygote;
+}
+
+static unsigned long elapsed_ns(struct timespec *start, struct timespec *end)
+{
+	return (end->tv_sec - start->tv_sec) * 1000000000UL +
+	       end->tv_nsec - start->tv_nsec;
+}
+
+int main(int argc, char **argv)
+{
+	char *filename = ZYGOTE_DEFAULT_FILENAME;
+	unsigned int i, nr_clones = ZYGOTE_DEFAULT_CLONES;
+	struct kvm_zygote *zygote;
+	struct kvm_vm *vm;
+	struct timespec start, end;
+	unsigned long total = 0;
+	int ret = 0;
+
+	if (argc > 1)
+		filename = argv[1];
+	if (argc > 2)
+		nr_clones = strtoul(argv[2], NULL, 0);
+
+	zygote = create_zygote(filename);
+	if (!zygote) {
+		fprintf(stderr, "%s: Unable to create zygote from <%s>\n",
+			__func__, filename);
+		return -ENOMEM;
+	}
+
+	for (i = 0; i < nr_clones; i++) {
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		vm = kvm_zygote_clone(zygote);
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		if (!vm) {
+			fprintf(stderr, "%s: Unable to clone VM %u\n",
+				__func__, i);
+			ret = -ENOMEM;
+			break;
+		}
+
+		total += elapsed_ns(&start, &end);
+		ret = kvm_vm_run(vm);
+		kvm_vm_destroy(vm);
+		if (ret) {
+			fprintf(stderr, "%s: VM %u failed (%d)\n",
+				__func__, i, ret);
+			break;
+		}
+	}
+
+	if (!ret && i)
+		fprintf(stdout, "Cloned %u VMs, %lu us per clone\n",
+			i, total / i / 1000);
+
+	kvm_zygote_destroy(zygote);
+	return ret;
+}